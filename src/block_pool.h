@@ -0,0 +1,154 @@
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <vector>
+
+namespace glit {
+
+// A recycling allocator for fixed-width blocks of T.
+//
+// Blocks are carved out of large slabs, each of which is dedicated to a
+// single level, so that blocks of the same level end up packed together in
+// memory. Released blocks go onto the free list for their level and are
+// handed straight back out on the next allocation at that level: we never
+// give memory back to the heap until the pool itself is destroyed. Once the
+// free lists have grown to cover the working set, allocate and release do
+// not touch the heap at all.
+//
+// Blocks are referred to by a 32 bit handle rather than by pointer so that
+// the owners can stay compact. Slabs never move once allocated, so pointers
+// into a block remain valid until it is released.
+//
+// Allocate and release may be called from several threads at once; each
+// level's free list has its own lock, so threads working on different parts
+// of the tree rarely contend. The slab directory is a fixed array rather
+// than a vector so that resolving a handle never needs a lock.
+template <typename T, size_t BlockWidth, size_t NumLevels>
+class BlockPool
+{
+  public:
+    using Handle = uint32_t;
+    constexpr static Handle InvalidHandle = uint32_t(-1);
+
+    // 256 blocks per slab: at 4 facets per block this is ~100KiB per slab.
+    constexpr static size_t SlabShift = 8;
+    constexpr static size_t SlabBlocks = size_t(1) << SlabShift;
+    constexpr static size_t SlabMask = SlabBlocks - 1;
+    constexpr static size_t MaxSlabs = size_t(1) << 16;
+
+    BlockPool()
+      : slabs_(new std::unique_ptr<Slab>[MaxSlabs])
+      , slabCount_(0)
+      , live_(0)
+      , peak_(0)
+    {
+        for (auto& live : levelLive_)
+            live = 0;
+    }
+
+    Handle allocate(size_t level) {
+        if (level >= NumLevels)
+            throw std::runtime_error("block pool level out of range");
+        Handle h;
+        {
+            std::lock_guard<std::mutex> guard(levelLocks_[level]);
+            auto& freeList = freeLists_[level];
+            if (freeList.empty())
+                addSlab(level);
+            h = freeList.back();
+            freeList.pop_back();
+            ++levelLive_[level];
+        }
+        size_t live = ++live_;
+        size_t peak = peak_;
+        while (live > peak && !peak_.compare_exchange_weak(peak, live))
+            ;
+        return h;
+    }
+
+    void release(size_t level, Handle h) {
+        {
+            std::lock_guard<std::mutex> guard(levelLocks_[level]);
+            freeLists_[level].push_back(h);
+            --levelLive_[level];
+        }
+        --live_;
+    }
+
+    T* block(Handle h) {
+        return &slabs_[h >> SlabShift]->items[(h & SlabMask) * BlockWidth];
+    }
+    const T* block(Handle h) const {
+        return &slabs_[h >> SlabShift]->items[(h & SlabMask) * BlockWidth];
+    }
+
+    // Counters, in items rather than blocks.
+    size_t liveItems() const { return live_ * BlockWidth; }
+    size_t peakItems() const { return peak_ * BlockWidth; }
+    size_t liveItems(size_t level) const {
+        std::lock_guard<std::mutex> guard(levelLocks_[level]);
+        return levelLive_[level] * BlockWidth;
+    }
+    size_t freeItems() const {
+        size_t total = 0;
+        for (size_t i = 0; i < NumLevels; ++i) {
+            std::lock_guard<std::mutex> guard(levelLocks_[i]);
+            total += freeLists_[i].size();
+        }
+        return total * BlockWidth;
+    }
+    size_t slabCount() const { return slabCount_; }
+
+  private:
+    struct Slab {
+        T items[SlabBlocks * BlockWidth];
+    };
+    std::unique_ptr<std::unique_ptr<Slab>[]> slabs_;
+    std::mutex slabLock_;
+    size_t slabCount_;
+
+    mutable std::mutex levelLocks_[NumLevels];
+    std::vector<Handle> freeLists_[NumLevels];
+    size_t levelLive_[NumLevels];
+    std::atomic<size_t> live_;
+    std::atomic<size_t> peak_;
+
+    // Called with the level lock held.
+    void addSlab(size_t level) {
+        Handle base;
+        {
+            std::lock_guard<std::mutex> guard(slabLock_);
+            if (slabCount_ == MaxSlabs)
+                throw std::runtime_error("block pool exhausted");
+            base = Handle(slabCount_ << SlabShift);
+            slabs_[slabCount_++].reset(new Slab);
+        }
+
+        // Push in reverse so that we hand out the slab front to back.
+        auto& freeList = freeLists_[level];
+        freeList.reserve(freeList.size() + SlabBlocks);
+        for (size_t i = SlabBlocks; i > 0; --i)
+            freeList.push_back(base + Handle(i - 1));
+    }
+
+    BlockPool(const BlockPool&) = delete;
+    BlockPool(BlockPool&&) = delete;
+};
+
+} // namespace glit
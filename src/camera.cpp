@@ -30,10 +30,14 @@ glit::Camera::Camera()
     up = vec3(0.f, 1.f, 0.f);
     projection = perspective(pi<float>() * 0.25f, 1.f,
                              NearDistance, FarDistance);
+
+    // Until we hear otherwise.
+    screenHeight = 600.f;
 }
 
 glit::Camera::Camera(const Camera& other)
   : projection(other.projection)
+  , screenHeight(other.screenHeight)
   , position(other.position)
   , direction(other.direction)
   , up(other.up)
@@ -44,6 +48,7 @@ glit::Camera::screenSizeChanged(float width, float height)
 {
     projection = perspective(pi<float>() * 0.25f, width / height,
                              NearDistance, FarDistance);
+    screenHeight = height;
 }
 
 void
@@ -68,3 +73,23 @@ glit::Camera::transform() const
     auto view = lookAt(position, position + direction, up);
     return projection * view;
 }
+
+glit::Camera::Frustum
+glit::Camera::frustum() const
+{
+    // With the eye at the origin, the side planes pass through it, so the
+    // usual sums of rows of the clip matrix have no w term.
+    mat4 m = projection * lookAt(vec3(0.f, 0.f, 0.f), direction, up);
+    vec3 x(m[0][0], m[1][0], m[2][0]);
+    vec3 y(m[0][1], m[1][1], m[2][1]);
+    vec3 w(m[0][3], m[1][3], m[2][3]);
+    Frustum out;
+    out.normals[0] = normalize(w + x);
+    out.normals[1] = normalize(w - x);
+    out.normals[2] = normalize(w + y);
+    out.normals[3] = normalize(w - y);
+
+    // The projection maps tan(fov / 2) to the top of the screen.
+    out.pixelScale = screenHeight * projection[1][1] / 2.f;
+    return out;
+}
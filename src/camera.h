@@ -24,6 +24,7 @@ class Camera
     // so that we can represent things that are very far away while still
     // getting good z clipping up close.
     glm::mat4 projection;
+    float screenHeight;
 
     // Updated constantly by input events.
     glm::vec3 position;
@@ -53,6 +54,19 @@ class Camera
     // Combined projection and view, suitable for multiplying with a model
     // to get a final transform matrix.
     glm::mat4 transform() const;
+
+    // The sides of the view frustum: planes through the eye, given by their
+    // inward facing unit normals, in the order left, right, bottom, top.
+    // Where the near and far planes land depends on the scale something is
+    // drawn at, so those are left to GL.
+    //
+    // Also the size in pixels on screen of something of unit size at unit
+    // distance straight ahead, for screen space error metrics.
+    struct Frustum {
+        glm::vec3 normals[4];
+        float pixelScale;
+    };
+    Frustum frustum() const;
 };
 
 } // namespace glit
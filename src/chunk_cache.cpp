@@ -0,0 +1,129 @@
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+#include "chunk_cache.h"
+
+using namespace std;
+
+glit::ChunkCache::ChunkCache(const VertexDescriptor& desc,
+                             size_t vertsPerChunk,
+                             const vector<uint32_t>& indexPattern,
+                             size_t slots)
+  : vertexBuffer_(new VertexBuffer(desc))
+  , indexBuffer_(new IndexBuffer())
+  , vertsPerChunk_(vertsPerChunk)
+  , indicesPerChunk_(indexPattern.size())
+  , slots_(slots)
+  , frame_(0)
+  , uploadBudget_(0)
+  , uploadsThisFrame_(0)
+  , evictions_(0)
+{
+    if (slots == 0)
+        throw runtime_error("chunk cache budget too small for a single chunk");
+
+    // Hand out low slots first.
+    for (size_t i = slots; i > 0; --i)
+        freeSlots_.push_back(Slot(i - 1));
+    for (auto& info : slots_) {
+        info.occupied = false;
+        info.pinned = false;
+    }
+
+    indexBuffer_->upload(indexPattern);
+}
+
+/* static */ size_t
+glit::ChunkCache::slotsForBudget(size_t byteBudget, size_t vertexBytes)
+{
+    return byteBudget / vertexBytes;
+}
+
+void
+glit::ChunkCache::beginFrame(size_t uploadBudget)
+{
+    ++frame_;
+    uploadBudget_ = uploadBudget;
+    uploadsThisFrame_ = 0;
+}
+
+void
+glit::ChunkCache::touch(Slot slot)
+{
+    SlotInfo& info = slots_[slot];
+    info.lastUsed = frame_;
+    if (!info.pinned)
+        lru_.splice(lru_.end(), lru_, info.lru);
+}
+
+glit::ChunkCache::Slot
+glit::ChunkCache::use(Key key)
+{
+    auto it = index_.find(key);
+    if (it == index_.end())
+        return NoSlot;
+    touch(it->second);
+    return it->second;
+}
+
+bool
+glit::ChunkCache::canUpload() const
+{
+    if (uploadsThisFrame_ >= uploadBudget_)
+        return false;
+    if (!freeSlots_.empty())
+        return true;
+    return !lru_.empty() && slots_[lru_.front()].lastUsed != frame_;
+}
+
+glit::ChunkCache::Slot
+glit::ChunkCache::acquireSlot(Key key, bool pinned)
+{
+    if (index_.count(key))
+        throw runtime_error("chunk uploaded twice");
+
+    Slot slot;
+    if (!freeSlots_.empty()) {
+        slot = freeSlots_.back();
+        freeSlots_.pop_back();
+    } else {
+        // Everything after the front of the list was used more recently, so
+        // if the front is in use this frame, there is nothing to evict.
+        if (lru_.empty() || slots_[lru_.front()].lastUsed == frame_)
+            return NoSlot;
+        slot = lru_.front();
+        lru_.pop_front();
+        index_.erase(slots_[slot].key);
+        ++evictions_;
+    }
+
+    SlotInfo& info = slots_[slot];
+    info.key = key;
+    info.lastUsed = frame_;
+    info.occupied = true;
+    info.pinned = pinned;
+    if (!pinned)
+        info.lru = lru_.insert(lru_.end(), slot);
+    index_[key] = slot;
+    return slot;
+}
+
+void
+glit::ChunkCache::clear()
+{
+    for (auto slot : lru_) {
+        index_.erase(slots_[slot].key);
+        slots_[slot].occupied = false;
+        freeSlots_.push_back(slot);
+    }
+    lru_.clear();
+}
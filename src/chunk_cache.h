@@ -0,0 +1,144 @@
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+#pragma once
+
+#include <cstdint>
+#include <list>
+#include <memory>
+#include <unordered_map>
+#include <vector>
+
+#include "vertex.h"
+
+namespace glit {
+
+// A GPU-resident cache of fixed-size mesh chunks.
+//
+// Every chunk has the same number of verts and the same index pattern, so
+// we carve one large vertex buffer into equal slots and upload the pattern
+// once as the whole index buffer. After that, making a chunk resident is a
+// single glBufferSubData into its slot, and drawing it is a single
+// glDrawElements of the pattern with the attributes pointed at its slot
+// (see firstVertex). The pattern only spans one chunk, so it fits in 16
+// bit indices however many slots there are.
+//
+// The number of slots is set by a byte budget. When we need a slot and
+// none are free, we evict the least recently used chunk that has not been
+// used in the current frame. The number of uploads per frame is capped so
+// that a sudden change of view does not stall a single frame; callers are
+// expected to fall back to a coarser chunk that is already resident.
+//
+// Pinned chunks are never evicted and do not count against the per-frame
+// upload budget; use them for the coarsest level so that there is always
+// something to fall back to.
+class ChunkCache
+{
+  public:
+    using Key = uint64_t;
+    using Slot = uint32_t;
+    constexpr static Slot NoSlot = uint32_t(-1);
+
+    template <typename VertexType>
+    static std::unique_ptr<ChunkCache> make(size_t vertsPerChunk,
+                                            const std::vector<uint32_t>& indexPattern,
+                                            size_t byteBudget)
+    {
+        std::unique_ptr<ChunkCache> cache(new ChunkCache(
+                    VertexDescriptor::fromType<VertexType>(),
+                    vertsPerChunk, indexPattern,
+                    slotsForBudget(byteBudget, vertsPerChunk * sizeof(VertexType))));
+        cache->vertexBuffer_->reserve<VertexType>(cache->slotCount() * vertsPerChunk);
+        return cache;
+    }
+
+    // Start a new frame, allowing up to |uploadBudget| uploads.
+    void beginFrame(size_t uploadBudget);
+
+    // Look up a resident chunk and mark it as used this frame. Returns NoSlot
+    // if the chunk is not resident.
+    Slot use(Key key);
+
+    // Whether an upload would succeed right now.
+    bool canUpload() const;
+
+    // Make |verts| resident as the chunk |key| and mark it as used this
+    // frame. Returns NoSlot if we are out of budget or there is nothing we
+    // can evict.
+    template <typename VertexType>
+    Slot upload(Key key, const std::vector<VertexType>& verts, bool pinned = false) {
+        if (verts.size() != vertsPerChunk_)
+            throw std::runtime_error("chunk upload with wrong vertex count");
+        if (!pinned && uploadsThisFrame_ >= uploadBudget_)
+            return NoSlot;
+        Slot slot = acquireSlot(key, pinned);
+        if (slot == NoSlot)
+            return NoSlot;
+        vertexBuffer_->uploadRange(verts, slot * vertsPerChunk_);
+        if (!pinned)
+            ++uploadsThisFrame_;
+        return slot;
+    }
+
+    // Drop everything that is not pinned.
+    void clear();
+
+    const VertexBuffer& vertexBuffer() const { return *vertexBuffer_; }
+    const IndexBuffer& indexBuffer() const { return *indexBuffer_; }
+    size_t indicesPerChunk() const { return indicesPerChunk_; }
+    size_t firstVertex(Slot slot) const { return slot * vertsPerChunk_; }
+
+    // Counters.
+    size_t slotCount() const { return slots_.size(); }
+    size_t residentChunks() const { return index_.size(); }
+    size_t uploadsThisFrame() const { return uploadsThisFrame_; }
+    size_t evictions() const { return evictions_; }
+
+  private:
+    ChunkCache(const VertexDescriptor& desc,
+               size_t vertsPerChunk,
+               const std::vector<uint32_t>& indexPattern,
+               size_t slots);
+
+    static size_t slotsForBudget(size_t byteBudget, size_t vertexBytes);
+    Slot acquireSlot(Key key, bool pinned);
+    void touch(Slot slot);
+
+    std::unique_ptr<VertexBuffer> vertexBuffer_;
+    std::unique_ptr<IndexBuffer> indexBuffer_;
+    size_t vertsPerChunk_;
+    size_t indicesPerChunk_;
+
+    // Per-slot bookkeeping. Unpinned, occupied slots are on the LRU list,
+    // least recently used at the front.
+    struct SlotInfo {
+        Key key;
+        size_t lastUsed;
+        bool occupied;
+        bool pinned;
+        std::list<Slot>::iterator lru;
+    };
+    std::vector<SlotInfo> slots_;
+    std::vector<Slot> freeSlots_;
+    std::list<Slot> lru_;
+    std::unordered_map<Key, Slot> index_;
+
+    size_t frame_;
+    size_t uploadBudget_;
+    size_t uploadsThisFrame_;
+    size_t evictions_;
+
+    ChunkCache(const ChunkCache&) = delete;
+    ChunkCache(ChunkCache&&) = delete;
+};
+
+} // namespace glit
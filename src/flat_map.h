@@ -0,0 +1,146 @@
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+#pragma once
+
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+namespace glit {
+
+// An open addressing hash map for small, trivially copyable keys and
+// values.
+//
+// Entries live in one flat array and we probe linearly from the key's hash,
+// so a lookup is usually a single cache line and an insert never touches
+// the heap unless the table has to grow. We scramble the hash and take the
+// slot from its top bits, so a hash that is weak in its low bits, or whose
+// low bits already picked this map out of several, still spreads. Erase
+// shifts the rest of the probe run back rather than leaving a tombstone, so
+// the table does not silt up under churn. The table never shrinks.
+//
+// Each slot is stamped with the generation it was filled in, and anything
+// stamped with an older one is empty. That makes clear constant time, which
+// matters for scratch maps that are cleared far more often than they fill.
+//
+// Pointers to values are only good until the next insert. Not thread safe;
+// the owner locks.
+template <typename Key, typename Value, typename Hash>
+class FlatMap
+{
+  public:
+    FlatMap()
+      : size_(0)
+      , shift_(64)
+      , generation_(1)
+    {}
+
+    size_t size() const { return size_; }
+    bool empty() const { return size_ == 0; }
+
+    Value* find(const Key& key) {
+        if (slots_.empty())
+            return nullptr;
+        for (size_t i = home(key); live(i); i = next(i)) {
+            if (slots_[i].key == key)
+                return &slots_[i].value;
+        }
+        return nullptr;
+    }
+
+    // Adds |value| under |key| unless there is one already. Either way,
+    // returns the value under |key| and whether we added it.
+    std::pair<Value*, bool> insert(const Key& key, const Value& value) {
+        if ((size_ + 1) * 2 > slots_.size())
+            grow();
+        size_t i = home(key);
+        for (; live(i); i = next(i)) {
+            if (slots_[i].key == key)
+                return std::make_pair(&slots_[i].value, false);
+        }
+        slots_[i] = Slot{key, value, generation_};
+        ++size_;
+        return std::make_pair(&slots_[i].value, true);
+    }
+
+    bool erase(const Key& key) {
+        if (slots_.empty())
+            return false;
+        size_t i = home(key);
+        for (; live(i); i = next(i)) {
+            if (slots_[i].key == key)
+                break;
+        }
+        if (!live(i))
+            return false;
+
+        // Pull back anything later in the run that would be stranded behind
+        // the hole, that is anything whose home is not between the hole and
+        // where it sits.
+        size_t hole = i;
+        for (size_t j = next(i); live(j); j = next(j)) {
+            size_t want = home(slots_[j].key);
+            if (((j - want) & mask()) >= ((j - hole) & mask())) {
+                slots_[hole] = slots_[j];
+                hole = j;
+            }
+        }
+        slots_[hole].generation = 0;
+        --size_;
+        return true;
+    }
+
+    void clear() {
+        size_ = 0;
+        if (++generation_ == 0) {
+            for (auto& slot : slots_)
+                slot.generation = 0;
+            generation_ = 1;
+        }
+    }
+
+  private:
+    struct Slot {
+        Key key;
+        Value value;
+        uint32_t generation;
+    };
+    std::vector<Slot> slots_;
+    size_t size_;
+    unsigned shift_;
+    uint32_t generation_;
+
+    size_t mask() const { return slots_.size() - 1; }
+    size_t home(const Key& key) const {
+        return size_t((uint64_t(Hash()(key)) * 0x9e3779b97f4a7c15ull) >> shift_);
+    }
+    size_t next(size_t i) const { return (i + 1) & mask(); }
+    bool live(size_t i) const { return slots_[i].generation == generation_; }
+
+    void grow() {
+        std::vector<Slot> old;
+        old.swap(slots_);
+        slots_.resize(old.empty() ? 64 : old.size() * 2, Slot{Key(), Value(), 0});
+        shift_ = old.empty() ? 58 : shift_ - 1;
+        for (auto& slot : old) {
+            if (slot.generation != generation_)
+                continue;
+            size_t i = home(slot.key);
+            while (live(i))
+                i = next(i);
+            slots_[i] = slot;
+        }
+    }
+};
+
+} // namespace glit
@@ -0,0 +1,515 @@
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+#include "height_kernel.h"
+
+#include <cmath>
+#include <stdexcept>
+
+#include <glm/glm.hpp>
+
+#include <simplexnoise.h>
+
+#if defined(__x86_64__) && !defined(__EMSCRIPTEN__)
+# define HAVE_X86_KERNELS
+# include <immintrin.h>
+#endif
+
+using namespace glm;
+using namespace std;
+
+void
+glit::MidpointBatch::clear()
+{
+    for (auto* v : {&ax, &ay, &az, &ha, &bx, &by, &bz, &hb, &x, &y, &z, &h, &values})
+        v->clear();
+}
+
+size_t
+glit::MidpointBatch::push(const vec3& a, const vec3& b,
+                          float aHeight, float bHeight)
+{
+    ax.push_back(a.x); ay.push_back(a.y); az.push_back(a.z);
+    bx.push_back(b.x); by.push_back(b.y); bz.push_back(b.z);
+    ha.push_back(aHeight);
+    hb.push_back(bHeight);
+    return ax.size() - 1;
+}
+
+/* static */ vector<glit::HeightKernel::Octave>
+glit::HeightKernel::fractal(float amplitude, size_t count, float gain)
+{
+    vector<Octave> octaves;
+    float frequency = 1.f;
+    for (size_t i = 0; i < count; ++i) {
+        octaves.push_back(Octave{frequency, amplitude});
+        frequency *= 2.f;
+        amplitude *= gain;
+    }
+    return octaves;
+}
+
+glit::HeightKernel::HeightKernel(float radius, vector<Octave> octaves)
+  : radius_(radius)
+  , octaves_(move(octaves))
+  , path_(bestPath())
+{}
+
+/* static */ bool
+glit::HeightKernel::supported(Path path)
+{
+    switch (path) {
+    case Path::Scalar:
+        return true;
+#ifdef HAVE_X86_KERNELS
+    case Path::SSE41:
+        return __builtin_cpu_supports("sse4.1");
+    case Path::AVX2:
+        return __builtin_cpu_supports("avx2");
+#else
+    default:
+        return false;
+#endif
+    }
+    return false;
+}
+
+/* static */ glit::HeightKernel::Path
+glit::HeightKernel::bestPath()
+{
+    if (supported(Path::AVX2))
+        return Path::AVX2;
+    if (supported(Path::SSE41))
+        return Path::SSE41;
+    return Path::Scalar;
+}
+
+/* static */ const char*
+glit::HeightKernel::pathName(Path path)
+{
+    switch (path) {
+    case Path::Scalar: return "scalar";
+    case Path::SSE41: return "sse4.1";
+    case Path::AVX2: return "avx2";
+    }
+    return "unknown";
+}
+
+void
+glit::HeightKernel::setPath(Path path)
+{
+    if (!supported(path))
+        throw runtime_error(string("height kernel path not supported: ") +
+                            pathName(path));
+    path_ = path;
+}
+
+float
+glit::HeightKernel::height(vec3 unit, size_t first, size_t end) const
+{
+    float h = 0.f;
+    for (size_t o = first; o < end; ++o) {
+        vec3 p = unit * octaves_[o].frequency;
+        h += octaves_[o].amplitude * raw_noise_3d(p.x, p.y, p.z);
+    }
+    return h;
+}
+
+void
+glit::HeightKernel::displaceScalar(MidpointBatch& batch,
+                                   size_t first, size_t end) const
+{
+    for (size_t i = 0; i < batch.size(); ++i) {
+        vec3 a(batch.ax[i], batch.ay[i], batch.az[i]);
+        vec3 b(batch.bx[i], batch.by[i], batch.bz[i]);
+        // Spelled out so that the SIMD paths can match it step for step.
+        vec3 m = a + ((b - a) / 2.f);
+        m = m * (1.f / sqrt((m.x * m.x + m.y * m.y) + m.z * m.z));
+        float h = (batch.ha[i] + batch.hb[i]) * 0.5f;
+        for (size_t o = first; o < end; ++o) {
+            vec3 p = m * octaves_[o].frequency;
+            float value = octaves_[o].amplitude * raw_noise_3d(p.x, p.y, p.z);
+            batch.values[(o - first) * batch.stride + i] = value;
+            h += value;
+        }
+        vec3 pos = m * (radius_ + h);
+        batch.x[i] = pos.x;
+        batch.y[i] = pos.y;
+        batch.z[i] = pos.z;
+        batch.h[i] = h;
+    }
+}
+
+#ifdef HAVE_X86_KERNELS
+// The gradients of the simplex noise, split by component.
+static const float GradX[12] = {1,-1, 1,-1, 1,-1, 1,-1, 0, 0, 0, 0};
+static const float GradY[12] = {1, 1,-1,-1, 0, 0, 0, 0, 1,-1, 1,-1};
+static const float GradZ[12] = {0, 0, 0, 0, 1, 1,-1,-1, 1, 1,-1,-1};
+
+// Everything a kernel needs, with the batch padded to a whole number of
+// lanes.
+struct KernelArgs {
+    const float *ax, *ay, *az, *ha;
+    const float *bx, *by, *bz, *hb;
+    float *x, *y, *z, *h;
+    float* values;
+    size_t count;
+    float radius;
+    const glit::HeightKernel::Octave* octaves;
+    size_t first;
+    size_t end;
+};
+
+// Both kernels follow raw_noise_3d step for step; see there for the why.
+// The only tricks are:
+//   * fastfloor is not quite floor: it rounds non-positive integers down.
+//   * The simplex ordering branches become masks:
+//       i1 = x>=y & x>=z    i2 = x>=y | x>=z
+//       j1 = x<y & y>=z     j2 = x<y | y>=z
+//       k1 = x<z & y<z      k2 = x<z | y<z
+//   * p % 12 for p in [0, 512) is p - 12 * ((p * 171) >> 11).
+
+#define AVX2 __attribute__((target("avx2")))
+#define SSE41 __attribute__((target("sse4.1")))
+
+AVX2 static inline __m256i
+fastfloor8(__m256 v)
+{
+    __m256i t = _mm256_cvttps_epi32(v);
+    __m256 le = _mm256_cmp_ps(v, _mm256_setzero_ps(), _CMP_LE_OQ);
+    return _mm256_add_epi32(t, _mm256_castps_si256(le));  // -1 where true
+}
+
+AVX2 static inline __m256i
+hash8(__m256i i, __m256i j, __m256i k)
+{
+    __m256i p = _mm256_i32gather_epi32(perm, k, 4);
+    p = _mm256_i32gather_epi32(perm, _mm256_add_epi32(j, p), 4);
+    p = _mm256_i32gather_epi32(perm, _mm256_add_epi32(i, p), 4);
+    __m256i q = _mm256_srli_epi32(_mm256_mullo_epi32(p, _mm256_set1_epi32(171)), 11);
+    return _mm256_sub_epi32(p, _mm256_mullo_epi32(q, _mm256_set1_epi32(12)));
+}
+
+AVX2 static inline __m256
+corner8(__m256 x, __m256 y, __m256 z, __m256i gi)
+{
+    __m256 t = _mm256_sub_ps(_mm256_set1_ps(0.6f), _mm256_mul_ps(x, x));
+    t = _mm256_sub_ps(t, _mm256_mul_ps(y, y));
+    t = _mm256_sub_ps(t, _mm256_mul_ps(z, z));
+    __m256 g = _mm256_mul_ps(_mm256_i32gather_ps(GradX, gi, 4), x);
+    g = _mm256_add_ps(g, _mm256_mul_ps(_mm256_i32gather_ps(GradY, gi, 4), y));
+    g = _mm256_add_ps(g, _mm256_mul_ps(_mm256_i32gather_ps(GradZ, gi, 4), z));
+    __m256 t2 = _mm256_mul_ps(t, t);
+    __m256 n = _mm256_mul_ps(_mm256_mul_ps(t2, t2), g);
+    return _mm256_and_ps(n, _mm256_cmp_ps(t, _mm256_setzero_ps(), _CMP_GE_OQ));
+}
+
+AVX2 static inline __m256
+noise8(__m256 x, __m256 y, __m256 z)
+{
+    const __m256 one = _mm256_set1_ps(1.f);
+    const __m256 F3 = _mm256_set1_ps(1.f / 3.f);
+    const __m256 G3 = _mm256_set1_ps(1.f / 6.f);
+    const __m256 G3x2 = _mm256_set1_ps(2.f / 6.f);
+    const __m256 G3x3 = _mm256_set1_ps(3.f / 6.f);
+    const __m256i ione = _mm256_set1_epi32(1);
+    const __m256i mask255 = _mm256_set1_epi32(255);
+
+    // Skew to find our cell.
+    __m256 s = _mm256_mul_ps(_mm256_add_ps(_mm256_add_ps(x, y), z), F3);
+    __m256i i = fastfloor8(_mm256_add_ps(x, s));
+    __m256i j = fastfloor8(_mm256_add_ps(y, s));
+    __m256i k = fastfloor8(_mm256_add_ps(z, s));
+    __m256 t = _mm256_mul_ps(_mm256_cvtepi32_ps(
+                _mm256_add_epi32(_mm256_add_epi32(i, j), k)), G3);
+    __m256 x0 = _mm256_sub_ps(x, _mm256_sub_ps(_mm256_cvtepi32_ps(i), t));
+    __m256 y0 = _mm256_sub_ps(y, _mm256_sub_ps(_mm256_cvtepi32_ps(j), t));
+    __m256 z0 = _mm256_sub_ps(z, _mm256_sub_ps(_mm256_cvtepi32_ps(k), t));
+
+    // Pick the simplex.
+    __m256 cxy = _mm256_cmp_ps(x0, y0, _CMP_GE_OQ);
+    __m256 cxz = _mm256_cmp_ps(x0, z0, _CMP_GE_OQ);
+    __m256 cyz = _mm256_cmp_ps(y0, z0, _CMP_GE_OQ);
+    __m256 i1 = _mm256_and_ps(_mm256_and_ps(cxy, cxz), one);
+    __m256 j1 = _mm256_and_ps(_mm256_andnot_ps(cxy, cyz), one);
+    __m256 k1 = _mm256_andnot_ps(_mm256_or_ps(cxz, cyz), one);
+    __m256 i2 = _mm256_and_ps(_mm256_or_ps(cxy, cxz), one);
+    __m256 j2 = _mm256_andnot_ps(_mm256_andnot_ps(cyz, cxy), one);
+    __m256 k2 = _mm256_andnot_ps(_mm256_and_ps(cxz, cyz), one);
+
+    __m256 x1 = _mm256_add_ps(_mm256_sub_ps(x0, i1), G3);
+    __m256 y1 = _mm256_add_ps(_mm256_sub_ps(y0, j1), G3);
+    __m256 z1 = _mm256_add_ps(_mm256_sub_ps(z0, k1), G3);
+    __m256 x2 = _mm256_add_ps(_mm256_sub_ps(x0, i2), G3x2);
+    __m256 y2 = _mm256_add_ps(_mm256_sub_ps(y0, j2), G3x2);
+    __m256 z2 = _mm256_add_ps(_mm256_sub_ps(z0, k2), G3x2);
+    __m256 x3 = _mm256_add_ps(_mm256_sub_ps(x0, one), G3x3);
+    __m256 y3 = _mm256_add_ps(_mm256_sub_ps(y0, one), G3x3);
+    __m256 z3 = _mm256_add_ps(_mm256_sub_ps(z0, one), G3x3);
+
+    // Hash the corners.
+    __m256i ii = _mm256_and_si256(i, mask255);
+    __m256i jj = _mm256_and_si256(j, mask255);
+    __m256i kk = _mm256_and_si256(k, mask255);
+    __m256i gi0 = hash8(ii, jj, kk);
+    __m256i gi1 = hash8(_mm256_add_epi32(ii, _mm256_cvtps_epi32(i1)),
+                        _mm256_add_epi32(jj, _mm256_cvtps_epi32(j1)),
+                        _mm256_add_epi32(kk, _mm256_cvtps_epi32(k1)));
+    __m256i gi2 = hash8(_mm256_add_epi32(ii, _mm256_cvtps_epi32(i2)),
+                        _mm256_add_epi32(jj, _mm256_cvtps_epi32(j2)),
+                        _mm256_add_epi32(kk, _mm256_cvtps_epi32(k2)));
+    __m256i gi3 = hash8(_mm256_add_epi32(ii, ione),
+                        _mm256_add_epi32(jj, ione),
+                        _mm256_add_epi32(kk, ione));
+
+    __m256 noise = _mm256_add_ps(corner8(x0, y0, z0, gi0), corner8(x1, y1, z1, gi1));
+    noise = _mm256_add_ps(noise, corner8(x2, y2, z2, gi2));
+    noise = _mm256_add_ps(noise, corner8(x3, y3, z3, gi3));
+    return _mm256_mul_ps(noise, _mm256_set1_ps(32.f));
+}
+
+AVX2 static void
+displaceAVX2(const KernelArgs& args)
+{
+    const __m256 half = _mm256_set1_ps(0.5f);
+    const __m256 one = _mm256_set1_ps(1.f);
+
+    for (size_t n = 0; n < args.count; n += 8) {
+        // m = normalize(a + (b - a) / 2)
+        __m256 Ax = _mm256_loadu_ps(args.ax + n);
+        __m256 Ay = _mm256_loadu_ps(args.ay + n);
+        __m256 Az = _mm256_loadu_ps(args.az + n);
+        __m256 x = _mm256_add_ps(Ax, _mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(args.bx + n), Ax), half));
+        __m256 y = _mm256_add_ps(Ay, _mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(args.by + n), Ay), half));
+        __m256 z = _mm256_add_ps(Az, _mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(args.bz + n), Az), half));
+        __m256 len2 = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(x, x), _mm256_mul_ps(y, y)),
+                                    _mm256_mul_ps(z, z));
+        __m256 inv = _mm256_div_ps(one, _mm256_sqrt_ps(len2));
+        x = _mm256_mul_ps(x, inv);
+        y = _mm256_mul_ps(y, inv);
+        z = _mm256_mul_ps(z, inv);
+
+        __m256 h = _mm256_mul_ps(_mm256_add_ps(_mm256_loadu_ps(args.ha + n),
+                                               _mm256_loadu_ps(args.hb + n)), half);
+        for (size_t o = args.first; o < args.end; ++o) {
+            __m256 f = _mm256_set1_ps(args.octaves[o].frequency);
+            __m256 noise = noise8(_mm256_mul_ps(x, f), _mm256_mul_ps(y, f), _mm256_mul_ps(z, f));
+            __m256 value = _mm256_mul_ps(_mm256_set1_ps(args.octaves[o].amplitude), noise);
+            _mm256_storeu_ps(args.values + (o - args.first) * args.count + n, value);
+            h = _mm256_add_ps(h, value);
+        }
+
+        __m256 r = _mm256_add_ps(_mm256_set1_ps(args.radius), h);
+        _mm256_storeu_ps(args.x + n, _mm256_mul_ps(x, r));
+        _mm256_storeu_ps(args.y + n, _mm256_mul_ps(y, r));
+        _mm256_storeu_ps(args.z + n, _mm256_mul_ps(z, r));
+        _mm256_storeu_ps(args.h + n, h);
+    }
+}
+
+// SSE has no gathers, so we do the table lookups a lane at a time.
+static inline __m128i
+gather4(const int* table, __m128i idx)
+{
+    alignas(16) int i[4];
+    _mm_store_si128(reinterpret_cast<__m128i*>(i), idx);
+    return _mm_setr_epi32(table[i[0]], table[i[1]], table[i[2]], table[i[3]]);
+}
+
+static inline __m128
+gather4(const float* table, __m128i idx)
+{
+    alignas(16) int i[4];
+    _mm_store_si128(reinterpret_cast<__m128i*>(i), idx);
+    return _mm_setr_ps(table[i[0]], table[i[1]], table[i[2]], table[i[3]]);
+}
+
+SSE41 static inline __m128i
+fastfloor4(__m128 v)
+{
+    __m128i t = _mm_cvttps_epi32(v);
+    return _mm_add_epi32(t, _mm_castps_si128(_mm_cmple_ps(v, _mm_setzero_ps())));
+}
+
+SSE41 static inline __m128i
+hash4(__m128i i, __m128i j, __m128i k)
+{
+    __m128i p = gather4(perm, k);
+    p = gather4(perm, _mm_add_epi32(j, p));
+    p = gather4(perm, _mm_add_epi32(i, p));
+    __m128i q = _mm_srli_epi32(_mm_mullo_epi32(p, _mm_set1_epi32(171)), 11);
+    return _mm_sub_epi32(p, _mm_mullo_epi32(q, _mm_set1_epi32(12)));
+}
+
+SSE41 static inline __m128
+corner4(__m128 x, __m128 y, __m128 z, __m128i gi)
+{
+    __m128 t = _mm_sub_ps(_mm_set1_ps(0.6f), _mm_mul_ps(x, x));
+    t = _mm_sub_ps(t, _mm_mul_ps(y, y));
+    t = _mm_sub_ps(t, _mm_mul_ps(z, z));
+    __m128 g = _mm_mul_ps(gather4(GradX, gi), x);
+    g = _mm_add_ps(g, _mm_mul_ps(gather4(GradY, gi), y));
+    g = _mm_add_ps(g, _mm_mul_ps(gather4(GradZ, gi), z));
+    __m128 t2 = _mm_mul_ps(t, t);
+    __m128 n = _mm_mul_ps(_mm_mul_ps(t2, t2), g);
+    return _mm_and_ps(n, _mm_cmpge_ps(t, _mm_setzero_ps()));
+}
+
+SSE41 static inline __m128
+noise4(__m128 x, __m128 y, __m128 z)
+{
+    const __m128 one = _mm_set1_ps(1.f);
+    const __m128 F3 = _mm_set1_ps(1.f / 3.f);
+    const __m128 G3 = _mm_set1_ps(1.f / 6.f);
+    const __m128 G3x2 = _mm_set1_ps(2.f / 6.f);
+    const __m128 G3x3 = _mm_set1_ps(3.f / 6.f);
+    const __m128i ione = _mm_set1_epi32(1);
+    const __m128i mask255 = _mm_set1_epi32(255);
+
+    __m128 s = _mm_mul_ps(_mm_add_ps(_mm_add_ps(x, y), z), F3);
+    __m128i i = fastfloor4(_mm_add_ps(x, s));
+    __m128i j = fastfloor4(_mm_add_ps(y, s));
+    __m128i k = fastfloor4(_mm_add_ps(z, s));
+    __m128 t = _mm_mul_ps(_mm_cvtepi32_ps(_mm_add_epi32(_mm_add_epi32(i, j), k)), G3);
+    __m128 x0 = _mm_sub_ps(x, _mm_sub_ps(_mm_cvtepi32_ps(i), t));
+    __m128 y0 = _mm_sub_ps(y, _mm_sub_ps(_mm_cvtepi32_ps(j), t));
+    __m128 z0 = _mm_sub_ps(z, _mm_sub_ps(_mm_cvtepi32_ps(k), t));
+
+    __m128 cxy = _mm_cmpge_ps(x0, y0);
+    __m128 cxz = _mm_cmpge_ps(x0, z0);
+    __m128 cyz = _mm_cmpge_ps(y0, z0);
+    __m128 i1 = _mm_and_ps(_mm_and_ps(cxy, cxz), one);
+    __m128 j1 = _mm_and_ps(_mm_andnot_ps(cxy, cyz), one);
+    __m128 k1 = _mm_andnot_ps(_mm_or_ps(cxz, cyz), one);
+    __m128 i2 = _mm_and_ps(_mm_or_ps(cxy, cxz), one);
+    __m128 j2 = _mm_andnot_ps(_mm_andnot_ps(cyz, cxy), one);
+    __m128 k2 = _mm_andnot_ps(_mm_and_ps(cxz, cyz), one);
+
+    __m128 x1 = _mm_add_ps(_mm_sub_ps(x0, i1), G3);
+    __m128 y1 = _mm_add_ps(_mm_sub_ps(y0, j1), G3);
+    __m128 z1 = _mm_add_ps(_mm_sub_ps(z0, k1), G3);
+    __m128 x2 = _mm_add_ps(_mm_sub_ps(x0, i2), G3x2);
+    __m128 y2 = _mm_add_ps(_mm_sub_ps(y0, j2), G3x2);
+    __m128 z2 = _mm_add_ps(_mm_sub_ps(z0, k2), G3x2);
+    __m128 x3 = _mm_add_ps(_mm_sub_ps(x0, one), G3x3);
+    __m128 y3 = _mm_add_ps(_mm_sub_ps(y0, one), G3x3);
+    __m128 z3 = _mm_add_ps(_mm_sub_ps(z0, one), G3x3);
+
+    __m128i ii = _mm_and_si128(i, mask255);
+    __m128i jj = _mm_and_si128(j, mask255);
+    __m128i kk = _mm_and_si128(k, mask255);
+    __m128i gi0 = hash4(ii, jj, kk);
+    __m128i gi1 = hash4(_mm_add_epi32(ii, _mm_cvtps_epi32(i1)),
+                        _mm_add_epi32(jj, _mm_cvtps_epi32(j1)),
+                        _mm_add_epi32(kk, _mm_cvtps_epi32(k1)));
+    __m128i gi2 = hash4(_mm_add_epi32(ii, _mm_cvtps_epi32(i2)),
+                        _mm_add_epi32(jj, _mm_cvtps_epi32(j2)),
+                        _mm_add_epi32(kk, _mm_cvtps_epi32(k2)));
+    __m128i gi3 = hash4(_mm_add_epi32(ii, ione),
+                        _mm_add_epi32(jj, ione),
+                        _mm_add_epi32(kk, ione));
+
+    __m128 noise = _mm_add_ps(corner4(x0, y0, z0, gi0), corner4(x1, y1, z1, gi1));
+    noise = _mm_add_ps(noise, corner4(x2, y2, z2, gi2));
+    noise = _mm_add_ps(noise, corner4(x3, y3, z3, gi3));
+    return _mm_mul_ps(noise, _mm_set1_ps(32.f));
+}
+
+SSE41 static void
+displaceSSE41(const KernelArgs& args)
+{
+    const __m128 half = _mm_set1_ps(0.5f);
+    const __m128 one = _mm_set1_ps(1.f);
+
+    for (size_t n = 0; n < args.count; n += 4) {
+        __m128 Ax = _mm_loadu_ps(args.ax + n);
+        __m128 Ay = _mm_loadu_ps(args.ay + n);
+        __m128 Az = _mm_loadu_ps(args.az + n);
+        __m128 x = _mm_add_ps(Ax, _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(args.bx + n), Ax), half));
+        __m128 y = _mm_add_ps(Ay, _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(args.by + n), Ay), half));
+        __m128 z = _mm_add_ps(Az, _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(args.bz + n), Az), half));
+        __m128 len2 = _mm_add_ps(_mm_add_ps(_mm_mul_ps(x, x), _mm_mul_ps(y, y)),
+                                 _mm_mul_ps(z, z));
+        __m128 inv = _mm_div_ps(one, _mm_sqrt_ps(len2));
+        x = _mm_mul_ps(x, inv);
+        y = _mm_mul_ps(y, inv);
+        z = _mm_mul_ps(z, inv);
+
+        __m128 h = _mm_mul_ps(_mm_add_ps(_mm_loadu_ps(args.ha + n),
+                                         _mm_loadu_ps(args.hb + n)), half);
+        for (size_t o = args.first; o < args.end; ++o) {
+            __m128 f = _mm_set1_ps(args.octaves[o].frequency);
+            __m128 noise = noise4(_mm_mul_ps(x, f), _mm_mul_ps(y, f), _mm_mul_ps(z, f));
+            __m128 value = _mm_mul_ps(_mm_set1_ps(args.octaves[o].amplitude), noise);
+            _mm_storeu_ps(args.values + (o - args.first) * args.count + n, value);
+            h = _mm_add_ps(h, value);
+        }
+
+        __m128 r = _mm_add_ps(_mm_set1_ps(args.radius), h);
+        _mm_storeu_ps(args.x + n, _mm_mul_ps(x, r));
+        _mm_storeu_ps(args.y + n, _mm_mul_ps(y, r));
+        _mm_storeu_ps(args.z + n, _mm_mul_ps(z, r));
+        _mm_storeu_ps(args.h + n, h);
+    }
+}
+#undef AVX2
+#undef SSE41
+#endif // HAVE_X86_KERNELS
+
+void
+glit::HeightKernel::displace(MidpointBatch& batch, size_t first, size_t end) const
+{
+    size_t count = batch.size();
+    for (auto* v : {&batch.x, &batch.y, &batch.z, &batch.h})
+        v->resize(count);
+    batch.first = first;
+    batch.stride = count;
+    batch.values.resize((end - first) * count);
+    if (count == 0)
+        return;
+
+#ifdef HAVE_X86_KERNELS
+    if (path_ != Path::Scalar) {
+        // Pad out to a whole number of lanes by repeating the first point.
+        size_t width = path_ == Path::AVX2 ? 8 : 4;
+        size_t padded = (count + width - 1) / width * width;
+        for (auto* v : {&batch.ax, &batch.ay, &batch.az, &batch.ha,
+                        &batch.bx, &batch.by, &batch.bz, &batch.hb})
+        {
+            v->resize(padded, (*v)[0]);
+        }
+        for (auto* v : {&batch.x, &batch.y, &batch.z, &batch.h})
+            v->resize(padded);
+        batch.stride = padded;
+        batch.values.resize((end - first) * padded);
+
+        KernelArgs args{
+            batch.ax.data(), batch.ay.data(), batch.az.data(), batch.ha.data(),
+            batch.bx.data(), batch.by.data(), batch.bz.data(), batch.hb.data(),
+            batch.x.data(), batch.y.data(), batch.z.data(), batch.h.data(),
+            batch.values.data(), padded, radius_, octaves_.data(), first, end};
+        if (path_ == Path::AVX2)
+            displaceAVX2(args);
+        else
+            displaceSSE41(args);
+
+        for (auto* v : {&batch.ax, &batch.ay, &batch.az, &batch.ha,
+                        &batch.bx, &batch.by, &batch.bz, &batch.hb,
+                        &batch.x, &batch.y, &batch.z, &batch.h})
+        {
+            v->resize(count);
+        }
+        return;
+    }
+#endif
+    displaceScalar(batch, first, end);
+}
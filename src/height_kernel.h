@@ -0,0 +1,128 @@
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+#pragma once
+
+#include <vector>
+
+#include <glm/vec3.hpp>
+
+namespace glit {
+
+// A set of edges whose midpoints we want to displace onto the terrain
+// surface, kept as structure-of-arrays so that the kernel can load eight
+// lanes of each component at once. Each end of the edge carries its height
+// above the radius, which the midpoint starts from.
+class MidpointBatch
+{
+    friend class HeightKernel;
+    std::vector<float> ax, ay, az, ha;
+    std::vector<float> bx, by, bz, hb;
+    std::vector<float> x, y, z, h;
+    std::vector<float> values;
+    size_t first = 0;
+    size_t stride = 0;
+
+  public:
+    void clear();
+    size_t size() const { return ax.size(); }
+    bool empty() const { return ax.empty(); }
+
+    // Returns the index of the result.
+    size_t push(const glm::vec3& a, const glm::vec3& b,
+                float aHeight = 0.f, float bHeight = 0.f);
+    glm::vec3 result(size_t i) const { return glm::vec3(x[i], y[i], z[i]); }
+    float height(size_t i) const { return h[i]; }
+
+    // The height result |i| started from: the mean of its ends.
+    float start(size_t i) const { return (ha[i] + hb[i]) * 0.5f; }
+
+    // What octave |octave| of the last displace added to result |i|.
+    float octave(size_t i, size_t octave) const {
+        return values[(octave - first) * stride + i];
+    }
+};
+
+// Fractal heights over the unit sphere: the sum of a series of octaves of 3D
+// simplex noise, each at a higher frequency and lower amplitude than the
+// last.
+//
+// The kernel finds the terrain point above the midpoint of each edge in a
+// batch. The height starts as the mean of the heights at the two ends and
+// then has a range of octaves, evaluated at the normalized midpoint, added
+// to it. With zero at the ends and every octave this is the full sum;
+// Terrain uses it to evaluate only the octaves that are new at each level.
+//
+// The scalar path is bit for bit what height() does. The SIMD paths run the
+// same steps in single precision on 4 or 8 lanes; the scalar noise does some
+// of its steps in double, so the results differ slightly. Each octave's
+// noise stays within NoiseTolerance of the scalar path (bench_noise checks
+// this), which is 8cm of height for our 20km base amplitude. Positions are
+// floats at planet radius, where a float step is half a meter, so in
+// practice they land within a couple of steps of the scalar result. Each
+// lane is independent of the others, so a point gets the same answer
+// whatever batch it is in.
+class HeightKernel
+{
+  public:
+    enum class Path {
+        Scalar,
+        SSE41,
+        AVX2,
+    };
+    constexpr static float NoiseTolerance = 4e-6f;
+
+    struct Octave {
+        float frequency;
+        float amplitude;
+    };
+
+    // Octaves that each double the frequency and scale the amplitude by
+    // |gain|. Sticking to powers of two keeps the scaling of the sample
+    // point exact.
+    static std::vector<Octave> fractal(float amplitude, size_t count, float gain);
+
+    HeightKernel(float radius, std::vector<Octave> octaves);
+
+    // The fastest path this CPU supports, and whether a path is supported.
+    static Path bestPath();
+    static bool supported(Path path);
+    static const char* pathName(Path path);
+
+    void setPath(Path path);
+    Path path() const { return path_; }
+
+    const std::vector<Octave>& octaves() const { return octaves_; }
+
+    // The sum of octaves [first, end), or of the first |octaveCount|, at
+    // |unit|.
+    float height(glm::vec3 unit, size_t first, size_t end) const;
+    float height(glm::vec3 unit, size_t octaveCount) const {
+        return height(unit, 0, octaveCount);
+    }
+
+    // Displace every midpoint in the batch, adding octaves [first, end). The
+    // batch keeps what each octave added; see MidpointBatch::octave.
+    void displace(MidpointBatch& batch, size_t first, size_t end) const;
+    void displace(MidpointBatch& batch) const {
+        displace(batch, 0, octaves_.size());
+    }
+
+  private:
+    float radius_;
+    std::vector<Octave> octaves_;
+    Path path_;
+
+    void displaceScalar(MidpointBatch& batch, size_t first, size_t end) const;
+};
+
+} // namespace glit
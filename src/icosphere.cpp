@@ -31,53 +31,66 @@ glit::IcoSphere::Face::Face(int a0, int a1, int a2, const std::vector<Vertex>& v
     normal = normalize(cross(v1 - v0, v2 - v0));
 }
 
-glit::IcoSphere::IcoSphere(int iterations)
-  : programPoints(makePointsProgram())
+/* static */ const vec3*
+glit::IcoSphere::baseVertices()
 {
-    float t = (1.f + sqrtf(5.f)) / 2.f;
-
-    verts.push_back(Vertex{normalize(vec3(-1.f,  t,  0.f))});
-    verts.push_back(Vertex{normalize(vec3( 1.f,  t,  0.f))});
-    verts.push_back(Vertex{normalize(vec3(-1.f, -t,  0.f))});
-    verts.push_back(Vertex{normalize(vec3( 1.f, -t,  0.f))});
-
-    verts.push_back(Vertex{normalize(vec3( 0.f, -1.f,  t))});
-    verts.push_back(Vertex{normalize(vec3( 0.f,  1.f,  t))});
-    verts.push_back(Vertex{normalize(vec3( 0.f, -1.f, -t))});
-    verts.push_back(Vertex{normalize(vec3( 0.f,  1.f, -t))});
-
-    verts.push_back(Vertex{normalize(vec3( t,  0.f, -1.f))});
-    verts.push_back(Vertex{normalize(vec3( t,  0.f,  1.f))});
-    verts.push_back(Vertex{normalize(vec3(-t,  0.f, -1.f))});
-    verts.push_back(Vertex{normalize(vec3(-t,  0.f,  1.f))});
+    static const float t = (1.f + sqrtf(5.f)) / 2.f;
+    static const vec3 verts[BaseVertexCount] = {
+        normalize(vec3(-1.f,  t,  0.f)),
+        normalize(vec3( 1.f,  t,  0.f)),
+        normalize(vec3(-1.f, -t,  0.f)),
+        normalize(vec3( 1.f, -t,  0.f)),
+
+        normalize(vec3( 0.f, -1.f,  t)),
+        normalize(vec3( 0.f,  1.f,  t)),
+        normalize(vec3( 0.f, -1.f, -t)),
+        normalize(vec3( 0.f,  1.f, -t)),
+
+        normalize(vec3( t,  0.f, -1.f)),
+        normalize(vec3( t,  0.f,  1.f)),
+        normalize(vec3(-t,  0.f, -1.f)),
+        normalize(vec3(-t,  0.f,  1.f)),
+    };
+    return verts;
+}
 
+const int glit::IcoSphere::BaseFaces[BaseFaceCount][3] = {
     // 5 faces around point 0
-    faces.push_back(Face(0, 11, 5, verts));
-    faces.push_back(Face(0, 5, 1, verts));
-    faces.push_back(Face(0, 1, 7, verts));
-    faces.push_back(Face(0, 7, 10, verts));
-    faces.push_back(Face(0, 10, 11, verts));
+    {0, 11, 5},
+    {0, 5, 1},
+    {0, 1, 7},
+    {0, 7, 10},
+    {0, 10, 11},
 
     // 5 adjacent faces
-    faces.push_back(Face(1, 5, 9, verts));
-    faces.push_back(Face(5, 11, 4, verts));
-    faces.push_back(Face(11, 10, 2, verts));
-    faces.push_back(Face(10, 7, 6, verts));
-    faces.push_back(Face(7, 1, 8, verts));
+    {1, 5, 9},
+    {5, 11, 4},
+    {11, 10, 2},
+    {10, 7, 6},
+    {7, 1, 8},
 
     // 5 faces around point 3
-    faces.push_back(Face(3, 9, 4, verts));
-    faces.push_back(Face(3, 4, 2, verts));
-    faces.push_back(Face(3, 2, 6, verts));
-    faces.push_back(Face(3, 6, 8, verts));
-    faces.push_back(Face(3, 8, 9, verts));
+    {3, 9, 4},
+    {3, 4, 2},
+    {3, 2, 6},
+    {3, 6, 8},
+    {3, 8, 9},
 
     // 5 adjacent faces
-    faces.push_back(Face(4, 9, 5, verts));
-    faces.push_back(Face(2, 4, 11, verts));
-    faces.push_back(Face(6, 2, 10, verts));
-    faces.push_back(Face(8, 6, 7, verts));
-    faces.push_back(Face(9, 8, 1, verts));
+    {4, 9, 5},
+    {2, 4, 11},
+    {6, 2, 10},
+    {8, 6, 7},
+    {9, 8, 1},
+};
+
+glit::IcoSphere::IcoSphere(int iterations)
+  : programPoints(makePointsProgram())
+{
+    for (size_t i = 0; i < BaseVertexCount; ++i)
+        verts.push_back(Vertex{baseVertices()[i]});
+    for (auto& face : BaseFaces)
+        faces.push_back(Face(face[0], face[1], face[2], verts));
 
     for (int i = 0; i < iterations; ++i) {
         Faces nextFaces;
@@ -88,11 +101,11 @@ glit::IcoSphere::IcoSphere(int iterations)
                                           verts[face.i2].aPosition));
             vec3 c = normalize(bisectEdge(verts[face.i2].aPosition,
                                           verts[face.i0].aPosition));
-            uint16_t ia = verts.size();
+            int ia = verts.size();
             verts.push_back(Vertex{a});
-            uint16_t ib = verts.size();
+            int ib = verts.size();
             verts.push_back(Vertex{b});
-            uint16_t ic = verts.size();
+            int ic = verts.size();
             verts.push_back(Vertex{c});
 
             nextFaces.push_back(Face(face.i0, ia, ic, verts));
@@ -148,8 +161,9 @@ glit::IcoSphere::uploadAsPoints() const
 {
     auto vb = VertexBuffer::make<IcoSphere::Vertex>(verts);
 
-    vector<uint16_t> indices;
-    for (uint16_t i = 0; i < verts.size(); ++i)
+    // IndexBuffer narrows these to shorts when the sphere is small enough.
+    vector<uint32_t> indices;
+    for (uint32_t i = 0; i < verts.size(); ++i)
         indices.push_back(i);
     auto ib = IndexBuffer::make(indices);
 
@@ -161,7 +175,7 @@ glit::IcoSphere::uploadAsWireframe() const
 {
     auto vb = VertexBuffer::make<IcoSphere::Vertex>(verts);
 
-    vector<uint16_t> indices;
+    vector<uint32_t> indices;
     for (auto& face : faces) {
         indices.push_back(face.i0);
         indices.push_back(face.i1);
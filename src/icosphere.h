@@ -43,6 +43,14 @@ class IcoSphere
 
 
     IcoSphere(int iterations);
+
+    // The icosahedron we start from, which we can have without a GL
+    // context. Faces are indices into the corners, wound the same way as
+    // faceList.
+    constexpr static size_t BaseVertexCount = 12;
+    constexpr static size_t BaseFaceCount = 20;
+    static const glm::vec3* baseVertices();
+    static const int BaseFaces[BaseFaceCount][3];
     Mesh uploadAsPoints() const;
     Mesh uploadAsWireframe() const;
 
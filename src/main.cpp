@@ -147,6 +147,7 @@ do_main()
     });
 
     gWorld.screenBuffer = make_shared<glit::GBuffer>(gWindow.width(), gWindow.height());
+    gWorld.camera.screenSizeChanged(gWindow.width(), gWindow.height());
 
     auto poi = POI::create();
     auto sun = glit::Sun::create();
@@ -182,6 +183,8 @@ do_main()
     dispatcher.onEdge("+ufoAccelerate", [&](){player->ufoAccelerate();});
     dispatcher.onEdge("+ufoDecelerate", [&](){player->ufoDecelerate();});
 
+    dispatcher.onEdge("+terrainEngine", [&](){planet->terrain().cycleEngine();});
+
     dispatcher.onLevel("ufoYaw", [&](double l, double dl){
                                             player->ufoYawDelta(dl);});
     dispatcher.onLevel("ufoPitch", [&](double l, double dl){
@@ -201,6 +204,7 @@ do_main()
     debugBindings.bindNamedKey("ufoRotateCW", GLFW_KEY_E);
     debugBindings.bindNamedKey("ufoAccelerate", GLFW_KEY_R);
     debugBindings.bindNamedKey("ufoDecelerate", GLFW_KEY_F);
+    debugBindings.bindNamedKey("terrainEngine", GLFW_KEY_T);
 
     debugBindings.bindMouseAxis("ufoYaw", 0);
     debugBindings.bindMouseAxis("ufoPitch", 1);
@@ -0,0 +1,87 @@
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+#include "mapped_file.h"
+
+#include <cstdio>
+
+#ifndef __EMSCRIPTEN__
+# include <fcntl.h>
+# include <sys/mman.h>
+# include <sys/stat.h>
+# include <unistd.h>
+#endif
+
+using namespace std;
+
+glit::MappedFile::MappedFile()
+  : data_(nullptr)
+  , size_(0)
+{}
+
+glit::MappedFile::~MappedFile()
+{
+#ifndef __EMSCRIPTEN__
+    if (data_)
+        munmap(const_cast<void*>(data_), size_);
+#endif
+}
+
+/* static */ unique_ptr<glit::MappedFile>
+glit::MappedFile::open(const string& path)
+{
+    unique_ptr<MappedFile> file(new MappedFile);
+#ifdef __EMSCRIPTEN__
+    FILE* fp = fopen(path.c_str(), "rb");
+    if (!fp)
+        return nullptr;
+    char buffer[1 << 16];
+    size_t got;
+    while ((got = fread(buffer, 1, sizeof(buffer), fp)) > 0)
+        file->contents_.insert(file->contents_.end(), buffer, buffer + got);
+    fclose(fp);
+    file->data_ = file->contents_.data();
+    file->size_ = file->contents_.size();
+#else
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+        return nullptr;
+    struct stat info;
+    if (fstat(fd, &info) != 0 || info.st_size == 0) {
+        close(fd);
+        return nullptr;
+    }
+    void* data = mmap(nullptr, size_t(info.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED)
+        return nullptr;
+    file->data_ = data;
+    file->size_ = size_t(info.st_size);
+#endif
+    return file;
+}
+
+/* static */ bool
+glit::MappedFile::write(const string& path, const void* data, size_t size)
+{
+    string temporary = path + ".tmp";
+    FILE* fp = fopen(temporary.c_str(), "wb");
+    if (!fp)
+        return false;
+    bool ok = fwrite(data, 1, size, fp) == size;
+    ok = fclose(fp) == 0 && ok;
+    if (ok)
+        ok = rename(temporary.c_str(), path.c_str()) == 0;
+    if (!ok)
+        remove(temporary.c_str());
+    return ok;
+}
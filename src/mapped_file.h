@@ -0,0 +1,52 @@
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+#pragma once
+
+#include <cstddef>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace glit {
+
+// A whole file, mapped read-only into memory. Pages come in from the file
+// as we touch them, so opening a large file costs nothing up front.
+// Emscripten has no real mmap, so there we read the file in instead.
+class MappedFile
+{
+    const void* data_;
+    size_t size_;
+#ifdef __EMSCRIPTEN__
+    std::vector<char> contents_;
+#endif
+
+    MappedFile();
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+  public:
+    ~MappedFile();
+
+    // Returns null if the file does not exist or cannot be mapped.
+    static std::unique_ptr<MappedFile> open(const std::string& path);
+
+    const void* data() const { return data_; }
+    size_t size() const { return size_; }
+
+    // Write |size| bytes to |path| through a temporary file that we rename
+    // over it at the end, so that a reader never maps a partial file.
+    // Returns false if anything went wrong.
+    static bool write(const std::string& path, const void* data, size_t size);
+};
+
+} // namespace glit
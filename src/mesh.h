@@ -56,11 +56,31 @@ class Drawable
             Program::AutoEnableAttributes aea(*shader, *vb);
             {
                 size_t cnt = count == 0 ? ib->numIndices() : count;
-                auto offset = util::BufferOffset<uint16_t>(start);
-                glDrawElements(mode, cnt, ib->type(), offset);
+                glDrawElements(mode, cnt, ib->type(), ib->offsetOf(start));
             } // Disable attributes.
         } // Unbind buffers.
     }
+
+    // Draw a list of batches instead of our range. Each batch needs
+    // firstVertex, firstIndex and indexCount; its indices count from
+    // firstVertex, so that a large mesh can still use 16 bit indices.
+    // |perBatch| gets the program and the batch before each draw, to bind
+    // whatever uniforms the batch has of its own.
+    template <typename Batch, typename PerBatch, typename ...Args>
+    void drawBatches(const std::vector<Batch>& batches, PerBatch&& perBatch,
+                     Args&&... args) const {
+        AutoBindVertexBuffer vbind(*vb);
+        AutoBindIndexBuffer ibind(*ib);
+        shader->use();
+        shader->bindUniforms<0>(args...);
+        Program::AutoEnableAttributes aea(*shader, *vb);
+        for (auto& batch : batches) {
+            perBatch(*shader, batch);
+            aea.rebase(batch.firstVertex);
+            glDrawElements(mode, batch.indexCount, ib->type(),
+                           ib->offsetOf(batch.firstIndex));
+        }
+    }
 };
 
 // A collection of drawables that represent a single thing.
@@ -56,6 +56,8 @@ glit::Planet::draw(const glit::Camera& camera)
     if (!playerp)
         throw runtime_error("no player pointer in terrain draw");
 
+    // Entities tick once a frame, so this is already in meters a frame.
+    terrain_.setViewVelocity(playerp->velocity(), Player::MaxSpeed);
     terrain_.draw(camera, sunp->sunDirection());
     /*
     auto pos = playerp->viewPosition();
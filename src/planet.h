@@ -44,6 +44,7 @@ class Planet : public Entity
     void setPlayer(std::shared_ptr<Player>& p);
 
     const Terrain& terrain() const { return terrain_; }
+    Terrain& terrain() { return terrain_; }
 
     void tick(double t, double dt) override;
     void draw(const Camera& camera) override;
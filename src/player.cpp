@@ -24,6 +24,7 @@ using namespace std;
 
 glit::Player::Player(std::shared_ptr<Planet>& p)
   : planet(p)
+  , step(0.0, 0.0, 0.0)
   , motionReq(0.f, 0.f, 0.f)
   , rotateReq(0.f, 0.f, 0.f)
   , rotateAxis(0.f, 0.f)
@@ -58,8 +59,10 @@ glit::Player::tick(double t, double dt)
     rotateAxis[1] = 0.f;
 
     // Apply button motion requests.
+    step = dvec3(0.0, 0.0, 0.0);
     if (length(motionReq) != 0.f)
-        pos += speed * (dir * normalize(dvec3(motionReq)));
+        step = speed * (dir * normalize(dvec3(motionReq)));
+    pos += step;
 }
 
 void
@@ -33,6 +33,7 @@ class Player : public Entity
     // State.
     glm::dvec3 pos; // head location
     glm::dquat dir; // view direction
+    glm::dvec3 step; // how far we moved last tick
 
     // Motion request from keyboard.
     glm::vec3 motionReq;
@@ -47,6 +48,9 @@ class Player : public Entity
     glm::vec3 viewDirection() const { return glm::vec3(dir * glm::dvec3(0.f, 0.f, -1.f)); }
     glm::vec3 viewUp() const { return glm::vec3(dir * glm::dvec3(0.f, 1.f, 0.f)); }
 
+    // In meters a tick, like speed.
+    const glm::dvec3& velocity() const { return step; }
+
     void nullIfExpected(float& ref, float expect) {
         if (ref == expect)
             ref = 0.f;
@@ -71,6 +71,8 @@ glit::BaseShader<Type>::loadIncludeFile(const string& line, vector<string>& outp
         output.push_back(glit::include_noise2D_glsl);
     } else if (filename == string("noise3D.glsl")) {
         output.push_back(glit::include_noise3D_glsl);
+    } else if (filename == string("simplex3D.glsl")) {
+        output.push_back(glit::include_simplex3D_glsl);
     } else {
         throw runtime_error(string("unknown include file: ") + filename);
     }
@@ -212,12 +214,12 @@ glit::Program::use() const
 }
 
 glit::Program::AutoEnableAttributes::AutoEnableAttributes(
-        const Program& p, const VertexBuffer& vb)
+        const Program& p, const VertexBuffer& vb, size_t firstVertex)
   : program(p)
 {
     if (vb.vertexDesc() != program.vertexShader.vertexDesc)
         throw runtime_error("mismatched vertex description");
-    program.enableVertexAttribs();
+    program.enableVertexAttribs(firstVertex);
 }
 
 glit::Program::AutoEnableAttributes::~AutoEnableAttributes()
@@ -226,7 +228,16 @@ glit::Program::AutoEnableAttributes::~AutoEnableAttributes()
 }
 
 void
-glit::Program::enableVertexAttribs() const
+glit::Program::AutoEnableAttributes::rebase(size_t firstVertex)
+{
+    for (auto& attr : program.vertexShader.vertexDesc.attributes()) {
+        if (attr.enabled())
+            attr.rebase(firstVertex);
+    }
+}
+
+void
+glit::Program::enableVertexAttribs(size_t firstVertex) const
 {
     for (auto& attr : vertexShader.vertexDesc.attributes()) {
         GLint index = glGetAttribLocation(id, attr.name());
@@ -234,7 +245,7 @@ glit::Program::enableVertexAttribs() const
             cerr << "failed to enable vertex attribute: " << attr.name() << endl;
             continue;
         }
-        attr.enable(index);
+        attr.enable(index, firstVertex);
     }
 }
 
@@ -126,6 +126,12 @@ class Program
     }
     template <size_t N>
     void bindUniforms() const {}
+
+    // For rebinding a single uniform between draws without respecifying the
+    // rest; cache the result.
+    GLint uniformLocation(const char* name) const {
+        return glGetUniformLocation(id, name);
+    }
     void bindUniform(GLint index, float f) const { glUniform1f(index, f); }
     void bindUniform(GLint index, int i) const { glUniform1i(index, i); }
     void bindUniform(GLint index, const glm::vec3& v) const {
@@ -149,12 +155,18 @@ class Program
         const Program& program;
 
       public:
-        AutoEnableAttributes(const Program& p, const VertexBuffer& vb);
+        // See VertexAttrib::enable for |firstVertex|.
+        AutoEnableAttributes(const Program& p, const VertexBuffer& vb,
+                             size_t firstVertex = 0);
         ~AutoEnableAttributes();
+
+        // Point the attributes at |firstVertex| instead, for the next draw
+        // from the same buffer.
+        void rebase(size_t firstVertex);
     };
 
   private:
-    void enableVertexAttribs() const;
+    void enableVertexAttribs(size_t firstVertex) const;
     void disableVertexAttribs() const;
 
     VertexShader vertexShader;
@@ -181,4 +181,83 @@ float snoise(vec3 v)
 }
 )SHADER");
 
+// The same 3D simplex noise as raw_noise_3d in deps/simplex, which is what
+// HeightKernel evaluates on the CPU, so that a shader can displace terrain
+// to the heights the CPU works with. ES2 has no constant arrays and need
+// not have vertex textures, so the permutation table comes in as 64
+// uniforms; see Terrain::drawGrid.
+const static std::string include_simplex3D_glsl = std::string(R"SHADER(
+uniform vec4 uSimplexPerm[64];
+
+float simplexPerm(float i)
+{
+    i = mod(i, 256.0);
+    float four = floor(i / 4.0);
+    vec4 entry = uSimplexPerm[int(four)];
+    float lane = i - four * 4.0;
+    return lane < 0.5 ? entry.x : lane < 1.5 ? entry.y : lane < 2.5 ? entry.z : entry.w;
+}
+
+// fastfloor truncates, then steps down from anything not positive, so it
+// is one low on negative integers and zero. Match it.
+float simplexFloor(float x)
+{
+    return x > 0.0 ? floor(x) : ceil(x) - 1.0;
+}
+
+// The twelve gradients are the midpoints of the edges of a cube, in the
+// order of grad3.
+float simplexCorner(vec3 d, float hash)
+{
+    float t = 0.6 - dot(d, d);
+    if (t < 0.0)
+        return 0.0;
+    float g = mod(hash, 12.0);
+    float a = mod(g, 2.0) < 0.5 ? 1.0 : -1.0;
+    float b = mod(floor(g / 2.0), 2.0) < 0.5 ? 1.0 : -1.0;
+    vec2 p = g < 3.5 ? d.xy : g < 7.5 ? d.xz : d.yz;
+    t *= t;
+    return t * t * (a * p.x + b * p.y);
+}
+
+float simplex3D(vec3 v)
+{
+    float s = (v.x + v.y + v.z) * (1.0 / 3.0);
+    vec3 i = vec3(simplexFloor(v.x + s), simplexFloor(v.y + s), simplexFloor(v.z + s));
+    float t = (i.x + i.y + i.z) * (1.0 / 6.0);
+    vec3 x0 = v - (i - t);
+
+    vec3 i1;
+    vec3 i2;
+    if (x0.x >= x0.y) {
+        if (x0.y >= x0.z) {
+            i1 = vec3(1.0, 0.0, 0.0); i2 = vec3(1.0, 1.0, 0.0);
+        } else if (x0.x >= x0.z) {
+            i1 = vec3(1.0, 0.0, 0.0); i2 = vec3(1.0, 0.0, 1.0);
+        } else {
+            i1 = vec3(0.0, 0.0, 1.0); i2 = vec3(1.0, 0.0, 1.0);
+        }
+    } else {
+        if (x0.y < x0.z) {
+            i1 = vec3(0.0, 0.0, 1.0); i2 = vec3(0.0, 1.0, 1.0);
+        } else if (x0.x < x0.z) {
+            i1 = vec3(0.0, 1.0, 0.0); i2 = vec3(0.0, 1.0, 1.0);
+        } else {
+            i1 = vec3(0.0, 1.0, 0.0); i2 = vec3(1.0, 1.0, 0.0);
+        }
+    }
+    vec3 x1 = x0 - i1 + 1.0 / 6.0;
+    vec3 x2 = x0 - i2 + 2.0 / 6.0;
+    vec3 x3 = x0 - 1.0 + 3.0 / 6.0;
+
+    vec3 h = mod(i, 256.0);
+    float g0 = simplexPerm(h.x + simplexPerm(h.y + simplexPerm(h.z)));
+    float g1 = simplexPerm(h.x + i1.x + simplexPerm(h.y + i1.y + simplexPerm(h.z + i1.z)));
+    float g2 = simplexPerm(h.x + i2.x + simplexPerm(h.y + i2.y + simplexPerm(h.z + i2.z)));
+    float g3 = simplexPerm(h.x + 1.0 + simplexPerm(h.y + 1.0 + simplexPerm(h.z + 1.0)));
+    return 32.0 * (simplexCorner(x0, g0) + simplexCorner(x1, g1) +
+                   simplexCorner(x2, g2) + simplexCorner(x3, g3));
+}
+)SHADER");
+
 } // namespace glit
@@ -13,6 +13,10 @@
 #include "terrain.h"
 
 #include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <functional>
+#include <stdexcept>
 
 #include <glm/glm.hpp>
 #include <glm/gtx/polar_coordinates.hpp>
@@ -20,30 +24,17 @@
 #include <simplexnoise.h>
 
 #include "icosphere.h"
+#include "mapped_file.h"
 
 using namespace glm;
 using namespace std;
 
-/* static */ vec3
-glit::Terrain::bisect(vec3 v0, vec3 v1)
-{
-    return v0 + ((v1 - v0) / 2.f);
-}
-
-void
-glit::Terrain::subdivideFacet(vec3 p0, vec3 p1, vec3 p2,
-                              vec3* c0, vec3* c1, vec3* c2) const
-{
-    *c0 = normalize(bisect(p1, p2));
-    *c1 = normalize(bisect(p0, p2));
-    *c2 = normalize(bisect(p0, p1));
-
-    *c0 = *c0 * heightAt(*c0);
-    *c1 = *c1 * heightAt(*c1);
-    *c2 = *c2 * heightAt(*c2);
-}
+constexpr size_t glit::Terrain::NoSlot;
+constexpr size_t glit::Terrain::DeferredSlot;
+constexpr size_t glit::Terrain::MinRefineSplits;
+constexpr size_t glit::Terrain::DefaultCacheLevels;
 
-glit::Terrain::Terrain(double r)
+glit::Terrain::Terrain(double r, const string& levelCache, size_t cacheLevels)
   : programLand(makeLandProgram())
   , programWater(makeWaterProgram())
   , wireframeMesh(std::vector<Drawable>{
@@ -53,8 +44,8 @@ glit::Terrain::Terrain(double r)
        Drawable(programWater, GL_LINES,
            make_shared<VertexBuffer>(VertexDescriptor::fromType<IcoSphere::Vertex>()),
            make_shared<IndexBuffer>())})
-  , tristripMesh(std::vector<Drawable>{
-       Drawable(programLand, GL_TRIANGLE_STRIP,
+  , triangleMesh(std::vector<Drawable>{
+       Drawable(programLand, GL_TRIANGLES,
            make_shared<VertexBuffer>(VertexDescriptor::fromType<Facet::GPUVertex>()),
            make_shared<IndexBuffer>()),
        Drawable(programWater, GL_TRIANGLES,
@@ -62,34 +53,72 @@ glit::Terrain::Terrain(double r)
            make_shared<IndexBuffer>()),
        })
   , radius_(r)
+  , heightKernel_(float(r), HeightKernel::fractal(HeightAmplitude, HeightOctaves, HeightGain))
+  , pixelError_(DefaultPixelError)
+  , validateHeights_(false)
+  , heightErrorSamples_(0)
+  , heightErrorMax_(0.f)
+  , heightErrorSquares_(0.0)
+  , viewVelocity_(0.0, 0.0, 0.0)
+  , maxViewSpeed_(0.0)
+  , balanceEverywhere_(true)
+  , incrementalReshape_(true)
+  , travel_(0.0)
+  , lastViewPosition_(0.0, 0.0, 0.0)
+  , refineSplits_(DefaultRefineSplits)
+  , refineMillis_(DefaultRefineMillis)
+  , reshapePass_(0)
+  , splitMillis_(0.0)
+  , refineCounts_{0, 0, 0, 0}
+  , triangleBudget_(0)
+  , tradeLeaves_(0)
+  , frustumCulling_(true)
+  , cullGuardBand_(DefaultCullGuardBand)
+  , turn_(0.0)
+  , lastFrustum_()
+  , horizonCulling_(true)
+  , occluderRadius_(r)
+  , uploadStamp_(0)
+  , reshapePool_(new ThreadPool(0))
+  , parallelSplitDepth_(DefaultParallelSplitDepth)
+  , reshapeTasksUsed_(0)
+  , reshapeRootsUsed_(0)
+  , reshapeView_(nullptr)
+  , reshapeFrustum_(nullptr)
+  , engine_(Engine::Immediate)
+  , forceReshape_(false)
+  , chunkBudget_(DefaultChunkBudget)
+  , chunkUploadBudget_(DefaultChunkUploadBudget)
+  , orbitAltitude_(DefaultOrbitAltitude)
+  , orbitDepth_(0)
+  , orbitFrame_(0)
+  , treeChanges_(0)
+  , publishedChanges_(0)
+  , queryEverywhere_(true)
+  , incrementalQueries_(true)
+  , queryNodesCopied_(0)
+  , queryPool_(new ThreadPool(ThreadPool::defaultThreadCount()))
+  , reshapeStats_()
+  , stats_()
+  , facetsCreated_(0)
+  , facetsDestroyed_(0)
+  , heightCalls_(0)
+  , kernelHeights_(0)
+  , statsFile_(nullptr)
+  , frontStage_(0)
+  , haveFrontStage_(false)
+  , frontUploaded_(false)
+#ifdef __EMSCRIPTEN__
+  , asyncPipeline_(false)
+#else
+  , asyncPipeline_(true)
+#endif
+  , backState_(StageState::Idle)
+  , pipelineQuit_(false)
+  , triangleOrder_(DefaultTriangleOrder)
 {
     // Use an IcoSphere to find the initial, static corners.
     IcoSphere sphere(0);
-    size_t i = 0;
-    for (auto& v : sphere.vertices()) {
-        baseVerts.push_back(Facet::VertexAndIndex{
-                {v.aPosition * heightAt(v.aPosition)},
-                uint32_t(-1)});
-        ++i;
-    }
-    i = 0;
-    for (auto& face : sphere.faceList()) {
-        facets[i].init(&baseVerts[face.i0], &baseVerts[face.i1], &baseVerts[face.i2]);
-        ++i;
-    }
-
-    // Copy verts from an icosphere for our water.
-    IcoSphere water(4);
-    tristripMesh.drawable(1).vertexBuffer()->upload(water.vertices());
-    wireframeMesh.drawable(1).vertexBuffer()->upload(water.vertices());
-    vector<uint16_t> indices;
-    for (auto& face : water.faceList()) {
-        indices.push_back(face.i0);
-        indices.push_back(face.i2);
-        indices.push_back(face.i1);
-    }
-    tristripMesh.drawable(1).indexBuffer()->upload(indices);
-    wireframeMesh.drawable(1).indexBuffer()->upload(indices);
 
     // We want a falloff so that we get more subdivisions near the camera and
     // they fall away in the distance. Ideally, we'd like the falloff to be
@@ -98,8 +127,9 @@ glit::Terrain::Terrain(double r)
     //
     // Maybe something like:
     //   y = 1 - ln(x + 1) / 2
-    float ang0 = acosf(dot(facets[0].verts[0]->vertex.position / radius_,
-                           facets[0].verts[1]->vertex.position / radius_));
+    IcoSphere::Face face0 = sphere.faceList()[0];
+    float ang0 = acosf(dot(sphere.vertices()[face0.i0].aPosition,
+                           sphere.vertices()[face0.i1].aPosition));
     float d0 = (radius_ * sin(ang0 / 2.f)) * 2.f;
     cout << "angle: " << ang0 << "; dist: " << d0 << endl;
     EdgeLengths[0] = d0;
@@ -110,12 +140,244 @@ glit::Terrain::Terrain(double r)
         EdgeLengths[i] = d0;
     }
 
+    // Octave wavelengths on the surface are about radius / frequency.
+    for (size_t level = 0; level < MaxSubdivisions; ++level) {
+        size_t count = 0;
+        for (auto& octave : heightKernel_.octaves()) {
+            if (radius_ / octave.frequency < EdgeLengths[level] / 2.f)
+                break;
+            ++count;
+        }
+        LevelOctaves[level] = count;
+    }
+    for (size_t level = 0; level < MaxSubdivisions; ++level) {
+        size_t end = octavesAt(level + 1);
+        size_t begin = 0;
+        for (; begin < end; ++begin) {
+            const HeightKernel::Octave& octave = heightKernel_.octaves()[begin];
+            float ratio = EdgeLengths[level] * octave.frequency / radius_;
+            float error = octave.amplitude * 4.9348f * ratio * ratio;
+            if (error > InterpolationError)
+                break;
+        }
+        if (end > DetailOctaves)
+            begin = std::max(begin, end - DetailOctaves);
+        LevelDetailBegin[level] = begin;
+    }
+    for (size_t level = 0; level < MaxSubdivisions; ++level) {
+        float rise = 0.f;
+        for (size_t o = detailBegin(level); o < heightKernel_.octaves().size(); ++o)
+            rise += 2.f * heightKernel_.octaves()[o].amplitude;
+        float half = asin(EdgeLengths[level] / (2.f * radius_));
+        float top = radius_ + 2.f * HeightAmplitude;
+        LevelRise[level] = rise;
+        LevelBulge[level] = 2.f * top * sin(half) * sin(half) + rise;
+    }
+    for (size_t level = 0; level < MaxSubdivisions; ++level) {
+        float edge = EdgeLengths[level];
+        float error = edge * edge / (8.f * radius_);
+        for (auto& octave : heightKernel_.octaves()) {
+            float ratio = edge * octave.frequency / radius_;
+            error += std::min(octave.amplitude, octave.amplitude * 4.9348f * ratio * ratio);
+        }
+        LevelError[level] = error;
+    }
+    for (auto& octave : heightKernel_.octaves())
+        occluderRadius_ -= octave.amplitude;
+
+    initRoots();
+    if (!levelCache.empty())
+        restoreLevels(levelCache, cacheLevels);
+
+    // Copy verts from an icosphere for our water.
+    IcoSphere water(4);
+    triangleMesh.drawable(1).vertexBuffer()->upload(water.vertices());
+    wireframeMesh.drawable(1).vertexBuffer()->upload(water.vertices());
+    vector<uint16_t> indices;
+    for (auto& face : water.faceList()) {
+        indices.push_back(face.i0);
+        indices.push_back(face.i2);
+        indices.push_back(face.i1);
+    }
+    triangleMesh.drawable(1).indexBuffer()->upload(indices);
+    wireframeMesh.drawable(1).indexBuffer()->upload(indices);
+
 }
 
 glit::Terrain::~Terrain()
 {
+    stopPipeline();
+    if (statsFile_)
+        fclose(statsFile_);
+    for (auto& facet : facets)
+        deleteChildren(0, facet);
+}
+
+// The corners evaluate every octave they carry, or come from the root tiles.
+// Only call this with nothing below the roots.
+void
+glit::Terrain::initRoots()
+{
+    balanceEverywhere_ = true;
+    queryEverywhere_ = true;
+    MidpointBatch batch;
+    for (size_t i = 0; i < IcoSphere::BaseVertexCount; ++i)
+        batch.push(IcoSphere::baseVertices()[i], IcoSphere::baseVertices()[i]);
+    size_t end = octavesAt(0);
+    size_t begin = end > DetailOctaves ? end - DetailOctaves : 0;
+    heightKernel_.displace(batch, 0, end);
+    baseVerts.clear();
+    TileStreamer::TileRef hint;
+    for (size_t i = 0; i < batch.size(); ++i) {
+        Facet::CPUVertex vertex = midpointVertex(batch, i, begin, end);
+        if (tiles_)
+            tileVertex(IcoSphere::baseVertices()[i], 0, hint, vertex);
+        baseVerts.push_back(Facet::VertexAndIndex{vertex, uint32_t(-1), 0});
+    }
+    for (size_t i = 0; i < IcoSphere::BaseFaceCount; ++i) {
+        const int* face = IcoSphere::BaseFaces[i];
+        Facet& facet = facets[i];
+        facet.init(&baseVerts[face[0]], &baseVerts[face[1]], &baseVerts[face[2]],
+                   bulgeAt(0), riseAt(0));
+        if (tiles_) {
+            float relief = tileRelief(0, facet);
+            facet.init(facet.verts[0], facet.verts[1], facet.verts[2],
+                       bulgeAt(0) + relief, riseAt(0) + relief);
+        }
+    }
+    publishQueryTree();
+}
+
+// Split the first |levels| levels everywhere, taking the midpoints from the
+// cache at |path| if it was made for the heights we have now. Otherwise we
+// find them as reshape would, so they come out bit for bit the same, and
+// write the cache for next time. Only call this straight after initRoots,
+// with no tiles.
+void
+glit::Terrain::restoreLevels(const string& path, size_t levels)
+{
+    LevelCacheHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, "glitlvls", sizeof(header.magic));
+    header.version = LevelCacheVersion;
+    header.recordSize = sizeof(Facet::CPUVertex);
+    header.levels = uint32_t(levels);
+    header.radius = radius_;
+    header.fingerprint = levelCacheFingerprint(levels);
+
+    // Each level has four times the edges of the last, and the roots 30.
+    header.count = 10 * ((uint64_t(1) << (2 * levels)) - 1);
+
+    unique_ptr<MappedFile> file = MappedFile::open(path);
+    const Facet::CPUVertex* records = nullptr;
+    if (file && file->size() == sizeof(header) + header.count * sizeof(Facet::CPUVertex) &&
+        memcmp(file->data(), &header, sizeof(header)) == 0)
+    {
+        const char* data = static_cast<const char*>(file->data());
+        records = reinterpret_cast<const Facet::CPUVertex*>(data + sizeof(header));
+    }
+
+    vector<Facet::CPUVertex> found;
+    FlatMap<EdgeKey, bool, EdgeKeyHash> seen;
+    vector<Facet*> current;
+    vector<Facet*> next;
     for (auto& facet : facets)
-        deleteChildren(facet);
+        current.push_back(&facet);
+    for (size_t level = 0; level < levels; ++level) {
+        if (records) {
+            // Nothing below the roots had midpoints before we got here, so
+            // the edges we do not find are the ones the next record is for.
+            for (Facet* facet : current) {
+                for (size_t e = 0; e < 3; ++e) {
+                    EdgeKey key = edgeKey(*facet, e);
+                    facet->childVerts[e] = findMidpoint(key);
+                    if (!facet->childVerts[e])
+                        facet->childVerts[e] = addMidpoint(key, *records++);
+                }
+                facet->error = midpointError(*facet);
+                facet->haveMidpoints = true;
+            }
+        } else {
+            findMidpoints(level, current, balanceScratch_);
+            seen.clear();
+            for (Facet* facet : current) {
+                for (size_t e = 0; e < 3; ++e) {
+                    if (seen.insert(edgeKey(*facet, e), true).second)
+                        found.push_back(facet->childVerts[e]->vertex);
+                }
+            }
+        }
+
+        next.clear();
+        for (Facet* facet : current) {
+            ensureChildren(level, *facet);
+            Facet* children = childrenOf(*facet);
+            for (size_t i = 0; i < 4; ++i)
+                next.push_back(&children[i]);
+        }
+        current.swap(next);
+    }
+
+    // Queries keep the roots until the first reshape, which has to walk
+    // the whole tree anyway.
+    queryEverywhere_ = true;
+
+    // There is nothing to be done about a cache we cannot write; we will
+    // just compute the levels again next time.
+    if (!records) {
+        size_t bytes = found.size() * sizeof(Facet::CPUVertex);
+        vector<char> contents(sizeof(header) + bytes);
+        memcpy(contents.data(), &header, sizeof(header));
+        memcpy(contents.data() + sizeof(header), found.data(), bytes);
+        MappedFile::write(path, contents.data(), contents.size());
+    }
+}
+
+// FNV-1a over everything that decides what a midpoint in the first |levels|
+// levels comes out as. There is no noise seed; the octaves stand in for
+// one, and sampling the kernel catches a change to the noise itself.
+uint64_t
+glit::Terrain::levelCacheFingerprint(size_t levels) const
+{
+    uint64_t hash = 14695981039346656037ull;
+    auto mix = [&hash](const void* data, size_t size) {
+        const uint8_t* bytes = static_cast<const uint8_t*>(data);
+        for (size_t i = 0; i < size; ++i)
+            hash = (hash ^ bytes[i]) * 1099511628211ull;
+    };
+    for (auto& octave : heightKernel_.octaves())
+        mix(&octave, sizeof(octave));
+    HeightKernel::Path path = heightKernel_.path();
+    mix(&path, sizeof(path));
+
+    // The corners, and the kernel along the root edges with each level's
+    // octaves.
+    for (auto& v : baseVerts) {
+        mix(&v.vertex.position, sizeof(v.vertex.position));
+        mix(&v.vertex.height, sizeof(v.vertex.height));
+        mix(&v.vertex.coarse, sizeof(v.vertex.coarse));
+    }
+    MidpointBatch probes;
+    for (size_t level = 0; level < levels; ++level) {
+        uint64_t range[2] = {detailBegin(level), detailEnd(level)};
+        mix(range, sizeof(range));
+        probes.clear();
+        for (auto& facet : facets) {
+            for (size_t e = 0; e < 3; ++e) {
+                EdgeKey key = edgeKey(facet, e);
+                probes.push(key.a->vertex.position, key.b->vertex.position,
+                            key.a->vertex.height, key.b->vertex.height);
+            }
+        }
+        heightKernel_.displace(probes, detailBegin(level), detailEnd(level));
+        for (size_t i = 0; i < probes.size(); ++i) {
+            vec3 position = probes.result(i);
+            float height = probes.height(i);
+            mix(&position, sizeof(position));
+            mix(&height, sizeof(height));
+        }
+    }
+    return hash;
 }
 
 /* static */ shared_ptr<glit::Program>
@@ -130,20 +392,36 @@ glit::Terrain::makeLandProgram()
             precision highp float;
 
             uniform mat4 uModelViewProj;
+            uniform vec3 uBatchOrigin;
+            uniform float uBatchScale;
             //uniform vec3 uCameraPosition;
             //uniform float uRadius;
 
             attribute vec3 aPosition;
-            attribute vec3 aNormal;
+            attribute vec2 aNormal;
 
             varying vec3 vColor;
             varying vec3 vNormal;
 
+            // See util::octahedralEncode.
+            vec3 octahedralDecode(vec2 e)
+            {
+                vec3 n = vec3(e, 1.0 - abs(e.x) - abs(e.y));
+                if (n.z < 0.0) {
+                    vec2 s = vec2(n.x >= 0.0 ? 1.0 : -1.0, n.y >= 0.0 ? 1.0 : -1.0);
+                    n.xy = (1.0 - abs(n.yx)) * s;
+                }
+                return normalize(n);
+            }
+
             void main()
             {
-                gl_Position = uModelViewProj * vec4(aPosition, 1.0);
+                // Positions come to us in [-1, 1] around the origin of the
+                // batch or chunk, which is relative to the camera.
+                vec3 position = uBatchOrigin + aPosition * uBatchScale;
+                gl_Position = uModelViewProj * vec4(position, 1.0);
                 vColor = vec3(1.0);
-                vNormal = aNormal;
+                vNormal = octahedralDecode(aNormal);
                 //vLatLon = posLatLon;
             }
             ///////////////////////////////////////////////////////////////////
@@ -171,6 +449,8 @@ glit::Terrain::makeLandProgram()
                 Program::MakeInput<mat4>("uModelViewProj"),
                 //Program::MakeInput<mat4>("uCameraPosition"),
                 Program::MakeInput<vec3>("uSunDirection"),
+                Program::MakeInput<vec3>("uBatchOrigin"),
+                Program::MakeInput<float>("uBatchScale"),
                 //Program::MakeInput<float>("uRadius"),
             });
 }
@@ -231,304 +511,3202 @@ glit::Terrain::makeWaterProgram()
             });
 }
 
+// The grid comes in with each vert's place on the patch, and the patch with
+// its corners on the unit sphere and its first corner against the camera.
+// Everything else about the vert we work out here.
+/* static */ shared_ptr<glit::Program>
+glit::Terrain::makeGridProgram()
+{
+    auto VertexDesc = VertexDescriptor::fromType<GridVertex>();
+
+    // The grid shader gets these from ours, so that the two cannot drift.
+    string constants =
+            "const float CameraScale = " + to_string(CameraScale) + ";\n"
+            "const int HeightOctaves = " + to_string(HeightOctaves) + ";\n";
+    VertexShader vs(
+            R"SHADER(
+            ///////////////////////////////////////////////////////////////////
+            #version 100
+            #extension GL_EXT_draw_buffers : require
+            precision highp float;
+            #include <simplex3D.glsl>
+
+            uniform mat4 uModelViewProj;
+            uniform float uRadius;
+            uniform float uHeightAmplitude;
+            uniform float uHeightGain;
+            uniform float uPixelScale;
+            uniform vec3 uOrigin;
+            uniform vec3 uCorner0;
+            uniform vec3 uCorner1;
+            uniform vec3 uCorner2;
+            uniform vec3 uEdgeAngles;
+            uniform float uMorphStart;
+            uniform float uMorphEnd;
+
+            attribute vec2 aGrid;
+            attribute vec2 aMorph;
+
+            varying vec3 vColor;
+            varying vec3 vNormal;
+            )SHADER" + constants + R"SHADER(
+            // Octaves fade out between twice this and this many pixels to a
+            // wavelength, so that the far terrain does not shimmer.
+            const float OctavePixels = 4.0;
+
+            // The shortest step we take to find the slope; any shorter and
+            // the heights are all rounding.
+            const float MinNormalStep = 50.0;
+
+            // Weighting the corners by sin(b * angle) rather than by b
+            // spaces the points along each edge at even angles, which is
+            // where the tree puts its midpoints. So the edge of a patch
+            // runs through the same points as the edges of its children
+            // along it.
+            vec3 patchDirection(vec2 grid)
+            {
+                vec3 b = vec3(1.0 - grid.x - grid.y, grid.x, grid.y);
+                vec3 pairs = b * b.yzx;
+                float total = pairs.x + pairs.y + pairs.z;
+                float angle = total > 0.0 ? dot(pairs, uEdgeAngles) / total : uEdgeAngles.x;
+                vec3 w = sin(b * angle);
+                return normalize(w.x * uCorner0 + w.y * uCorner1 + w.z * uCorner2);
+            }
+
+            // The same octaves as HeightKernel::fractal.
+            float fractal(vec3 unit, float dist)
+            {
+                float h = 0.0;
+                float frequency = 1.0;
+                float amplitude = uHeightAmplitude;
+                for (int o = 0; o < HeightOctaves; ++o) {
+                    float pixels = uRadius / frequency * uPixelScale / dist;
+                    float weight = clamp(pixels / OctavePixels - 1.0, 0.0, 1.0);
+                    if (weight <= 0.0)
+                        break;
+                    h += weight * amplitude * simplex3D(unit * frequency);
+                    frequency *= 2.0;
+                    amplitude *= uHeightGain;
+                }
+                return h;
+            }
+
+            void main()
+            {
+                // The morph goes by how far the vert is before it moves, so
+                // that a vert on an edge moves the same in both patches.
+                vec3 unit = patchDirection(aGrid);
+                float dist = length(uOrigin * CameraScale + (unit - uCorner0) * uRadius);
+                float morph = clamp((dist - uMorphStart) / (uMorphEnd - uMorphStart), 0.0, 1.0);
+                unit = patchDirection(aGrid + aMorph * morph);
+                dist = max(dist, 1.0);
+                float h = fractal(unit, dist);
+
+                // The slope from two more samples a couple of pixels away.
+                float step = max(dist / uPixelScale * 2.0, MinNormalStep);
+                vec3 axis = abs(unit.y) < 0.9 ? vec3(0.0, 1.0, 0.0) : vec3(1.0, 0.0, 0.0);
+                vec3 east = normalize(cross(axis, unit));
+                vec3 north = cross(unit, east);
+                float dx = fractal(normalize(unit + east * (step / uRadius)), dist) - h;
+                float dy = fractal(normalize(unit + north * (step / uRadius)), dist) - h;
+                vNormal = normalize(unit - (east * dx + north * dy) / step);
+
+                vec3 position = uOrigin + ((unit - uCorner0) * uRadius + unit * h) / CameraScale;
+                gl_Position = uModelViewProj * vec4(position, 1.0);
+                vColor = vec3(1.0);
+            }
+            ///////////////////////////////////////////////////////////////////
+            )SHADER",
+            VertexDesc);
+    FragmentShader fs(
+            R"SHADER(
+            ///////////////////////////////////////////////////////////////////
+            #version 100
+            #extension GL_EXT_draw_buffers : require
+            precision highp float;
+            uniform vec3 uSunDirection;
+            varying vec3 vNormal;
+            varying vec3 vColor;
+
+            void main() {
+                float diffuse = dot(vNormal, -uSunDirection);
+                gl_FragData[0] = vec4(vColor * diffuse, 1.0);
+            }
+            ///////////////////////////////////////////////////////////////////
+            )SHADER"
+        );
+    return make_shared<Program>(move(vs), move(fs), vector<UniformDesc>{
+                Program::MakeInput<mat4>("uModelViewProj"),
+                Program::MakeInput<vec3>("uSunDirection"),
+                Program::MakeInput<float>("uRadius"),
+                Program::MakeInput<float>("uHeightAmplitude"),
+                Program::MakeInput<float>("uHeightGain"),
+                Program::MakeInput<float>("uPixelScale"),
+            });
+}
+
 void
 glit::Terrain::draw(const Camera& camera, glm::vec3 sunDirection)
 {
-    //auto mesh = uploadAsTriStrips(camera.viewPosition(), camera.viewDirection());
-    auto mesh = uploadAsWireframe(camera.viewPosition(), camera.viewDirection());
-
-    // We upload vertices relative to the camera position. This allows us to
-    // "pre-transform" the verticies using double precision, allowing us to
-    // have a both precise movement and planetary scales. This means we need to
-    // do the draw transformed back to origin.
+    // Verts are relative to the origin of their batch or chunk, which we
+    // move to be relative to the camera in double precision for each draw.
+    // This allows us to have both precise movement and planetary scales.
+    // This means we need to do the draw transformed back to origin.
     Camera cam(camera);
     cam.move(vec3(0.f, 0.f, 0.f));
 
-    mesh->drawable(0).draw(cam.transform(), sunDirection);
+    // From orbit we draw a mesh we already have. Unless we are close
+    // enough to come down soon, we leave the tree alone altogether.
+    double altitude = length(camera.viewPosition()) - double(radius_);
+    size_t orbitDepth = 0;
+    if (orbitAltitude_ > 0.0) {
+        double above = orbitDepth_ ? orbitAltitude_ : orbitAltitude_ * (1.0 + OrbitHysteresis);
+        if (altitude > above)
+            orbitDepth = pickOrbitDepth(altitude, camera.frustum().pixelScale);
+    }
+    orbitDepth_ = orbitDepth;
+    bool warm = orbitDepth == 0 || altitude < orbitAltitude_ * OrbitWarmBand;
+
+    auto millisSince = [](chrono::steady_clock::time_point from) {
+        auto dt = chrono::steady_clock::now() - from;
+        return chrono::duration<double, milli>(dt).count();
+    };
+    size_t frame = stats_.frame + 1;
+    stats_ = Stats();
+
+    Mesh* mesh = DrawAsTriangles ? &triangleMesh : &wireframeMesh;
+    if (warm) {
+        if (tiles_)
+            tiles_->prefetch(viewVelocity_, maxViewSpeed_);
+        if (asyncPipeline_) {
+            advancePipeline(camera.viewPosition(), camera.frustum());
+        } else {
+            buildStage(stages_[frontStage_ ^ 1], stages_[frontStage_],
+                       camera.viewPosition(), camera.frustum());
+            lock_guard<mutex> guard(pipelineLock_);
+            swapStages();
+        }
+
+        // The stage may have been built for an older camera position, but
+        // since we place it against the camera when drawing, that does not
+        // matter. We upload it even if we are not drawing it, so that the
+        // GPU has it when we come down. A stage we have not uploaded yet is
+        // a new one, which brings the work that went into it.
+        const Stage& stage = stages_[frontStage_];
+        if (!frontUploaded_)
+            stats_ = stage.stats;
+        auto start = chrono::steady_clock::now();
+        if (stage.engine == Engine::Chunked)
+            prepareChunks(stage);
+        else if (stage.engine == Engine::Immediate && !frontUploaded_)
+            uploadStage(stage);
+        frontUploaded_ = true;
+        stats_.uploadMillis += millisSince(start);
+    }
+
+    // Only now that the pipeline has swapped is this the front stage.
+    const Stage& stage = stages_[frontStage_];
+    stats_.frame = frame;
+    stats_.levelFacets = stage.stats.levelFacets;
+    stats_.facets = stage.stats.facets;
+    if (orbitDepth) {
+        auto start = chrono::steady_clock::now();
+        const OrbitMesh& orbit = orbitMesh(orbitDepth);
+        stats_.uploadMillis += millisSince(start);
+        drawBatches(orbit.batches, orbit.drawable, cam.transform(),
+                    camera.viewPosition(), sunDirection);
+    } else if (stage.engine == Engine::Chunked) {
+        drawChunks(cam.transform(), camera.viewPosition(), sunDirection);
+    } else if (stage.engine == Engine::Instanced) {
+        drawGrid(stage, cam.transform(), camera.viewPosition(),
+                 camera.frustum().pixelScale, sunDirection);
+    } else {
+        drawBatches(stage.batches, mesh->drawable(0), cam.transform(),
+                    camera.viewPosition(), sunDirection);
+    }
     mesh->drawable(1).draw(cam.transform(), camera.viewPosition(),
                            sunDirection, float(radius_));
+    if (statsFile_)
+        writeStats();
 }
 
 float
 glit::Terrain::heightAt(vec3 dpos) const
 {
-    return radius_ + 20000.f * raw_noise_3d(dpos.x, dpos.y, dpos.z);
+    ++heightCalls_;
+    return radius_ + heightKernel_.height(dpos, heightKernel_.octaves().size());
 }
 
-glit::Mesh*
-glit::Terrain::uploadAsWireframe(const dvec3& viewPosition,
-                                 const dvec3& viewDirection)
+void
+glit::Terrain::setStatsFile(const string& path)
 {
-    wireframeMesh.drawable(0).vertexBuffer()->orphan<Facet::GPUVertex>();
-    wireframeMesh.drawable(0).indexBuffer()->orphan();
-
-    reshape(viewPosition, viewDirection);
-
-    vector<Facet::GPUVertex> verts;
-    vector<uint32_t> indices;
-    {
-        //util::Timer t("Terrain::upload");
-        for (size_t i = 0; i < 20; ++i)
-            drawSubtreeWireframe(facets[i], viewPosition, verts, indices);
+    if (statsFile_) {
+        fclose(statsFile_);
+        statsFile_ = nullptr;
     }
+    if (path.empty())
+        return;
+    statsFile_ = fopen(path.c_str(), "w");
+    if (!statsFile_)
+        throw runtime_error("failed to open terrain stats file: " + path);
+    fprintf(statsFile_, "frame,reshape_ms,emit_ms,upload_ms,facets,created,destroyed,"
+                        "height_calls,kernel_heights,verts,indices,bytes_uploaded,"
+                        "query_ms,query_nodes");
+    for (size_t level = 0; level < MaxSubdivisions; ++level)
+        fprintf(statsFile_, ",level%zu", level);
+    fprintf(statsFile_, "\n");
+}
 
-    wireframeMesh.drawable(0).vertexBuffer()->upload(verts);
-    wireframeMesh.drawable(0).indexBuffer()->upload(indices);
-    return &wireframeMesh;
+// One line per frame, with a column for every level whether or not the
+// tree goes that deep, so that the lines all line up.
+void
+glit::Terrain::writeStats()
+{
+    const Stats& s = stats_;
+    fprintf(statsFile_, "%zu,%.3f,%.3f,%.3f,%zu,%zu,%zu,%zu,%zu,%zu,%zu,%zu,%.3f,%zu",
+            s.frame, s.reshapeMillis, s.emitMillis, s.uploadMillis, s.facets,
+            s.facetsCreated, s.facetsDestroyed, s.heightCalls, s.kernelHeights,
+            s.vertsEmitted, s.indicesEmitted, s.bytesUploaded, s.queryMillis,
+            s.queryNodes);
+    for (size_t level = 0; level < MaxSubdivisions; ++level)
+        fprintf(statsFile_, ",%zu", level < s.levelFacets.size() ? s.levelFacets[level] : 0);
+    fprintf(statsFile_, "\n");
 }
 
-glit::Mesh*
-glit::Terrain::uploadAsTriStrips(const dvec3& viewPosition,
-                                 const dvec3& viewDirection)
+// The roots, then each level's children, which the pool keeps under the
+// level of their parent.
+void
+glit::Terrain::countFacets(Stats& stats) const
 {
-    tristripMesh.drawable(0).vertexBuffer()->orphan<Facet::GPUVertex>();
-    tristripMesh.drawable(0).indexBuffer()->orphan();
+    stats.levelFacets.assign(1, 20);
+    for (size_t level = 0; level + 1 < MaxSubdivisions; ++level) {
+        size_t count = facetPool.liveItems(level);
+        if (!count)
+            break;
+        stats.levelFacets.push_back(count);
+    }
+    stats.facets = 0;
+    for (size_t count : stats.levelFacets)
+        stats.facets += count;
+}
 
-    reshape(viewPosition, viewDirection);
+double
+glit::Terrain::meshHeightAt(const dvec3& position) const
+{
+    return queryHeight(*queryTree(), position);
+}
 
-    vector<Facet::GPUVertex> verts;
-    vector<uint32_t> indices;
-    drawSubtreeTriStrip(viewPosition, verts, indices);
+bool
+glit::Terrain::intersectSegment(const dvec3& from, const dvec3& to, RayHit* hit) const
+{
+    *hit = RayHit{false, 0.0, dvec3(0.0), vec3(0.f)};
+    TileStreamer::TileRef hint;
+    shared_ptr<const QueryTree> tree = queryTree();
+    return querySegment(*tree, *tree->top, 0, 20, from, to - from, hint, hit);
+}
 
-    tristripMesh.drawable(0).vertexBuffer()->upload(verts);
-    tristripMesh.drawable(0).indexBuffer()->upload(indices);
-    return &tristripMesh;
+bool
+glit::Terrain::intersectRay(const dvec3& origin, const dvec3& direction,
+                            RayHit* hit) const
+{
+    double reach = length(origin) + 2.0 * double(radius_);
+    return intersectSegment(origin, origin + normalize(direction) * reach, hit);
 }
 
 void
-glit::Terrain::deleteChildren(Facet& self)
+glit::Terrain::meshHeightsAt(const vector<dvec3>& positions,
+                             vector<double>& heights) const
 {
-    if (self.children) {
-        for (size_t i = 0; i < 4; ++i)
-            deleteChildren(self.children[i]);
-        delete [] self.children;
-        self.children = nullptr;
+    shared_ptr<const QueryTree> tree = queryTree();
+    heights.resize(positions.size());
+    ThreadPool::TaskGroup group;
+    for (size_t begin = 0; begin < positions.size(); begin += QueriesPerTask) {
+        size_t end = std::min(begin + QueriesPerTask, positions.size());
+        queryPool_->spawn(group, [this, &tree, &positions, &heights, begin, end](){
+            for (size_t i = begin; i < end; ++i)
+                heights[i] = queryHeight(*tree, positions[i]);
+        });
     }
+    queryPool_->wait(group);
 }
 
 void
-glit::Terrain::Facet::init(VertexAndIndex* v0, VertexAndIndex* v1, VertexAndIndex* v2)
+glit::Terrain::intersectSegments(const vector<Segment>& segments,
+                                 vector<RayHit>& hits) const
 {
-    children = nullptr;
-
-    verts[0] = v0;
-    verts[1] = v1;
-    verts[2] = v2;
-
-    normal = normalize(cross(v1->vertex.position - v0->vertex.position,
-                             v2->vertex.position - v0->vertex.position));
-
-    // Uninitialized:
-    //   childVerts
+    shared_ptr<const QueryTree> tree = queryTree();
+    hits.resize(segments.size());
+    ThreadPool::TaskGroup group;
+    for (size_t begin = 0; begin < segments.size(); begin += QueriesPerTask) {
+        size_t end = std::min(begin + QueriesPerTask, segments.size());
+        queryPool_->spawn(group, [this, &tree, &segments, &hits, begin, end](){
+            TileStreamer::TileRef hint;
+            for (size_t i = begin; i < end; ++i) {
+                const Segment& segment = segments[i];
+                hits[i] = RayHit{false, 0.0, dvec3(0.0), vec3(0.f)};
+                querySegment(*tree, *tree->top, 0, 20, segment.from,
+                             segment.to - segment.from, hint, &hits[i]);
+            }
+        });
+    }
+    queryPool_->wait(group);
 }
 
 void
-glit::Terrain::reshape(const dvec3& viewPosition, const dvec3& viewDirection)
+glit::Terrain::setQueryThreads(size_t threads)
 {
-    // Clear base verts cache'd upload index.
-    for (auto& vert : baseVerts)
-        vert.index = uint32_t(-1);
-
-    for (size_t i = 0; i < 20; ++i)
-        reshapeN(0, facets[i], viewPosition, viewDirection);
+    if (threads != queryPool_->threadCount())
+        queryPool_.reset(new ThreadPool(threads));
 }
 
 void
-glit::Terrain::reshapeN(size_t level, Facet& self,
-                       const dvec3& viewPosition, const dvec3& viewDirection)
+glit::Terrain::setIncrementalQueries(bool enable)
 {
-    // Max subdivision is ~1M resolution.
-    if (level >= MaxSubdivisions)
-        return deleteChildren(self);
-
-    // Cull distant faces.
-    vec3 center = (self.verts[0]->vertex.position +
-                   self.verts[1]->vertex.position +
-                   self.verts[2]->vertex.position) / 3.f;
-    vec3 to = center - vec3(viewPosition);
-    float dist2 = to.x * to.x + to.y * to.y + to.z * to.z;
-    if ((EdgeLengths[level] * EdgeLengths[level] * (10.f * 10.f)) < dist2) {
-        return deleteChildren(self);
-    }
-
-    // Cull back facing facets.
-    float cosOfAng = dot(normalize(vec3(viewPosition)), self.normal);
-    if (cosOfAng < 0)
-        return deleteChildren(self);
-
-    // Clear cached upload indices.
-    self.childVerts[0].index = uint32_t(-1);
-    self.childVerts[1].index = uint32_t(-1);
-    self.childVerts[2].index = uint32_t(-1);
-
-    if (!self.children) {
-        // Subdivide allocate and assign verts.
-        subdivideFacet(self.verts[0]->vertex.position,
-                       self.verts[1]->vertex.position,
-                       self.verts[2]->vertex.position,
-                       &self.childVerts[0].vertex.position,
-                       &self.childVerts[1].vertex.position,
-                       &self.childVerts[2].vertex.position);
-
-        self.children = new Facet[4];
-        self.children[0].init(self.verts[0],
-                              &self.childVerts[2],
-                              &self.childVerts[1]);
-        self.children[1].init(&self.childVerts[0],
-                              &self.childVerts[1],
-                              &self.childVerts[2]);
-        self.children[2].init(&self.childVerts[2],
-                              self.verts[1],
-                              &self.childVerts[0]);
-        self.children[3].init(&self.childVerts[1],
-                              &self.childVerts[0],
-                              self.verts[2]);
-    }
-
-    reshapeN(level + 1, self.children[0], viewPosition, viewDirection);
-    reshapeN(level + 1, self.children[1], viewPosition, viewDirection);
-    reshapeN(level + 1, self.children[2], viewPosition, viewDirection);
-    reshapeN(level + 1, self.children[3], viewPosition, viewDirection);
+    waitForPipeline();
+    incrementalQueries_ = enable;
 }
 
-/* static */ glit::Terrain::Facet::GPUVertex
-glit::Terrain::Facet::GPUVertex::fromCPU(const CPUVertex& v,
-                                         const Facet& owner,
-                                         const dvec3& viewPosition)
+shared_ptr<const glit::Terrain::QueryTree>
+glit::Terrain::queryTree() const
 {
-    vec3 actual = (v.position - vec3(viewPosition)) / CameraScale;
-    return GPUVertex{actual, owner.normal};
+    lock_guard<mutex> guard(queryLock_);
+    return queryTree_;
 }
 
-/* static */ uint32_t
-glit::Terrain::pushVertex(Facet::VertexAndIndex* insert,
-                          const Facet& owner,
-                          const glm::dvec3& viewPosition,
-                          vector<Facet::GPUVertex>& verts)
+// Called by whoever owns the tree, once it is done changing it. Returns
+// how many nodes it copied rather than shared.
+size_t
+glit::Terrain::publishQueryTree()
 {
-    if (insert->index != uint32_t(-1))
-        return insert->index;
-    insert->index = verts.size();
-    verts.push_back(Facet::GPUVertex::fromCPU(insert->vertex, owner, viewPosition));
-    return insert->index;
+    shared_ptr<const QueryTree> last = queryTree();
+    shared_ptr<QueryTree> tree(new QueryTree);
+    tree->refineLevels = lodBias();
+
+    // Nothing is reshaping, but we still take the lock, as everyone else
+    // who reads the changes does.
+    lock_guard<mutex> guard(balanceLock_);
+    const QueryBlock* old = nullptr;
+    queryNear_.clear();
+    if (last && last->refineLevels == tree->refineLevels && incrementalQueries_ &&
+        !queryEverywhere_ && queryChanges_.size() <= MaxBalanceChanges)
+    {
+        old = last->top.get();
+        for (uint32_t i = 0; i < queryChanges_.size(); ++i)
+            queryNear_.push_back(i);
+    }
+    queryNodesCopied_ = 0;
+    tree->top = snapshotQueryBlock(0, facets, 20, tree->refineLevels, old,
+                                   0, uint32_t(queryNear_.size()));
+    queryChanges_.clear();
+    queryEverywhere_ = false;
+    publishedChanges_ = treeChanges_;
+
+    lock_guard<mutex> queryGuard(queryLock_);
+    queryTree_ = move(tree);
+    return queryNodesCopied_;
 }
 
-void
-glit::Terrain::drawSubtreeTriStrip(const dvec3& viewPosition,
-                                   vector<Facet::GPUVertex>& verts,
-                                   vector<uint32_t>& indices)
+// The facet's bounding sphere is its corners plus some slack; the lowest
+// corner less the same slack is as low as its mesh goes.
+/* static */ glit::Terrain::QueryNode
+glit::Terrain::makeQueryNode(size_t level, const Facet& facet)
 {
-    //util::Timer t("Terrain::upload");
-    for (size_t i = 0; i < 20; ++i)
-        drawSubtreeTriStripN(facets[i], viewPosition, verts, indices);
+    QueryNode node{{
+            facet.verts[0]->vertex,
+            facet.verts[1]->vertex,
+            facet.verts[2]->vertex},
+        0.f, facet.maxHeight, uint32_t(level), Facet::NoChildren, 0, 0};
+    float reach = 0.f;
+    float lowest = numeric_limits<float>::max();
+    for (auto& corner : node.corners) {
+        reach = std::max(reach, distance(facet.center, corner.position));
+        lowest = std::min(lowest, corner.height);
+    }
+    node.low = lowest - (facet.bound - reach);
+    return node;
+}
+
+// Copy the |count| facets at |top|, at |level|, and their subtrees down to
+// the next block into a new block. |old| is the block that we made for the
+// same facets last time, if there is one we can share from; the changes in
+// queryNear_ [nearBegin, nearEnd) are the ones that touch these facets.
+shared_ptr<const glit::Terrain::QueryBlock>
+glit::Terrain::snapshotQueryBlock(size_t level, const Facet* top, size_t count,
+                                  size_t refineLevels, const QueryBlock* old,
+                                  uint32_t nearBegin, uint32_t nearEnd)
+{
+    shared_ptr<QueryBlock> block(new QueryBlock);
+    for (size_t i = 0; i < count; ++i)
+        block->nodes.push_back(makeQueryNode(level, top[i]));
+    for (size_t i = 0; i < count; ++i) {
+        snapshotQueryNodes(top[i], i, old ? i : NoQueryNode, refineLevels, *block,
+                           old, nearBegin, nearEnd);
+    }
+    queryNodesCopied_ += block->nodes.size();
+    return block;
 }
 
+// |oldNode| is the same facet's node in |old|, if it had one.
 void
-glit::Terrain::drawSubtreeTriStripN(Facet& facet, const dvec3& viewPosition,
-                                    vector<Facet::GPUVertex>& verts,
-                                    vector<uint32_t>& indices) const
-{
-    // Draw leaf triangles.
-    if (!facet.children) {
-        uint32_t i0 = pushVertex(facet.verts[0], facet, viewPosition, verts);
-        uint32_t i1 = pushVertex(facet.verts[1], facet, viewPosition, verts);
-        uint32_t i2 = pushVertex(facet.verts[2], facet, viewPosition, verts);
-        indices.push_back(i0);
-        indices.push_back(i0);
-        indices.push_back(i1);
-        indices.push_back(i2);
-        indices.push_back(i2);
-        indices.push_back(i2);
+glit::Terrain::snapshotQueryNodes(const Facet& facet, size_t node, size_t oldNode,
+                                  size_t refineLevels, QueryBlock& block,
+                                  const QueryBlock* old, uint32_t nearBegin,
+                                  uint32_t nearEnd)
+{
+    vector<QueryNode>& nodes = block.nodes;
+    if (!facet.hasChildren()) {
+        if (refineLevels)
+            return;
+        Facet::VertexAndIndex* slots[6];
+        const StitchPattern& pattern = stitchLeaf(facet, slots);
+        if (pattern.count == 1)
+            return;
+        nodes[node].midpoints = uint32_t(block.midpoints.size());
+        nodes[node].stitch = uint8_t(&pattern - StitchPatterns);
+        for (size_t i = 3; i < 6; ++i)
+            block.midpoints.push_back(slots[i] ? slots[i]->vertex : Facet::CPUVertex());
         return;
     }
 
-    // Recurse into our children.
-    drawSubtreeTriStripN(facet.children[0], viewPosition, verts, indices);
-    drawSubtreeTriStripN(facet.children[1], viewPosition, verts, indices);
-    drawSubtreeTriStripN(facet.children[2], viewPosition, verts, indices);
-    drawSubtreeTriStripN(facet.children[3], viewPosition, verts, indices);
+    const QueryNode* oldParent = nullptr;
+    if (oldNode != NoQueryNode && old->nodes[oldNode].children != Facet::NoChildren)
+        oldParent = &old->nodes[oldNode];
+    const Facet* children = childrenOf(facet);
+    size_t level = nodes[node].level + 1;
 
-    // Draw joining tris between our children and grandchildren.
-    //
-    // Semi-Assumption: A maximum of one level of subdivision difference is
-    // possible between siblings. e.g. At whatever range we subdivide, the next
-    // subdivision range is always going to be more than one triangle centroid
-    // away. This means:
-    //   1- we only need to check locally between siblings, modulo the
-    //      top-level facet checks above; this can be done by checking if one
-    //      has children and the other does not.
-    //   2- we only ever need to insert a single triangle to join facets of
-    //      different levels.
-    // Note that we make these checks in the parent because the parent knows
-    // what is adjacent to which other child and where.
-    if (facet.children[0].children != facet.children[1].children) {
-        //uint32_t i0, i1, i2;
-        if (facet.children[1].children) {
-            /*
-            i0 = facet.children[1].verts[2]->index;
-            i1 = facet.children[1].verts[1]->index;
-            i2 = facet.children[1].childVerts[0].index;
-            if (i0 == uint32_t(-1)) throw runtime_error("a0: what?");
-            if (i1 == uint32_t(-1)) throw runtime_error("a1: what?");
-            if (i2 == uint32_t(-1)) throw runtime_error("a2: what?");
-            indices.push_back(i0);
-            indices.push_back(i0);
-            indices.push_back(i1);
-            indices.push_back(i2);
-            indices.push_back(i2);
-            indices.push_back(i2);
-            */
-        } else {
-            /*
-            i0 = facet.children[0].verts[2]->index;
-            i1 = facet.children[0].childVerts[0].index;
-            i2 = facet.children[0].verts[1]->index;
-            if (i0 == uint32_t(-1)) throw runtime_error("b0: what?");
-            if (i1 == uint32_t(-1)) throw runtime_error("b1: what?");
-            if (i2 == uint32_t(-1)) throw runtime_error("b2: what?");
-            indices.push_back(i0);
-            indices.push_back(i0);
-            indices.push_back(i1);
-            indices.push_back(i2);
-            indices.push_back(i2);
-            indices.push_back(i2);
-            */
-        }
-        /*
-        indices.push_back(i0);
-        indices.push_back(i0);
-        indices.push_back(i1);
-        indices.push_back(i2);
-        indices.push_back(i2);
-        indices.push_back(i2);
-        */
-    }
-    if (facet.children[1].children != facet.children[2].children) {
-        if (!facet.children[1].children) {
+    // Our children start a new block. We share the last one if nothing
+    // has touched us since.
+    if (level % QueryBlockLevels == 0) {
+        shared_ptr<const QueryBlock> child;
+        if (oldParent) {
+            uint32_t begin = uint32_t(queryNear_.size());
+            for (uint32_t i = nearBegin; i < nearEnd; ++i) {
+                if (touches(facet, queryChanges_[queryNear_[i]]))
+                    queryNear_.push_back(queryNear_[i]);
+            }
+            uint32_t end = uint32_t(queryNear_.size());
+            const shared_ptr<const QueryBlock>& last = old->blocks[oldParent->children];
+            if (begin == end)
+                child = last;
+            else
+                child = snapshotQueryBlock(level, children, 4, refineLevels, last.get(),
+                                           begin, end);
         } else {
+            child = snapshotQueryBlock(level, children, 4, refineLevels, nullptr, 0, 0);
         }
+        nodes[node].children = uint32_t(block.blocks.size());
+        block.blocks.push_back(move(child));
+        return;
+    }
+
+    size_t first = nodes.size();
+    nodes[node].children = uint32_t(first);
+    for (size_t i = 0; i < 4; ++i)
+        nodes.push_back(makeQueryNode(level, children[i]));
+    for (size_t i = 0; i < 4; ++i) {
+        snapshotQueryNodes(children[i], first + i,
+                           oldParent ? oldParent->children + i : NoQueryNode,
+                           refineLevels, block, old, nearBegin, nearEnd);
+    }
+}
+
+// The first of |node|'s four children in |block|, or in the block they
+// start, in which case we move |block| on to it.
+/* static */ const glit::Terrain::QueryNode*
+glit::Terrain::queryChildren(const QueryNode& node, const QueryBlock*& block)
+{
+    if ((node.level + 1) % QueryBlockLevels == 0) {
+        block = block->blocks[node.children].get();
+        return &block->nodes[0];
     }
+    return &block->nodes[node.children];
 }
 
+// As ensureChildren and ChunkRecipe lay them out.
+const uint8_t glit::Terrain::ChildCorners[4][3] = {
+    {0, 5, 4},
+    {3, 4, 5},
+    {5, 1, 3},
+    {4, 3, 2},
+};
+
+// The midpoints of the edges of a facet at |level|, opposite each of its
+// corners, just as buildChunk would make them. Where a tile is not in yet,
+// we settle for its ancestor.
 void
-glit::Terrain::drawSubtreeWireframe(Facet& facet, const dvec3& viewPosition,
-                                    vector<Facet::GPUVertex>& verts,
-                                    vector<uint32_t>& indices) const
+glit::Terrain::splitQueryCorners(const Facet::CPUVertex corners[3], size_t level,
+                                 Facet::CPUVertex out[3],
+                                 TileStreamer::TileRef& hint) const
 {
-    if (facet.children) {
-        drawSubtreeWireframe(facet.children[0], viewPosition, verts, indices);
-        drawSubtreeWireframe(facet.children[1], viewPosition, verts, indices);
-        drawSubtreeWireframe(facet.children[2], viewPosition, verts, indices);
-        drawSubtreeWireframe(facet.children[3], viewPosition, verts, indices);
-    } else {
-        uint32_t i0 = pushVertex(facet.verts[0], facet, viewPosition, verts);
-        uint32_t i1 = pushVertex(facet.verts[1], facet, viewPosition, verts);
-        uint32_t i2 = pushVertex(facet.verts[2], facet, viewPosition, verts);
-        indices.push_back(i0);
-        indices.push_back(i1);
-        indices.push_back(i1);
-        indices.push_back(i2);
-        indices.push_back(i2);
-        indices.push_back(i0);
+    static const size_t Edges[3][2] = {{1, 2}, {0, 2}, {0, 1}};
+    size_t first = detailBegin(level);
+    size_t last = tiles_ ? first : detailEnd(level);
+    MidpointBatch batch;
+    for (auto& edge : Edges) {
+        const Facet::CPUVertex& a = corners[edge[0]];
+        const Facet::CPUVertex& b = corners[edge[1]];
+        batch.push(a.position, b.position,
+                   coarseHeight(a, first), coarseHeight(b, first));
+    }
+    heightKernel_.displace(batch, first, last);
+    for (size_t i = 0; i < 3; ++i) {
+        out[i] = midpointVertex(batch, i, first, last);
+        if (tiles_) {
+            Facet::CPUVertex vertex;
+            vec3 unit = normalize(corners[Edges[i][0]].position +
+                                  corners[Edges[i][1]].position);
+            if (tileVertex(unit, level + 1, hint, vertex) != TileSample::Beyond)
+                out[i] = vertex;
+        }
+    }
+}
+
+// How far |unit| is inside the cone from the center of the planet through
+// |corners|, by the least of its distances past each side. Negative if it
+// is outside.
+/* static */ double
+glit::Terrain::insideCone(const dvec3 corners[3], const dvec3& unit)
+{
+    double inside = numeric_limits<double>::max();
+    for (size_t i = 0; i < 3; ++i) {
+        dvec3 side = normalize(cross(corners[(i + 1) % 3], corners[(i + 2) % 3]));
+        double sign = dot(side, corners[i]) < 0.0 ? -1.0 : 1.0;
+        inside = std::min(inside, sign * dot(side, unit));
+    }
+    return inside;
+}
+
+// Down the tree to the leaf under |position|, and on down as far as the
+// engine splits it, to the triangle we draw there.
+double
+glit::Terrain::queryHeight(const QueryTree& tree, const dvec3& position) const
+{
+    dvec3 unit = normalize(position);
+    auto deepest = [&](const Facet::CPUVertex* const* options, size_t count) {
+        size_t best = 0;
+        double bestInside = -numeric_limits<double>::max();
+        for (size_t i = 0; i < count; ++i) {
+            dvec3 corners[3] = {dvec3(options[i][0].position),
+                                dvec3(options[i][1].position),
+                                dvec3(options[i][2].position)};
+            double inside = insideCone(corners, unit);
+            if (inside > bestInside) {
+                best = i;
+                bestInside = inside;
+            }
+        }
+        return best;
+    };
+
+    const QueryBlock* block = tree.top.get();
+    const Facet::CPUVertex* options[20];
+    for (size_t i = 0; i < 20; ++i)
+        options[i] = block->nodes[i].corners;
+    const QueryNode* node = &block->nodes[deepest(options, 20)];
+    while (node->children != Facet::NoChildren) {
+        const QueryNode* children = queryChildren(*node, block);
+        for (size_t i = 0; i < 4; ++i)
+            options[i] = children[i].corners;
+        node = &children[deepest(options, 4)];
+    }
+
+    Facet::CPUVertex corners[3] = {node->corners[0], node->corners[1], node->corners[2]};
+    Facet::CPUVertex children[4][3];
+    if (node->stitch) {
+        const StitchPattern& pattern = StitchPatterns[node->stitch];
+        const Facet::CPUVertex* slots[6] = {&corners[0], &corners[1], &corners[2],
+                                            &block->midpoints[node->midpoints + 0],
+                                            &block->midpoints[node->midpoints + 1],
+                                            &block->midpoints[node->midpoints + 2]};
+        for (size_t i = 0; i < pattern.count; ++i) {
+            for (size_t j = 0; j < 3; ++j)
+                children[i][j] = *slots[pattern.triangles[i][j]];
+            options[i] = children[i];
+        }
+        size_t child = deepest(options, pattern.count);
+        for (size_t j = 0; j < 3; ++j)
+            corners[j] = children[child][j];
+    }
+    TileStreamer::TileRef hint;
+    for (size_t level = node->level; level < node->level + tree.refineLevels; ++level) {
+        Facet::CPUVertex slots[6] = {corners[0], corners[1], corners[2]};
+        splitQueryCorners(corners, level, &slots[3], hint);
+        for (size_t i = 0; i < 4; ++i) {
+            for (size_t j = 0; j < 3; ++j)
+                children[i][j] = slots[ChildCorners[i][j]];
+            options[i] = children[i];
+        }
+        size_t child = deepest(options, 4);
+        for (size_t j = 0; j < 3; ++j)
+            corners[j] = children[child][j];
+    }
+
+    // Where the line from the center through |position| meets the triangle.
+    dvec3 p0(corners[0].position);
+    dvec3 normal = cross(dvec3(corners[1].position) - p0, dvec3(corners[2].position) - p0);
+    return dot(normal, p0) / dot(normal, unit);
+}
+
+// Where the segment from |from| along |delta| first gets to where the mesh
+// under |corners| could be, as a fraction of the way along; negative if it
+// never does. That is inside the cone from the center through the corners,
+// each side of which is a plane through the center, and between |low| and
+// |high|.
+double
+glit::Terrain::queryEntry(const Facet::CPUVertex corners[3], float low, float high,
+                          const dvec3& from, const dvec3& delta) const
+{
+    // Verts are floats, so a midpoint can be off the plane of its edge by
+    // half a meter or so, and its own midpoints by a little more. We widen
+    // everything by a couple of meters, so that we do not slip between two
+    // facets.
+    const double Tolerance = 2.0;
+    double a = dot(delta, delta);
+    if (a == 0.0)
+        return -1.0;
+    double t0 = 0.0;
+    double t1 = 1.0;
+    for (size_t i = 0; i < 3; ++i) {
+        dvec3 side = normalize(cross(dvec3(corners[(i + 1) % 3].position),
+                                     dvec3(corners[(i + 2) % 3].position)));
+        if (dot(side, dvec3(corners[i].position)) < 0.0)
+            side = -side;
+        double start = dot(side, from) + Tolerance;
+        double rate = dot(side, delta);
+        if (rate > 0.0)
+            t0 = std::max(t0, -start / rate);
+        else if (rate < 0.0)
+            t1 = std::min(t1, -start / rate);
+        else if (start < 0.0)
+            return -1.0;
+    }
+
+    // The distance from the center squared is a t^2 + 2 b t + c.
+    double b = dot(from, delta);
+    double c = dot(from, from);
+    double outer = double(radius_) + double(high) + Tolerance;
+    double discriminant = b * b - a * (c - outer * outer);
+    if (discriminant < 0.0)
+        return -1.0;
+    double root = sqrt(discriminant);
+    t0 = std::max(t0, (-b - root) / a);
+    t1 = std::min(t1, (-b + root) / a);
+    double inner = double(radius_) + double(low) - Tolerance;
+    discriminant = b * b - a * (c - inner * inner);
+    if (discriminant > 0.0) {
+        root = sqrt(discriminant);
+        if (t0 > (-b - root) / a && t0 < (-b + root) / a)
+            t0 = (-b + root) / a;
+    }
+    return t0 <= t1 ? t0 : -1.0;
+}
+
+// Test the nodes [first, first + count) of |block|, nearest first, and stop
+// once the rest are all behind the hit we have.
+bool
+glit::Terrain::querySegment(const QueryTree& tree, const QueryBlock& block,
+                            size_t first, size_t count,
+                            const dvec3& from, const dvec3& delta,
+                            TileStreamer::TileRef& hint, RayHit* hit) const
+{
+    pair<double, size_t> order[20];
+    size_t hits = 0;
+    for (size_t i = first; i < first + count; ++i) {
+        const QueryNode& node = block.nodes[i];
+        double entry = queryEntry(node.corners, node.low, node.high, from, delta);
+        if (entry >= 0.0)
+            order[hits++] = make_pair(entry, i);
+    }
+    sort(order, order + hits);
+
+    double reach = length(delta);
+    bool found = false;
+    for (size_t i = 0; i < hits; ++i) {
+        if (hit->hit && order[i].first * reach >= hit->distance)
+            break;
+        const QueryNode& node = block.nodes[order[i].second];
+        if (node.children != Facet::NoChildren) {
+            const QueryBlock* childBlock = &block;
+            const QueryNode* children = queryChildren(node, childBlock);
+            found = querySegment(tree, *childBlock, children - childBlock->nodes.data(), 4,
+                                 from, delta, hint, hit) || found;
+            continue;
+        }
+
+        if (node.stitch) {
+            const StitchPattern& pattern = StitchPatterns[node.stitch];
+            const Facet::CPUVertex* slots[6] = {&node.corners[0], &node.corners[1],
+                                                &node.corners[2],
+                                                &block.midpoints[node.midpoints + 0],
+                                                &block.midpoints[node.midpoints + 1],
+                                                &block.midpoints[node.midpoints + 2]};
+            for (size_t j = 0; j < pattern.count; ++j) {
+                Facet::CPUVertex triangle[3];
+                for (size_t k = 0; k < 3; ++k)
+                    triangle[k] = *slots[pattern.triangles[j][k]];
+                found = queryTriangle(triangle, from, delta, hit) || found;
+            }
+            continue;
+        }
+
+        // With tiles, a facet leaves room for them to rise above its
+        // corners. Below the leaf, we need that room as well.
+        float lowest = numeric_limits<float>::max();
+        for (auto& corner : node.corners)
+            lowest = std::min(lowest, corner.height);
+        float relief = std::max(0.f, lowest - node.low - bulgeAt(node.level));
+        found = queryNearerHit(node.corners, node.level, tree.refineLevels, relief,
+                               from, delta, hint, hit) || found;
+    }
+    return found;
+}
+
+// Whether the segment meets the triangle nearer than |hit|. Either side
+// counts.
+/* static */ bool
+glit::Terrain::queryTriangle(const Facet::CPUVertex corners[3],
+                             const dvec3& from, const dvec3& delta, RayHit* hit)
+{
+    dvec3 p0(corners[0].position);
+    dvec3 edge1 = dvec3(corners[1].position) - p0;
+    dvec3 edge2 = dvec3(corners[2].position) - p0;
+    dvec3 p = cross(delta, edge2);
+    double det = dot(edge1, p);
+    if (det == 0.0)
+        return false;
+    dvec3 offset = from - p0;
+    double u = dot(offset, p) / det;
+    if (u < 0.0 || u > 1.0)
+        return false;
+    dvec3 q = cross(offset, edge1);
+    double v = dot(delta, q) / det;
+    if (v < 0.0 || u + v > 1.0)
+        return false;
+    double t = dot(edge2, q) / det;
+    double reach = length(delta);
+    if (t < 0.0 || t > 1.0 || (hit->hit && t * reach >= hit->distance))
+        return false;
+    vec3 normal = normalize(vec3(cross(edge1, edge2)));
+    if (dot(dvec3(normal), p0) < 0.0)
+        normal = -normal;
+    *hit = RayHit{true, t * reach, from + delta * t, normal};
+    return true;
+}
+
+// Split the triangle |refine| more times, nearest first, and test the
+// triangles we get to against the segment.
+bool
+glit::Terrain::queryNearerHit(const Facet::CPUVertex corners[3], size_t level,
+                              size_t refine, float relief, const dvec3& from,
+                              const dvec3& delta, TileStreamer::TileRef& hint,
+                              RayHit* hit) const
+{
+    if (refine == 0)
+        return queryTriangle(corners, from, delta, hit);
+
+    // The same bounds as ensureChildren would give the children.
+    Facet::CPUVertex slots[6] = {corners[0], corners[1], corners[2]};
+    splitQueryCorners(corners, level, &slots[3], hint);
+    pair<double, size_t> order[4];
+    size_t hits = 0;
+    Facet::CPUVertex children[4][3];
+    for (size_t i = 0; i < 4; ++i) {
+        float lowest = numeric_limits<float>::max();
+        float highest = -numeric_limits<float>::max();
+        for (size_t j = 0; j < 3; ++j) {
+            children[i][j] = slots[ChildCorners[i][j]];
+            lowest = std::min(lowest, children[i][j].height);
+            highest = std::max(highest, children[i][j].height);
+        }
+        float low = lowest - bulgeAt(level + 1) - relief;
+        float high = highest + riseAt(level + 1) + relief;
+        double entry = queryEntry(children[i], low, high, from, delta);
+        if (entry >= 0.0)
+            order[hits++] = make_pair(entry, i);
+    }
+    sort(order, order + hits);
+
+    double reach = length(delta);
+    bool found = false;
+    for (size_t i = 0; i < hits; ++i) {
+        if (hit->hit && order[i].first * reach >= hit->distance)
+            break;
+        found = queryNearerHit(children[order[i].second], level + 1, refine - 1, relief,
+                               from, delta, hint, hit) || found;
+    }
+    return found;
+}
+
+void
+glit::Terrain::setValidateHeights(bool enable)
+{
+    waitForPipeline();
+    validateHeights_ = enable;
+}
+
+glit::Terrain::HeightError
+glit::Terrain::heightError() const
+{
+    lock_guard<mutex> lock(heightErrorLock_);
+    HeightError error{heightErrorSamples_, heightErrorMax_, 0.f};
+    if (heightErrorSamples_)
+        error.rms = float(sqrt(heightErrorSquares_ / heightErrorSamples_));
+    return error;
+}
+
+void
+glit::Terrain::resetHeightError()
+{
+    lock_guard<mutex> lock(heightErrorLock_);
+    heightErrorSamples_ = 0;
+    heightErrorMax_ = 0.f;
+    heightErrorSquares_ = 0.0;
+}
+
+float
+glit::Terrain::coarseHeight(const Facet::CPUVertex& v, size_t octave) const
+{
+    size_t begin = v.detailBegin;
+    size_t end = v.detailEnd;
+    octave = std::max(octave, begin);
+    if (octave >= end)
+        return v.height;
+    if (octave == begin)
+        return v.coarse;
+    vec3 unit = normalize(v.position);
+    if (octave - begin <= end - octave)
+        return v.coarse + heightKernel_.height(unit, begin, octave);
+    return v.height - heightKernel_.height(unit, octave, end);
+}
+
+/* static */ glit::Terrain::Facet::CPUVertex
+glit::Terrain::midpointVertex(const MidpointBatch& batch, size_t i,
+                              size_t begin, size_t end)
+{
+    Facet::CPUVertex v;
+    v.position = batch.result(i);
+    v.height = batch.height(i);
+    v.coarse = batch.start(i);
+    v.detailBegin = uint8_t(begin);
+    v.detailEnd = uint8_t(end);
+    return v;
+}
+
+// |check| holds the same edges as |batch|, but with zero heights at the ends,
+// so displacing it over all |octaves| is the full evaluation.
+void
+glit::Terrain::checkHeights(const MidpointBatch& batch, MidpointBatch& check,
+                            size_t octaves) const
+{
+    heightKernel_.displace(check, 0, octaves);
+    float max = 0.f;
+    double squares = 0.0;
+    for (size_t i = 0; i < batch.size(); ++i) {
+        float error = std::abs(batch.height(i) - check.height(i));
+        max = std::max(max, error);
+        squares += double(error) * error;
+    }
+    lock_guard<mutex> lock(heightErrorLock_);
+    heightErrorSamples_ += batch.size();
+    heightErrorMax_ = std::max(heightErrorMax_, max);
+    heightErrorSquares_ += squares;
+}
+
+// Run on the worker when the pipeline is async. |previous| is the front
+// stage, which the render thread may be reading, but not writing.
+void
+glit::Terrain::buildStage(Stage& stage, const Stage& previous,
+                          const dvec3& viewPosition,
+                          const Camera::Frustum& frustum)
+{
+    stage.cullCounts = reshape(viewPosition, frustum);
+    stage.refineCounts = refineCounts_;
+    stage.stats = reshapeStats_;
+    auto start = chrono::steady_clock::now();
+    stage.engine = engine_;
+    stage.batches.clear();
+    stage.verts.clear();
+    stage.indices.clear();
+    stage.chunkNodes.clear();
+    stage.gridPatches.clear();
+    if (engine_ == Engine::Chunked) {
+        for (size_t i = 0; i < 20; ++i)
+            stage.chunkNodes.push_back(makeChunkNode(rootKey(i), 0, facets[i]));
+        for (size_t i = 0; i < 20; ++i)
+            snapshotChunkNodes(facets[i], i, stage.chunkNodes);
+    } else if (engine_ == Engine::Instanced) {
+        for (size_t i = 0; i < 20; ++i) {
+            snapshotGridPatches(facets[i], rootKey(i), 0, frustum.pixelScale,
+                                stage.gridPatches);
+        }
+    } else if (DrawAsTriangles) {
+        drawSubtreeTriangles(viewPosition, stage.batches, stage.verts, stage.indices);
+    } else {
+        buildWireframe(viewPosition, stage.batches, stage.verts, stage.indices);
+    }
+
+    // Count each batch's indices from its first vert, so that they fit in
+    // the 16 bits that IndexBuffer will then pick.
+    for (auto& batch : stage.batches) {
+        for (size_t i = batch.firstIndex; i < batch.firstIndex + batch.indexCount; ++i)
+            stage.indices[i] -= batch.firstVertex;
+    }
+    stage.stats.vertsEmitted = stage.verts.size();
+    stage.stats.indicesEmitted = stage.indices.size();
+    stage.stats.emitMillis =
+        chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+
+    // Nothing in the mesh depends on the camera, so unless the tree or the
+    // batches changed, it is what we uploaded last time and we can keep it.
+    // Every front stage gets uploaded, or kept, before the next swap.
+    stage.meshChanged = stage.engine != previous.engine ||
+                        stage.verts.size() != previous.verts.size() ||
+                        stage.indices != previous.indices ||
+                        memcmp(stage.verts.data(), previous.verts.data(),
+                               stage.verts.size() * sizeof(stage.verts[0])) != 0;
+}
+
+glit::Mesh*
+glit::Terrain::uploadStage(const Stage& stage)
+{
+    Mesh* mesh = DrawAsTriangles ? &triangleMesh : &wireframeMesh;
+    if (!stage.meshChanged)
+        return mesh;
+    mesh->drawable(0).vertexBuffer()->orphan<Facet::GPUVertex>();
+    mesh->drawable(0).indexBuffer()->orphan();
+    mesh->drawable(0).vertexBuffer()->upload(stage.verts);
+    mesh->drawable(0).indexBuffer()->upload(stage.indices);
+    stats_.bytesUploaded += stage.verts.size() * sizeof(stage.verts[0]) +
+                            stage.indices.size() * mesh->drawable(0).indexBuffer()->indexSize();
+    return mesh;
+}
+
+void
+glit::Terrain::drawBatches(const vector<MeshBatch>& batches,
+                           const Drawable& drawable,
+                           const mat4& transform,
+                           const dvec3& viewPosition,
+                           vec3 sunDirection)
+{
+    GLint originIndex = programLand->uniformLocation("uBatchOrigin");
+    GLint scaleIndex = programLand->uniformLocation("uBatchScale");
+    auto placeBatch = [&](const Program& program, const MeshBatch& batch) {
+        vec3 origin((batch.origin - viewPosition) / double(CameraScale));
+        program.bindUniform(originIndex, origin);
+        program.bindUniform(scaleIndex, batch.scale / CameraScale);
+    };
+    drawable.drawBatches(batches, placeBatch, transform, sunDirection, vec3(0.f), 1.f);
+}
+
+// The coarsest mesh that is within the pixel error all the way down to the
+// ground right below us. Nothing else is nearer.
+size_t
+glit::Terrain::pickOrbitDepth(double altitude, float pixelScale) const
+{
+    for (size_t depth = OrbitMinDepth; depth < OrbitMaxDepth; ++depth) {
+        if (levelErrorAt(depth) * pixelScale / altitude <= pixelError_)
+            return depth;
+    }
+    return OrbitMaxDepth;
+}
+
+// Each root is a chunk |depth| levels deep, built just as the chunked engine
+// would, in a batch of its own.
+unique_ptr<glit::Terrain::OrbitMesh>
+glit::Terrain::makeOrbitMesh(size_t depth) const
+{
+    ChunkRecipe recipe = makeChunkRecipe(depth);
+    vector<uint16_t> pattern;
+    if (DrawAsTriangles)
+        pattern = recipe.triangles;
+    else
+        pattern.assign(recipe.lines.begin(), recipe.lines.end());
+
+    bool settled = false;
+    vector<MeshBatch> batches;
+    vector<Facet::GPUVertex> verts;
+    vector<uint16_t> indices;
+    vector<Facet::GPUVertex> scratch;
+    for (size_t i = 0; i < 20; ++i) {
+        ChunkNode node = rootChunkNode(i);
+        if (!buildChunk(node, scratch, false, recipe)) {
+            settled = true;
+            buildChunk(node, scratch, true, recipe);
+        }
+        batches.push_back(MeshBatch{dvec3(node.corners[0].position),
+                                    chunkScale(node) * CameraScale,
+                                    uint32_t(verts.size()), uint32_t(scratch.size()),
+                                    uint32_t(indices.size()), uint32_t(pattern.size())});
+        verts.insert(verts.end(), scratch.begin(), scratch.end());
+        indices.insert(indices.end(), pattern.begin(), pattern.end());
+    }
+
+    GLenum mode = DrawAsTriangles ? GL_TRIANGLES : GL_LINES;
+    return unique_ptr<OrbitMesh>(new OrbitMesh{
+            Drawable(programLand, mode, VertexBuffer::make(verts), IndexBuffer::make(indices)),
+            move(batches), settled, orbitFrame_});
+}
+
+// Built the first time we need it, which is the only time we touch the CPU
+// for it unless it is still waiting on tiles.
+const glit::Terrain::OrbitMesh&
+glit::Terrain::orbitMesh(size_t depth)
+{
+    ++orbitFrame_;
+    if (orbitMeshes_.size() <= depth)
+        orbitMeshes_.resize(depth + 1);
+    unique_ptr<OrbitMesh>& mesh = orbitMeshes_[depth];
+    if (!mesh || (mesh->settled && orbitFrame_ - mesh->builtFrame >= OrbitRetryFrames)) {
+        mesh = makeOrbitMesh(depth);
+        for (auto& batch : mesh->batches) {
+            stats_.vertsEmitted += batch.vertexCount;
+            stats_.indicesEmitted += batch.indexCount;
+            stats_.bytesUploaded += batch.vertexCount * sizeof(Facet::GPUVertex) +
+                                    batch.indexCount * sizeof(uint16_t);
+        }
+    }
+    return *mesh;
+}
+
+void
+glit::Terrain::setAsyncPipeline(bool enable)
+{
+#ifdef __EMSCRIPTEN__
+    enable = false;
+#endif
+    waitForPipeline();
+    asyncPipeline_ = enable;
+}
+
+// Called with pipelineLock_ held once the back stage is built.
+void
+glit::Terrain::swapStages()
+{
+    frontStage_ ^= 1;
+    haveFrontStage_ = true;
+    frontUploaded_ = false;
+    backState_ = StageState::Idle;
+}
+
+void
+glit::Terrain::advancePipeline(const dvec3& viewPosition,
+                               const Camera::Frustum& frustum)
+{
+    if (!pipelineThread_.joinable())
+        pipelineThread_ = thread([this](){ pipelineMain(); });
+
+    unique_lock<mutex> guard(pipelineLock_);
+    if (backState_ == StageState::Ready)
+        swapStages();
+    if (backState_ == StageState::Idle) {
+        requestPosition_ = viewPosition;
+        requestFrustum_ = frustum;
+        backState_ = StageState::Building;
+        pipelineWake_.notify_all();
+    }
+
+    // Nothing to draw at all yet, so we have no choice but to wait.
+    if (!haveFrontStage_) {
+        pipelineWake_.wait(guard, [this](){
+            return backState_ == StageState::Ready;
+        });
+        swapStages();
+    }
+}
+
+void
+glit::Terrain::pipelineMain()
+{
+    unique_lock<mutex> guard(pipelineLock_);
+    while (true) {
+        pipelineWake_.wait(guard, [this](){
+            return pipelineQuit_ || backState_ == StageState::Building;
+        });
+        if (pipelineQuit_)
+            return;
+
+        dvec3 viewPosition = requestPosition_;
+        Camera::Frustum frustum = requestFrustum_;
+        Stage& stage = stages_[frontStage_ ^ 1];
+        const Stage& previous = stages_[frontStage_];
+        guard.unlock();
+        buildStage(stage, previous, viewPosition, frustum);
+        guard.lock();
+
+        backState_ = StageState::Ready;
+        pipelineWake_.notify_all();
+    }
+}
+
+// Block until the worker is not touching the tree, so that we can change
+// the settings that reshape depends on.
+void
+glit::Terrain::waitForPipeline()
+{
+    unique_lock<mutex> guard(pipelineLock_);
+    pipelineWake_.wait(guard, [this](){
+        return backState_ != StageState::Building;
+    });
+}
+
+void
+glit::Terrain::stopPipeline()
+{
+    if (!pipelineThread_.joinable())
+        return;
+    {
+        lock_guard<mutex> guard(pipelineLock_);
+        pipelineQuit_ = true;
+    }
+    pipelineWake_.notify_all();
+    pipelineThread_.join();
+}
+
+void
+glit::Terrain::buildWireframe(const dvec3& viewPosition,
+                              vector<MeshBatch>& batches,
+                              vector<MeshVertex>& verts,
+                              vector<uint32_t>& indices)
+{
+    size_t firstBatch = batches.size();
+    for (size_t i = 0; i < 20; ++i)
+        drawSubtreeWireframe(facets[i], false, viewPosition, batches, verts, indices);
+
+    // Neighbouring leaves emit the edges they share from both sides, now
+    // that they share the verts; keep one of each. Verts are only shared
+    // within a batch, so that is as far as we need to look.
+    vector<uint64_t>& edges = wireframeEdges_;
+    size_t out = firstBatch < batches.size() ? batches[firstBatch].firstIndex : 0;
+    for (size_t k = firstBatch; k < batches.size(); ++k) {
+        MeshBatch& batch = batches[k];
+        edges.clear();
+        for (size_t i = batch.firstIndex; i < batch.firstIndex + batch.indexCount; i += 2) {
+            uint32_t a = std::min(indices[i], indices[i + 1]);
+            uint32_t b = std::max(indices[i], indices[i + 1]);
+            edges.push_back(uint64_t(a) << 32 | b);
+        }
+        sort(edges.begin(), edges.end());
+        edges.erase(unique(edges.begin(), edges.end()), edges.end());
+        batch.firstIndex = uint32_t(out);
+        batch.indexCount = uint32_t(edges.size() * 2);
+        for (uint64_t edge : edges) {
+            indices[out++] = uint32_t(edge >> 32);
+            indices[out++] = uint32_t(edge);
+        }
+    }
+    if (firstBatch < batches.size())
+        indices.resize(out);
+}
+
+bool
+glit::Terrain::deleteChildren(size_t level, Facet& self)
+{
+    if (!self.hasChildren())
+        return false;
+    Facet* children = childrenOf(self);
+    for (size_t i = 0; i < 4; ++i) {
+        deleteChildren(level + 1, children[i]);
+        releaseMidpoints(children[i]);
+    }
+    facetPool.release(level, self.children);
+    self.children = Facet::NoChildren;
+    self.forced = false;
+    countSplit(self, -1);
+    ++treeChanges_;
+    facetsDestroyed_ += 4;
+    return true;
+}
+
+void
+glit::Terrain::Facet::init(VertexAndIndex* v0, VertexAndIndex* v1, VertexAndIndex* v2,
+                           float bulge, float rise)
+{
+    children = NoChildren;
+    validUntil = 0.0;
+    validUntilTurn = 0.0;
+    haveMidpoints = false;
+    error = 0.f;
+    culled = Cull::None;
+    forced = false;
+    culledFrustum = 0;
+    culledHorizon = 0;
+
+    verts[0] = v0;
+    verts[1] = v1;
+    verts[2] = v2;
+
+    normal = normalize(cross(v1->vertex.position - v0->vertex.position,
+                             v2->vertex.position - v0->vertex.position));
+
+    center = (v0->vertex.position + v1->vertex.position + v2->vertex.position) / 3.f;
+    bound = 0.f;
+    for (auto v : verts)
+        bound = std::max(bound, distance(center, v->vertex.position));
+    bound += bulge;
+    maxHeight = std::max(v0->vertex.height,
+                         std::max(v1->vertex.height, v2->vertex.height)) + rise;
+
+    // Uninitialized:
+    //   childVerts
+}
+
+void
+glit::Terrain::setIncrementalReshape(bool enable)
+{
+    waitForPipeline();
+    incrementalReshape_ = enable;
+}
+
+void
+glit::Terrain::setRefineBudget(size_t splits, double millis)
+{
+    waitForPipeline();
+    refineSplits_ = splits;
+    refineMillis_ = millis;
+}
+
+void
+glit::Terrain::setTriangleBudget(size_t triangles)
+{
+    waitForPipeline();
+    triangleBudget_ = triangles;
+    forceReshape_ = true;
+}
+
+void
+glit::Terrain::setFrustumCulling(bool enable)
+{
+    waitForPipeline();
+    frustumCulling_ = enable;
+    forceReshape_ = true;
+}
+
+void
+glit::Terrain::setCullGuardBand(float radians)
+{
+    waitForPipeline();
+    cullGuardBand_ = radians;
+    forceReshape_ = true;
+}
+
+void
+glit::Terrain::setPixelError(float pixels)
+{
+    waitForPipeline();
+    pixelError_ = pixels;
+    forceReshape_ = true;
+}
+
+void
+glit::Terrain::setHorizonCulling(bool enable)
+{
+    waitForPipeline();
+    horizonCulling_ = enable;
+    forceReshape_ = true;
+}
+
+void
+glit::Terrain::setEngine(Engine engine)
+{
+    // The grid shader only knows the noise, so over tiles it would draw
+    // other ground than the tree that queries and culling see.
+    if (engine == Engine::Instanced && tiles_)
+        engine = Engine::Chunked;
+    if (engine == engine_)
+        return;
+    waitForPipeline();
+    engine_ = engine;
+
+    // The LOD bias changed, so none of the recorded slack is valid.
+    forceReshape_ = true;
+}
+
+void
+glit::Terrain::cycleEngine()
+{
+    switch (engine_) {
+    case Engine::Immediate: setEngine(Engine::Chunked); break;
+    case Engine::Chunked: setEngine(tiles_ ? Engine::Immediate : Engine::Instanced); break;
+    case Engine::Instanced: setEngine(Engine::Immediate); break;
+    }
+    cout << "terrain engine: " << engineName(engine_) << endl;
+}
+
+/* static */ const char*
+glit::Terrain::engineName(Engine engine)
+{
+    switch (engine) {
+    case Engine::Immediate: return "immediate";
+    case Engine::Chunked: return "chunked";
+    case Engine::Instanced: return "instanced";
+    }
+    return "unknown";
+}
+
+void
+glit::Terrain::setTriangleOrder(TriangleOrder order)
+{
+    waitForPipeline();
+    triangleOrder_ = order;
+}
+
+/* static */ const char*
+glit::Terrain::triangleOrderName(TriangleOrder order)
+{
+    switch (order) {
+    case TriangleOrder::Tree: return "tree";
+    case TriangleOrder::Sierpinski: return "sierpinski";
+    case TriangleOrder::Forsyth: return "forsyth";
+    }
+    return "unknown";
+}
+
+void
+glit::Terrain::setReshapeThreads(size_t threads)
+{
+    if (threads == reshapePool_->threadCount())
+        return;
+    waitForPipeline();
+    reshapePool_.reset(new ThreadPool(threads));
+}
+
+void
+glit::Terrain::setParallelSplitDepth(size_t depth)
+{
+    waitForPipeline();
+    parallelSplitDepth_ = depth;
+}
+
+void
+glit::Terrain::startReshapeTasks()
+{
+    size_t room = std::max(facetPool.peakItems(), size_t(20));
+    if (reshapeTasks_.size() < room) {
+        reshapeTasks_.resize(room);
+        reshapeRoots_.resize(room);
+    }
+    reshapeTasksUsed_ = 0;
+    reshapeRootsUsed_ = 0;
+}
+
+// Returns false, having spawned nothing, if the pass has already handed out
+// all the room reshape made for it, in which case the caller keeps the work.
+bool
+glit::Terrain::spawnReshape(ThreadPool::TaskGroup& group, size_t level,
+                            Facet* const* roots, size_t count)
+{
+    size_t task = reshapeTasksUsed_.fetch_add(1);
+    size_t first = reshapeRootsUsed_.fetch_add(count);
+    if (task >= reshapeTasks_.size() || first + count > reshapeRoots_.size())
+        return false;
+    std::copy(roots, roots + count, &reshapeRoots_[first]);
+    reshapeTasks_[task] = ReshapeTask{level, first, count};
+    const ReshapeTask* slot = &reshapeTasks_[task];
+    reshapePool_->spawn(group, [this, slot](){
+        reshapeSubtree(slot->level, &reshapeRoots_[slot->first], slot->count,
+                       *reshapeView_, *reshapeFrustum_);
+    });
+    return true;
+}
+
+glit::Terrain::CullCounts
+glit::Terrain::reshape(const dvec3& viewPosition, const Camera::Frustum& frustum)
+{
+    // Moving the camera by d changes the distance to any point by at most d,
+    // so the total distance moved bounds the change in every LOD test.
+    travel_ += distance(viewPosition, lastViewPosition_);
+    lastViewPosition_ = viewPosition;
+
+    // See inFrustum for what the turn bounds.
+    double turned = 0.0;
+    for (size_t i = 0; i < 4; ++i) {
+        turned = std::max(turned, double(distance(frustum.normals[i],
+                                                  lastFrustum_.normals[i])));
+    }
+    turn_ += turned;
+
+    // Resizing the window changes every screen space error.
+    if (frustum.pixelScale != lastFrustum_.pixelScale)
+        forceReshape_ = true;
+    lastFrustum_ = frustum;
+
+    // With a refine budget, reshapeSubtree stops at the leaves that want to
+    // split and hands them back to us. We split as many as the budget
+    // allows, those whose error shows most on screen first, then reshape
+    // the new subtrees to see what they want in turn, and so on until
+    // nothing wants splitting or the budget is spent. Since each pass only
+    // splits what the one before it found, the tree fills in a level at a
+    // time everywhere at once. Whatever we stop short of stays a leaf that
+    // has already expired, so the next frame picks it up.
+    //
+    // Most of what a split costs is its children's reshape in the pass
+    // after it, so we keep track of that and only split as many as we
+    // have time left for. The first pass gets MinRefineSplits regardless,
+    // so that we get somewhere however slow the frame is.
+    auto start = chrono::steady_clock::now();
+    auto millisSince = [](chrono::steady_clock::time_point from) {
+        auto dt = chrono::steady_clock::now() - from;
+        return chrono::duration<double, milli>(dt).count();
+    };
+    size_t splitsLeft = refineSplits_ ? refineSplits_ : numeric_limits<size_t>::max();
+    refineCounts_ = RefineCounts{0, 0, 0, 0};
+    tradeLeaves_ = 0;
+    vector<RefineCandidate>& granted = refineGranted_;
+    granted.clear();
+    reshapeView_ = &viewPosition;
+    reshapeFrustum_ = &frustum;
+    for (reshapePass_ = 0; ; ++reshapePass_) {
+        // Subtrees are disjoint, so tasks only share the facet pool, the
+        // midpoints, the candidates and the balance changes, which lock,
+        // and the upload indices of the shared corner verts, which reshape
+        // does not touch (see VertexAndIndex).
+        auto passStart = chrono::steady_clock::now();
+        ThreadPool::TaskGroup group;
+        startReshapeTasks();
+        if (reshapePass_ == 0) {
+            for (size_t i = 0; i < 20; ++i) {
+                Facet* facet = &facets[i];
+                if (!spawnReshape(group, 0, &facet, 1))
+                    reshapeSubtree(0, &facet, 1, viewPosition, frustum);
+            }
+        } else {
+            // The new subtrees, a level's worth to a task, split over the
+            // workers, so that their midpoints still go in batches.
+            vector<Facet*>& splitRoots = refineRoots_;
+            splitRoots.clear();
+            for (auto& split : granted)
+                splitRoots.push_back(split.facet);
+            size_t slices = std::max(reshapePool_->threadCount(), size_t(1));
+            for (size_t begin = 0; begin < granted.size();) {
+                size_t level = granted[begin].level;
+                size_t end = begin;
+                while (end < granted.size() && granted[end].level == level)
+                    ++end;
+                size_t slice = (end - begin + slices - 1) / slices;
+                for (; begin < end; begin += slice) {
+                    Facet* const* roots = &splitRoots[begin];
+                    size_t count = std::min(slice, end - begin);
+                    if (!spawnReshape(group, level, roots, count))
+                        reshapeSubtree(level, roots, count, viewPosition, frustum);
+                }
+            }
+        }
+        reshapePool_->wait(group);
+        forceReshape_ = false;
+        ++refineCounts_.passes;
+        if (!granted.empty()) {
+            double perSplit = millisSince(passStart) / double(granted.size());
+            splitMillis_ = splitMillis_ > 0.0 ? (splitMillis_ + perSplit) / 2.0 : perSplit;
+        }
+        if (refineCandidates_.empty() && !triangleBudget_)
+            break;
+
+        size_t most = std::min(splitsLeft, refineCandidates_.size());
+        if (refineMillis_ > 0.0 && splitMillis_ > 0.0) {
+            double left = std::max(0.0, refineMillis_ - millisSince(start));
+            size_t affordable = size_t(left / splitMillis_);
+            if (reshapePass_ == 0)
+                affordable = std::max(affordable, MinRefineSplits);
+            most = std::min(most, affordable);
+        }
+        if (triangleBudget_) {
+            tradeTriangles(most, granted);
+        } else {
+            // Ties are rare, but sort them by level too, so that the tree
+            // does not depend on the order the tasks finished in.
+            sort(refineCandidates_.begin(), refineCandidates_.end(),
+                 [](const RefineCandidate& a, const RefineCandidate& b) {
+                return a.importance != b.importance ? a.importance > b.importance
+                                                    : a.level < b.level;
+            });
+            granted.assign(refineCandidates_.begin(), refineCandidates_.begin() + most);
+            refineCandidates_.erase(refineCandidates_.begin(),
+                                    refineCandidates_.begin() + most);
+            refineCounts_.deferred = refineCandidates_.size();
+        }
+        size_t grant = granted.size();
+        stable_sort(granted.begin(), granted.end(),
+                    [](const RefineCandidate& a, const RefineCandidate& b) {
+            return a.level < b.level;
+        });
+        for (auto& split : granted) {
+            if (ensureChildren(split.level, *split.facet))
+                noteBalanceChange(*split.facet);
+        }
+        splitsLeft -= grant;
+        refineCounts_.splits += grant;
+        if (grant == 0)
+            break;
+    }
+    refineCandidates_.clear();
+    if (triangleBudget_)
+        finishTrades();
+    if (engine_ == Engine::Immediate) {
+        balanceTree();
+    } else {
+        // Nothing to stitch, so when we come back it is to an unbalanced
+        // tree.
+        lock_guard<mutex> guard(balanceLock_);
+        balanceChanges_.clear();
+        balanceEverywhere_ = true;
+    }
+    size_t queryNodes = 0;
+    double queryMillis = 0.0;
+    if (treeChanges_ != publishedChanges_ || queryTree()->refineLevels != lodBias()) {
+        auto queryStart = chrono::steady_clock::now();
+        queryNodes = publishQueryTree();
+        queryMillis = millisSince(queryStart);
+    }
+
+    reshapeStats_ = Stats();
+    countFacets(reshapeStats_);
+    reshapeStats_.facetsCreated = facetsCreated_.exchange(0);
+    reshapeStats_.facetsDestroyed = facetsDestroyed_.exchange(0);
+    reshapeStats_.heightCalls = heightCalls_.exchange(0);
+    reshapeStats_.kernelHeights = kernelHeights_.exchange(0);
+    reshapeStats_.reshapeMillis = millisSince(start);
+    reshapeStats_.queryNodes = queryNodes;
+    reshapeStats_.queryMillis = queryMillis;
+
+    CullCounts counts{0, 0};
+    for (auto& facet : facets) {
+        counts.frustum += facet.culledFrustum;
+        counts.horizon += facet.culledHorizon;
+    }
+    return counts;
+}
+
+// Trade splits for merges, after ROAM: split the most important leaves
+// while there is room in the triangle budget, and once it is full, merge
+// the least important parents of four leaves to make room for leaves that
+// matter more than they do. Over budget, say after turning towards more
+// of the planet, we merge first until we fit. Makes at most |most| splits,
+// which go in |granted|; merges are never held back. The merged facets
+// keep their children until finishTrades, so that the pool cannot hand
+// the memory out again while candidates still point at it.
+void
+glit::Terrain::tradeTriangles(size_t most, vector<RefineCandidate>& granted)
+{
+    auto splitOrder = [](const RefineCandidate& a, const RefineCandidate& b) {
+        return a.importance != b.importance ? a.importance < b.importance
+                                            : a.level > b.level;
+    };
+    auto mergeOrder = [](const RefineCandidate& a, const RefineCandidate& b) {
+        return a.importance != b.importance ? a.importance > b.importance
+                                            : a.level < b.level;
+    };
+    make_heap(refineCandidates_.begin(), refineCandidates_.end(), splitOrder);
+    make_heap(mergeCandidates_.begin(), mergeCandidates_.end(), mergeOrder);
+    size_t perLeaf = size_t(1) << (2 * lodBias());
+    size_t budget = triangleBudget_ / perLeaf;
+
+    // Drop merge candidates that stopped being one, and say whether there
+    // is one left that matters less than |importance|.
+    auto cheapestMerge = [&](double importance) {
+        while (!mergeCandidates_.empty()) {
+            const RefineCandidate& merge = mergeCandidates_.front();
+            bool valid = !tradeSplit_.count(merge.facet) && !tradeMerged_.count(merge.facet);
+            Facet* children = childrenOf(*merge.facet);
+            for (size_t i = 0; i < 4 && valid; ++i)
+                valid = !children[i].hasChildren() && !tradeSplit_.count(&children[i]);
+            if (valid)
+                return merge.importance < importance;
+            pop_heap(mergeCandidates_.begin(), mergeCandidates_.end(), mergeOrder);
+            mergeCandidates_.pop_back();
+        }
+        return false;
+    };
+    auto merge = [&]() {
+        pop_heap(mergeCandidates_.begin(), mergeCandidates_.end(), mergeOrder);
+        RefineCandidate merged = mergeCandidates_.back();
+        mergeCandidates_.pop_back();
+        Facet* children = childrenOf(*merged.facet);
+        for (size_t i = 0; i < 4; ++i)
+            tradeDoomed_.insert(&children[i]);
+        tradeMerged_.insert(merged.facet);
+        tradeMerges_.push_back(merged);
+        tradeLeaves_ -= 3;
+        ++refineCounts_.merges;
+    };
+
+    while (tradeLeaves_ > budget && cheapestMerge(numeric_limits<double>::infinity()))
+        merge();
+    granted.clear();
+    while (granted.size() < most && !refineCandidates_.empty()) {
+        const RefineCandidate& split = refineCandidates_.front();
+        if (tradeDoomed_.count(split.facet)) {
+            pop_heap(refineCandidates_.begin(), refineCandidates_.end(), splitOrder);
+            refineCandidates_.pop_back();
+            continue;
+        }
+        if (tradeLeaves_ + 3 > budget) {
+            if (!cheapestMerge(split.importance))
+                break;
+            // Which may have merged away our parent.
+            merge();
+            continue;
+        }
+        tradeSplit_.insert(split.facet);
+        tradeLeaves_ += 3;
+        granted.push_back(split);
+        pop_heap(refineCandidates_.begin(), refineCandidates_.end(), splitOrder);
+        refineCandidates_.pop_back();
+    }
+    refineCounts_.deferred = granted.size() == most ? refineCandidates_.size() : 0;
+}
+
+// Carry out the merges tradeTriangles decided on.
+void
+glit::Terrain::finishTrades()
+{
+    for (auto& merged : tradeMerges_) {
+        if (deleteChildren(merged.level, *merged.facet))
+            noteBalanceChange(*merged.facet);
+        merged.facet->validUntil = travel_;
+        merged.facet->validUntilTurn = turn_;
+    }
+    tradeMerges_.clear();
+    tradeMerged_.clear();
+    tradeDoomed_.clear();
+    tradeSplit_.clear();
+    mergeCandidates_.clear();
+}
+
+// Decide whether |self| should have children in the current view. Also
+// returns the distance the camera can move before the answer could change.
+bool
+glit::Terrain::wantsChildren(size_t level, const Facet& self,
+                             const dvec3& viewPosition, float pixelScale,
+                             double* slack, double* importance) const
+{
+    // Max subdivision is ~1M resolution.
+    size_t lodLevel = level + lodBias();
+    if (lodLevel >= MaxSubdivisions) {
+        *slack = numeric_limits<double>::infinity();
+        *importance = 0.0;
+        return false;
+    }
+
+    // Split if the error we would fix by splitting covers more than
+    // pixelError_ pixels on screen: that is, if the nearest part of us is
+    // closer than lodDistance. A chunk stands in for ChunkDepth more levels,
+    // each of which about halves the error. Which threshold we test against
+    // depends on whether we are currently split, which gives us a band of
+    // hysteresis. Children that are only there to balance the tree do not
+    // count. The instanced engine goes by the typical error for the level
+    // instead; see drawGrid.
+    double dist = std::max(0.0, distance(dvec3(self.center), viewPosition) - self.bound);
+    double error = engine_ == Engine::Instanced
+                 ? double(levelErrorAt(lodLevel))
+                 : ldexp(double(self.error), -int(lodBias()));
+    double lodDistance = error * pixelScale / pixelError_;
+    double splitDistance = lodDistance * (1.0 - SplitHysteresis);
+    double mergeDistance = lodDistance * (1.0 + SplitHysteresis);
+    bool split = self.hasChildren() && !self.forced;
+    bool inRange = dist < (split ? mergeDistance : splitDistance);
+    double rangeSlack = inRange ? mergeDistance - dist : dist - splitDistance;
+
+    // Cull back facing facets. This is the side of the plane through the
+    // planet's center with the facet's normal that we are on.
+    double facing = dot(viewPosition, dvec3(self.normal));
+    bool front = facing >= 0.0;
+    double frontSlack = std::abs(facing);
+
+    // How many times over pixelError_ our error is on screen, give or take
+    // the projection. Within a meter, go by the error alone, so that the
+    // facets around the camera come coarse first. Back facing facets have
+    // none.
+    *importance = front ? lodDistance / std::max(dist, 1.0) : 0.0;
+
+    // If we are split, either test flipping would merge us. If we are not,
+    // all failing tests have to flip before we would split.
+    if (inRange && front) {
+        *slack = std::min(rangeSlack, frontSlack);
+        return true;
+    }
+    *slack = std::max(inRange ? 0.0 : rangeSlack, front ? 0.0 : frontSlack);
+    return false;
+}
+
+// Test whether any of |self|'s subtree could show over the limb of the
+// occluder. Also returns how far the camera can move before the answer
+// could change.
+bool
+glit::Terrain::aboveHorizon(const Facet& self, const dvec3& viewPosition,
+                            double* slack) const
+{
+    double eye = length(viewPosition);
+    double center = length(dvec3(self.center));
+    if (!horizonCulling_ || self.bound >= center) {
+        *slack = numeric_limits<double>::infinity();
+        return true;
+    }
+    if (eye <= occluderRadius_) {
+        *slack = occluderRadius_ - eye;
+        return true;
+    }
+
+    // Seen from the planet's center, the camera's horizon is acos(R / eye)
+    // out from the camera, and a point at height top can see over the limb
+    // up to acos(R / top) further. Our subtree lies within asin(bound /
+    // center) of the direction to our center, at no more than top, so it is
+    // hidden if that direction is further out than the sum of the three.
+    // We add the angles up as cosines and sines to stay clear of the trig
+    // functions, which are most of the cost of the test otherwise.
+    double top = std::max(double(radius_ + self.maxHeight), occluderRadius_);
+    double cosEye = occluderRadius_ / eye;
+    double cosTop = occluderRadius_ / top;
+    double sinSpread = self.bound / center;
+    double sinEye = sqrt(1.0 - cosEye * cosEye);
+    double sinTop = sqrt(1.0 - cosTop * cosTop);
+    double cosSpread = sqrt(1.0 - sinSpread * sinSpread);
+    double cosReach = cosEye * cosTop - sinEye * sinTop;
+    double sinReach = sinEye * cosTop + cosEye * sinTop;
+    double cosLimit = cosReach * cosSpread - sinReach * sinSpread;
+    double sinLimit = sinReach * cosSpread + cosReach * sinSpread;
+    double cosTheta = dot(viewPosition, dvec3(self.center)) / (eye * center);
+
+    // Past half way round, nothing is behind the limb.
+    bool visible = sinLimit < 0.0 || cosTheta >= cosLimit;
+
+    // The difference in cosines is no more than the difference in angles,
+    // and that changes by at most 1 / h per unit moved, where h is the
+    // distance to the horizon. Don't move more than halfway to the occluder,
+    // so that h stays above what it is there.
+    double most = (eye - occluderRadius_) / 2.0;
+    double low = eye - most;
+    double horizon = sqrt(low * low - occluderRadius_ * occluderRadius_);
+    double margin = sinLimit < 0.0 ? numeric_limits<double>::infinity()
+                                   : std::abs(cosTheta - cosLimit);
+    *slack = std::min(most, margin * horizon);
+    return visible;
+}
+
+// Test |self|'s bounding sphere against the frustum, widened by the guard
+// band. Also returns how far the camera can move and turn before the answer
+// could change.
+bool
+glit::Terrain::inFrustum(const Facet& self, const dvec3& viewPosition,
+                         const Camera::Frustum& frustum, Slack* slack) const
+{
+    if (!frustumCulling_) {
+        *slack = Slack{numeric_limits<double>::infinity(),
+                       numeric_limits<double>::infinity()};
+        return true;
+    }
+
+    // Widening by the guard band pushes each plane out by dist * sin(band)
+    // at the sphere. The margin is how far the sphere is inside a plane, or
+    // outside it if negative.
+    dvec3 offset = dvec3(self.center) - viewPosition;
+    double dist = length(offset);
+    double reach = self.bound + dist * sin(double(cullGuardBand_));
+    double inside = numeric_limits<double>::infinity();
+    double outside = 0.0;
+    for (auto& normal : frustum.normals) {
+        double margin = dot(dvec3(normal), offset) + reach;
+        inside = std::min(inside, margin);
+        outside = std::max(outside, -margin);
+    }
+    bool visible = inside >= 0.0;
+    double margin = visible ? inside : outside;
+
+    // Moving by t changes each margin by at most 2t, and turning a normal
+    // by a changes it by at most a times the distance, which moving can
+    // also add to. Splitting the margin evenly between the two keeps the
+    // sum of both effects below it.
+    *slack = Slack{margin / 4.0, (margin / 2.0) / (dist + margin / 4.0)};
+    return visible;
+}
+
+glit::Terrain::AutoReshapeScratch::AutoReshapeScratch(Terrain& terrain)
+  : terrain_(terrain)
+{
+    lock_guard<mutex> lock(terrain_.reshapeScratchLock_);
+    if (terrain_.reshapeScratch_.empty()) {
+        scratch_.reset(new ReshapeScratch);
+        return;
+    }
+    scratch_ = move(terrain_.reshapeScratch_.back());
+    terrain_.reshapeScratch_.pop_back();
+}
+
+glit::Terrain::AutoReshapeScratch::~AutoReshapeScratch()
+{
+    scratch_->visits.clear();
+    scratch_->deferred.clear();
+    scratch_->needMidpoints.clear();
+    scratch_->candidates.clear();
+    scratch_->merges.clear();
+    scratch_->balanceChanges.clear();
+    lock_guard<mutex> lock(terrain_.reshapeScratchLock_);
+    terrain_.reshapeScratch_.push_back(move(scratch_));
+}
+
+// Walk the subtrees under the |count| |roots|, all at |level|, a level at a
+// time, so that all the facets that need midpoints at a level get them
+// displaced in one batch.
+void
+glit::Terrain::reshapeSubtree(size_t level, Facet* const* roots, size_t count,
+                              const dvec3& viewPosition,
+                              const Camera::Frustum& frustum)
+{
+    auto expired = [this](const Facet& facet) {
+        return travel_ >= facet.validUntil || turn_ >= facet.validUntilTurn;
+    };
+
+    // Leave |self| a leaf for now, and come back to it on the next pass.
+    auto revisit = [this](Facet& self) {
+        self.validUntil = travel_;
+        self.validUntilTurn = turn_;
+        self.culledFrustum = 0;
+        self.culledHorizon = 0;
+    };
+    AutoReshapeScratch reshapeScratch(*this);
+    vector<ReshapeVisit>& visits = (*reshapeScratch).visits;
+    vector<ReshapeVisit>& deferred = (*reshapeScratch).deferred;
+    vector<Facet*>& needMidpoints = (*reshapeScratch).needMidpoints;
+    vector<RefineCandidate>& candidates = (*reshapeScratch).candidates;
+    vector<RefineCandidate>& merges = (*reshapeScratch).merges;
+    MidpointScratch& scratch = (*reshapeScratch).midpoints;
+    vector<BalanceChange>& balanceChanges = (*reshapeScratch).balanceChanges;
+    for (size_t i = 0; i < count; ++i)
+        visits.push_back(ReshapeVisit{roots[i], level, Slack{0.0, 0.0}, false, false,
+                                      0.0});
+    size_t leaves = 0;
+
+    // Later passes only need to look at what the ones before them split.
+    // Under a triangle budget, every leaf is a candidate every frame, so
+    // we look at all of them.
+    bool trading = triangleBudget_ > 0;
+    bool incremental = (incrementalReshape_ || reshapePass_ > 0) && !forceReshape_ &&
+                       !trading;
+    bool haveThreads = reshapePool_->threadCount() > 0;
+    bool budgeted = refineBudgeted();
+    ThreadPool::TaskGroup group;
+
+    for (size_t begin = 0; begin < visits.size();) {
+        size_t end = visits.size();
+        needMidpoints.clear();
+        for (size_t v = begin; v < end; ++v) {
+            ReshapeVisit& visit = visits[v];
+            Facet& self = *visit.facet;
+
+            // Nothing in this subtree can have changed since we last looked.
+            if (incremental && !expired(self))
+                continue;
+
+            // Anything we cannot see stays as coarse as it gets, for as long
+            // as we cannot see it.
+            double slack;
+            Facet::Cull wasCulled = self.culled;
+            self.culled = Facet::Cull::None;
+            if (!aboveHorizon(self, viewPosition, &slack)) {
+                self.culled = Facet::Cull::Horizon;
+                visit.slack = Slack{slack, numeric_limits<double>::infinity()};
+            } else if (!inFrustum(self, viewPosition, frustum, &visit.slack)) {
+                self.culled = Facet::Cull::Frustum;
+                visit.slack.travel = std::min(visit.slack.travel, slack);
+            } else {
+                visit.slack.travel = std::min(visit.slack.travel, slack);
+                visit.visible = true;
+                if (wasCulled != Facet::Cull::None)
+                    balanceChanges.push_back(BalanceChange{self.center, self.bound});
+            }
+            if (!visit.visible) {
+                if (deleteChildren(visit.level, self))
+                    balanceChanges.push_back(BalanceChange{self.center, self.bound});
+                self.validUntil = travel_ + visit.slack.travel;
+                self.validUntilTurn = turn_ + visit.slack.turn;
+                self.culledFrustum = self.culled == Facet::Cull::Frustum;
+                self.culledHorizon = self.culled == Facet::Cull::Horizon;
+                continue;
+            }
+
+            // We need our midpoints to know how much splitting would fix.
+            if (!self.haveMidpoints)
+                needMidpoints.push_back(&self);
+        }
+        findMidpoints(visits[begin].level, needMidpoints, scratch);
+
+        for (size_t v = begin; v < end; ++v) {
+            // A copy, since we append to visits below.
+            ReshapeVisit visit = visits[v];
+            if (!visit.visible)
+                continue;
+            Facet& self = *visit.facet;
+
+            // Still waiting on a tile for our midpoints, so we stay a leaf
+            // for now and look again next frame.
+            if (!self.haveMidpoints) {
+                self.forced = false;
+                revisit(self);
+                continue;
+            }
+            double slack;
+            double importance;
+            visit.split = wantsChildren(visit.level, self, viewPosition,
+                                        frustum.pixelScale, &slack, &importance);
+            visit.slack.travel = std::min(visit.slack.travel, slack);
+            visit.importance = importance;
+
+            // Under a triangle budget, tradeTriangles decides rather than
+            // the distance, so we stay as we are and bid for a split.
+            if (trading) {
+                visit.split = self.hasChildren() && !self.forced;
+                if (!visit.split && importance > 0.0)
+                    candidates.push_back(RefineCandidate{&self, visit.level, importance});
+                if (!visit.split && reshapePass_ == 0)
+                    ++leaves;
+            }
+            visits[v] = visit;
+            self.forced = false;
+            if (!visit.split) {
+                if (deleteChildren(visit.level, self))
+                    balanceChanges.push_back(BalanceChange{self.center, self.bound});
+                self.validUntil = travel_ + visit.slack.travel;
+                self.validUntilTurn = turn_ + visit.slack.turn;
+                self.culledFrustum = 0;
+                self.culledHorizon = 0;
+                continue;
+            }
+
+            // New splits wait for reshape to hand out the budget.
+            if (budgeted && !self.hasChildren()) {
+                candidates.push_back(RefineCandidate{&self, visit.level, importance});
+                visits[v].split = false;
+                revisit(self);
+                continue;
+            }
+            if (ensureChildren(visit.level, self))
+                balanceChanges.push_back(BalanceChange{self.center, self.bound});
+
+            // Hand the top of the tree out to the other workers.
+            bool spawn = visit.level < parallelSplitDepth_ && haveThreads;
+            Facet* children = childrenOf(self);
+            for (size_t i = 0; i < 4; ++i) {
+                ReshapeVisit child{&children[i], visit.level + 1, Slack{0.0, 0.0},
+                                   false, false, 0.0};
+                if (!spawn)
+                    visits.push_back(child);
+                else if (!incremental || expired(children[i]))
+                    deferred.push_back(child);
+            }
+        }
+        begin = end;
+
+        // Below the split depth, all the work near the camera is in a few
+        // subtrees, so whenever a worker is idle we hand it the back half
+        // of our next level. Anything smaller than a grain is not worth a
+        // task, and would split up the midpoint batches.
+        size_t frontier = visits.size() - begin;
+        if (haveThreads && frontier >= 2 * ParallelGrain && reshapePool_->wantsTasks()) {
+            size_t keep = begin + frontier / 2;
+            size_t nextLevel = visits[begin].level;
+            // needMidpoints is done with until the next level; spawnReshape
+            // copies the facets out.
+            vector<Facet*>& handoff = needMidpoints;
+            handoff.clear();
+            for (size_t v = keep; v < visits.size(); ++v)
+                handoff.push_back(visits[v].facet);
+            if (spawnReshape(group, nextLevel, handoff.data(), handoff.size()))
+                visits.resize(keep);
+        }
+    }
+
+    for (auto& child : deferred) {
+        if (!spawnReshape(group, child.level, &child.facet, 1))
+            reshapeSubtree(child.level, &child.facet, 1, viewPosition, frustum);
+    }
+    reshapePool_->wait(group);
+
+    // Children come after their parents, so walking backwards sees every
+    // subtree finished before it folds into its parent.
+    for (size_t v = visits.size(); v > 0; --v) {
+        const ReshapeVisit& visit = visits[v - 1];
+        if (!visit.split)
+            continue;
+        Facet& self = *visit.facet;
+        Facet* children = childrenOf(self);
+        double validUntil = travel_ + visit.slack.travel;
+        double validUntilTurn = turn_ + visit.slack.turn;
+        float maxHeight = children[0].maxHeight;
+        bool leafChildren = true;
+        self.culledFrustum = 0;
+        self.culledHorizon = 0;
+        for (size_t i = 0; i < 4; ++i) {
+            validUntil = std::min(validUntil, children[i].validUntil);
+            validUntilTurn = std::min(validUntilTurn, children[i].validUntilTurn);
+            maxHeight = std::max(maxHeight, children[i].maxHeight);
+            self.culledFrustum += children[i].culledFrustum;
+            self.culledHorizon += children[i].culledHorizon;
+            leafChildren = leafChildren && !children[i].hasChildren();
+        }
+        if (trading && leafChildren)
+            merges.push_back(RefineCandidate{&self, visit.level, visit.importance});
+
+        // Our horizon test above used the looser bound, so look again.
+        if (maxHeight < self.maxHeight) {
+            self.maxHeight = maxHeight;
+            validUntil = travel_;
+        }
+        self.validUntil = validUntil;
+        self.validUntilTurn = validUntilTurn;
+    }
+
+    if (!candidates.empty() || !merges.empty() || leaves) {
+        lock_guard<mutex> lock(refineLock_);
+        refineCandidates_.insert(refineCandidates_.end(),
+                                 candidates.begin(), candidates.end());
+        mergeCandidates_.insert(mergeCandidates_.end(), merges.begin(), merges.end());
+        tradeLeaves_ += leaves;
+    }
+    if (!balanceChanges.empty()) {
+        lock_guard<mutex> guard(balanceLock_);
+        balanceChanges_.insert(balanceChanges_.end(),
+                               balanceChanges.begin(), balanceChanges.end());
+        queryChanges_.insert(queryChanges_.end(),
+                             balanceChanges.begin(), balanceChanges.end());
+    }
+}
+
+// Find the midpoints of all of |facets|, which are at |level|, and how far
+// each facet is from them. Take any that our neighbours have already found,
+// and only compute the rest once, even where siblings share them.
+void
+glit::Terrain::findMidpoints(size_t level, const vector<Facet*>& facets,
+                             MidpointScratch& scratch)
+{
+    if (facets.empty())
+        return;
+
+    // Everything at one level gets the same octaves. With tiles, the
+    // octaves are baked into them, so where they run out we interpolate.
+    size_t first = detailBegin(level);
+    size_t last = tiles_ ? first : detailEnd(level);
+    bool validate = validateHeights_ && !tiles_;
+    MidpointBatch& batch = scratch.batch;
+    MidpointBatch& check = scratch.check;
+    batch.clear();
+    check.clear();
+    scratch.slots.clear();
+    scratch.pending.clear();
+    scratch.sampled.clear();
+    TileStreamer::TileRef hint;
+    for (Facet* facet : facets) {
+        bool missing = false;
+        for (size_t e = 0; e < 3; ++e) {
+            EdgeKey key = edgeKey(*facet, e);
+            facet->childVerts[e] = findMidpoint(key);
+            if (facet->childVerts[e]) {
+                scratch.slots.push_back(NoSlot);
+                continue;
+            }
+            if (const size_t* found = scratch.pending.find(key)) {
+                scratch.slots.push_back(*found);
+                continue;
+            }
+            const Facet::CPUVertex& a = key.a->vertex;
+            const Facet::CPUVertex& b = key.b->vertex;
+            Facet::CPUVertex vertex;
+            TileSample from = TileSample::Beyond;
+            if (tiles_) {
+                from = tileVertex(normalize(a.position + b.position), level + 1,
+                                  hint, vertex);
+            }
+            if (from == TileSample::Missing) {
+                missing = true;
+                scratch.slots.push_back(NoSlot);
+                continue;
+            }
+            scratch.pending.insert(key, batch.size());
+            if (from == TileSample::Sampled)
+                scratch.sampled.emplace_back(batch.size(), vertex);
+            scratch.slots.push_back(batch.push(a.position, b.position,
+                                               coarseHeight(a, first),
+                                               coarseHeight(b, first)));
+            if (validate)
+                check.push(a.position, b.position);
+        }
+
+        // Without all three we cannot tell how much splitting would fix, so
+        // let go of what we have and wait for the tile; see reshapeSubtree.
+        if (missing) {
+            size_t slot = scratch.slots.size() - 3;
+            for (size_t e = 0; e < 3; ++e, ++slot) {
+                // The pool may hand the midpoint to another edge once we let
+                // go of it.
+                if (facet->childVerts[e]) {
+                    releaseMidpoint(edgeKey(*facet, e));
+                    facet->childVerts[e] = nullptr;
+                }
+                scratch.slots[slot] = DeferredSlot;
+            }
+        }
+    }
+    heightKernel_.displace(batch, first, last);
+    kernelHeights_ += batch.size();
+    if (validate && !batch.empty())
+        checkHeights(batch, check, last);
+    scratch.vertices.resize(batch.size());
+    for (size_t i = 0; i < batch.size(); ++i)
+        scratch.vertices[i] = midpointVertex(batch, i, first, last);
+    for (auto& sampled : scratch.sampled)
+        scratch.vertices[sampled.first] = sampled.second;
+
+    size_t next = 0;
+    for (Facet* facet : facets) {
+        if (scratch.slots[next] == DeferredSlot) {
+            next += 3;
+            continue;
+        }
+        for (size_t e = 0; e < 3; ++e) {
+            size_t slot = scratch.slots[next++];
+            if (slot != NoSlot) {
+                facet->childVerts[e] = addMidpoint(edgeKey(*facet, e),
+                                                   scratch.vertices[slot]);
+            }
+        }
+        facet->error = midpointError(*facet);
+        facet->haveMidpoints = true;
+    }
+}
+
+// How far |facet|'s midpoints stray from its plane, which is the error in
+// not splitting it.
+/* static */ float
+glit::Terrain::midpointError(const Facet& facet)
+{
+    float error = 0.f;
+    for (size_t e = 0; e < 3; ++e) {
+        vec3 offset = facet.childVerts[e]->vertex.position -
+                      facet.verts[0]->vertex.position;
+        error = std::max(error, std::abs(dot(offset, facet.normal)));
+    }
+    return error;
+}
+
+// The edge between |a| and |b|, with its ends in the order that we compute
+// its midpoint from.
+/* static */ glit::Terrain::EdgeKey
+glit::Terrain::edgeKey(const Facet::VertexAndIndex* a,
+                       const Facet::VertexAndIndex* b)
+{
+    const vec3& pa = a->vertex.position;
+    const vec3& pb = b->vertex.position;
+    if (pb.x < pa.x || (pb.x == pa.x && (pb.y < pa.y || (pb.y == pa.y && pb.z < pa.z))))
+        std::swap(a, b);
+    return EdgeKey{a, b};
+}
+
+// The edge opposite vert |edge|.
+/* static */ glit::Terrain::EdgeKey
+glit::Terrain::edgeKey(const Facet& facet, size_t edge)
+{
+    return edgeKey(facet.verts[edge == 0 ? 1 : 0], facet.verts[edge == 2 ? 1 : 2]);
+}
+
+// Takes a reference to the midpoint if we have it.
+glit::Terrain::Facet::VertexAndIndex*
+glit::Terrain::findMidpoint(const EdgeKey& key)
+{
+    MidpointShard& shard = midpointShards_[shardOf(key)];
+    lock_guard<mutex> guard(shard.lock);
+    MidpointPool::Handle* found = shard.midpoints.find(key);
+    if (!found)
+        return nullptr;
+    SharedMidpoint& midpoint = *midpointPool_.block(*found);
+    ++midpoint.refs;
+    return &midpoint.vertex;
+}
+
+// Takes a reference to the midpoint, adding it if no one else got there
+// first.
+glit::Terrain::Facet::VertexAndIndex*
+glit::Terrain::addMidpoint(const EdgeKey& key, const Facet::CPUVertex& vertex)
+{
+    size_t index = shardOf(key);
+    MidpointShard& shard = midpointShards_[index];
+    lock_guard<mutex> guard(shard.lock);
+    auto inserted = shard.midpoints.insert(key, MidpointPool::InvalidHandle);
+    if (inserted.second) {
+        *inserted.first = midpointPool_.allocate(index);
+        *midpointPool_.block(*inserted.first) =
+            SharedMidpoint{Facet::VertexAndIndex{vertex, 0, 0}, 0, 0};
+    }
+    SharedMidpoint& midpoint = *midpointPool_.block(*inserted.first);
+    ++midpoint.refs;
+    return &midpoint.vertex;
+}
+
+void
+glit::Terrain::releaseMidpoint(const EdgeKey& key)
+{
+    size_t index = shardOf(key);
+    MidpointShard& shard = midpointShards_[index];
+    lock_guard<mutex> guard(shard.lock);
+    MidpointPool::Handle handle = *shard.midpoints.find(key);
+    if (--midpointPool_.block(handle)->refs == 0) {
+        shard.midpoints.erase(key);
+        midpointPool_.release(index, handle);
+    }
+}
+
+void
+glit::Terrain::releaseMidpoints(Facet& facet)
+{
+    if (!facet.haveMidpoints)
+        return;
+    for (size_t e = 0; e < 3; ++e)
+        releaseMidpoint(edgeKey(facet, e));
+    facet.haveMidpoints = false;
+}
+
+// Count |facet| in or out of the splits of its edges.
+void
+glit::Terrain::countSplit(const Facet& facet, int delta)
+{
+    for (size_t e = 0; e < 3; ++e) {
+        EdgeKey key = edgeKey(facet, e);
+        MidpointShard& shard = midpointShards_[shardOf(key)];
+        lock_guard<mutex> guard(shard.lock);
+        midpointPool_.block(*shard.midpoints.find(key))->splits += delta;
+    }
+}
+
+void
+glit::Terrain::setTileSource(const string& path, size_t budget)
+{
+    waitForPipeline();
+    unique_ptr<TileStreamer> tiles;
+    if (!path.empty()) {
+        unique_ptr<TilePyramid> pyramid = TilePyramid::open(path);
+        if (!pyramid)
+            throw runtime_error("no tile pyramid at: " + path);
+        if (pyramid->radius() != radius_)
+            throw runtime_error("tile pyramid is for another radius: " + path);
+        tiles.reset(new TileStreamer(move(pyramid), TileStreamer::DefaultThreads,
+                                     budget));
+    }
+
+    // Everything below the roots came from the old heights.
+    for (auto& facet : facets) {
+        deleteChildren(0, facet);
+        releaseMidpoints(facet);
+    }
+    tiles_ = move(tiles);
+    initRoots();
+    forceReshape_ = true;
+
+    // Nor may we draw any stage built from them, since the chunk cache
+    // would hang on to it. The orbit meshes are built from them too.
+    chunkCache_.reset();
+    orbitMeshes_.clear();
+
+    // See setEngine.
+    if (tiles_ && engine_ == Engine::Instanced)
+        engine_ = Engine::Chunked;
+    lock_guard<mutex> guard(pipelineLock_);
+    backState_ = StageState::Idle;
+    haveFrontStage_ = false;
+}
+
+void
+glit::Terrain::setViewVelocity(const dvec3& velocity, double maxSpeed)
+{
+    viewVelocity_ = velocity;
+    maxViewSpeed_ = maxSpeed;
+}
+
+// The vert at |unit| and |level| of the tree, from the tiles. Leaves |out|
+// alone where the pyramid stops short of |level|.
+glit::Terrain::TileSample
+glit::Terrain::tileVertex(const vec3& unit, size_t level,
+                          TileStreamer::TileRef& hint,
+                          Facet::CPUVertex& out) const
+{
+    size_t wanted = tileLevel(level);
+    bool complete = true;
+    if (!hint || !(hint->level == wanted || (hint->leaf && hint->level < wanted)) ||
+        !TilePyramid::covers(hint->corners, unit))
+    {
+        hint = tiles_->find(unit, wanted, &complete);
+    }
+    if (complete && hint->level < wanted)
+        return TileSample::Beyond;
+
+    TilePyramid::Sample sample = TilePyramid::sample(
+            hint->data, tiles_->pyramid().depth(), hint->corners, unit);
+    out.position = unit * (radius_ + sample.height);
+    out.height = sample.height;
+    out.coarse = sample.height;
+    out.detailBegin = 0;
+    out.detailEnd = 0;
+    return complete ? TileSample::Sampled : TileSample::Missing;
+}
+
+// How far the tiles under |facet|, at |level|, rise above its lowest
+// corner. The noise's bounds say nothing about the tiles', so we add this
+// to them. Coarse tiles are filtered, so finer ones can poke a little above
+// this; the facets below get their own relief from those.
+float
+glit::Terrain::tileRelief(size_t level, const Facet& facet) const
+{
+    bool complete;
+    vec3 unit = normalize(facet.center);
+    TileStreamer::TileRef tile = tiles_->find(unit, tileLevel(level), &complete);
+    size_t depth = tiles_->pyramid().depth();
+
+    // Past the finest samples, everything below us is interpolated from
+    // our corners, so it cannot rise above them.
+    if (complete && tile->leaf && level >= tile->level + depth)
+        return 0.f;
+    float highest = TilePyramid::maxHeight(tile->data, depth, tile->corners, unit,
+                                           level - tile->level);
+    float lowest = std::min(facet.verts[0]->vertex.height,
+                            std::min(facet.verts[1]->vertex.height,
+                                     facet.verts[2]->vertex.height));
+    return std::max(0.f, highest - lowest);
+}
+
+bool
+glit::Terrain::ensureChildren(size_t level, Facet& self)
+{
+    if (self.hasChildren())
+        return false;
+
+    self.children = facetPool.allocate(level);
+    Facet* children = childrenOf(self);
+    float bulge = bulgeAt(level + 1);
+    float rise = riseAt(level + 1);
+    if (tiles_) {
+        float relief = tileRelief(level, self);
+        bulge += relief;
+        rise += relief;
+    }
+    children[0].init(self.verts[0],
+                     self.childVerts[2],
+                     self.childVerts[1], bulge, rise);
+    children[1].init(self.childVerts[0],
+                     self.childVerts[1],
+                     self.childVerts[2], bulge, rise);
+    children[2].init(self.childVerts[2],
+                     self.verts[1],
+                     self.childVerts[0], bulge, rise);
+    children[3].init(self.childVerts[1],
+                     self.childVerts[0],
+                     self.verts[2], bulge, rise);
+    countSplit(self, 1);
+    ++treeChanges_;
+    facetsCreated_ += 4;
+    return true;
+}
+
+// Slots 0-2 are the leaf's verts, 3-5 the midpoints of the edges opposite
+// them. Where two edges are split, we cut off the corner between them and
+// fan the rest from the third corner.
+const glit::Terrain::StitchPattern glit::Terrain::StitchPatterns[8] = {
+    {1, {{0, 1, 2}}},
+    {2, {{0, 1, 3}, {0, 3, 2}}},
+    {2, {{0, 1, 4}, {1, 2, 4}}},
+    {3, {{4, 3, 2}, {0, 1, 3}, {0, 3, 4}}},
+    {2, {{0, 5, 2}, {5, 1, 2}}},
+    {3, {{5, 1, 3}, {0, 5, 3}, {0, 3, 2}}},
+    {3, {{0, 5, 4}, {5, 1, 4}, {1, 2, 4}}},
+    {4, {{0, 5, 4}, {3, 4, 5}, {5, 1, 3}, {4, 3, 2}}},
+};
+
+// The midpoint of |key| if a facet along it has split. This does not lock,
+// so only call it while reshape is not running.
+glit::Terrain::Facet::VertexAndIndex*
+glit::Terrain::splitMidpoint(const EdgeKey& key) const
+{
+    MidpointShard& shard = midpointShards_[shardOf(key)];
+    MidpointPool::Handle* found = shard.midpoints.find(key);
+    if (!found)
+        return nullptr;
+    SharedMidpoint& midpoint = *midpointPool_.block(*found);
+    if (midpoint.splits == 0)
+        return nullptr;
+    return &midpoint.vertex;
+}
+
+// Fill in the slots of |leaf| and return how to draw it. A leaf has not
+// split, so any split along its edges is the neighbour's.
+const glit::Terrain::StitchPattern&
+glit::Terrain::stitchLeaf(const Facet& leaf, Facet::VertexAndIndex* slots[6]) const
+{
+    size_t mask = 0;
+    for (size_t e = 0; e < 3; ++e) {
+        slots[e] = leaf.verts[e];
+        slots[3 + e] = splitMidpoint(edgeKey(leaf, e));
+        mask |= size_t(slots[3 + e] != nullptr) << e;
+    }
+    return StitchPatterns[mask];
+}
+
+// Whether the neighbour across any edge of |leaf| has split more than once
+// along it, which the stitch patterns cannot join.
+bool
+glit::Terrain::needsBalance(const Facet& leaf) const
+{
+    for (size_t e = 0; e < 3; ++e) {
+        EdgeKey key = edgeKey(leaf, e);
+        Facet::VertexAndIndex* mid = splitMidpoint(key);
+        if (mid && (splitMidpoint(edgeKey(key.a, mid)) ||
+                    splitMidpoint(edgeKey(mid, key.b))))
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Split every visible leaf that is more than a level coarser than one of its
+// neighbours. Splitting a leaf can do the same to a coarser one next to it,
+// so we go a level at a time from the bottom, and go round again in case
+// the new leaves themselves need splitting. Reshape does not look at the
+// facets we split again until they expire, so we also merge any that no
+// longer need it; that way we end up with the same tree whether reshape is
+// incremental or not. Each round only looks at the leaves and forced
+// splits that touch what changed since the last; see BalanceChange.
+void
+glit::Terrain::balanceTree()
+{
+    auto& stack = balanceStack_;
+    auto& near = balanceNear_;
+    auto& candidates = balanceCandidates_;
+    auto& forced = balanceForced_;
+    auto& needMidpoints = balanceNeedMidpoints_;
+    auto& round = balanceRound_;
+
+    // One walk over the tree, into the subtrees that touch a change. Each
+    // visit carries the changes that touch its parent, in |near|, and
+    // passes on to its children the ones that touch it.
+    auto gather = [&](bool everywhere) {
+        near.clear();
+        if (!everywhere) {
+            for (uint32_t i = 0; i < round.size(); ++i)
+                near.push_back(i);
+        }
+        for (size_t i = 20; i > 0; --i)
+            stack.push_back(BalanceVisit{0, &facets[i - 1], 0, uint32_t(near.size())});
+        while (!stack.empty()) {
+            BalanceVisit visit = stack.back();
+            stack.pop_back();
+            Facet& facet = *visit.facet;
+            if (!everywhere) {
+                uint32_t begin = uint32_t(near.size());
+                for (uint32_t i = visit.begin; i < visit.end; ++i) {
+                    if (touches(facet, round[near[i]]))
+                        near.push_back(near[i]);
+                }
+                if (begin == near.size())
+                    continue;
+                visit.begin = begin;
+                visit.end = uint32_t(near.size());
+            }
+            if (facet.hasChildren()) {
+                Facet* children = childrenOf(facet);
+                for (size_t i = 4; i > 0; --i) {
+                    stack.push_back(BalanceVisit{visit.level + 1, &children[i - 1],
+                                                 visit.begin, visit.end});
+                }
+            } else if (facet.culled == Facet::Cull::None) {
+                candidates.emplace_back(visit.level, &facet);
+            }
+            if (facet.forced)
+                candidates.emplace_back(visit.level, &facet);
+        }
+    };
+
+    {
+        lock_guard<mutex> guard(balanceLock_);
+        balanceChanges_.insert(balanceChanges_.end(),
+                               balanceRetry_.begin(), balanceRetry_.end());
+    }
+    balanceRetry_.clear();
+    for (bool changed = true; changed;) {
+        changed = false;
+        {
+            lock_guard<mutex> guard(balanceLock_);
+            round.swap(balanceChanges_);
+            balanceChanges_.clear();
+        }
+        if (round.empty() && !balanceEverywhere_)
+            break;
+        if (round.size() > MaxBalanceChanges)
+            balanceEverywhere_ = true;
+        candidates.clear();
+        gather(balanceEverywhere_);
+        balanceEverywhere_ = false;
+        stable_sort(candidates.begin(), candidates.end(),
+                    [](const pair<size_t, Facet*>& a, const pair<size_t, Facet*>& b) {
+                        return a.first > b.first;
+                    });
+
+        for (size_t begin = 0; begin < candidates.size();) {
+            size_t level = candidates[begin].first;
+            size_t end = begin;
+            forced.clear();
+            needMidpoints.clear();
+            for (; end < candidates.size() && candidates[end].first == level; ++end) {
+                Facet* leaf = candidates[end].second;
+                if (leaf->forced) {
+                    // Our children have to be candidates for the test to only
+                    // see the neighbours' splits.
+                    Facet* children = childrenOf(*leaf);
+                    bool leafChildren = true;
+                    for (size_t i = 0; i < 4; ++i)
+                        leafChildren = leafChildren && !children[i].hasChildren();
+                    if (leafChildren && !needsBalance(*leaf) && deleteChildren(level, *leaf))
+                        noteBalanceChange(*leaf);
+                    continue;
+                }
+                if (!needsBalance(*leaf))
+                    continue;
+                forced.push_back(leaf);
+                if (!leaf->haveMidpoints)
+                    needMidpoints.push_back(leaf);
+            }
+            findMidpoints(level, needMidpoints, balanceScratch_);
+            for (Facet* leaf : forced) {
+                // Waiting on a tile; we look again next frame.
+                if (!leaf->haveMidpoints) {
+                    balanceRetry_.push_back(BalanceChange{leaf->center, leaf->bound});
+                    continue;
+                }
+                ensureChildren(level, *leaf);
+                noteBalanceChange(*leaf);
+                leaf->forced = true;
+                changed = true;
+            }
+            begin = end;
+        }
+    }
+}
+
+void
+glit::Terrain::noteBalanceChange(const Facet& facet)
+{
+    lock_guard<mutex> guard(balanceLock_);
+    balanceChanges_.push_back(BalanceChange{facet.center, facet.bound});
+    queryChanges_.push_back(BalanceChange{facet.center, facet.bound});
+}
+
+// Spheres round neighbouring facets touch at their shared corners, or
+// would but for float positions at planet radius.
+/* static */ bool
+glit::Terrain::touches(const Facet& facet, const BalanceChange& change)
+{
+    constexpr float Slack = 4.f;
+    return distance(facet.center, change.center) <= facet.bound + change.bound + Slack;
+}
+
+/* static */ glit::Terrain::Facet::GPUVertex
+glit::Terrain::Facet::GPUVertex::encode(const vec3& offset, const vec3& normal)
+{
+    vec2 e = util::octahedralEncode(normal);
+    return GPUVertex{
+        i16vec3(round(clamp(offset, -1.f, 1.f) * 32767.f)),
+        i8vec2(round(clamp(e, -1.f, 1.f) * 127.f))};
+}
+
+uint32_t
+glit::Terrain::pushVertex(Facet::VertexAndIndex* insert,
+                          const Facet& owner,
+                          const MeshBatch& batch,
+                          vector<Facet::GPUVertex>& verts) const
+{
+    if (insert->stamp == uploadStamp_)
+        return insert->index;
+    insert->stamp = uploadStamp_;
+    insert->index = verts.size();
+    vec3 offset((dvec3(insert->vertex.position) - batch.origin) / double(batch.scale));
+    verts.push_back(Facet::GPUVertex::encode(offset, owner.normal));
+    return insert->index;
+}
+
+bool
+glit::Terrain::beginBatch(const Facet& facet, const dvec3& viewPosition,
+                          vector<MeshBatch>& batches,
+                          const vector<Facet::GPUVertex>& verts,
+                          const vector<uint32_t>& indices)
+{
+    if (facet.hasChildren()) {
+        // Nothing in the subtree is nearer than its sphere, or than the
+        // camera is to the highest it reaches, whichever is further.
+        double dist = std::max(distance(dvec3(facet.center), viewPosition) - facet.bound,
+                               length(viewPosition) - radius_ - facet.maxHeight);
+        dist = std::max(0.0, dist);
+        double step = double(facet.bound) / 32767.0;
+        if (step * lastFrustum_.pixelScale > QuantizationPixels * dist)
+            return false;
+    }
+
+    // A fresh stamp, so that verts we already emitted for another batch
+    // get emitted again for this one.
+    ++uploadStamp_;
+    MeshBatch batch;
+    batch.origin = dvec3(facet.center);
+    batch.scale = facet.bound;
+    batch.firstVertex = uint32_t(verts.size());
+    batch.vertexCount = 0;
+    batch.firstIndex = uint32_t(indices.size());
+    batch.indexCount = 0;
+    batches.push_back(batch);
+    return true;
+}
+
+// A leaf adds at most 6 verts. If that could take the open batch past
+// what 16 bit indices can reach, carry on in a new batch with the same
+// origin and scale.
+void
+glit::Terrain::continueBatchIfFull(vector<MeshBatch>& batches,
+                                   const vector<Facet::GPUVertex>& verts,
+                                   const vector<uint32_t>& indices)
+{
+    if (verts.size() + 6 - batches.back().firstVertex <= MaxBatchVerts)
+        return;
+    MeshBatch next = batches.back();
+    endBatch(batches, verts, indices);
+    ++uploadStamp_;
+    next.firstVertex = uint32_t(verts.size());
+    next.vertexCount = 0;
+    next.firstIndex = uint32_t(indices.size());
+    next.indexCount = 0;
+    batches.push_back(next);
+}
+
+/* static */ void
+glit::Terrain::endBatch(vector<MeshBatch>& batches,
+                        const vector<Facet::GPUVertex>& verts,
+                        const vector<uint32_t>& indices)
+{
+    MeshBatch& batch = batches.back();
+    batch.vertexCount = uint32_t(verts.size() - batch.firstVertex);
+    batch.indexCount = uint32_t(indices.size() - batch.firstIndex);
+    if (batch.indexCount == 0)
+        batches.pop_back();
+}
+
+void
+glit::Terrain::drawSubtreeTriangles(const dvec3& viewPosition,
+                                    vector<MeshBatch>& batches,
+                                    vector<Facet::GPUVertex>& verts,
+                                    vector<uint32_t>& indices)
+{
+    size_t firstBatch = batches.size();
+    for (size_t i = 0; i < 20; ++i)
+        drawSubtreeTrianglesN(facets[i], 0, 1, false, viewPosition, batches, verts, indices);
+    if (triangleOrder_ != TriangleOrder::Forsyth)
+        return;
+
+    for (size_t k = firstBatch; k < batches.size(); ++k) {
+        const MeshBatch& batch = batches[k];
+        vertexCache_.optimize(&indices[batch.firstIndex], batch.indexCount,
+                              batch.firstVertex, batch.vertexCount);
+    }
+}
+
+void
+glit::Terrain::drawSubtreeTrianglesN(const Facet& facet, size_t entry, size_t exit,
+                                     bool inBatch, const dvec3& viewPosition,
+                                     vector<MeshBatch>& batches,
+                                     vector<Facet::GPUVertex>& verts,
+                                     vector<uint32_t>& indices)
+{
+    if (!facet.hasChildren() && facet.culled != Facet::Cull::None)
+        return;
+    bool opened = !inBatch && beginBatch(facet, viewPosition, batches, verts, indices);
+    inBatch = inBatch || opened;
+
+    if (facet.hasChildren()) {
+        const Facet* children = childrenOf(facet);
+        if (triangleOrder_ == TriangleOrder::Tree) {
+            for (size_t i = 0; i < 4; ++i) {
+                drawSubtreeTrianglesN(children[i], 0, 1, inBatch,
+                                      viewPosition, batches, verts, indices);
+            }
+        } else {
+            // See ensureChildren: the child at our corner c has c at index
+            // c, and the midpoint of our edge from c to j at index j. The
+            // middle child has each midpoint at the index of the vert
+            // opposite. So we go corner, corner, middle, corner, with the
+            // curve leaving each child where the next one enters.
+            static const size_t CornerChild[3] = {0, 2, 3};
+            size_t other = 3 - entry - exit;
+            drawSubtreeTrianglesN(children[CornerChild[entry]], entry, other, inBatch,
+                                  viewPosition, batches, verts, indices);
+            drawSubtreeTrianglesN(children[CornerChild[other]], entry, exit, inBatch,
+                                  viewPosition, batches, verts, indices);
+            drawSubtreeTrianglesN(children[1], entry, other, inBatch,
+                                  viewPosition, batches, verts, indices);
+            drawSubtreeTrianglesN(children[CornerChild[exit]], entry, exit, inBatch,
+                                  viewPosition, batches, verts, indices);
+        }
+    } else {
+        continueBatchIfFull(batches, verts, indices);
+        const MeshBatch& batch = batches.back();
+        Facet::VertexAndIndex* slots[6];
+        const StitchPattern& pattern = stitchLeaf(facet, slots);
+        for (size_t t = 0; t < pattern.count; ++t) {
+            const uint8_t* tri = pattern.triangles[t];
+            indices.push_back(pushVertex(slots[tri[0]], facet, batch, verts));
+            indices.push_back(pushVertex(slots[tri[1]], facet, batch, verts));
+            indices.push_back(pushVertex(slots[tri[2]], facet, batch, verts));
+        }
+    }
+
+    if (opened)
+        endBatch(batches, verts, indices);
+}
+
+void
+glit::Terrain::drawSubtreeWireframe(const Facet& facet, bool inBatch,
+                                    const dvec3& viewPosition,
+                                    vector<MeshBatch>& batches,
+                                    vector<Facet::GPUVertex>& verts,
+                                    vector<uint32_t>& indices)
+{
+    if (!facet.hasChildren() && facet.culled != Facet::Cull::None)
+        return;
+    bool opened = !inBatch && beginBatch(facet, viewPosition, batches, verts, indices);
+    inBatch = inBatch || opened;
+
+    if (facet.hasChildren()) {
+        const Facet* children = childrenOf(facet);
+        for (size_t i = 0; i < 4; ++i)
+            drawSubtreeWireframe(children[i], inBatch, viewPosition, batches, verts, indices);
+    } else {
+        continueBatchIfFull(batches, verts, indices);
+        const MeshBatch& batch = batches.back();
+        Facet::VertexAndIndex* slots[6];
+        const StitchPattern& pattern = stitchLeaf(facet, slots);
+        for (size_t t = 0; t < pattern.count; ++t) {
+            const uint8_t* tri = pattern.triangles[t];
+            uint32_t i0 = pushVertex(slots[tri[0]], facet, batch, verts);
+            uint32_t i1 = pushVertex(slots[tri[1]], facet, batch, verts);
+            uint32_t i2 = pushVertex(slots[tri[2]], facet, batch, verts);
+            indices.push_back(i0);
+            indices.push_back(i1);
+            indices.push_back(i1);
+            indices.push_back(i2);
+            indices.push_back(i2);
+            indices.push_back(i0);
+        }
+    }
+
+    if (opened)
+        endBatch(batches, verts, indices);
+}
+
+/* static */ const glit::Terrain::ChunkRecipe&
+glit::Terrain::chunkRecipe()
+{
+    static const ChunkRecipe recipe = makeChunkRecipe(ChunkDepth);
+    return recipe;
+}
+
+/* static */ glit::Terrain::ChunkRecipe
+glit::Terrain::makeChunkRecipe(size_t chunkDepth)
+{
+    ChunkRecipe recipe;
+
+    // Verts live on a triangular grid with N segments on a side; (i, j) is
+    // p0 + i/N of the way to p1 + j/N of the way to p2.
+    const int N = 1 << chunkDepth;
+    vector<int> grid((N + 1) * (N + 1), -1);
+    auto vertAt = [&](ivec2 p) -> int& { return grid[p.y * (N + 1) + p.x]; };
+    vertAt(ivec2(0, 0)) = 0;
+    vertAt(ivec2(N, 0)) = 1;
+    vertAt(ivec2(0, N)) = 2;
+    recipe.vertCount = 3;
+    recipe.grid = {ivec2(0, 0), ivec2(N, 0), ivec2(0, N)};
+
+    // Mirror reshapeSubtree and ensureChildren, so that chunk verts land
+    // where the tree would put them.
+    vector<vector<ChunkRecipe::Midpoint>> byDepth(chunkDepth);
+    auto midpoint = [&](ivec2 a, ivec2 b, size_t depth) {
+        ivec2 m = (a + b) / 2;
+        if (vertAt(m) == -1) {
+            vertAt(m) = int(recipe.vertCount++);
+            recipe.grid.push_back(m);
+            byDepth[depth].push_back(ChunkRecipe::Midpoint{
+                    uint16_t(vertAt(m)), uint16_t(vertAt(a)), uint16_t(vertAt(b))});
+        }
+        return m;
+    };
+    function<void(ivec2, ivec2, ivec2, size_t)> subdivide =
+        [&](ivec2 p0, ivec2 p1, ivec2 p2, size_t depth) {
+            if (depth == chunkDepth) {
+                recipe.triangles.push_back(uint16_t(vertAt(p0)));
+                recipe.triangles.push_back(uint16_t(vertAt(p1)));
+                recipe.triangles.push_back(uint16_t(vertAt(p2)));
+                return;
+            }
+            ivec2 c0 = midpoint(p1, p2, depth);
+            ivec2 c1 = midpoint(p0, p2, depth);
+            ivec2 c2 = midpoint(p0, p1, depth);
+            subdivide(p0, c2, c1, depth + 1);
+            subdivide(c0, c1, c2, depth + 1);
+            subdivide(c2, p1, c0, depth + 1);
+            subdivide(c1, c0, p2, depth + 1);
+        };
+    subdivide(ivec2(0, 0), ivec2(N, 0), ivec2(0, N), 0);
+    for (auto& midpoints : byDepth) {
+        recipe.midpoints.insert(recipe.midpoints.end(),
+                                midpoints.begin(), midpoints.end());
+        recipe.depthEnds.push_back(recipe.midpoints.size());
+    }
+
+    // We draw wireframe, so emit each edge once.
+    vector<pair<uint32_t, uint32_t>> edges;
+    for (size_t i = 0; i < recipe.triangles.size(); i += 3) {
+        for (size_t e = 0; e < 3; ++e) {
+            uint32_t a = recipe.triangles[i + e];
+            uint32_t b = recipe.triangles[i + (e + 1) % 3];
+            edges.push_back(make_pair(std::min(a, b), std::max(a, b)));
+        }
+    }
+    sort(edges.begin(), edges.end());
+    edges.erase(unique(edges.begin(), edges.end()), edges.end());
+    for (auto& edge : edges) {
+        recipe.lines.push_back(edge.first);
+        recipe.lines.push_back(edge.second);
+    }
+    return recipe;
+}
+
+// Returns false if we need a tile that is not in yet, unless we |settle|
+// for what its nearest resident ancestor has.
+bool
+glit::Terrain::buildChunk(const ChunkNode& node, vector<Facet::GPUVertex>& verts,
+                          bool settle, const ChunkRecipe& recipe) const
+{
+    vector<Facet::CPUVertex> cpuVerts(recipe.vertCount);
+    for (size_t i = 0; i < 3; ++i)
+        cpuVerts[i] = node.corners[i];
+    MidpointBatch batch;
+    MidpointBatch check;
+    vector<pair<size_t, Facet::CPUVertex>> sampled;
+    TileStreamer::TileRef hint;
+    bool validate = validateHeights_ && !tiles_;
+    size_t begin = 0;
+    for (size_t depth = 0; depth < recipe.depthEnds.size(); ++depth) {
+        size_t end = recipe.depthEnds[depth];
+        size_t first = detailBegin(node.level + depth);
+        size_t last = tiles_ ? first : detailEnd(node.level + depth);
+        batch.clear();
+        check.clear();
+        sampled.clear();
+        for (size_t i = begin; i < end; ++i) {
+            const Facet::CPUVertex& a = cpuVerts[recipe.midpoints[i].a];
+            const Facet::CPUVertex& b = cpuVerts[recipe.midpoints[i].b];
+            if (tiles_) {
+                Facet::CPUVertex vertex;
+                TileSample from = tileVertex(normalize(a.position + b.position),
+                                             node.level + depth + 1, hint, vertex);
+                if (from == TileSample::Missing && !settle)
+                    return false;
+                if (from != TileSample::Beyond)
+                    sampled.emplace_back(i, vertex);
+            }
+            batch.push(a.position, b.position,
+                       coarseHeight(a, first), coarseHeight(b, first));
+            if (validate)
+                check.push(a.position, b.position);
+        }
+        heightKernel_.displace(batch, first, last);
+        kernelHeights_ += batch.size();
+        if (validate)
+            checkHeights(batch, check, last);
+        for (size_t i = begin; i < end; ++i) {
+            cpuVerts[recipe.midpoints[i].target] =
+                midpointVertex(batch, i - begin, first, last);
+        }
+        for (auto& vertex : sampled)
+            cpuVerts[recipe.midpoints[vertex.first].target] = vertex.second;
+        begin = end;
+    }
+    vector<vec3> positions(recipe.vertCount);
+    for (size_t i = 0; i < recipe.vertCount; ++i)
+        positions[i] = cpuVerts[i].position;
+
+    vector<vec3> normals(recipe.vertCount, vec3(0.f));
+    for (size_t i = 0; i < recipe.triangles.size(); i += 3) {
+        uint16_t i0 = recipe.triangles[i + 0];
+        uint16_t i1 = recipe.triangles[i + 1];
+        uint16_t i2 = recipe.triangles[i + 2];
+        vec3 n = cross(positions[i1] - positions[i0],
+                       positions[i2] - positions[i0]);
+        normals[i0] += n;
+        normals[i1] += n;
+        normals[i2] += n;
+    }
+
+    // Relative to the first corner, which is also what we draw against.
+    float scale = chunkScale(node) * CameraScale;
+    verts.resize(recipe.vertCount);
+    for (size_t i = 0; i < recipe.vertCount; ++i) {
+        verts[i] = Facet::GPUVertex::encode((positions[i] - positions[0]) / scale,
+                                            normalize(normals[i]));
+    }
+    return true;
+}
+
+float
+glit::Terrain::chunkScale(const ChunkNode& node) const
+{
+    const vec3& origin = node.corners[0].position;
+    float reach = std::max(distance(origin, node.corners[1].position),
+                           distance(origin, node.corners[2].position));
+    return (reach + bulgeAt(node.level)) / CameraScale;
+}
+
+void
+glit::Terrain::makeChunkCache()
+{
+    const ChunkRecipe& recipe = chunkRecipe();
+    chunkCache_ = ChunkCache::make<Facet::GPUVertex>(
+            recipe.vertCount, recipe.lines, chunkBudget_);
+
+    // Pin the roots so that there is always something to fall back to.
+    // The root corners never change, so this is safe to do while the
+    // worker is reshaping. With a shallow pyramid, the roots may want tiles
+    // below the roots of the pyramid, but we cannot wait for them.
+    vector<Facet::GPUVertex> verts;
+    for (size_t i = 0; i < 20; ++i) {
+        buildChunk(rootChunkNode(i), verts, true);
+        chunkCache_->upload(rootKey(i), verts, true);
+    }
+}
+
+/* static */ glit::Terrain::ChunkNode
+glit::Terrain::makeChunkNode(ChunkKey key, size_t level, const Facet& facet)
+{
+    return ChunkNode{key, uint32_t(level), {
+            facet.verts[0]->vertex,
+            facet.verts[1]->vertex,
+            facet.verts[2]->vertex},
+        ChunkNode::NoChildren, facet.culled != Facet::Cull::None};
+}
+
+// Only the corners, which is all that is safe to read while the worker is
+// reshaping; it may be culling the root as we go.
+glit::Terrain::ChunkNode
+glit::Terrain::rootChunkNode(size_t i) const
+{
+    const Facet& facet = facets[i];
+    return ChunkNode{rootKey(i), 0, {
+            facet.verts[0]->vertex,
+            facet.verts[1]->vertex,
+            facet.verts[2]->vertex},
+        ChunkNode::NoChildren, false};
+}
+
+void
+glit::Terrain::snapshotChunkNodes(const Facet& facet, size_t node,
+                                  vector<ChunkNode>& nodes) const
+{
+    if (!facet.hasChildren())
+        return;
+
+    size_t first = nodes.size();
+    nodes[node].children = uint32_t(first);
+    const Facet* children = childrenOf(facet);
+    for (size_t i = 0; i < 4; ++i) {
+        nodes.push_back(makeChunkNode(childKey(nodes[node].key, i),
+                                      nodes[node].level + 1, children[i]));
+    }
+    for (size_t i = 0; i < 4; ++i)
+        snapshotChunkNodes(children[i], first + i, nodes);
+}
+
+// Gather the chunks needed to draw |node|'s subtree into chunkDraws_.
+// Where a chunk is not resident and we cannot upload it this frame, we draw
+// its parent instead; returns false if we could not draw |node| at all, so
+// that our caller can do the same.
+bool
+glit::Terrain::collectChunks(const vector<ChunkNode>& nodes, size_t node,
+                             vector<Facet::GPUVertex>& scratch)
+{
+    const ChunkNode& self = nodes[node];
+    if (self.culled)
+        return true;
+    if (self.children != ChunkNode::NoChildren) {
+        size_t mark = chunkDraws_.size();
+        bool complete = true;
+        for (size_t i = 0; i < 4 && complete; ++i)
+            complete = collectChunks(nodes, self.children + i, scratch);
+        if (complete)
+            return true;
+        chunkDraws_.resize(mark);
+    }
+
+    ChunkCache::Slot slot = chunkCache_->use(self.key);
+    if (slot == ChunkCache::NoSlot) {
+        if (!chunkCache_->canUpload())
+            return false;
+        if (!buildChunk(self, scratch))
+            return false;
+        slot = chunkCache_->upload(self.key, scratch);
+        if (slot == ChunkCache::NoSlot)
+            return false;
+        stats_.vertsEmitted += scratch.size();
+        stats_.bytesUploaded += scratch.size() * sizeof(scratch[0]);
+    }
+    chunkDraws_.push_back(ChunkDraw{slot, dvec3(self.corners[0].position),
+                                    chunkScale(self)});
+    return true;
+}
+
+void
+glit::Terrain::prepareChunks(const Stage& stage)
+{
+    if (!chunkCache_)
+        makeChunkCache();
+
+    chunkCache_->beginFrame(chunkUploadBudget_);
+    chunkDraws_.clear();
+    vector<Facet::GPUVertex> scratch;
+    for (size_t i = 0; i < 20; ++i)
+        collectChunks(stage.chunkNodes, i, scratch);
+}
+
+void
+glit::Terrain::drawChunks(const mat4& transform,
+                          const dvec3& viewPosition,
+                          vec3 sunDirection)
+{
+    const VertexBuffer& vb = chunkCache_->vertexBuffer();
+    const IndexBuffer& ib = chunkCache_->indexBuffer();
+    AutoBindVertexBuffer vbind(vb);
+    AutoBindIndexBuffer ibind(ib);
+    programLand->use();
+    programLand->bindUniforms<0>(transform, sunDirection, vec3(0.f), 1.f);
+    GLint originIndex = programLand->uniformLocation("uBatchOrigin");
+    GLint scaleIndex = programLand->uniformLocation("uBatchScale");
+    Program::AutoEnableAttributes aea(*programLand, vb);
+    for (auto& chunk : chunkDraws_) {
+        vec3 origin((chunk.origin - viewPosition) / double(CameraScale));
+        programLand->bindUniform(originIndex, origin);
+        programLand->bindUniform(scaleIndex, chunk.scale);
+        aea.rebase(chunkCache_->firstVertex(chunk.slot));
+        glDrawElements(GL_LINES, chunkCache_->indicesPerChunk(), ib.type(),
+                       ib.offsetOf(0));
+    }
+}
+
+void
+glit::Terrain::snapshotGridPatches(const Facet& facet, ChunkKey key, size_t level,
+                                   float pixelScale, vector<GridPatch>& patches) const
+{
+    if (facet.culled != Facet::Cull::None)
+        return;
+    if (facet.hasChildren()) {
+        const Facet* children = childrenOf(facet);
+        for (size_t i = 0; i < 4; ++i)
+            snapshotGridPatches(children[i], childKey(key, i), level + 1, pixelScale, patches);
+        return;
+    }
+
+    GridPatch patch;
+    TilePyramid::corners(key, patch.corners);
+    for (size_t i = 0; i < 3; ++i) {
+        float chord = distance(patch.corners[i], patch.corners[(i + 1) % 3]);
+        patch.edgeAngles[i] = 2.f * asin(chord / 2.f);
+    }
+
+    // Our parent splits inside its range, short of the hysteresis, and
+    // merges us a little outside it. No vert of ours is nearer than our
+    // parent, so by the time it merges, we are all the way into its grid.
+    // A coarser neighbour is at least that far, so along its edge we are
+    // on its grid too. The roots have nothing to morph into.
+    if (level == 0) {
+        patch.morphStart = numeric_limits<float>::max() / 2.f;
+        patch.morphEnd = numeric_limits<float>::max();
+    } else {
+        double range = double(levelErrorAt(level - 1 + ChunkDepth)) * pixelScale / pixelError_;
+        patch.morphEnd = float(range * (1.0 - SplitHysteresis));
+        patch.morphStart = patch.morphEnd * MorphStart;
+    }
+    patches.push_back(patch);
+}
+
+void
+glit::Terrain::makeGrid()
+{
+    const ChunkRecipe& recipe = chunkRecipe();
+    const int N = 1 << ChunkDepth;
+    vector<GridVertex> verts;
+    for (const ivec2& p : recipe.grid) {
+        // Odd verts sit halfway along an edge of the coarse grid: along
+        // one of the sides, or the diagonal if both are odd.
+        ivec2 morph(0, 0);
+        if (p.x & 1)
+            morph = p.y & 1 ? ivec2(-1, 1) : ivec2(-1, 0);
+        else if (p.y & 1)
+            morph = ivec2(0, -1);
+        verts.push_back(GridVertex{vec2(p) / float(N), vec2(morph) / float(N)});
+    }
+    vector<uint16_t> indices;
+    if (DrawAsTriangles)
+        indices = recipe.triangles;
+    else
+        indices.assign(recipe.lines.begin(), recipe.lines.end());
+    gridVerts_ = VertexBuffer::make(verts);
+    gridIndices_ = IndexBuffer::make(indices);
+
+    // Uniforms stay with the program, so the permutation table only needs
+    // to go up once.
+    programGrid = makeGridProgram();
+    vector<vec4> table(64);
+    for (size_t i = 0; i < 256; ++i)
+        table[i / 4][i % 4] = float(perm[i]);
+    programGrid->use();
+    glUniform4fv(programGrid->uniformLocation("uSimplexPerm"), GLsizei(table.size()),
+                 &table[0][0]);
+}
+
+// One draw of the shared grid per patch. ES2 has no instanced draws, so
+// the patch goes in as uniforms rather than as per instance attributes;
+// either way, all we do per patch is place it.
+void
+glit::Terrain::drawGrid(const Stage& stage,
+                        const mat4& transform,
+                        const dvec3& viewPosition,
+                        float pixelScale,
+                        vec3 sunDirection)
+{
+    if (!programGrid)
+        makeGrid();
+
+    AutoBindVertexBuffer vbind(*gridVerts_);
+    AutoBindIndexBuffer ibind(*gridIndices_);
+    programGrid->use();
+    programGrid->bindUniforms<0>(transform, sunDirection, float(radius_),
+                                 float(HeightAmplitude), float(HeightGain), pixelScale);
+    GLint originIndex = programGrid->uniformLocation("uOrigin");
+    GLint cornerIndex[3] = {
+        programGrid->uniformLocation("uCorner0"),
+        programGrid->uniformLocation("uCorner1"),
+        programGrid->uniformLocation("uCorner2"),
+    };
+    GLint anglesIndex = programGrid->uniformLocation("uEdgeAngles");
+    GLint morphStartIndex = programGrid->uniformLocation("uMorphStart");
+    GLint morphEndIndex = programGrid->uniformLocation("uMorphEnd");
+    Program::AutoEnableAttributes aea(*programGrid, *gridVerts_);
+    GLenum mode = DrawAsTriangles ? GL_TRIANGLES : GL_LINES;
+    for (auto& patch : stage.gridPatches) {
+        vec3 origin((dvec3(patch.corners[0]) * double(radius_) - viewPosition) / double(CameraScale));
+        programGrid->bindUniform(originIndex, origin);
+        for (size_t i = 0; i < 3; ++i)
+            programGrid->bindUniform(cornerIndex[i], patch.corners[i]);
+        programGrid->bindUniform(anglesIndex, patch.edgeAngles);
+        programGrid->bindUniform(morphStartIndex, patch.morphStart);
+        programGrid->bindUniform(morphEndIndex, patch.morphEnd);
+        glDrawElements(mode, GLsizei(gridIndices_->numIndices()), gridIndices_->type(),
+                       gridIndices_->offsetOf(0));
     }
 }
@@ -12,18 +12,33 @@
 // along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #pragma once
 
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
 #include <limits>
-#include <unordered_map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_set>
 #include <vector>
 
 #include <glm/vec2.hpp>
 #include <glm/vec3.hpp>
 
+#include "block_pool.h"
 #include "camera.h"
+#include "chunk_cache.h"
+#include "flat_map.h"
+#include "height_kernel.h"
 #include "icosphere.h"
 #include "mesh.h"
 #include "shader.h"
+#include "thread_pool.h"
+#include "tile_streamer.h"
 #include "vertex.h"
+#include "vertex_cache.h"
 #include "utility.h"
 
 namespace glit {
@@ -33,34 +48,348 @@ namespace glit {
 class Terrain
 {
   public:
-    Terrain(double r);
+    // If |levelCache| names a file, the first |cacheLevels| levels of the
+    // tree are split everywhere before the first frame, with their
+    // midpoints mapped from that file, so that the first reshape starts
+    // from a warm tree rather than working out those heights again. The
+    // file is only used if it was made for the heights we have now; if it
+    // is missing or was not, we compute the levels and write it afresh.
+    // Off unless asked for: culling keeps the first frame's tree small, so
+    // a warm tree mostly adds facets that the first reshape merges again;
+    // see bench_reshape.
+    constexpr static size_t DefaultCacheLevels = 2;
+    Terrain(double r, const std::string& levelCache = std::string(),
+            size_t cacheLevels = DefaultCacheLevels);
     ~Terrain();
     void draw(const Camera& camera, glm::vec3 sunDirection);
 
+    // The full fractal height at a point on the unit sphere. The mesh only
+    // carries the octaves that its resolution can show and takes the coarse
+    // ones from the level above, so it will not match this exactly.
     float heightAt(glm::vec3 pos) const;
     float radius() const { return radius_; }
 
+    // Queries against the surface we draw, tiles and all, rather than the
+    // noise. Each reshape publishes a read only copy of the tree that the
+    // queries walk, so they are safe from any thread and never wait on a
+    // reshape in progress; a query sees the tree as the last reshape to
+    // finish left it. Below the leaves, we go on splitting as far as the
+    // engine draws them. Culled parts of the tree are coarse, so answers
+    // there are too. Not safe to call while setTileSource is running.
+    //
+    // The distance from the center of the planet to the surface right
+    // under |position|.
+    double meshHeightAt(const glm::dvec3& position) const;
+
+    // The first place the segment from |from| to |to| meets the surface,
+    // if it does, with |distance| from |from|. A ray is a segment long
+    // enough to go through the planet.
+    struct RayHit {
+        bool hit;
+        double distance;
+        glm::dvec3 position;
+        glm::vec3 normal;
+    };
+    bool intersectSegment(const glm::dvec3& from, const glm::dvec3& to,
+                          RayHit* hit) const;
+    bool intersectRay(const glm::dvec3& origin, const glm::dvec3& direction,
+                      RayHit* hit) const;
+
+    // The same for many at once, split over a pool of their own so that
+    // they do not wait behind reshape. All of a batch sees the same tree.
+    struct Segment {
+        glm::dvec3 from;
+        glm::dvec3 to;
+    };
+    void meshHeightsAt(const std::vector<glm::dvec3>& positions,
+                       std::vector<double>& heights) const;
+    void intersectSegments(const std::vector<Segment>& segments,
+                           std::vector<RayHit>& hits) const;
+
+    // The batches' pool has ThreadPool::defaultThreadCount threads unless
+    // we say otherwise. Only change it while no batch is running.
+    void setQueryThreads(size_t threads);
+    size_t queryThreads() const { return queryPool_->threadCount(); }
+
+    // Only copy what reshape changed into each new snapshot that queries
+    // see, and share the rest with the one before. On by default; disable
+    // to copy the whole tree every time.
+    void setIncrementalQueries(bool enable);
+    bool incrementalQueries() const { return incrementalQueries_; }
+
+    // Check every height that reshape and chunk builds compute against a
+    // full evaluation of the same octaves, and keep track of the difference.
+    // This is slow, so off by default.
+    struct HeightError {
+        size_t samples;
+        float max;
+        float rms;
+    };
+    void setValidateHeights(bool enable);
+    bool validateHeights() const { return validateHeights_; }
+    HeightError heightError() const;
+    void resetHeightError();
+
+    // Split facets until the geometric error left in each, projected onto
+    // the screen, is no more than this many pixels.
+    void setPixelError(float pixels);
+    float pixelError() const { return pixelError_; }
+
+    // Only re-evaluate the parts of the facet tree that the camera's motion
+    // could have affected. On by default; disable to re-test every facet
+    // every frame.
+    void setIncrementalReshape(bool enable);
+    bool incrementalReshape() const { return incrementalReshape_; }
+
+    // Hold each reshape to at most |splits| new splits and about |millis|
+    // milliseconds, so that a jump in the camera costs a few frames of
+    // coarse terrain rather than one long one. What the budget allows goes
+    // to the facets whose error shows most on screen; the rest stay leaves,
+    // and are drawn that way, until a later frame gets to them. Merges are
+    // never held back. Zero for either leaves it unlimited; zero for both
+    // turns the budget off, which splits everything in one frame as before.
+    void setRefineBudget(size_t splits, double millis);
+    size_t refineSplits() const { return refineSplits_; }
+    double refineMillis() const { return refineMillis_; }
+
+    // Rather than split by distance, keep the |triangles| we draw that
+    // matter most: split the leaves whose error shows most on screen and
+    // merge the parents whose error shows least, until we are at the budget
+    // and no split is worth more than the merge that would pay for it. A
+    // leaf of the chunked engine counts as all the triangles in its chunk.
+    // The tree carries over from frame to frame, so once we are there, a
+    // frame only makes the few trades the camera's motion calls for, and
+    // the refine budget above still caps the splits. Zero, the default,
+    // goes back to splitting by distance.
+    void setTriangleBudget(size_t triangles);
+    size_t triangleBudget() const { return triangleBudget_; }
+
+    // How much splitting the budget let through, how much it held back for
+    // later, and how many passes over the tree that took. Under a triangle
+    // budget, also how many merges paid for splits, and deferred is the
+    // leaves still bidding when we ran out of splits for the frame.
+    struct RefineCounts {
+        size_t splits;
+        size_t deferred;
+        size_t passes;
+        size_t merges;
+    };
+    // For the frame draw last showed.
+    RefineCounts refineCounts() const { return stages_[frontStage_].refineCounts; }
+
+    // Keep facets outside the view frustum coarse and leave them out of the
+    // mesh. The guard band widens the frustum by an angle on every side, so
+    // that what we draw a frame late (see setAsyncPipeline) still covers
+    // the screen while the camera turns. On by default.
+    void setFrustumCulling(bool enable);
+    bool frustumCulling() const { return frustumCulling_; }
+    void setCullGuardBand(float radians);
+    float cullGuardBand() const { return cullGuardBand_; }
+
+    // Keep facets that are hidden behind the limb of the planet coarse and
+    // leave them out of the mesh. On by default.
+    void setHorizonCulling(bool enable);
+    bool horizonCulling() const { return horizonCulling_; }
+
+    // How many leaves of the tree are culled, and by which test.
+    struct CullCounts {
+        size_t frustum;
+        size_t horizon;
+    };
+    // For the frame draw last showed.
+    CullCounts cullCounts() const { return stages_[frontStage_].cullCounts; }
+
+    // Facet pool counters, in facets.
+    size_t liveFacets() const { return facetPool.liveItems(); }
+    size_t freeFacets() const { return facetPool.freeItems(); }
+    size_t peakFacets() const { return facetPool.peakItems(); }
+
+    // What went into the frame draw last showed. The facets are the tree
+    // it drew, by level. The rest is the work done for it, so it is all
+    // zero on a frame that the worker had nothing new for; reshape and
+    // emission happen on the worker, and upload on the render thread. The
+    // chunked engine builds each chunk just before uploading it, so that
+    // counts as upload, and the instanced engine emits nothing. Heights
+    // are counted up to the end of the reshape, as heightAt calls and
+    // midpoints run through the height kernel. Reshape's time includes
+    // publishing the copy of the tree that queries walk, which is also
+    // given on its own, with the nodes it copied rather than shared.
+    struct Stats {
+        size_t frame;
+        std::vector<size_t> levelFacets;
+        size_t facets;
+        size_t facetsCreated;
+        size_t facetsDestroyed;
+        size_t heightCalls;
+        size_t kernelHeights;
+        size_t vertsEmitted;
+        size_t indicesEmitted;
+        size_t bytesUploaded;
+        double reshapeMillis;
+        double emitMillis;
+        double uploadMillis;
+        double queryMillis;
+        size_t queryNodes;
+    };
+    const Stats& stats() const { return stats_; }
+
+    // Also append the stats to a CSV file at |path| every frame, a line
+    // each, under a line of column names. Throws if we cannot write there;
+    // an empty path stops.
+    void setStatsFile(const std::string& path);
+
+    // Take heights from the baked tiles in the pyramid at |path| (see
+    // tools/bake_tiles) rather than from the noise. Tiles stream in on
+    // their own threads and stay in memory up to |budget| bytes; see
+    // TileStreamer. Reshape never waits on one: a facet whose midpoints
+    // need a tile that is not in yet stays as it is, and we look again next
+    // frame. Past the finest tiles we only interpolate. Throws if there is
+    // no pyramid at |path|; an empty path goes back to the noise.
+    void setTileSource(const std::string& path,
+                       size_t budget = TileStreamer::DefaultBudget);
+    TileStreamer* tileStreamer() { return tiles_.get(); }
+
+    // Which way the viewer is moving, in meters a frame, and the fastest
+    // it can go, so that we can fetch the tiles ahead of it.
+    void setViewVelocity(const glm::dvec3& velocity, double maxSpeed);
+
+    // Reshape runs as tasks on a pool of worker threads: one task per root
+    // facet, with the children of facets above the split depth spawned as
+    // further tasks. Below that, subtrees hand part of each level to idle
+    // workers as they go. Zero threads gives the old serial path. Either
+    // way the resulting tree, and thus the mesh, is identical. Zero is the
+    // default until bench_reshape shows the pool beating the serial path.
+    void setReshapeThreads(size_t threads);
+    size_t reshapeThreads() const { return reshapePool_->threadCount(); }
+    void setParallelSplitDepth(size_t depth);
+    size_t parallelSplitDepth() const { return parallelSplitDepth_; }
+
+    // How we get the tree onto the GPU.
+    //   Immediate: rebuild and re-upload the whole mesh every frame.
+    //   Chunked: draw each leaf of the tree as a fixed-size chunk that is
+    //            uniformly subdivided ChunkDepth more levels, built once and
+    //            kept resident in a GPU cache.
+    //   Instanced: draw each leaf of the tree as the same grid of that size,
+    //              and let the vertex shader put it on the sphere, displace
+    //              it and morph it into the next level up as it gets far
+    //              enough to be replaced by it; see drawGrid. The CPU only
+    //              keeps the tree, so its cost goes with the number of
+    //              leaves, not triangles. It draws the fractal, not tiles,
+    //              so with a tile source we draw chunked instead.
+    enum class Engine {
+        Immediate,
+        Chunked,
+        Instanced,
+    };
+    void setEngine(Engine engine);
+    Engine engine() const { return engine_; }
+    void cycleEngine();
+    static const char* engineName(Engine engine);
+
+    // Chunk cache limits: total GPU bytes, and chunks uploaded per frame.
+    // The byte budget takes effect the next time the cache is created.
+    void setChunkBudget(size_t bytes) { chunkBudget_ = bytes; }
+    void setChunkUploadBudget(size_t chunks) { chunkUploadBudget_ = chunks; }
+    const ChunkCache* chunkCache() const { return chunkCache_.get(); }
+
+    // Run reshape and mesh emission for the next frame on a worker thread
+    // while we draw the current frame. Draw never waits for the worker
+    // except on the very first frame; if the worker falls behind, we keep
+    // drawing the last mesh it finished, so the mesh lags the camera by one
+    // frame in the steady state and more only while the worker catches up.
+    // On by default, except on emscripten where we have no threads.
+    void setAsyncPipeline(bool enable);
+    bool asyncPipeline() const { return asyncPipeline_; }
+
+    // Above |meters| we draw a whole planet mesh that we built once rather
+    // than the tree, and do no terrain work at all on the CPU. There is one
+    // such mesh for each of a few depths, and we use the coarsest that is
+    // within the pixel error from where we are. From a little way below
+    // the altitude on up, we keep reshaping as well, so that the tree is
+    // ready for us when we come down. Zero turns it off.
+    void setOrbitAltitude(double meters) { orbitAltitude_ = meters; }
+    double orbitAltitude() const { return orbitAltitude_; }
+    // Whether the last frame was drawn from orbit.
+    bool inOrbit() const { return orbitDepth_ != 0; }
+
+    // The order we emit triangles in when drawing them solid.
+    //   Tree: depth first with the children in pool order.
+    //   Sierpinski: along a Sierpinski curve through the tree, so that each
+    //               leaf shares a vert or an edge with the one before it.
+    //   Forsyth: the Sierpinski order, then reordered for the vertex cache;
+    //            see VertexCacheOptimizer.
+    enum class TriangleOrder {
+        Tree,
+        Sierpinski,
+        Forsyth,
+    };
+    void setTriangleOrder(TriangleOrder order);
+    TriangleOrder triangleOrder() const { return triangleOrder_; }
+    static const char* triangleOrderName(TriangleOrder order);
+
+    // The immediate engine's mesh is drawn in batches, each a run of verts
+    // and indices whose positions are quantized to [-1, 1] around a shared
+    // origin, in world space, so that they do not change as the camera
+    // moves. Forsyth reorders each batch on its own. A batch has at most
+    // MaxBatchVerts verts, so that its indices fit in 16 bits.
+    struct MeshBatch {
+        glm::dvec3 origin;
+        float scale;
+        uint32_t firstVertex;
+        uint32_t vertexCount;
+        uint32_t firstIndex;
+        uint32_t indexCount;
+    };
+
+    // The CPU side of draw, without touching GL. This is for the tools;
+    // draw calls it for us. Not safe to call while the async pipeline is
+    // running. See also buildWireframe below.
+    CullCounts reshape(const glm::dvec3& viewPosition,
+                       const Camera::Frustum& frustum);
+
   private:
     std::shared_ptr<Program> programLand;
     static std::shared_ptr<Program> makeLandProgram();
     std::shared_ptr<Program> programWater;
     static std::shared_ptr<Program> makeWaterProgram();
+    std::shared_ptr<Program> programGrid;
+    static std::shared_ptr<Program> makeGridProgram();
     Mesh wireframeMesh;
-    Mesh tristripMesh;
+    Mesh triangleMesh;
+
+    // The wireframe shows the LOD better while we work on the terrain.
+    constexpr static bool DrawAsTriangles = false;
 
-    Mesh* uploadAsWireframe(const glm::dvec3& viewPosition,
-                            const glm::dvec3& viewDirection);
-    Mesh* uploadAsTriStrips(const glm::dvec3& viewPosition,
-                            const glm::dvec3& viewDirection);
     float radius_;
 
+    // Terrain heights are radius_ plus fractal noise: HeightOctaves octaves
+    // starting at HeightAmplitude, each half the wavelength and HeightGain
+    // times the amplitude of the last. heightAt does one point at a time;
+    // reshape and chunk builds batch their midpoints through the kernel.
+    constexpr static float HeightAmplitude = 20000.f;
+    constexpr static size_t HeightOctaves = 12;
+    constexpr static float HeightGain = 0.5f;
+    HeightKernel heightKernel_;
+
+    // A new vertex interpolates the octaves that are smooth over its edge
+    // from the ends of the edge and evaluates the rest itself. Interpolating
+    // an octave of amplitude A and wavelength w at the middle of an edge of
+    // length e is off by about A * pi^2 / 2 * (e / w)^2; we interpolate while
+    // that is under InterpolationError meters. With our gain, each level
+    // down can interpolate two more octaves and adds one, so the number we
+    // evaluate per vertex peaks at around DetailOctaves and then falls off,
+    // however many octaves there are. Past that we take the error.
+    constexpr static float InterpolationError = 2.f;
+    constexpr static size_t DetailOctaves = 8;
+
     // A facet is the subdividable piece of the terrain.
     //
     // Each facet is one side of the isocohedron (20 at the root), or one of
     // the subdivided sub-triangles within the isocohedron. Each facet holds
-    // pointers to its four children. Children are usually null and are
-    // constructed on the fly if we are close enough to the facet to make it
-    // worth drawing and removed if we are too far away.
+    // a handle to its block of four children in the facetPool. Children are
+    // usually absent and are constructed on the fly if we are close enough
+    // to the facet to make it worth drawing and released back to the pool if
+    // we are too far away.
     //
     // Although there are only four triangles in each subdivision, the magical
     // power of exponential growth means that with only 23 levels, we can cover
@@ -86,46 +415,105 @@ class Terrain
         // Given the world scale, we have to compute everything in double
         // precision to avoid juddering on small movements. This is not a huge
         // slowdown since we have to compute everything on the CPU anyway. For
-        // upload, we translate everything to be camera origin before
-        // truncating to floats so that near verticies are all small and have
-        // comparatively high precision.
+        // upload, we store everything relative to the origin of its batch,
+        // which we only move to be relative to the camera when drawing, so
+        // that near verticies have comparatively high precision.
         struct CPUVertex {
             glm::vec3 position;
-            glm::vec3 normal;
+
+            // Height above radius_, and the height that we started from
+            // before we evaluated octaves [detailBegin, detailEnd) here. We
+            // evaluate them again if a child needs some of them backed out;
+            // see coarseHeight.
+            float height;
+            float coarse;
+            uint8_t detailBegin;
+            uint8_t detailEnd;
         };
+        // What we upload is much smaller: the position in 16 bit fixed
+        // point within a cube around the origin of the batch it is drawn
+        // in (see MeshBatch), and the normal in two bytes, octahedrally
+        // encoded. The land shader unpacks both.
         struct GPUVertex {
-            glm::vec3 aPosition;
-            glm::vec3 aNormal;
+            glm::i16vec3 aPosition;
+            glm::i8vec2 aNormal;
 
-            static GPUVertex fromCPU(const CPUVertex& v,
-                                     const Facet& owner,
-                                     const glm::dvec3& viewPosition);
+            // |offset| is from the batch origin, in units of the batch
+            // scale, so in [-1, 1].
+            static GPUVertex encode(const glm::vec3& offset,
+                                    const glm::vec3& normal);
 
             static void describe(std::vector<VertexAttrib>& attribs) {
-                attribs.push_back(MakeGLMVertexAttrib(GPUVertex, aPosition, false));
-                attribs.push_back(MakeGLMVertexAttrib(GPUVertex, aNormal, false));
+                attribs.push_back(MakeGLMVertexAttrib(GPUVertex, aPosition, true));
+                attribs.push_back(MakeGLMVertexAttrib(GPUVertex, aNormal, true));
             }
         };
+        static_assert(sizeof(GPUVertex) == 8, "GPUVertex should pack to 8 bytes");
 
-        Facet* children; // 4 wide
+        // Handle of our 4 wide block of children in the facetPool.
+        constexpr static uint32_t NoChildren = uint32_t(-1);
+        uint32_t children;
+        bool hasChildren() const { return children != NoChildren; }
 
         // Cached normal to speed up vertex normal computations.
         glm::vec3 normal;
 
+        // A sphere around everything our subtree could ever put in the
+        // mesh, and the highest it could reach above radius_. Once we have
+        // had children we know the latter better: since they always come
+        // out the same, we keep the tighter bound after merging them again.
+        glm::vec3 center;
+        float bound;
+        float maxHeight;
+
+        // Whether the last reshape culled us, and why. Culled facets have
+        // no children.
+        enum class Cull : uint8_t {
+            None,
+            Frustum,
+            Horizon,
+        };
+        Cull culled;
+
+        // Whether our children are only there because balanceTree needed
+        // them rather than because reshape wanted them.
+        bool forced;
+
+        // The leaves in our subtree that are culled, by test.
+        uint32_t culledFrustum;
+        uint32_t culledHorizon;
+
+        // The upload index is only meaningful if stamp matches the stamp of
+        // the upload in progress; this saves us from having to walk the
+        // entire tree each frame to reset it.
         struct VertexAndIndex {
-            CPUVertex vertex; // Refers to baseVerts or childVerts.
-            uint32_t index; // Reset by reshape. Invalid is -1.
+            CPUVertex vertex; // Refers to baseVerts or a shared midpoint.
+            uint32_t index;
+            uint32_t stamp;
         };
         VertexAndIndex* verts[3];
 
-        // The children use a combination of our verts and pointers to verts
-        // stored here.
-        VertexAndIndex childVerts[3];
+        // The midpoints of our edges, opposite the vert with the same index,
+        // which our children use along with our verts. We work these out
+        // before we split, to find how far they stray from our plane, which
+        // is the error in not splitting. Our children always come out the
+        // same, so we keep them around after merging. They are shared with
+        // the facet on the other side of each edge; see SharedMidpoint.
+        VertexAndIndex* childVerts[3];
+        bool haveMidpoints;
+        float error;
+
+        // The values of Terrain::travel_ and Terrain::turn_ up to which no
+        // LOD or culling decision in this subtree can change. See
+        // reshapeSubtree.
+        double validUntil;
+        double validUntilTurn;
 
         Facet() {
             //memset(this, 0, sizeof(Facet));
         }
-        void init(VertexAndIndex* v0, VertexAndIndex* v1, VertexAndIndex* v2);
+        void init(VertexAndIndex* v0, VertexAndIndex* v1, VertexAndIndex* v2,
+                  float bulge, float rise);
     };
 
     // The topmost verts and facets.
@@ -135,14 +523,613 @@ class Terrain
     // LOD: The number of tris we want to show for any particular patch is
     // going to vary by its angle to us, it's relative smoothness, its height
     // relative to the surroundings, how interesting the content on it is, etc.
-    // Instead, to simplify the computation (as we currently have to do this
-    // all on the CPU), we use the distance alone. The following table is
-    // expressed in terms of Radii of the planetary body. Moreover, we want to
-    // make the distance calculations in the squared space to avoid the sqrt.
-    // This is all multiplied out in the constructor into the real table.
+    // We go by how far splitting would move the surface, as it looks from
+    // where we are; see wantsChildren. The edge lengths at each level are
+    // still what picks the octaves.
+    constexpr static float DefaultPixelError = 2.f;
+    float pixelError_;
     const static size_t MaxSubdivisions = 23;
     float EdgeLengths[MaxSubdivisions];
 
+    // The number of octaves a vertex carries if its edges are as long as
+    // EdgeLengths[level]: those with a wavelength of at least half the edge
+    // length. Anything finer would just alias. A midpoint takes the coarse
+    // octaves from the ends of its edge and only evaluates the octaves from
+    // LevelDetailBegin up, so the cost per vertex does not grow with the
+    // number of octaves.
+    size_t LevelOctaves[MaxSubdivisions];
+    size_t LevelDetailBegin[MaxSubdivisions];
+    size_t octavesAt(size_t level) const {
+        if (level >= MaxSubdivisions)
+            return heightKernel_.octaves().size();
+        return LevelOctaves[level];
+    }
+
+    // How far the mesh under a facet at |level| can rise above the heights
+    // of its corners: twice the amplitude of every octave its descendants
+    // evaluate rather than interpolate from the corners. The bulge adds the
+    // curve of the sphere across the facet to get how far the mesh can
+    // stray from the plane of the corners.
+    float LevelRise[MaxSubdivisions];
+    float LevelBulge[MaxSubdivisions];
+    float riseAt(size_t level) const {
+        return LevelRise[std::min(level, MaxSubdivisions - 1)];
+    }
+    float bulgeAt(size_t level) const {
+        return LevelBulge[std::min(level, MaxSubdivisions - 1)];
+    }
+
+    // How far a facet at |level| typically is from the surface: the
+    // interpolation error of every octave across its edges, plus the sag of
+    // its edges under the sphere. The instanced engine splits by this
+    // rather than by each facet's own error, so that which level is drawn
+    // only depends on distance; see drawGrid.
+    float LevelError[MaxSubdivisions];
+    float levelErrorAt(size_t level) const {
+        return LevelError[std::min(level, MaxSubdivisions - 1)];
+    }
+
+    // Height validation; see setValidateHeights.
+    bool validateHeights_;
+    mutable std::mutex heightErrorLock_;
+    mutable size_t heightErrorSamples_;
+    mutable float heightErrorMax_;
+    mutable double heightErrorSquares_;
+    void checkHeights(const MidpointBatch& batch, MidpointBatch& check,
+                      size_t octaves) const;
+
+    // The octaves a midpoint of an edge of a facet at |level| evaluates.
+    size_t detailBegin(size_t level) const {
+        if (level >= MaxSubdivisions)
+            return LevelDetailBegin[MaxSubdivisions - 1];
+        return LevelDetailBegin[level];
+    }
+    size_t detailEnd(size_t level) const { return octavesAt(level + 1); }
+
+    // The height at |v| from the octaves below |octave| alone; this is what
+    // a midpoint that evaluates from |octave| up interpolates. We add the
+    // octaves we need to |v|'s coarse height or take them off its full
+    // height, whichever is fewer; a deep vertex carries no detail at all.
+    float coarseHeight(const Facet::CPUVertex& v, size_t octave) const;
+    static Facet::CPUVertex midpointVertex(const MidpointBatch& batch, size_t i,
+                                           size_t begin, size_t end);
+
+    // The corners of the root facets.
+    void initRoots();
+
+    // The level cache; see Terrain::Terrain. Its records are the midpoints
+    // of the first |levels| levels in the order restoreLevels meets them:
+    // level by level, facets in the order we split them and edges in
+    // order, each midpoint where the first facet along its edge takes it.
+    // The header has to match what we would write now byte for byte. Its
+    // fingerprint covers everything that goes into a midpoint, and the
+    // kernel's output at a few points at each level, so that a change to
+    // the noise or to the kernel shows up as well. Normals are not kept:
+    // a facet's is the cross product of its corners in Facet::init, and
+    // its verts are drawn with it, so they come out of the positions bit
+    // for bit.
+    struct LevelCacheHeader {
+        char magic[8];
+        uint32_t version;
+        uint32_t recordSize;
+        uint32_t levels;
+        uint32_t reserved;
+        double radius;
+        uint64_t fingerprint;
+        uint64_t count;
+    };
+    constexpr static uint32_t LevelCacheVersion = 1;
+    void restoreLevels(const std::string& path, size_t levels);
+    uint64_t levelCacheFingerprint(size_t levels) const;
+
+    // Baked tiles; see setTileSource. A vert at |level| of the tree comes
+    // from the tile TilePyramid::depth() levels above it, where its grid
+    // has a sample about every vert. |hint| is the last tile we used, which
+    // will usually do for the next vert as well.
+    std::unique_ptr<TileStreamer> tiles_;
+    glm::dvec3 viewVelocity_;
+    double maxViewSpeed_;
+    enum class TileSample {
+        Sampled, // From the tile for its level.
+        Beyond,  // The pyramid stops short here, so interpolate.
+        Missing, // The tile is not in yet; |out| is from an ancestor.
+    };
+    size_t tileLevel(size_t level) const {
+        size_t depth = tiles_->pyramid().depth();
+        return level > depth ? level - depth : 0;
+    }
+    TileSample tileVertex(const glm::vec3& unit, size_t level,
+                          TileStreamer::TileRef& hint,
+                          Facet::CPUVertex& out) const;
+    float tileRelief(size_t level, const Facet& facet) const;
+
+    // Edge midpoints, shared by the facets on both sides of the edge, so
+    // that we only compute and upload each once, across root facets too.
+    // Facets on both sides of an edge have the same ends and are at the same
+    // level, so we key on the pair of end verts. We always compute from the
+    // end with the lesser position, so a midpoint comes out the same
+    // whichever side gets there first; when reshape tasks race, the loser
+    // simply adopts the winner's. Each facet that has found its midpoints
+    // holds a reference to them, and each facet that has split counts
+    // itself in splits, which is how a leaf finds out that its neighbour is
+    // finer than it is; see StitchPatterns.
+    struct EdgeKey {
+        const Facet::VertexAndIndex* a;
+        const Facet::VertexAndIndex* b;
+        bool operator==(const EdgeKey& other) const {
+            return a == other.a && b == other.b;
+        }
+    };
+    struct EdgeKeyHash {
+        size_t operator()(const EdgeKey& key) const {
+            size_t h = (uintptr_t(key.a) >> 3) * 2654435761u + (uintptr_t(key.b) >> 3);
+            return h ^ (h >> 16);
+        }
+    };
+    struct SharedMidpoint {
+        Facet::VertexAndIndex vertex;
+        uint32_t refs;
+        uint32_t splits;
+    };
+    // Facets point at the vertex in a SharedMidpoint, so those stay put in
+    // a pool, a level of it per shard, and each shard's map only holds
+    // their handles.
+    // There are several times as many shards as workers, so that the lock
+    // a worker wants is rarely held, and each is padded out so that it
+    // does not share a cache line with the next one's lock.
+    constexpr static size_t MidpointShards = 64;
+    using MidpointPool = BlockPool<SharedMidpoint, 1, MidpointShards>;
+    struct MidpointShard {
+        std::mutex lock;
+        FlatMap<EdgeKey, MidpointPool::Handle, EdgeKeyHash> midpoints;
+        char padding[64];
+    };
+    mutable MidpointShard midpointShards_[MidpointShards];
+    mutable MidpointPool midpointPool_;
+    static EdgeKey edgeKey(const Facet::VertexAndIndex* a,
+                           const Facet::VertexAndIndex* b);
+    static EdgeKey edgeKey(const Facet& facet, size_t edge);
+    static size_t shardOf(const EdgeKey& key) {
+        return EdgeKeyHash()(key) % MidpointShards;
+    }
+    Facet::VertexAndIndex* findMidpoint(const EdgeKey& key);
+    Facet::VertexAndIndex* addMidpoint(const EdgeKey& key,
+                                       const Facet::CPUVertex& vertex);
+    void releaseMidpoint(const EdgeKey& key);
+    void releaseMidpoints(Facet& facet);
+    void countSplit(const Facet& facet, int delta);
+
+    // A slot for an edge whose midpoint we already have, and the three
+    // slots of a facet we have to come back to.
+    constexpr static size_t NoSlot = size_t(-1);
+    constexpr static size_t DeferredSlot = size_t(-2);
+
+    // Reshape's scratch space for finding the midpoints of a level's
+    // facets in one batch. Midpoints from tiles go through the batch as
+    // well, and are swapped in for its results afterwards.
+    struct MidpointScratch {
+        MidpointBatch batch;
+        MidpointBatch check;
+        std::vector<size_t> slots;
+        FlatMap<EdgeKey, size_t, EdgeKeyHash> pending;
+        std::vector<Facet::CPUVertex> vertices;
+        std::vector<std::pair<size_t, Facet::CPUVertex>> sampled;
+    };
+    void findMidpoints(size_t level, const std::vector<Facet*>& facets,
+                       MidpointScratch& scratch);
+    static float midpointError(const Facet& facet);
+
+    // Stitching. Where a leaf meets a neighbour that has split, the
+    // neighbour's midpoint sits on our shared edge, so we draw the leaf as a
+    // fan that takes that midpoint in rather than leave a T-junction. The
+    // pattern depends only on which of the three edges are split, so it is
+    // a lookup in a fixed table, indexed by a bit per edge. The slots are
+    // our verts and then the midpoints of our edges, numbered as for
+    // childVerts. Triangles keep the winding of the leaf.
+    //
+    // The table only covers neighbours one level finer, so after reshape
+    // we split any leaf we draw whose neighbour is further down than that;
+    // see balanceTree. The splits are found through the midpoint registry,
+    // so siblings, cousins and neighbours under other root facets all look
+    // the same. Only for the immediate engine; chunks are not stitched.
+    struct StitchPattern {
+        uint8_t count;
+        uint8_t triangles[4][3];
+    };
+    static const StitchPattern StitchPatterns[8];
+    Facet::VertexAndIndex* splitMidpoint(const EdgeKey& key) const;
+    const StitchPattern& stitchLeaf(const Facet& leaf,
+                                    Facet::VertexAndIndex* slots[6]) const;
+    bool needsBalance(const Facet& leaf) const;
+    void balanceTree();
+
+    // Where the tree changed since balanceTree last looked: the sphere of
+    // each facet that split or merged, or came into view. Only the leaves
+    // that touch one can have a new neighbour, so those are all it checks,
+    // unless so much changed that a walk over the whole tree is cheaper.
+    // Leaves still waiting on a tile for their midpoints go round again
+    // next frame. Reshape's tasks collect theirs in their own scratch and
+    // hand them over once each, so that splits do not queue on the lock.
+    // publishQueryTree keeps its own list of them; see QueryBlock. The
+    // rest is balanceTree's scratch, kept between frames.
+    struct BalanceChange {
+        glm::vec3 center;
+        float bound;
+    };
+    void noteBalanceChange(const Facet& facet);
+    static bool touches(const Facet& facet, const BalanceChange& change);
+    constexpr static size_t MaxBalanceChanges = 1024;
+    std::mutex balanceLock_;
+    std::vector<BalanceChange> balanceChanges_;
+    std::vector<BalanceChange> balanceRound_;
+    std::vector<BalanceChange> balanceRetry_;
+    bool balanceEverywhere_;
+    struct BalanceVisit {
+        size_t level;
+        Facet* facet;
+        uint32_t begin;
+        uint32_t end;
+    };
+    std::vector<BalanceVisit> balanceStack_;
+    std::vector<uint32_t> balanceNear_;
+    std::vector<std::pair<size_t, Facet*>> balanceCandidates_;
+    std::vector<Facet*> balanceForced_;
+    std::vector<Facet*> balanceNeedMidpoints_;
+    MidpointScratch balanceScratch_;
+
+    // Backing store for all non-root facets. We cross LOD boundaries
+    // constantly while flying, so rather than going to the heap for every
+    // split and merge, we recycle blocks of children through per-level free
+    // lists. The pool is indexed by the level of the parent facet.
+    using FacetPool = BlockPool<Facet, 4, MaxSubdivisions>;
+    FacetPool facetPool;
+    Facet* childrenOf(const Facet& facet) {
+        return facetPool.block(facet.children);
+    }
+    const Facet* childrenOf(const Facet& facet) const {
+        return facetPool.block(facet.children);
+    }
+
+    // Hysteresis: a facet splits when we come within (1 - SplitHysteresis)
+    // of its LOD distance and only merges again once we are beyond
+    // (1 + SplitHysteresis) of it, so that hovering on the boundary does
+    // not rebuild the same children every frame.
+    constexpr static float SplitHysteresis = 0.1f;
+
+    // Incremental reshape: each subtree records how far the camera may move
+    // before any decision within it could change. We keep a running total
+    // of the distance the camera has moved (the odometer) and only revisit
+    // subtrees that have expired.
+    bool incrementalReshape_;
+    double travel_;
+    glm::dvec3 lastViewPosition_;
+
+    // Refine budget. With one, reshapeSubtree does not split a leaf but
+    // hands it back as a candidate, and reshape splits the most important
+    // candidates and goes round again; see reshape.
+    constexpr static size_t DefaultRefineSplits = 512;
+    constexpr static double DefaultRefineMillis = 4.0;
+    constexpr static size_t MinRefineSplits = 32;
+    struct RefineCandidate {
+        Facet* facet;
+        size_t level;
+        double importance;
+    };
+    size_t refineSplits_;
+    double refineMillis_;
+    size_t reshapePass_;
+    double splitMillis_;
+    std::mutex refineLock_;
+    std::vector<RefineCandidate> refineCandidates_;
+    std::vector<RefineCandidate> refineGranted_;
+    std::vector<Facet*> refineRoots_;
+    RefineCounts refineCounts_;
+    bool refineBudgeted() const { return refineSplits_ > 0 || refineMillis_ > 0.0; }
+
+    // Triangle budget. reshapeSubtree leaves the tree as it is and bids
+    // every visible leaf for a split and every parent of four leaves for a
+    // merge; tradeTriangles settles them. We count visible leaves, and what
+    // this frame's trades did, as we go.
+    size_t triangleBudget_;
+    std::vector<RefineCandidate> mergeCandidates_;
+    size_t tradeLeaves_;
+    std::vector<RefineCandidate> tradeMerges_;
+    std::unordered_set<Facet*> tradeSplit_;
+    std::unordered_set<Facet*> tradeMerged_;
+    std::unordered_set<Facet*> tradeDoomed_;
+    void tradeTriangles(size_t most, std::vector<RefineCandidate>& granted);
+    void finishTrades();
+
+    // Frustum culling. Turning the camera only matters to culling, so we
+    // keep a second odometer of how far the frustum planes have swung. We
+    // add up the largest change in any plane's normal, which bounds the
+    // angle it turned through.
+    constexpr static float DefaultCullGuardBand = 0.1f;
+    bool frustumCulling_;
+    float cullGuardBand_;
+    double turn_;
+    Camera::Frustum lastFrustum_;
+
+    // Horizon culling. The terrain never dips below the occluder, a sphere
+    // at the depth of every octave at its lowest, so anything behind the
+    // occluder's limb as seen from the camera is hidden.
+    bool horizonCulling_;
+    double occluderRadius_;
+
+    // How far the camera can move, and the frustum turn, before a decision
+    // could change.
+    struct Slack {
+        double travel;
+        double turn;
+    };
+
+    // Incremented before each upload; see VertexAndIndex.
+    uint32_t uploadStamp_;
+
+    // Facets at a level below this spawn their children's reshape as tasks,
+    // which is enough to give every worker a subtree to start on. The few
+    // subtrees near the camera, where all the work is at low altitude, get
+    // spread out further by handing off ParallelGrain or more facets of a
+    // level at a time, and only while a worker is idle, so that the spawn
+    // overhead stays in the noise.
+    constexpr static size_t DefaultParallelSplitDepth = 3;
+    constexpr static size_t ParallelGrain = 32;
+    std::unique_ptr<ThreadPool> reshapePool_;
+    size_t parallelSplitDepth_;
+
+    // What a reshape task works on: |count| subtrees at |level|, from
+    // |first| in reshapeRoots_. Every facet is the root of at most one task
+    // a pass, so reshape sizes both to the most facets we have had at the
+    // start of each pass and spawnReshape hands out slots from there; a
+    // task only captures its slot, which std::function keeps inline. Once
+    // the tree has grown, spawning stops allocating.
+    struct ReshapeTask {
+        size_t level;
+        size_t first;
+        size_t count;
+    };
+    std::vector<ReshapeTask> reshapeTasks_;
+    std::atomic<size_t> reshapeTasksUsed_;
+    std::vector<Facet*> reshapeRoots_;
+    std::atomic<size_t> reshapeRootsUsed_;
+    const glm::dvec3* reshapeView_;
+    const Camera::Frustum* reshapeFrustum_;
+    void startReshapeTasks();
+    bool spawnReshape(ThreadPool::TaskGroup& group, size_t level,
+                      Facet* const* roots, size_t count);
+
+    // Chunked engine state. With a chunk, or an instanced patch, standing
+    // in for ChunkDepth levels of the tree, we make the LOD decision for a
+    // facet at level n as if it were at level n + ChunkDepth, so that
+    // triangle density on screen is about the same as for the immediate
+    // engine.
+    Engine engine_;
+    bool forceReshape_;
+    constexpr static size_t ChunkDepth = 4;
+    constexpr static size_t DefaultChunkBudget = 32 << 20;
+    constexpr static size_t DefaultChunkUploadBudget = 16;
+    size_t chunkBudget_;
+    size_t chunkUploadBudget_;
+    std::unique_ptr<ChunkCache> chunkCache_;
+    size_t lodBias() const {
+        return engine_ == Engine::Immediate ? 0 : ChunkDepth;
+    }
+
+    // Chunks are keyed by their path from the root: a marker bit, the root
+    // index, then two bits per level for the child index. This is stable
+    // across splits and merges, unlike the facet's pool handle.
+    using ChunkKey = ChunkCache::Key;
+    static ChunkKey rootKey(size_t i) { return ChunkKey(0x20 | i); }
+    static ChunkKey childKey(ChunkKey parent, size_t i) {
+        return (parent << 2) | ChunkKey(i);
+    }
+
+    // Every chunk has the same shape, so we work out the order of midpoint
+    // computations and the resulting index pattern once. The orbit meshes
+    // are made the same way, from deeper recipes.
+    struct ChunkRecipe {
+        struct Midpoint {
+            uint16_t target;
+            uint16_t a;
+            uint16_t b;
+        };
+        size_t vertCount;
+        // Sorted by depth: each midpoint only depends on shallower ones, so
+        // every depth is one batch. Depth d ends at depthEnds[d].
+        std::vector<Midpoint> midpoints;
+        std::vector<size_t> depthEnds;
+        std::vector<uint16_t> triangles;
+        std::vector<uint32_t> lines;
+        // Where each vert is on the grid; see chunkRecipe.
+        std::vector<glm::ivec2> grid;
+    };
+    static const ChunkRecipe& chunkRecipe();
+    static ChunkRecipe makeChunkRecipe(size_t chunkDepth);
+
+    struct ChunkDraw {
+        ChunkCache::Slot slot;
+        glm::dvec3 origin;
+        float scale;
+    };
+    std::vector<ChunkDraw> chunkDraws_;
+
+    // What the chunked engine needs from the tree, copied out so that the
+    // render thread can walk it while the worker reshapes the real thing.
+    // The children of a node are four consecutive entries.
+    struct ChunkNode {
+        constexpr static uint32_t NoChildren = uint32_t(-1);
+        ChunkKey key;
+        uint32_t level;
+        Facet::CPUVertex corners[3];
+        uint32_t children;
+        bool culled;
+    };
+    static ChunkNode makeChunkNode(ChunkKey key, size_t level, const Facet& facet);
+    ChunkNode rootChunkNode(size_t i) const;
+
+    // Chunk verts are quantized around the first corner. Nothing in the
+    // chunk is further from it than the other corners plus the bulge.
+    float chunkScale(const ChunkNode& node) const;
+
+    // Instanced engine state. Every patch is drawn with the chunk recipe's
+    // grid. A vert has its place on the grid, in units of a patch edge, and
+    // how far it moves when morphed all the way into the grid of the level
+    // above: an odd vert slides along its edge of the coarse grid onto the
+    // even vert at one end, which collapses the fine triangles into the
+    // coarse ones.
+    struct GridVertex {
+        glm::vec2 aGrid;
+        glm::vec2 aMorph;
+
+        static void describe(std::vector<VertexAttrib>& attribs) {
+            attribs.push_back(MakeGLMVertexAttrib(GridVertex, aGrid, false));
+            attribs.push_back(MakeGLMVertexAttrib(GridVertex, aMorph, false));
+        }
+    };
+    std::shared_ptr<VertexBuffer> gridVerts_;
+    std::shared_ptr<IndexBuffer> gridIndices_;
+
+    // A leaf of the tree to draw as a patch: its corners on the unit
+    // sphere, without any height, the angles its edges span, and the
+    // distances over which it morphs into its parent's grid. It starts at
+    // MorphStart of the way to the end, and has finished by the time its
+    // parent would merge it away.
+    struct GridPatch {
+        glm::vec3 corners[3];
+        glm::vec3 edgeAngles;
+        float morphStart;
+        float morphEnd;
+    };
+    constexpr static float MorphStart = 0.7f;
+
+    // Orbit state. We go into orbit a little above the altitude and come out
+    // at it, so that we do not flicker between the two. A mesh built while
+    // its tiles were still coming in is built again every so often until
+    // it has them all.
+    constexpr static double DefaultOrbitAltitude = 1000e3;
+    constexpr static double OrbitHysteresis = 0.05;
+    constexpr static double OrbitWarmBand = 1.5;
+    constexpr static size_t OrbitMinDepth = 3;
+    constexpr static size_t OrbitMaxDepth = 7;
+    constexpr static size_t OrbitRetryFrames = 60;
+    struct OrbitMesh {
+        Drawable drawable;
+        std::vector<MeshBatch> batches;
+        bool settled;
+        size_t builtFrame;
+    };
+    std::vector<std::unique_ptr<OrbitMesh>> orbitMeshes_;
+    double orbitAltitude_;
+    size_t orbitDepth_;
+    size_t orbitFrame_;
+
+    // Query state. The copy of the tree that queries walk, in blocks of
+    // QueryBlockLevels levels. The top block starts with the 20 roots, and
+    // each other block with the four children of a node in the bottom
+    // level of the block above; that node's |children| indexes the block's
+    // |blocks|. Within a block, the children of a node are four consecutive
+    // entries, as with ChunkNode. Everything under a node is in the cone
+    // from the center through its corners, between heights low and high
+    // above radius_; these are the same bounds as its facet's. Leaves
+    // split |refineLevels| more times, as the engine draws them. For the
+    // immediate engine, which does not split them, a leaf instead keeps
+    // the midpoints it is stitched to, as slots 3-5 of its StitchPattern,
+    // from |midpoints| on in its block.
+    //
+    // Reshape only makes a new copy if the tree has changed since the last
+    // one; treeChanges_ counts splits and merges. Blocks never change once
+    // published, so the new copy shares every block below the top whose
+    // parent no change since the last copy touches (see BalanceChange),
+    // and only copies the rest. Most frames only change the tree in a few
+    // places, so most of it is shared.
+    constexpr static size_t QueryBlockLevels = 4;
+    struct QueryNode {
+        Facet::CPUVertex corners[3];
+        float low;
+        float high;
+        uint32_t level;
+        uint32_t children;
+        uint32_t midpoints;
+        uint8_t stitch;
+    };
+    struct QueryBlock {
+        std::vector<QueryNode> nodes;
+        std::vector<Facet::CPUVertex> midpoints;
+        std::vector<std::shared_ptr<const QueryBlock>> blocks;
+    };
+    struct QueryTree {
+        std::shared_ptr<const QueryBlock> top;
+        size_t refineLevels;
+    };
+    mutable std::mutex queryLock_;
+    std::shared_ptr<const QueryTree> queryTree_;
+    std::atomic<size_t> treeChanges_;
+    size_t publishedChanges_;
+    std::vector<BalanceChange> queryChanges_;
+    std::vector<uint32_t> queryNear_;
+    bool queryEverywhere_;
+    bool incrementalQueries_;
+    size_t queryNodesCopied_;
+    constexpr static size_t NoQueryNode = size_t(-1);
+    std::unique_ptr<ThreadPool> queryPool_;
+    constexpr static size_t QueriesPerTask = 256;
+
+    // Stats. Reshape fills in its part of reshapeStats_, buildStage adds
+    // the emission and the stage carries them to draw, which adds the
+    // uploads in stats_. The counters are bumped by reshape's tasks, chunk
+    // builds and whoever calls heightAt, so they are atomic; reshape takes
+    // them as it finishes.
+    Stats reshapeStats_;
+    Stats stats_;
+    std::atomic<size_t> facetsCreated_;
+    std::atomic<size_t> facetsDestroyed_;
+    mutable std::atomic<size_t> heightCalls_;
+    mutable std::atomic<size_t> kernelHeights_;
+    FILE* statsFile_;
+    void countFacets(Stats& stats) const;
+    void writeStats();
+
+    // Everything the render thread needs to draw one frame of terrain.
+    // Everything in it is absolute; we place it against the camera as we
+    // draw. Unlike what buildWireframe and buildTriangles give the tools,
+    // indices count from their batch's first vert. If meshChanged is
+    // false, the verts and indices are the same as the previous stage's,
+    // which are already on the GPU.
+    struct Stage {
+        Engine engine = Engine::Immediate;
+        std::vector<MeshBatch> batches;
+        std::vector<Facet::GPUVertex> verts;
+        std::vector<uint32_t> indices;
+        bool meshChanged = true;
+        std::vector<ChunkNode> chunkNodes;
+        std::vector<GridPatch> gridPatches;
+        CullCounts cullCounts{0, 0};
+        RefineCounts refineCounts{0, 0, 0, 0};
+        Stats stats = Stats();
+    };
+
+    // The worker fills the back stage while we draw the front stage. The
+    // front stage and the request belong to the render thread unless the
+    // back stage is Building, in which case the back stage, the tree, and
+    // everything reshape touches belong to the worker.
+    enum class StageState {
+        Idle,
+        Building,
+        Ready,
+    };
+    Stage stages_[2];
+    size_t frontStage_;
+    bool haveFrontStage_;
+    bool frontUploaded_;
+    bool asyncPipeline_;
+    std::thread pipelineThread_;
+    std::mutex pipelineLock_;
+    std::condition_variable pipelineWake_;
+    StageState backState_;
+    bool pipelineQuit_;
+    glm::dvec3 requestPosition_;
+    Camera::Frustum requestFrustum_;
+
     // Scale: We display the resulting verticies on a camera with a fairly
     // short far plane. To allow this, we scale the verts down to a smaller,
     // proportional size when drawing. This does not murder our precision
@@ -151,37 +1138,200 @@ class Terrain
     // long as its not too extreme.
     constexpr static float CameraScale = 10000.f;
 
-    static glm::vec3 bisect(glm::vec3 v0, glm::vec3 v1);
-    void subdivideFacet(glm::vec3 p0, glm::vec3 p1, glm::vec3 p2,
-                        glm::vec3* c0, glm::vec3* c1, glm::vec3* c2) const;
-    void reshape(const glm::dvec3& viewPosition,
-                 const glm::dvec3& viewDirection);
-    void reshapeN(size_t level, Facet& self,
-                  const glm::dvec3& viewPosition,
-                  const glm::dvec3& viewDirection);
+    // reshapeSubtree's working space. Calls nest, since a call that
+    // spawns tasks runs them itself while it waits, so rather than one per
+    // thread we keep a free list and each call takes one for as long as it
+    // runs. They keep their capacity, so once the tree has grown, reshape
+    // stops allocating for them.
+    struct ReshapeVisit {
+        Facet* facet;
+        size_t level;
+        Slack slack;
+        bool visible;
+        bool split;
+        double importance;
+    };
+    struct ReshapeScratch {
+        std::vector<ReshapeVisit> visits;
+        std::vector<ReshapeVisit> deferred;
+        std::vector<Facet*> needMidpoints;
+        std::vector<RefineCandidate> candidates;
+        std::vector<RefineCandidate> merges;
+        MidpointScratch midpoints;
+        std::vector<BalanceChange> balanceChanges;
+    };
+    std::mutex reshapeScratchLock_;
+    std::vector<std::unique_ptr<ReshapeScratch>> reshapeScratch_;
+    class AutoReshapeScratch
+    {
+        Terrain& terrain_;
+        std::unique_ptr<ReshapeScratch> scratch_;
+
+      public:
+        explicit AutoReshapeScratch(Terrain& terrain);
+        ~AutoReshapeScratch();
+        ReshapeScratch& operator*() { return *scratch_; }
+    };
+
+    void reshapeSubtree(size_t level, Facet* const* roots, size_t count,
+                        const glm::dvec3& viewPosition,
+                        const Camera::Frustum& frustum);
+    bool wantsChildren(size_t level, const Facet& self,
+                       const glm::dvec3& viewPosition, float pixelScale,
+                       double* slack, double* importance) const;
+    bool inFrustum(const Facet& self, const glm::dvec3& viewPosition,
+                   const Camera::Frustum& frustum, Slack* slack) const;
+    bool aboveHorizon(const Facet& self, const glm::dvec3& viewPosition,
+                      double* slack) const;
+    bool ensureChildren(size_t level, Facet& self);
 
     // Given that the tree has already been balanced for the active view,
-    // walk current tree and emit verticies for all active children, inserting
-    // joining tris as necessary between levels.
-    void drawSubtreeTriStrip(const glm::dvec3& viewPosition,
-                             std::vector<Facet::GPUVertex>& verts,
-                             std::vector<uint32_t>& indices);
-    void drawSubtreeTriStripN(Facet& facet, const glm::dvec3& viewPosition,
+    // walk current tree and emit verticies for all active children, stitched
+    // to their neighbours as necessary between levels. The curve enters
+    // each facet at vert |entry| and leaves at vert |exit|.
+    constexpr static TriangleOrder DefaultTriangleOrder = TriangleOrder::Forsyth;
+    TriangleOrder triangleOrder_;
+    VertexCacheOptimizer vertexCache_;
+    void drawSubtreeTriangles(const glm::dvec3& viewPosition,
+                              std::vector<MeshBatch>& batches,
                               std::vector<Facet::GPUVertex>& verts,
-                              std::vector<uint32_t>& indices) const;
+                              std::vector<uint32_t>& indices);
+    void drawSubtreeTrianglesN(const Facet& facet, size_t entry, size_t exit,
+                               bool inBatch, const glm::dvec3& viewPosition,
+                               std::vector<MeshBatch>& batches,
+                               std::vector<Facet::GPUVertex>& verts,
+                               std::vector<uint32_t>& indices);
 
-    // Spit out complete triangles for all faces. We don't need joins because
-    // they would just overlay lines that are already present.
-    void drawSubtreeWireframe(Facet& facet, const glm::dvec3& viewPosition,
+    // Spit out complete triangles for all faces, stitched the same way, so
+    // that the lines show where the levels meet.
+    void drawSubtreeWireframe(const Facet& facet, bool inBatch,
+                              const glm::dvec3& viewPosition,
+                              std::vector<MeshBatch>& batches,
                               std::vector<Facet::GPUVertex>& verts,
-                              std::vector<uint32_t>& indices) const;
+                              std::vector<uint32_t>& indices);
+    // Where buildWireframe sorts each batch's edges, kept so that it does
+    // not allocate every frame.
+    std::vector<uint64_t> wireframeEdges_;
 
-    static uint32_t pushVertex(Facet::VertexAndIndex* insert,
-                               const Facet& owner,
-                               const glm::dvec3& viewPosition,
-                               std::vector<Facet::GPUVertex>& verts);
-    void deleteChildren(Facet& self);
+    // The emitters start a batch at the first facet on the way down whose
+    // subtree is small enough on screen that a quantization step is below
+    // QuantizationPixels, or at the leaf if none is. Verts are not shared
+    // across batches, since they are quantized against a different origin
+    // in each.
+    constexpr static float QuantizationPixels = 0.125f;
+    constexpr static size_t MaxBatchVerts = 1 << 16;
+    bool beginBatch(const Facet& facet, const glm::dvec3& viewPosition,
+                    std::vector<MeshBatch>& batches,
+                    const std::vector<Facet::GPUVertex>& verts,
+                    const std::vector<uint32_t>& indices);
+    void continueBatchIfFull(std::vector<MeshBatch>& batches,
+                             const std::vector<Facet::GPUVertex>& verts,
+                             const std::vector<uint32_t>& indices);
+    static void endBatch(std::vector<MeshBatch>& batches,
+                         const std::vector<Facet::GPUVertex>& verts,
+                         const std::vector<uint32_t>& indices);
+    uint32_t pushVertex(Facet::VertexAndIndex* insert,
+                        const Facet& owner,
+                        const MeshBatch& batch,
+                        std::vector<Facet::GPUVertex>& verts) const;
+    bool deleteChildren(size_t level, Facet& self);
 
+    // Chunked engine.
+    void makeChunkCache();
+    bool buildChunk(const ChunkNode& node,
+                    std::vector<Facet::GPUVertex>& verts,
+                    bool settle = false,
+                    const ChunkRecipe& recipe = chunkRecipe()) const;
+    void snapshotChunkNodes(const Facet& facet, size_t node,
+                            std::vector<ChunkNode>& nodes) const;
+    bool collectChunks(const std::vector<ChunkNode>& nodes, size_t node,
+                       std::vector<Facet::GPUVertex>& scratch);
+    void prepareChunks(const Stage& stage);
+    void drawChunks(const glm::mat4& transform,
+                    const glm::dvec3& viewPosition,
+                    glm::vec3 sunDirection);
+
+    // Instanced engine.
+    void snapshotGridPatches(const Facet& facet, ChunkKey key, size_t level,
+                             float pixelScale,
+                             std::vector<GridPatch>& patches) const;
+    void makeGrid();
+    void drawGrid(const Stage& stage,
+                  const glm::mat4& transform,
+                  const glm::dvec3& viewPosition,
+                  float pixelScale,
+                  glm::vec3 sunDirection);
+
+    // Orbit.
+    size_t pickOrbitDepth(double altitude, float pixelScale) const;
+    std::unique_ptr<OrbitMesh> makeOrbitMesh(size_t depth) const;
+    const OrbitMesh& orbitMesh(size_t depth);
+
+    // Queries.
+    size_t publishQueryTree();
+    static QueryNode makeQueryNode(size_t level, const Facet& facet);
+    std::shared_ptr<const QueryBlock> snapshotQueryBlock(
+        size_t level, const Facet* top, size_t count, size_t refineLevels,
+        const QueryBlock* old, uint32_t nearBegin, uint32_t nearEnd);
+    void snapshotQueryNodes(const Facet& facet, size_t node, size_t oldNode,
+                            size_t refineLevels, QueryBlock& block,
+                            const QueryBlock* old, uint32_t nearBegin,
+                            uint32_t nearEnd);
+    static const QueryNode* queryChildren(const QueryNode& node,
+                                          const QueryBlock*& block);
+    std::shared_ptr<const QueryTree> queryTree() const;
+    void splitQueryCorners(const Facet::CPUVertex corners[3], size_t level,
+                           Facet::CPUVertex out[3],
+                           TileStreamer::TileRef& hint) const;
+    double queryHeight(const QueryTree& tree, const glm::dvec3& position) const;
+    bool queryNearerHit(const Facet::CPUVertex corners[3], size_t level,
+                        size_t refine, float relief, const glm::dvec3& from,
+                        const glm::dvec3& delta, TileStreamer::TileRef& hint,
+                        RayHit* hit) const;
+    bool querySegment(const QueryTree& tree, const QueryBlock& block,
+                      size_t first, size_t count,
+                      const glm::dvec3& from, const glm::dvec3& delta,
+                      TileStreamer::TileRef& hint, RayHit* hit) const;
+    static const uint8_t ChildCorners[4][3];
+    static double insideCone(const glm::dvec3 corners[3], const glm::dvec3& unit);
+    static bool queryTriangle(const Facet::CPUVertex corners[3],
+                              const glm::dvec3& from, const glm::dvec3& delta,
+                              RayHit* hit);
+    double queryEntry(const Facet::CPUVertex corners[3], float low, float high,
+                      const glm::dvec3& from, const glm::dvec3& delta) const;
+
+    // Immediate engine, and the orbit meshes.
+    void drawBatches(const std::vector<MeshBatch>& batches,
+                     const Drawable& drawable,
+                     const glm::mat4& transform,
+                     const glm::dvec3& viewPosition,
+                     glm::vec3 sunDirection);
+
+    // Pipeline.
+    void buildStage(Stage& stage, const Stage& previous,
+                    const glm::dvec3& viewPosition,
+                    const Camera::Frustum& frustum);
+    Mesh* uploadStage(const Stage& stage);
+    void advancePipeline(const glm::dvec3& viewPosition,
+                         const Camera::Frustum& frustum);
+    void swapStages();
+    void waitForPipeline();
+    void stopPipeline();
+    void pipelineMain();
+
+  public:
+    // Build the mesh that draw would upload for the current tree.
+    using MeshVertex = Facet::GPUVertex;
+    void buildWireframe(const glm::dvec3& viewPosition,
+                        std::vector<MeshBatch>& batches,
+                        std::vector<MeshVertex>& verts,
+                        std::vector<uint32_t>& indices);
+    void buildTriangles(const glm::dvec3& viewPosition,
+                        std::vector<MeshBatch>& batches,
+                        std::vector<MeshVertex>& verts,
+                        std::vector<uint32_t>& indices) {
+        drawSubtreeTriangles(viewPosition, batches, verts, indices);
+    }
 };
 
 } // namespace glit
@@ -0,0 +1,199 @@
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+#include "thread_pool.h"
+
+using namespace std;
+
+// The pool and queue index of the current thread, if it is a worker.
+static thread_local const glit::ThreadPool* tlsPool = nullptr;
+static thread_local size_t tlsQueue = 0;
+
+glit::ThreadPool::ThreadPool(size_t threads)
+  : queued_(0)
+  , sleepers_(0)
+  , done_(false)
+{
+#ifdef __EMSCRIPTEN__
+    threads = 0;
+#endif
+    for (size_t i = 0; i < threads + 1; ++i)
+        queues_.push_back(unique_ptr<Queue>(new Queue));
+    for (size_t i = 0; i < threads; ++i)
+        workers_.push_back(thread([this, i](){ workerLoop(i); }));
+}
+
+glit::ThreadPool::~ThreadPool()
+{
+    {
+        lock_guard<mutex> guard(sleepLock_);
+        done_ = true;
+    }
+    wake_.notify_all();
+    for (auto& worker : workers_)
+        worker.join();
+}
+
+/* static */ size_t
+glit::ThreadPool::defaultThreadCount()
+{
+    size_t hw = thread::hardware_concurrency();
+    return hw > 1 ? hw - 1 : 0;
+}
+
+size_t
+glit::ThreadPool::localQueue() const
+{
+    if (tlsPool == this)
+        return tlsQueue;
+    return queues_.size() - 1;
+}
+
+void
+glit::ThreadPool::spawn(TaskGroup& group, function<void()> task)
+{
+    ++group.pending_;
+    Task t{move(task), &group};
+    if (workers_.empty()) {
+        run(t);
+        return;
+    }
+
+    // Count the task under the same lock as the queue it is in, so that
+    // whoever takes it cannot count it out first. A thread counts itself
+    // in sleepers_ before it looks at queued_ for the last time, so either
+    // it sees this task or we see it. Taking the sleep lock after that
+    // means it is either asleep already or will see this task before it
+    // sleeps.
+    Queue& queue = *queues_[localQueue()];
+    {
+        lock_guard<mutex> guard(queue.lock);
+        queue.tasks.push_back(move(t));
+        ++queued_;
+    }
+    wakeSleepers(false);
+}
+
+void
+glit::ThreadPool::wakeSleepers(bool all)
+{
+    if (sleepers_ == 0)
+        return;
+    {
+        lock_guard<mutex> guard(sleepLock_);
+    }
+    if (all)
+        wake_.notify_all();
+    else
+        wake_.notify_one();
+}
+
+bool
+glit::ThreadPool::popLocal(size_t index, Task& task)
+{
+    Queue& queue = *queues_[index];
+    lock_guard<mutex> guard(queue.lock);
+    if (queue.tasks.empty())
+        return false;
+    task = move(queue.tasks.back());
+    queue.tasks.pop_back();
+    --queued_;
+    return true;
+}
+
+bool
+glit::ThreadPool::steal(size_t start, Task& task)
+{
+    for (size_t i = 1; i <= queues_.size(); ++i) {
+        Queue& queue = *queues_[(start + i) % queues_.size()];
+        lock_guard<mutex> guard(queue.lock);
+        if (queue.tasks.empty())
+            continue;
+        task = move(queue.tasks.front());
+        queue.tasks.pop_front();
+        --queued_;
+        return true;
+    }
+    return false;
+}
+
+bool
+glit::ThreadPool::findTask(Task& task)
+{
+    size_t index = localQueue();
+    return popLocal(index, task) || steal(index, task);
+}
+
+void
+glit::ThreadPool::run(Task& task)
+{
+    try {
+        task.fn();
+    } catch (...) {
+        lock_guard<mutex> guard(task.group->errorLock_);
+        if (!task.group->error_)
+            task.group->error_ = current_exception();
+    }
+    task.fn = nullptr;
+
+    // The group may be gone as soon as pending_ gets to zero, so we are done
+    // with it. Anyone waiting on it is asleep on wake_, or about to look at
+    // pending_ once more before it sleeps; see spawn.
+    if (--task.group->pending_ == 0)
+        wakeSleepers(true);
+}
+
+void
+glit::ThreadPool::wait(TaskGroup& group)
+{
+    Task task;
+    while (group.pending_ > 0) {
+        if (findTask(task)) {
+            run(task);
+            continue;
+        }
+        unique_lock<mutex> guard(sleepLock_);
+        ++sleepers_;
+        wake_.wait(guard, [this, &group](){
+            return group.pending_ == 0 || queued_ > 0;
+        });
+        --sleepers_;
+    }
+
+    lock_guard<mutex> guard(group.errorLock_);
+    if (group.error_) {
+        exception_ptr error = group.error_;
+        group.error_ = nullptr;
+        rethrow_exception(error);
+    }
+}
+
+void
+glit::ThreadPool::workerLoop(size_t index)
+{
+    tlsPool = this;
+    tlsQueue = index;
+
+    Task task;
+    while (true) {
+        if (findTask(task)) {
+            run(task);
+            continue;
+        }
+        unique_lock<mutex> guard(sleepLock_);
+        ++sleepers_;
+        wake_.wait(guard, [this](){ return done_ || queued_ > 0; });
+        --sleepers_;
+        if (done_)
+            return;
+    }
+}
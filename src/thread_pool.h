@@ -0,0 +1,110 @@
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace glit {
+
+// A fixed set of worker threads with one task deque each. Workers push and
+// pop their own tasks at the back of their deque, so recursive work stays
+// depth first and cache warm, and steal from the front of other deques when
+// they run dry. Tasks spawned from threads outside the pool land in a shared
+// injection deque that every worker steals from.
+//
+// A pool with zero threads runs every task inline at spawn, which gives us
+// the serial path for free. This is also what we get on emscripten, where
+// threads are not available.
+class ThreadPool
+{
+  public:
+    // Tracks completion of a set of spawned tasks. The first exception
+    // thrown by any task in the group is rethrown from wait.
+    class TaskGroup
+    {
+        friend class ThreadPool;
+        std::atomic<size_t> pending_;
+        std::mutex errorLock_;
+        std::exception_ptr error_;
+
+        TaskGroup(const TaskGroup&) = delete;
+        TaskGroup(TaskGroup&&) = delete;
+
+      public:
+        TaskGroup() : pending_(0) {}
+    };
+
+    explicit ThreadPool(size_t threads);
+    ~ThreadPool();
+
+    // One less than the number of hardware threads, since the thread that
+    // waits on a group also runs tasks.
+    static size_t defaultThreadCount();
+    size_t threadCount() const { return workers_.size(); }
+
+    void spawn(TaskGroup& group, std::function<void()> task);
+
+    // Whether a task spawned now would likely find a worker with nothing
+    // else to do. Work that can be split either way can use this to only
+    // pay for a task when it buys some parallelism.
+    bool wantsTasks() const { return queued_ < workers_.size(); }
+
+    // Block until all tasks in |group| are done, running queued tasks on the
+    // calling thread in the meantime and sleeping while there are none.
+    void wait(TaskGroup& group);
+
+  private:
+    struct Task {
+        std::function<void()> fn;
+        TaskGroup* group;
+    };
+    struct Queue {
+        std::mutex lock;
+        std::deque<Task> tasks;
+    };
+
+    // One queue per worker, plus the injection queue at the end.
+    std::vector<std::unique_ptr<Queue>> queues_;
+    std::vector<std::thread> workers_;
+
+    // Sleeping workers wait here for queued_ to become non-zero, and
+    // threads in wait for that or for their group to finish. sleepers_
+    // counts them, so that spawn and run can skip the wake when no one is
+    // asleep, which is most of the time while there is work to go round.
+    std::mutex sleepLock_;
+    std::condition_variable wake_;
+    std::atomic<size_t> queued_;
+    std::atomic<size_t> sleepers_;
+    std::atomic<bool> done_;
+
+    size_t localQueue() const;
+    bool popLocal(size_t index, Task& task);
+    bool steal(size_t start, Task& task);
+    bool findTask(Task& task);
+    void run(Task& task);
+    void wakeSleepers(bool all);
+    void workerLoop(size_t index);
+
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool(ThreadPool&&) = delete;
+};
+
+} // namespace glit
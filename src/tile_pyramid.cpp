@@ -0,0 +1,622 @@
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+#include "tile_pyramid.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <functional>
+#include <limits>
+#include <stdexcept>
+
+#include "icosphere.h"
+#include "utility.h"
+
+using namespace glm;
+using namespace std;
+
+namespace {
+
+// The corners of child |i| of a facet with corners |p| and edge midpoints
+// |m|, each midpoint opposite the corner with the same index. The same
+// layout as Terrain::ensureChildren.
+template <typename T>
+void
+childOf(const T p[3], const T m[3], size_t i, T out[3])
+{
+    switch (i) {
+    case 0: out[0] = p[0]; out[1] = m[2]; out[2] = m[1]; break;
+    case 1: out[0] = m[0]; out[1] = m[1]; out[2] = m[2]; break;
+    case 2: out[0] = m[2]; out[1] = p[1]; out[2] = m[0]; break;
+    case 3: out[0] = m[1]; out[1] = m[0]; out[2] = p[2]; break;
+    }
+}
+
+int
+cross2(const ivec2& a, const ivec2& b)
+{
+    return a.x * b.y - a.y * b.x;
+}
+
+void
+midpoints(const vec3 p[3], vec3 m[3])
+{
+    m[0] = normalize(p[1] + p[2]);
+    m[1] = normalize(p[0] + p[2]);
+    m[2] = normalize(p[0] + p[1]);
+}
+
+// How far inside the spherical triangle |p| the point |unit| is, as the
+// sine of the angle to the nearest edge; negative outside. The finest
+// tiles are a few metres across, and the planes of their edges get lost in
+// float, so this is all in double.
+double
+insideness(const vec3 p[3], const vec3& unit)
+{
+    dvec3 q[3] = {dvec3(p[0]), dvec3(p[1]), dvec3(p[2])};
+    double side = dot(q[0], cross(q[1], q[2])) >= 0.0 ? 1.0 : -1.0;
+    double result = numeric_limits<double>::max();
+    for (size_t e = 0; e < 3; ++e) {
+        dvec3 plane = normalize(cross(q[e], q[(e + 1) % 3]));
+        result = std::min(result, side * dot(dvec3(unit), plane));
+    }
+    return result;
+}
+
+// Residuals go out as unsigned varints, 7 bits at a time. The low bit says
+// whether the rest is a run of zeros, less one, or a single residual,
+// zigzagged so that small residuals of either sign are small numbers. Flat
+// stretches and colours that do not change then cost almost nothing.
+class ResidualWriter
+{
+    vector<uint8_t>& out_;
+    uint32_t zeros_;
+
+    void put(uint32_t bits) {
+        while (bits >= 0x80) {
+            out_.push_back(uint8_t(bits | 0x80));
+            bits >>= 7;
+        }
+        out_.push_back(uint8_t(bits));
+    }
+
+  public:
+    explicit ResidualWriter(vector<uint8_t>& out) : out_(out), zeros_(0) {}
+    ~ResidualWriter() { flush(); }
+
+    void write(int32_t value) {
+        if (value == 0) {
+            ++zeros_;
+            return;
+        }
+        flush();
+        put(((uint32_t(value) << 1) ^ uint32_t(value >> 31)) << 1);
+    }
+    void flush() {
+        if (zeros_)
+            put((zeros_ - 1) << 1 | 1);
+        zeros_ = 0;
+    }
+};
+
+class ResidualReader
+{
+    const uint8_t* data_;
+    const uint8_t* end_;
+    uint32_t zeros_;
+
+    bool get(uint32_t* bits) {
+        *bits = 0;
+        for (size_t shift = 0; shift < 35; shift += 7) {
+            if (data_ == end_)
+                return false;
+            uint8_t byte = *data_++;
+            *bits |= uint32_t(byte & 0x7f) << shift;
+            if (!(byte & 0x80))
+                return true;
+        }
+        return false;
+    }
+
+  public:
+    ResidualReader(const uint8_t* data, const uint8_t* end)
+      : data_(data), end_(end), zeros_(0)
+    {}
+    bool done() const { return data_ == end_ && zeros_ == 0; }
+
+    bool read(int32_t* value) {
+        if (zeros_) {
+            --zeros_;
+            *value = 0;
+            return true;
+        }
+        uint32_t bits;
+        if (!get(&bits))
+            return false;
+        if (bits & 1) {
+            zeros_ = bits >> 1;
+            *value = 0;
+            return true;
+        }
+        bits >>= 1;
+        *value = int32_t(bits >> 1) ^ -int32_t(bits & 1);
+        return true;
+    }
+};
+
+// The value at (i, j) predicted from the ones before it in the grid: the
+// parallelogram rule where we have all three neighbours, which is exact
+// for anything linear.
+template <typename Get>
+int32_t
+predict(size_t i, size_t j, Get get)
+{
+    if (j == 0)
+        return i ? get(i - 1, 0) : 0;
+    if (i == 0)
+        return get(0, j - 1);
+    return get(i - 1, j) + get(i, j - 1) - get(i - 1, j - 1);
+}
+
+// Walk |levels| levels down the grid of the tile with |corners|, n cells
+// along an edge, to the triangle that |unit| is in: its corners |p| and
+// their grid coordinates |g|.
+void
+gridTriangle(const vec3 corners[3], const vec3& unit, size_t levels, size_t n,
+             vec3 p[3], ivec2 g[3])
+{
+    copy(corners, corners + 3, p);
+    g[0] = ivec2(0, 0);
+    g[1] = ivec2(n, 0);
+    g[2] = ivec2(0, n);
+    for (size_t d = 0; d < levels; ++d) {
+        vec3 child[3];
+        size_t i = glit::TilePyramid::childContaining(p, unit, child);
+        ivec2 m[3] = {(g[1] + g[2]) / 2, (g[0] + g[2]) / 2, (g[0] + g[1]) / 2};
+        ivec2 next[3];
+        childOf(g, m, i, next);
+        copy(child, child + 3, p);
+        copy(next, next + 3, g);
+    }
+}
+
+} // namespace
+
+/* static */ size_t
+glit::TilePyramid::keyLevel(Key key)
+{
+    size_t bits = 0;
+    while (key >> bits)
+        ++bits;
+    return (bits - 6) / 2;
+}
+
+/* static */ void
+glit::TilePyramid::corners(Key key, vec3 out[3])
+{
+    size_t level = keyLevel(key);
+    const int* face = IcoSphere::BaseFaces[(key >> (2 * level)) & 0x1f];
+    for (size_t k = 0; k < 3; ++k)
+        out[k] = IcoSphere::baseVertices()[face[k]];
+    for (size_t l = level; l > 0; --l) {
+        vec3 m[3];
+        vec3 parent[3] = {out[0], out[1], out[2]};
+        midpoints(parent, m);
+        childOf(parent, m, size_t(key >> (2 * (l - 1))) & 3, out);
+    }
+}
+
+/* static */ size_t
+glit::TilePyramid::childContaining(const vec3 corners[3], const vec3& unit,
+                                   vec3 child[3])
+{
+    vec3 m[3];
+    midpoints(corners, m);
+    size_t best = 0;
+    double bestInside = -numeric_limits<double>::max();
+    for (size_t i = 0; i < 4; ++i) {
+        vec3 candidate[3];
+        childOf(corners, m, i, candidate);
+        double inside = insideness(candidate, unit);
+        if (inside > bestInside) {
+            bestInside = inside;
+            best = i;
+            copy(candidate, candidate + 3, child);
+        }
+    }
+    return best;
+}
+
+/* static */ bool
+glit::TilePyramid::covers(const vec3 corners[3], const vec3& unit)
+{
+    return insideness(corners, unit) >= 0.0;
+}
+
+/* static */ void
+glit::TilePyramid::samplePositions(const vec3 corners[3], size_t depth,
+                                   vector<vec3>& positions)
+{
+    size_t n = gridSize(depth);
+    positions.resize(sampleCount(depth));
+    positions[sampleIndex(0, 0, n)] = corners[0];
+    positions[sampleIndex(n, 0, n)] = corners[1];
+    positions[sampleIndex(0, n, n)] = corners[2];
+
+    // Split level by level, as the tree would. A midpoint only depends on
+    // the ends of its edge, so it does not matter which side finds it.
+    function<void(const ivec2*, size_t)> split = [&](const ivec2* g, size_t step) {
+        if (step == 1)
+            return;
+        ivec2 m[3] = {(g[1] + g[2]) / 2, (g[0] + g[2]) / 2, (g[0] + g[1]) / 2};
+        for (size_t e = 0; e < 3; ++e) {
+            const ivec2& a = g[e == 0 ? 1 : 0];
+            const ivec2& b = g[e == 2 ? 1 : 2];
+            positions[sampleIndex(m[e].x, m[e].y, n)] = normalize(
+                    positions[sampleIndex(a.x, a.y, n)] +
+                    positions[sampleIndex(b.x, b.y, n)]);
+        }
+        for (size_t i = 0; i < 4; ++i) {
+            ivec2 child[3];
+            childOf(g, m, i, child);
+            split(child, step / 2);
+        }
+    };
+    ivec2 grid[3] = {ivec2(0, 0), ivec2(n, 0), ivec2(0, n)};
+    split(grid, n);
+}
+
+/* static */ void
+glit::TilePyramid::downsample(const Tile children[4], size_t depth, Tile& parent)
+{
+    // The children together make a grid twice as fine as ours, numbered
+    // the same way. Each fine sample is in one to three of the children,
+    // which all agree on it.
+    int n = int(gridSize(depth));
+    auto locate = [n](int I, int J, size_t* child) {
+        if (I >= n) {
+            *child = 2;
+            return sampleIndex(I - n, J, n);
+        }
+        if (J >= n) {
+            *child = 3;
+            return sampleIndex(I, J - n, n);
+        }
+        if (I + J <= n) {
+            *child = 0;
+            return sampleIndex(I, J, n);
+        }
+        *child = 1;
+        return sampleIndex(n - I, n - J, n);
+    };
+    struct Value {
+        float height;
+        vec3 normal;
+        vec3 colour;
+    };
+    auto fine = [&](int I, int J) {
+        size_t child;
+        size_t index = locate(I, J, &child);
+        const Tile& tile = children[child];
+        return Value{tile.heights[index], tile.normals[index], vec3(tile.colours[index])};
+    };
+
+    size_t count = sampleCount(depth);
+    parent.heights.resize(count);
+    parent.normals.resize(count);
+    parent.colours.resize(count);
+    const ivec2 around[6] = {ivec2(1, 0), ivec2(-1, 0), ivec2(0, 1),
+                             ivec2(0, -1), ivec2(1, -1), ivec2(-1, 1)};
+    for (int j = 0; j <= n; ++j) {
+        for (int i = 0; i <= n - j; ++i) {
+            ivec2 at(2 * i, 2 * j);
+            Value v = fine(at.x, at.y);
+            bool edge = i == 0 || j == 0 || i + j == n;
+            if (!edge) {
+                Value sum{0.f, vec3(0.f), vec3(0.f)};
+                for (auto& offset : around) {
+                    Value a = fine(at.x + offset.x, at.y + offset.y);
+                    sum.height += a.height;
+                    sum.normal += a.normal;
+                    sum.colour += a.colour;
+                }
+                v.height = 0.5f * v.height + sum.height / 12.f;
+                v.normal = normalize(0.5f * v.normal + sum.normal / 12.f);
+                v.colour = 0.5f * v.colour + sum.colour / 12.f;
+            }
+            size_t index = sampleIndex(i, j, n);
+            parent.heights[index] = v.height;
+            parent.normals[index] = v.normal;
+            parent.colours[index] = u8vec3(round(clamp(v.colour, 0.f, 255.f)));
+        }
+    }
+}
+
+/* static */ glit::TilePyramid::Sample
+glit::TilePyramid::sample(const Tile& tile, size_t depth,
+                          const vec3 corners[3], const vec3& unit)
+{
+    size_t n = gridSize(depth);
+    vec3 p[3];
+    ivec2 g[3];
+    gridTriangle(corners, unit, depth, n, p, g);
+
+    // Where the ray to the point crosses the plane of the triangle. Deep
+    // down the triangles are tiny next to the unit vectors, so take the
+    // corners relative to the point and work in double; in float the
+    // weights come out wrong enough to move a height by a metre.
+    dvec3 u(unit);
+    dvec3 q[3] = {dvec3(p[0]) - u, dvec3(p[1]) - u, dvec3(p[2]) - u};
+    double side = dot(u, cross(q[1] - q[0], q[2] - q[0])) >= 0.0 ? 1.0 : -1.0;
+    dvec3 dw(std::max(0.0, side * dot(u, cross(q[1], q[2]))),
+             std::max(0.0, side * dot(u, cross(q[2], q[0]))),
+             std::max(0.0, side * dot(u, cross(q[0], q[1]))));
+    double total = dw.x + dw.y + dw.z;
+    vec3 w = total > 0.0 ? vec3(dw / total) : vec3(1.f, 0.f, 0.f);
+
+    Sample result{0.f, vec3(0.f), vec3(0.f)};
+    for (size_t k = 0; k < 3; ++k) {
+        size_t index = sampleIndex(g[k].x, g[k].y, n);
+        result.height += w[k] * tile.heights[index];
+        result.normal += w[k] * tile.normals[index];
+        result.colour += w[k] * vec3(tile.colours[index]) / 255.f;
+    }
+    result.normal = normalize(result.normal);
+    return result;
+}
+
+/* static */ float
+glit::TilePyramid::maxHeight(const Tile& tile, size_t depth,
+                             const vec3 corners[3], const vec3& unit, size_t levels)
+{
+    size_t n = gridSize(depth);
+    vec3 p[3];
+    ivec2 g[3];
+    gridTriangle(corners, unit, std::min(levels, depth), n, p, g);
+
+    // The samples on or inside the grid triangle, from its bounding box.
+    ivec2 lo = min(g[0], min(g[1], g[2]));
+    ivec2 hi = max(g[0], max(g[1], g[2]));
+    int side = cross2(g[1] - g[0], g[2] - g[0]) >= 0 ? 1 : -1;
+    float result = tile.heights[sampleIndex(g[0].x, g[0].y, n)];
+    for (int j = lo.y; j <= hi.y; ++j) {
+        for (int i = lo.x; i <= hi.x; ++i) {
+            ivec2 at(i, j);
+            if (side * cross2(g[1] - g[0], at - g[0]) < 0 ||
+                side * cross2(g[2] - g[1], at - g[1]) < 0 ||
+                side * cross2(g[0] - g[2], at - g[2]) < 0)
+            {
+                continue;
+            }
+            result = std::max(result, tile.heights[sampleIndex(i, j, n)]);
+        }
+    }
+    return result;
+}
+
+/* static */ unique_ptr<glit::TilePyramid>
+glit::TilePyramid::open(const string& path)
+{
+    unique_ptr<MappedFile> file = MappedFile::open(path);
+    if (!file)
+        return nullptr;
+
+    unique_ptr<TilePyramid> pyramid(new TilePyramid);
+    Header& header = pyramid->header_;
+    if (file->size() < sizeof(header))
+        throw runtime_error("tile pyramid too short: " + path);
+    memcpy(&header, file->data(), sizeof(header));
+    if (memcmp(header.magic, "glittile", sizeof(header.magic)) != 0)
+        throw runtime_error("not a tile pyramid: " + path);
+    if (header.version != Version)
+        throw runtime_error("unsupported tile pyramid version: " + path);
+    if (header.depth > 8 || header.heightStep <= 0.f)
+        throw runtime_error("bad tile pyramid header: " + path);
+
+    size_t indexEnd = sizeof(header) + header.tileCount * sizeof(IndexEntry);
+    if (header.tileCount > file->size() / sizeof(IndexEntry) || indexEnd > file->size())
+        throw runtime_error("tile pyramid index truncated: " + path);
+    const char* data = static_cast<const char*>(file->data());
+    pyramid->index_ = reinterpret_cast<const IndexEntry*>(data + sizeof(header));
+    for (size_t i = 0; i < header.tileCount; ++i) {
+        const IndexEntry& entry = pyramid->index_[i];
+        if (entry.offset < indexEnd || entry.size > file->size() - entry.offset)
+            throw runtime_error("tile pyramid tile truncated: " + path);
+        if (i > 0 && entry.key <= pyramid->index_[i - 1].key)
+            throw runtime_error("tile pyramid index out of order: " + path);
+    }
+    pyramid->file_ = move(file);
+    return pyramid;
+}
+
+const glit::TilePyramid::IndexEntry*
+glit::TilePyramid::find(Key key) const
+{
+    const IndexEntry* end = index_ + header_.tileCount;
+    const IndexEntry* found = lower_bound(index_, end, key,
+        [](const IndexEntry& entry, Key key) { return entry.key < key; });
+    if (found == end || found->key != key)
+        return nullptr;
+    return found;
+}
+
+size_t
+glit::TilePyramid::tileBytes(Key key) const
+{
+    const IndexEntry* entry = find(key);
+    return entry ? size_t(entry->size) : 0;
+}
+
+bool
+glit::TilePyramid::decode(Key key, Tile& tile) const
+{
+    const IndexEntry* entry = find(key);
+    if (!entry)
+        return false;
+    const uint8_t* data = static_cast<const uint8_t*>(file_->data()) + entry->offset;
+    if (!decodeTile(data, size_t(entry->size), header_.depth, header_.heightStep, tile))
+        throw runtime_error("corrupt tile in tile pyramid");
+    return true;
+}
+
+glit::TilePyramid::Key
+glit::TilePyramid::deepest(const vec3& unit, size_t maxLevel, vec3 corners[3]) const
+{
+    size_t root = 0;
+    double bestInside = -numeric_limits<double>::max();
+    for (size_t i = 0; i < IcoSphere::BaseFaceCount; ++i) {
+        vec3 p[3];
+        for (size_t k = 0; k < 3; ++k)
+            p[k] = IcoSphere::baseVertices()[IcoSphere::BaseFaces[i][k]];
+        double inside = insideness(p, unit);
+        if (inside > bestInside) {
+            bestInside = inside;
+            root = i;
+            copy(p, p + 3, corners);
+        }
+    }
+
+    Key key = rootKey(root);
+    for (size_t level = 0; level < maxLevel; ++level) {
+        vec3 child[3];
+        Key next = childKey(key, childContaining(corners, unit, child));
+        if (!contains(next))
+            break;
+        key = next;
+        copy(child, child + 3, corners);
+    }
+    return key;
+}
+
+/* static */ void
+glit::TilePyramid::encodeTile(const Tile& tile, size_t depth, float heightStep,
+                              vector<uint8_t>& out)
+{
+    size_t n = gridSize(depth);
+    size_t count = sampleCount(depth);
+    vector<int32_t> values(count);
+    ResidualWriter writer(out);
+    auto channel = [&](function<int32_t(size_t)> quantize) {
+        for (size_t k = 0; k < count; ++k)
+            values[k] = quantize(k);
+        auto get = [&](size_t i, size_t j) { return values[sampleIndex(i, j, n)]; };
+        for (size_t j = 0; j <= n; ++j) {
+            for (size_t i = 0; i <= n - j; ++i)
+                writer.write(get(i, j) - predict(i, j, get));
+        }
+    };
+    channel([&](size_t k) { return int32_t(lround(tile.heights[k] / heightStep)); });
+    for (size_t c = 0; c < 2; ++c) {
+        channel([&](size_t k) {
+            return int32_t(lround(clamp(util::octahedralEncode(tile.normals[k])[c], -1.f, 1.f) * 127.f));
+        });
+    }
+    for (size_t c = 0; c < 3; ++c)
+        channel([&](size_t k) { return int32_t(tile.colours[k][c]); });
+}
+
+/* static */ bool
+glit::TilePyramid::decodeTile(const uint8_t* data, size_t size, size_t depth,
+                              float heightStep, Tile& tile)
+{
+    size_t n = gridSize(depth);
+    size_t count = sampleCount(depth);
+    ResidualReader reader(data, data + size);
+    vector<int32_t> values(count);
+    auto channel = [&]() {
+        auto get = [&](size_t i, size_t j) { return values[sampleIndex(i, j, n)]; };
+        for (size_t j = 0; j <= n; ++j) {
+            for (size_t i = 0; i <= n - j; ++i) {
+                int32_t residual;
+                if (!reader.read(&residual))
+                    return false;
+                values[sampleIndex(i, j, n)] = predict(i, j, get) + residual;
+            }
+        }
+        return true;
+    };
+
+    tile.heights.resize(count);
+    tile.normals.resize(count);
+    tile.colours.resize(count);
+    if (!channel())
+        return false;
+    for (size_t k = 0; k < count; ++k)
+        tile.heights[k] = float(values[k]) * heightStep;
+    vector<vec2> octahedral(count);
+    for (size_t c = 0; c < 2; ++c) {
+        if (!channel())
+            return false;
+        for (size_t k = 0; k < count; ++k)
+            octahedral[k][c] = float(values[k]) / 127.f;
+    }
+    for (size_t k = 0; k < count; ++k)
+        tile.normals[k] = util::octahedralDecode(octahedral[k]);
+    for (size_t c = 0; c < 3; ++c) {
+        if (!channel())
+            return false;
+        for (size_t k = 0; k < count; ++k)
+            tile.colours[k][c] = uint8_t(clamp(values[k], 0, 255));
+    }
+    return reader.done();
+}
+
+glit::TilePyramid::Builder::Builder(float radius, size_t depth, float heightStep)
+  : radius_(radius)
+  , depth_(depth)
+  , heightStep_(heightStep)
+  , levels_(0)
+{}
+
+void
+glit::TilePyramid::Builder::add(Key key, const Tile& tile)
+{
+    vector<uint8_t>& out = tiles_[key];
+    out.clear();
+    encodeTile(tile, depth_, heightStep_, out);
+    levels_ = std::max(levels_, keyLevel(key) + 1);
+}
+
+size_t
+glit::TilePyramid::Builder::bytes() const
+{
+    size_t total = sizeof(Header) + tiles_.size() * sizeof(IndexEntry);
+    for (auto& tile : tiles_)
+        total += tile.second.size();
+    return total;
+}
+
+bool
+glit::TilePyramid::Builder::write(const string& path) const
+{
+    Header header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, "glittile", sizeof(header.magic));
+    header.version = Version;
+    header.depth = uint32_t(depth_);
+    header.levels = uint32_t(levels_);
+    header.radius = radius_;
+    header.heightStep = heightStep_;
+    header.tileCount = tiles_.size();
+
+    vector<char> contents(bytes());
+    memcpy(contents.data(), &header, sizeof(header));
+    IndexEntry* index = reinterpret_cast<IndexEntry*>(contents.data() + sizeof(header));
+    size_t offset = sizeof(header) + tiles_.size() * sizeof(IndexEntry);
+    for (auto& tile : tiles_) {
+        *index++ = IndexEntry{tile.first, offset, tile.second.size()};
+        memcpy(contents.data() + offset, tile.second.data(), tile.second.size());
+        offset += tile.second.size();
+    }
+    return MappedFile::write(path, contents.data(), contents.size());
+}
@@ -0,0 +1,186 @@
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+#pragma once
+
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <glm/glm.hpp>
+#include <glm/gtc/type_precision.hpp>
+
+#include "mapped_file.h"
+
+namespace glit {
+
+// A pyramid of baked terrain tiles, in a file that we map and read in
+// place. tools/bake_tiles writes them.
+//
+// A tile covers one facet of the subdivided icosahedron, the same facets
+// that Terrain's tree is made of, and is keyed by its path from the root
+// the same way as a terrain chunk: a marker bit, the root face, then two
+// bits per level for the child, numbered as in Terrain::ensureChildren.
+// Inside, the facet is split |depth| more times into a triangular grid of
+// samples, each new one at the normalized midpoint of its edge, just as
+// the tree would split. With n = 2^depth cells along an edge, sample
+// (i, j) is i steps from corner 0 towards corner 1 and j steps from corner
+// 0 towards corner 2. Tiles that share an edge have their samples along it
+// at the same points and with the same values.
+//
+// Every sample has a height above the radius, a normal and a colour. The
+// finest tiles sample the source; each tile above them is filtered down
+// from its four children (see downsample), so that a coarse tile is a
+// proper mip of the ones below it rather than an aliased point sample.
+//
+// The file is:
+//   Header
+//   IndexEntry[tileCount], sorted by key. This puts each level after the
+//       one above it and in quadtree order within the level, so the coarse
+//       levels sit together at the front of the file.
+//   The tiles, in the same order.
+// Heights are quantized to a fixed step for the whole pyramid, so that
+// shared edges stay the same, normals are octahedral with 8 bits a
+// component and colours are 8 bit RGB. Each value is predicted from the
+// samples before it in the grid and the residual written as a varint,
+// with runs of zeros collapsed; see ResidualWriter.
+class TilePyramid
+{
+  public:
+    using Key = uint64_t;
+    static Key rootKey(size_t i) { return Key(0x20 | i); }
+    static Key childKey(Key parent, size_t i) { return (parent << 2) | Key(i); }
+    static Key parentKey(Key key) { return key >> 2; }
+    static size_t keyLevel(Key key);
+
+    // The corners of tile |key| on the unit sphere.
+    static void corners(Key key, glm::vec3 out[3]);
+
+    // Which of the four children of the facet with |corners| |unit| is in,
+    // and that child's corners.
+    static size_t childContaining(const glm::vec3 corners[3], const glm::vec3& unit,
+                                  glm::vec3 child[3]);
+
+    // Whether |unit| is in the facet with |corners|, edges included.
+    static bool covers(const glm::vec3 corners[3], const glm::vec3& unit);
+
+    // The samples of a tile; see sampleIndex for the order.
+    static size_t gridSize(size_t depth) { return size_t(1) << depth; }
+    static size_t sampleCount(size_t depth) {
+        size_t n = gridSize(depth);
+        return (n + 1) * (n + 2) / 2;
+    }
+    static size_t sampleIndex(size_t i, size_t j, size_t n) {
+        return j * (n + 1) - j * (j - 1) / 2 + i;
+    }
+    static void samplePositions(const glm::vec3 corners[3], size_t depth,
+                                std::vector<glm::vec3>& positions);
+
+    struct Tile {
+        std::vector<float> heights;
+        std::vector<glm::vec3> normals;
+        std::vector<glm::u8vec3> colours;
+    };
+
+    // Filter four child tiles down to their parent. Inside the parent,
+    // each sample is a weighted average of the child sample at the same
+    // point and its six neighbours. Samples on the parent's edges are taken
+    // as they are: the tile on the other side may be split more or less
+    // deeply than this one, and this way the two still agree.
+    static void downsample(const Tile children[4], size_t depth, Tile& parent);
+
+    // |unit| interpolated from the grid of |tile|, whose corners are
+    // |corners|. Points just outside the tile clamp to its edge. Colours
+    // come out in [0, 1].
+    struct Sample {
+        float height;
+        glm::vec3 normal;
+        glm::vec3 colour;
+    };
+    static Sample sample(const Tile& tile, size_t depth,
+                         const glm::vec3 corners[3], const glm::vec3& unit);
+
+    // The highest sample of |tile| in the facet |levels| below it that
+    // |unit| is in. Past the grid, that is the grid triangle |unit| is in.
+    static float maxHeight(const Tile& tile, size_t depth,
+                           const glm::vec3 corners[3], const glm::vec3& unit,
+                           size_t levels);
+
+    // Returns null if there is no file at |path|; throws if there is one
+    // but it is not a tile pyramid we can read.
+    static std::unique_ptr<TilePyramid> open(const std::string& path);
+
+    float radius() const { return header_.radius; }
+    float heightStep() const { return header_.heightStep; }
+    size_t depth() const { return header_.depth; }
+    size_t levels() const { return header_.levels; }
+    size_t tileCount() const { return size_t(header_.tileCount); }
+    size_t tileBytes(Key key) const;
+
+    bool contains(Key key) const { return find(key) != nullptr; }
+    bool decode(Key key, Tile& tile) const;
+
+    // The deepest tile at or above |maxLevel| that |unit| is in, and its
+    // corners.
+    Key deepest(const glm::vec3& unit, size_t maxLevel, glm::vec3 corners[3]) const;
+
+    // Collects encoded tiles and writes them out as a pyramid.
+    class Builder
+    {
+        float radius_;
+        size_t depth_;
+        float heightStep_;
+        size_t levels_;
+        std::map<Key, std::vector<uint8_t>> tiles_;
+
+      public:
+        Builder(float radius, size_t depth, float heightStep);
+        void add(Key key, const Tile& tile);
+        size_t tileCount() const { return tiles_.size(); }
+        size_t bytes() const;
+        bool write(const std::string& path) const;
+    };
+
+  private:
+    struct Header {
+        char magic[8];
+        uint32_t version;
+        uint32_t depth;
+        uint32_t levels;
+        float radius;
+        float heightStep;
+        uint32_t reserved;
+        uint64_t tileCount;
+    };
+    struct IndexEntry {
+        Key key;
+        uint64_t offset;
+        uint64_t size;
+    };
+    constexpr static uint32_t Version = 1;
+
+    std::unique_ptr<MappedFile> file_;
+    Header header_;
+    const IndexEntry* index_;
+
+    TilePyramid() {}
+    const IndexEntry* find(Key key) const;
+
+    static void encodeTile(const Tile& tile, size_t depth, float heightStep,
+                           std::vector<uint8_t>& out);
+    static bool decodeTile(const uint8_t* data, size_t size, size_t depth,
+                           float heightStep, Tile& tile);
+};
+
+} // namespace glit
@@ -0,0 +1,407 @@
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+#include "tile_streamer.h"
+
+#include <algorithm>
+#include <cmath>
+#include <functional>
+#include <iostream>
+#include <limits>
+#include <stdexcept>
+#include <vector>
+
+#include "icosphere.h"
+
+using namespace glm;
+using namespace std;
+
+// Tiles someone is waiting on sort before any prefetch.
+static const double PrefetchPriority = 1e9;
+
+// The most steps along the way ahead that prefetch moves a tile.
+static const size_t PrefetchSteps = 32;
+
+glit::TileStreamer::TileStreamer(unique_ptr<TilePyramid> pyramid,
+                                 size_t threads, size_t budget)
+  : pyramid_(move(pyramid))
+  , budget_(budget)
+  , prefetchFrames_(DefaultPrefetchFrames)
+  , residentBytes_(0)
+  , frame_(0)
+  , tasks_(0)
+  , planning_(false)
+  , quit_(false)
+  , stats_()
+#ifdef __EMSCRIPTEN__
+  , pool_(new ThreadPool(0))
+#else
+  , pool_(new ThreadPool(threads))
+#endif
+{
+    for (size_t i = 0; i < IcoSphere::BaseFaceCount; ++i) {
+        TileRef root = load(TilePyramid::rootKey(i));
+        if (!root)
+            throw runtime_error("tile pyramid is missing a root tile");
+        insert(root, true);
+    }
+}
+
+glit::TileStreamer::~TileStreamer()
+{
+    {
+        lock_guard<mutex> guard(lock_);
+        quit_ = true;
+        clearQueue();
+    }
+    pool_->wait(loads_);
+}
+
+glit::TileStreamer::TileRef
+glit::TileStreamer::find(const vec3& unit, size_t level, bool* complete)
+{
+    vec3 corners[3];
+    TilePyramid::Key wanted = pyramid_->deepest(unit, level, corners);
+
+    TileRef tile;
+    bool queued = false;
+    {
+        lock_guard<mutex> guard(lock_);
+        ++stats_.finds;
+        seen_.insert(wanted);
+
+        // The roots are pinned, so we always end up with something.
+        TilePyramid::Key key = wanted;
+        auto found = resident_.find(key);
+        while (found == resident_.end()) {
+            key = TilePyramid::parentKey(key);
+            found = resident_.find(key);
+        }
+        Entry& entry = found->second;
+        entry.lastUsed = frame_;
+        if (!entry.pinned)
+            lru_.splice(lru_.end(), lru_, entry.lru);
+        tile = entry.tile;
+
+        // A tile that would not decode is as good as not being there.
+        *complete = key == wanted || broken_.count(wanted);
+        if (*complete) {
+            ++stats_.hits;
+        } else {
+            ++stats_.stalls;
+            request(wanted, double(TilePyramid::keyLevel(wanted)), true);
+            queued = true;
+        }
+    }
+    if (queued)
+        startLoads();
+    return tile;
+}
+
+void
+glit::TileStreamer::prefetch(const dvec3& velocity, double maxSpeed)
+{
+    vector<TilePyramid::Key> seen;
+    {
+        lock_guard<mutex> guard(lock_);
+        ++frame_;
+
+        // Last frame's plan is stale now; anything someone asked for is not.
+        for (auto i = queue_.begin(); i != queue_.end();) {
+            if (i->second.demand)
+                ++i;
+            else
+                i = queue_.erase(i);
+        }
+        rebuildOrder();
+        seen.assign(seen_.begin(), seen_.end());
+        seen_.clear();
+        if (planning_ || seen.empty() || prefetchFrames_ == 0)
+            return;
+        planning_ = true;
+    }
+
+    // Working out the path is a few thousand walks down the pyramid, so
+    // that goes on the pool as well.
+    double speed = std::min(length(velocity), maxSpeed);
+    dvec3 direction = speed > 0.0 ? velocity / length(velocity) : dvec3(0.0);
+    double reach = speed * double(prefetchFrames_);
+    pool_->spawn(loads_, [this, seen, direction, reach](){
+        plan(seen, direction, reach);
+    });
+}
+
+// The tiles we will want further on are about the ones we wanted last
+// frame, |seen|, moved along with us. So we queue those moved a tile at a
+// time up to |reach| meters the way we are going, nearest first. We also
+// queue the children of the deepest ones, so that coming down does not
+// stall at every level on the way.
+void
+glit::TileStreamer::plan(const vector<TilePyramid::Key>& seen,
+                         const dvec3& direction, double reach)
+{
+    const vec3* base = IcoSphere::baseVertices();
+    double edgeAngle = acos(double(dot(base[IcoSphere::BaseFaces[0][0]],
+                                       base[IcoSphere::BaseFaces[0][1]])));
+    double radius = double(pyramid_->radius());
+    size_t deepest = 0;
+    for (TilePyramid::Key key : seen)
+        deepest = std::max(deepest, TilePyramid::keyLevel(key));
+
+    vector<pair<TilePyramid::Key, double>> wanted;
+    vec3 corners[3];
+    for (TilePyramid::Key key : seen) {
+        size_t level = TilePyramid::keyLevel(key);
+        TilePyramid::corners(key, corners);
+        dvec3 center = normalize(dvec3(corners[0] + corners[1] + corners[2])) * radius;
+        double width = ldexp(edgeAngle, -int(level)) * radius;
+        size_t steps = size_t(std::min(double(PrefetchSteps), reach / width));
+        for (size_t s = 1; s <= steps; ++s) {
+            // Sooner before later, then coarse before fine.
+            double along = reach * double(s) / double(steps);
+            double priority = PrefetchPriority + along / reach * PrefetchSteps * 64.0 +
+                              double(level);
+            vec3 unit(normalize(center + direction * along));
+            wanted.emplace_back(pyramid_->deepest(unit, level, corners), priority);
+        }
+        if (level == deepest && level + 1 < pyramid_->levels()) {
+            double priority = PrefetchPriority + PrefetchSteps * 64.0 + double(level + 1);
+            for (size_t i = 0; i < 4; ++i)
+                wanted.emplace_back(TilePyramid::childKey(key, i), priority);
+        }
+    }
+    sort(wanted.begin(), wanted.end(), [](const pair<TilePyramid::Key, double>& a,
+                                          const pair<TilePyramid::Key, double>& b) {
+        return a.second < b.second;
+    });
+
+    {
+        lock_guard<mutex> guard(lock_);
+        for (auto& tile : wanted) {
+            if (pyramid_->contains(tile.first))
+                request(tile.first, tile.second, false);
+        }
+        planning_ = false;
+    }
+    startLoads();
+}
+
+void
+glit::TileStreamer::drain()
+{
+    {
+        lock_guard<mutex> guard(lock_);
+        clearQueue();
+    }
+    pool_->wait(loads_);
+}
+
+void
+glit::TileStreamer::setBudget(size_t bytes)
+{
+    lock_guard<mutex> guard(lock_);
+    budget_ = bytes;
+    evict();
+}
+
+glit::TileStreamer::Stats
+glit::TileStreamer::stats() const
+{
+    lock_guard<mutex> guard(lock_);
+    Stats stats = stats_;
+    stats.residentTiles = resident_.size();
+    stats.residentBytes = residentBytes_;
+    stats.queued = queue_.size() + loading_.size();
+    return stats;
+}
+
+void
+glit::TileStreamer::resetStats()
+{
+    lock_guard<mutex> guard(lock_);
+    stats_ = Stats();
+}
+
+// Runs without the lock; the pyramid is read only. A tile that is there
+// but will not decode comes back null, the same as one that is not there.
+glit::TileStreamer::TileRef
+glit::TileStreamer::load(TilePyramid::Key key) const
+{
+    shared_ptr<Tile> tile(new Tile);
+    try {
+        if (!pyramid_->decode(key, tile->data))
+            return nullptr;
+    } catch (const runtime_error&) {
+        return nullptr;
+    }
+    tile->key = key;
+    tile->level = TilePyramid::keyLevel(key);
+    tile->leaf = !pyramid_->contains(TilePyramid::childKey(key, 0));
+    TilePyramid::corners(key, tile->corners);
+    auto range = minmax_element(tile->data.heights.begin(), tile->data.heights.end());
+    tile->minHeight = *range.first;
+    tile->maxHeight = *range.second;
+    tile->bytes = sizeof(Tile) +
+                  tile->data.heights.size() * sizeof(tile->data.heights[0]) +
+                  tile->data.normals.size() * sizeof(tile->data.normals[0]) +
+                  tile->data.colours.size() * sizeof(tile->data.colours[0]);
+    return tile;
+}
+
+// Called with the lock held.
+void
+glit::TileStreamer::request(TilePyramid::Key key, double priority, bool demand)
+{
+    if (resident_.count(key) || loading_.count(key) || broken_.count(key))
+        return;
+    auto found = queue_.find(key);
+    if (found != queue_.end()) {
+        found->second.demand = found->second.demand || demand;
+        if (priority < found->second.priority) {
+            found->second.priority = priority;
+            pushOrder(key, priority);
+        }
+        return;
+    }
+    if (queue_.size() < MaxQueued || demand) {
+        queue_.emplace(key, Request{priority, demand});
+        pushOrder(key, priority);
+    }
+}
+
+// Called with the lock held. order_ is a heap of what is in queue_, lowest
+// priority on top. Rather than dig an entry out when its request goes or
+// moves up, we leave it and skip it once it gets to the top; see popQueue.
+void
+glit::TileStreamer::pushOrder(TilePyramid::Key key, double priority)
+{
+    order_.emplace_back(priority, key);
+    push_heap(order_.begin(), order_.end(), greater<pair<double, TilePyramid::Key>>());
+}
+
+// Called with the lock held, after dropping requests, so that what they
+// left in the heap does not pile up.
+void
+glit::TileStreamer::rebuildOrder()
+{
+    order_.clear();
+    for (auto& queued : queue_)
+        order_.emplace_back(queued.second.priority, queued.first);
+    make_heap(order_.begin(), order_.end(), greater<pair<double, TilePyramid::Key>>());
+}
+
+// Called with the lock held.
+void
+glit::TileStreamer::clearQueue()
+{
+    queue_.clear();
+    order_.clear();
+}
+
+// Called with the lock held, with something in the queue.
+glit::TilePyramid::Key
+glit::TileStreamer::popQueue(bool* demand)
+{
+    while (true) {
+        pop_heap(order_.begin(), order_.end(), greater<pair<double, TilePyramid::Key>>());
+        pair<double, TilePyramid::Key> top = order_.back();
+        order_.pop_back();
+        auto found = queue_.find(top.second);
+        if (found == queue_.end() || found->second.priority != top.first)
+            continue;
+        *demand = found->second.demand;
+        queue_.erase(found);
+        if (queue_.empty())
+            order_.clear();
+        return top.second;
+    }
+}
+
+// Called with the lock held.
+void
+glit::TileStreamer::insert(TileRef tile, bool pinned)
+{
+    if (resident_.count(tile->key))
+        return;
+    Entry entry{tile, frame_, pinned, lru_.end()};
+    if (!pinned)
+        entry.lru = lru_.insert(lru_.end(), tile->key);
+    resident_.emplace(tile->key, entry);
+    residentBytes_ += tile->bytes;
+    evict();
+}
+
+// Called with the lock held. The LRU list is in order of use, so once we
+// get to a tile used this frame, so were all the rest.
+void
+glit::TileStreamer::evict()
+{
+    while (residentBytes_ > budget_ && !lru_.empty()) {
+        auto found = resident_.find(lru_.front());
+        if (found->second.lastUsed >= frame_)
+            break;
+        residentBytes_ -= found->second.tile->bytes;
+        resident_.erase(found);
+        lru_.pop_front();
+        ++stats_.evictions;
+    }
+}
+
+// Keep a task running per thread while there is anything queued. Each one
+// loads until the queue is empty.
+void
+glit::TileStreamer::startLoads()
+{
+    size_t start = 0;
+    {
+        lock_guard<mutex> guard(lock_);
+        size_t most = std::max(pool_->threadCount(), size_t(1));
+        while (tasks_ < most && tasks_ < queue_.size() && !quit_) {
+            ++tasks_;
+            ++start;
+        }
+    }
+    for (size_t i = 0; i < start; ++i)
+        pool_->spawn(loads_, [this](){ loadNext(); });
+}
+
+void
+glit::TileStreamer::loadNext()
+{
+    unique_lock<mutex> guard(lock_);
+    AutoLoadTask task(*this, guard);
+    while (!quit_ && !queue_.empty()) {
+        bool demand;
+        TilePyramid::Key key = popQueue(&demand);
+
+        // Prefetch only fills three quarters of the budget; past that it
+        // would only push out what we are using, or each other.
+        if (!demand && residentBytes_ >= budget_ - budget_ / 4)
+            continue;
+        loading_.insert(key);
+        task.loading(key);
+
+        guard.unlock();
+        TileRef tile = load(key);
+        guard.lock();
+
+        loading_.erase(key);
+        task.loaded();
+        if (!tile) {
+            cerr << "tile " << hex << key << dec << " would not decode" << endl;
+            broken_.insert(key);
+            continue;
+        }
+        insert(tile, false);
+        ++(demand ? stats_.demandLoads : stats_.prefetchLoads);
+    }
+}
@@ -0,0 +1,196 @@
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+#pragma once
+
+#include <cstdint>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
+#include <glm/glm.hpp>
+
+#include "thread_pool.h"
+#include "tile_pyramid.h"
+
+namespace glit {
+
+// Keeps the tiles of a TilePyramid that we are using decoded in memory, and
+// loads the rest on a pool of I/O threads, so that nothing that asks for a
+// tile ever waits on the disk.
+//
+// Asking for a tile that is not resident queues it and hands back its
+// nearest resident ancestor instead. The roots are loaded up front and never
+// evicted, so there is always one. Ahead of the viewer, prefetch queues the
+// tiles it will want along the way it is moving, out to as far as it will
+// get in PrefetchFrames frames at its current speed.
+//
+// Resident tiles are kept in least recently used order and evicted once we
+// are over the byte budget, except for the ones used this frame; those we
+// keep even if it takes us over for a while. Tiles are handed out by shared
+// pointer, so eviction never pulls one out from under a reader.
+//
+// On emscripten, where there are no threads, loads run inline.
+class TileStreamer
+{
+  public:
+    // A decoded tile and what we need to sample it. The pyramid goes no
+    // deeper than a leaf tile.
+    struct Tile {
+        TilePyramid::Key key;
+        size_t level;
+        bool leaf;
+        glm::vec3 corners[3];
+        TilePyramid::Tile data;
+        float minHeight;
+        float maxHeight;
+        size_t bytes;
+    };
+    using TileRef = std::shared_ptr<const Tile>;
+
+    constexpr static size_t DefaultThreads = 2;
+    constexpr static size_t DefaultBudget = 64 << 20;
+    constexpr static size_t DefaultPrefetchFrames = 120;
+
+    TileStreamer(std::unique_ptr<TilePyramid> pyramid,
+                 size_t threads = DefaultThreads,
+                 size_t budget = DefaultBudget);
+    ~TileStreamer();
+
+    const TilePyramid& pyramid() const { return *pyramid_; }
+
+    // The tile at |level| that |unit| is in, or the deepest one above it if
+    // the pyramid stops short of |level| there. If that tile is not
+    // resident, we queue it and return its nearest resident ancestor, and
+    // clear |complete|. Safe to call from any thread.
+    TileRef find(const glm::vec3& unit, size_t level, bool* complete);
+
+    // Once a frame, from one thread: start a new frame and queue the tiles
+    // along the way the viewer is headed. |velocity| is in meters a frame;
+    // we go no faster than |maxSpeed|.
+    void prefetch(const glm::dvec3& velocity, double maxSpeed);
+
+    // Drop everything queued and wait for the loads in flight.
+    void drain();
+
+    void setBudget(size_t bytes);
+    size_t budget() const { return budget_; }
+
+    // Zero turns prefetch off.
+    void setPrefetchFrames(size_t frames) { prefetchFrames_ = frames; }
+    size_t prefetchFrames() const { return prefetchFrames_; }
+
+    // A hit is a find that got the tile it wanted; a stall is one that had
+    // to fall back to an ancestor. Loads are split by what queued them.
+    struct Stats {
+        size_t finds;
+        size_t hits;
+        size_t stalls;
+        size_t demandLoads;
+        size_t prefetchLoads;
+        size_t evictions;
+        size_t residentTiles;
+        size_t residentBytes;
+        size_t queued;
+        double hitRate() const { return finds ? double(hits) / double(finds) : 1.0; }
+    };
+    Stats stats() const;
+    void resetStats();
+
+  private:
+    std::unique_ptr<TilePyramid> pyramid_;
+    size_t budget_;
+    size_t prefetchFrames_;
+
+    // Resident tiles. Unpinned ones are on the LRU list, least recently
+    // used at the front.
+    struct Entry {
+        TileRef tile;
+        size_t lastUsed;
+        bool pinned;
+        std::list<TilePyramid::Key>::iterator lru;
+    };
+
+    // Tiles waiting to load. Lower priorities load first: tiles someone is
+    // waiting on go before prefetches, coarse levels before fine, and
+    // prefetches in the order we expect to need them.
+    struct Request {
+        double priority;
+        bool demand;
+    };
+
+    mutable std::mutex lock_;
+    std::unordered_map<TilePyramid::Key, Entry> resident_;
+    std::list<TilePyramid::Key> lru_;
+    std::unordered_map<TilePyramid::Key, Request> queue_;
+    std::vector<std::pair<double, TilePyramid::Key>> order_;
+    std::unordered_set<TilePyramid::Key> loading_;
+    std::unordered_set<TilePyramid::Key> broken_;
+    size_t residentBytes_;
+    size_t frame_;
+    size_t tasks_;
+    std::unordered_set<TilePyramid::Key> seen_;
+    bool planning_;
+    bool quit_;
+    Stats stats_;
+
+    std::unique_ptr<ThreadPool> pool_;
+    ThreadPool::TaskGroup loads_;
+
+    // The most we keep queued; past this, prefetch gives up on the rest of
+    // its path until next frame.
+    constexpr static size_t MaxQueued = 256;
+
+    // Gives back a load task's slot, and the key it was loading if it was
+    // loading one, however the task leaves. Takes the lock if the task had
+    // let go of it.
+    class AutoLoadTask
+    {
+        TileStreamer& streamer_;
+        std::unique_lock<std::mutex>& guard_;
+        bool loading_;
+        TilePyramid::Key key_;
+
+      public:
+        AutoLoadTask(TileStreamer& streamer, std::unique_lock<std::mutex>& guard)
+          : streamer_(streamer), guard_(guard), loading_(false), key_(0)
+        {}
+        ~AutoLoadTask() {
+            if (!guard_.owns_lock())
+                guard_.lock();
+            if (loading_)
+                streamer_.loading_.erase(key_);
+            --streamer_.tasks_;
+        }
+        void loading(TilePyramid::Key key) { loading_ = true; key_ = key; }
+        void loaded() { loading_ = false; }
+    };
+
+    TileRef load(TilePyramid::Key key) const;
+    void plan(const std::vector<TilePyramid::Key>& seen,
+              const glm::dvec3& direction, double reach);
+    void request(TilePyramid::Key key, double priority, bool demand);
+    void pushOrder(TilePyramid::Key key, double priority);
+    void rebuildOrder();
+    void clearQueue();
+    TilePyramid::Key popQueue(bool* demand);
+    void insert(TileRef tile, bool pinned);
+    void evict();
+    void startLoads();
+    void loadNext();
+};
+
+} // namespace glit
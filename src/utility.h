@@ -23,6 +23,7 @@
 #include <vector>
 
 #include <glm/glm.hpp>
+#include <glm/gtc/type_precision.hpp>
 
 #include "glwrapper.h"
 #include <GLFW/glfw3.h>
@@ -62,11 +63,16 @@ template <const char* Name> struct MapNameToTraits{};
 #define MAKE_MAP(D) \
     D(float, GL_FLOAT, 1, 1) \
     D(uint8_t, GL_UNSIGNED_BYTE, 1, 1) \
+    D(int8_t, GL_BYTE, 1, 1) \
+    D(int16_t, GL_SHORT, 1, 1) \
+    D(uint16_t, GL_UNSIGNED_SHORT, 1, 1) \
     D(Texture, 0x140F, 1, 1) \
     D(int, GL_INT, 1, 1) \
     D(GLuint, GL_UNSIGNED_INT, 1, 1) \
     D(glm::vec2, GL_FLOAT, 2, 1) \
     D(glm::vec3, GL_FLOAT, 3, 1) \
+    D(glm::i8vec2, GL_BYTE, 2, 1) \
+    D(glm::i16vec3, GL_SHORT, 3, 1) \
     D(glm::mat4, GL_FLOAT, 4, 4)
 #define EXPAND_MAP_ITEM(ty, en, rows_, cols_) \
     template <> struct MapTypeToTraits<ty> { \
@@ -283,5 +289,31 @@ ipow(int64_t base, int exp, int64_t result = 1)
                                         : result);
 }
 
+// Project a unit vector onto the octahedron |x| + |y| + |z| = 1 and fold
+// the lower half out over the corners of the upper half, which maps the
+// sphere onto the square [-1, 1]^2 with about even precision everywhere.
+inline glm::vec2
+octahedralEncode(const glm::vec3& v)
+{
+    glm::vec3 n = v / (std::abs(v.x) + std::abs(v.y) + std::abs(v.z));
+    glm::vec2 e(n.x, n.y);
+    if (n.z < 0.f) {
+        e = glm::vec2((1.f - std::abs(n.y)) * (n.x >= 0.f ? 1.f : -1.f),
+                      (1.f - std::abs(n.x)) * (n.y >= 0.f ? 1.f : -1.f));
+    }
+    return e;
+}
+
+inline glm::vec3
+octahedralDecode(const glm::vec2& e)
+{
+    glm::vec3 n(e.x, e.y, 1.f - std::abs(e.x) - std::abs(e.y));
+    if (n.z < 0.f) {
+        n.x = (1.f - std::abs(e.y)) * (e.x >= 0.f ? 1.f : -1.f);
+        n.y = (1.f - std::abs(e.x)) * (e.y >= 0.f ? 1.f : -1.f);
+    }
+    return glm::normalize(n);
+}
+
 } // namespace util
 } // namespace glit
@@ -12,6 +12,8 @@
 // along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #include "vertex.h"
 
+#include <algorithm>
+
 using namespace std;
 
 glit::VertexAttrib::VertexAttrib(const char* name, size_t size, GLenum type,
@@ -44,16 +46,24 @@ glit::VertexAttrib::operator !=(const VertexAttrib& other) const
 }
 
 void
-glit::VertexAttrib::enable(GLint index) const
+glit::VertexAttrib::enable(GLint index, size_t firstVertex) const
 {
     if (index_ != -1)
         throw runtime_error("double-enable of attribute");
 
     index_ = index;
-    glVertexAttribPointer(index_, size_, type_, normalized_, stride_, (void*)offset_);
+    size_t offset = offset_ + firstVertex * stride_;
+    glVertexAttribPointer(index_, size_, type_, normalized_, stride_, (void*)offset);
     glEnableVertexAttribArray(index);
 }
 
+void
+glit::VertexAttrib::rebase(size_t firstVertex) const
+{
+    size_t offset = offset_ + firstVertex * stride_;
+    glVertexAttribPointer(index_, size_, type_, normalized_, stride_, (void*)offset);
+}
+
 void
 glit::VertexAttrib::disable() const
 {
@@ -151,14 +161,41 @@ glit::IndexBuffer::orphan()
     if (type_ == GLenum(-1))
         return;  // Already orphaned or never uploaded.
 
-    size_t size = -1;  // Ensure we generate GL_INVALID_VALUE if not set.
-    switch (type_) {
-    case GL_UNSIGNED_BYTE: size = sizeof(uint8_t); break;
-    case GL_UNSIGNED_SHORT: size = sizeof(uint16_t); break;
-    case GL_UNSIGNED_INT: size = sizeof(uint32_t); break;
-    }
     glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, id);
-    glBufferData(GL_ELEMENT_ARRAY_BUFFER, numIndices_ * size,
+    glBufferData(GL_ELEMENT_ARRAY_BUFFER, numIndices_ * indexSize(),
                  nullptr, GL_STATIC_DRAW);
     numIndices_ = -1;
 }
+
+void
+glit::IndexBuffer::upload(const vector<uint32_t>& indices)
+{
+    // Shorts halve the index traffic, and are all that ES2 can draw without
+    // OES_element_index_uint, so we use them whenever the indices fit. Bytes
+    // would be smaller again, but many drivers convert those on the CPU.
+    uint32_t largest = 0;
+    for (uint32_t i : indices)
+        largest = std::max(largest, i);
+    if (largest <= 0xFFFF) {
+        narrowed_.assign(indices.begin(), indices.end());
+        upload(narrowed_);
+        return;
+    }
+
+    type_ = GL_UNSIGNED_INT;
+    numIndices_ = indices.size();
+    bind();
+    glBufferData(GL_ELEMENT_ARRAY_BUFFER, numIndices_ * sizeof(uint32_t),
+                 &indices[0], GL_STATIC_DRAW);
+}
+
+size_t
+glit::IndexBuffer::indexSize() const
+{
+    switch (type_) {
+    case GL_UNSIGNED_BYTE: return sizeof(uint8_t);
+    case GL_UNSIGNED_SHORT: return sizeof(uint16_t);
+    case GL_UNSIGNED_INT: return sizeof(uint32_t);
+    }
+    return size_t(-1);  // Ensure we generate GL_INVALID_VALUE if not set.
+}
@@ -79,9 +79,16 @@ class VertexAttrib
 
     const char* name() const { return name_; }
     GLenum type() const { return type_; }
+    bool enabled() const { return index_ != -1; }
 
-    void enable(GLint index) const;
+    // Point the attribute at the buffer with vert |firstVertex| as vert 0.
+    // ES2 has no base vertex draw call, so this is how we get one.
+    void enable(GLint index, size_t firstVertex = 0) const;
     void disable() const;
+
+    // Move an enabled attribute to a new |firstVertex|, without looking it
+    // up or enabling it again.
+    void rebase(size_t firstVertex) const;
 };
 
 // Given a class with attribute named |attrname|, in |cls|'s scope,
@@ -198,6 +205,30 @@ class VertexBuffer : BufferBase
         //             (numVerts_ * sizeof(VertexType))<< " bytes)" << std::endl;
     }
 
+    // Allocate storage for |count| verts without filling it, so that the
+    // buffer can be used as an arena and filled piecewise with uploadRange.
+    template <typename VertexType>
+    void reserve(size_t count) {
+        if (vertexDesc_ != VertexDescriptor::fromType<VertexType>())
+            throw std::runtime_error("reserving with wrong vertex type");
+        numVerts_ = count;
+        glBindBuffer(GL_ARRAY_BUFFER, id);
+        glBufferData(GL_ARRAY_BUFFER, numVerts_ * sizeof(VertexType),
+                     nullptr, GL_DYNAMIC_DRAW);
+    }
+
+    // Overwrite verts [first, first + verts.size()) of a reserved buffer.
+    template <typename VertexType>
+    void uploadRange(const std::vector<VertexType>& verts, size_t first) {
+        if (vertexDesc_ != VertexDescriptor::fromType<VertexType>())
+            throw std::runtime_error("attempting to upload into wrong buffer type");
+        if (!hasData() || first + verts.size() > numVerts_)
+            throw std::runtime_error("upload range outside of vertex buffer");
+        glBindBuffer(GL_ARRAY_BUFFER, id);
+        glBufferSubData(GL_ARRAY_BUFFER, first * sizeof(VertexType),
+                        verts.size() * sizeof(VertexType), &verts[0]);
+    }
+
   private:
     VertexBuffer(const VertexBuffer&) = delete;
 };
@@ -208,6 +239,10 @@ class IndexBuffer : BufferBase
     size_t numIndices_;
     GLenum type_;
 
+    // Where 32 bit indices get narrowed to shorts, kept so that uploading
+    // every frame does not allocate.
+    std::vector<uint16_t> narrowed_;
+
   public:
     IndexBuffer();
     IndexBuffer(IndexBuffer&& other);
@@ -215,6 +250,12 @@ class IndexBuffer : BufferBase
     size_t numIndices() const { return numIndices_; }
     bool hasData() const { return numIndices_ != size_t(-1); }
     GLenum type() const { return type_; }
+    size_t indexSize() const;
+
+    // The offset to pass to glDrawElements to start at index |first|.
+    const GLvoid* offsetOf(size_t first) const {
+        return util::BufferOffset<uint8_t>(first * indexSize());
+    }
 
     void bind() const;
     static void unbind();
@@ -246,15 +287,9 @@ class IndexBuffer : BufferBase
         //             (2 * numIndices_)<< " bytes)" << std::endl;
     }
 
-    void upload(const std::vector<uint32_t>& indices) {
-        type_ = GL_UNSIGNED_INT;
-        numIndices_ = indices.size();
-        bind();
-        glBufferData(GL_ELEMENT_ARRAY_BUFFER, numIndices_ * sizeof(uint32_t),
-                     &indices[0], GL_STATIC_DRAW);
-        //std::cout << "uploaded " << numIndices_ << " indices (" <<
-        //             (4 * numIndices_)<< " bytes)" << std::endl;
-    }
+
+    // Stored as shorts if they all fit; see vertex.cpp.
+    void upload(const std::vector<uint32_t>& indices);
 };
 
 template <typename BufferType>
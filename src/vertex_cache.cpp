@@ -0,0 +1,190 @@
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+#include "vertex_cache.h"
+
+#include <algorithm>
+#include <cmath>
+
+using namespace std;
+
+// Forsyth's constants. The three most recent verts all score the same, since
+// it does not matter which order the triangle that used them went in.
+static const float CacheDecayPower = 1.5f;
+static const float LastTriangleScore = 0.75f;
+static const float ValenceBoostScale = 2.0f;
+static const float ValenceBoostPower = 0.5f;
+
+// The scores for each cache position and for the common valences, so that
+// we are not calling pow in the inner loop.
+namespace {
+struct ScoreTables {
+    constexpr static size_t MaxValence = 32;
+    float cache[glit::VertexCacheOptimizer::CacheSize];
+    float valence[MaxValence];
+
+    ScoreTables() {
+        const size_t size = glit::VertexCacheOptimizer::CacheSize;
+        for (size_t i = 0; i < size; ++i) {
+            if (i < 3)
+                cache[i] = LastTriangleScore;
+            else
+                cache[i] = pow(1.f - float(i - 3) / float(size - 3), CacheDecayPower);
+        }
+        valence[0] = 0.f;
+        for (size_t i = 1; i < MaxValence; ++i)
+            valence[i] = ValenceBoostScale * pow(float(i), -ValenceBoostPower);
+    }
+};
+} // namespace
+static const ScoreTables Scores;
+
+/* static */ float
+glit::VertexCacheOptimizer::score(const Vertex& vertex)
+{
+    if (vertex.remaining == 0)
+        return -1.f;
+
+    float result = 0.f;
+    if (vertex.cachePosition >= 0)
+        result = Scores.cache[vertex.cachePosition];
+    if (vertex.remaining < ScoreTables::MaxValence)
+        return result + Scores.valence[vertex.remaining];
+    return result + ValenceBoostScale * pow(float(vertex.remaining), -ValenceBoostPower);
+}
+
+void
+glit::VertexCacheOptimizer::optimize(uint32_t* indices, size_t count,
+                                     uint32_t firstVertex, size_t vertexCount)
+{
+    size_t triangleCount = count / 3;
+    if (triangleCount == 0)
+        return;
+
+    // Work in range-local vert numbers.
+    local_.resize(count);
+    for (size_t i = 0; i < count; ++i)
+        local_[i] = indices[i] - firstVertex;
+
+    // Each vert's triangles, packed. We take a triangle out of its verts'
+    // lists when we add it, so the live part of each list is the first
+    // |remaining| entries.
+    verts_.assign(vertexCount, Vertex{0.f, -1, 0, 0});
+    for (uint32_t index : local_)
+        ++verts_[index].remaining;
+    uint32_t offset = 0;
+    for (auto& vertex : verts_) {
+        vertex.firstTriangle = offset;
+        offset += vertex.remaining;
+        vertex.remaining = 0;
+    }
+    adjacency_.resize(count);
+    for (size_t t = 0; t < triangleCount; ++t) {
+        for (size_t k = 0; k < 3; ++k) {
+            Vertex& vertex = verts_[local_[3 * t + k]];
+            adjacency_[vertex.firstTriangle + vertex.remaining++] = uint32_t(t);
+        }
+    }
+    for (auto& vertex : verts_)
+        vertex.score = score(vertex);
+
+    added_.assign(triangleCount, 0);
+
+    uint32_t cache[CacheSize];
+    size_t cacheUsed = 0;
+    size_t written = 0;
+    size_t cursor = 0;
+    int64_t best = -1;
+    while (written < count) {
+        // Nothing in the cache has triangles left, so start somewhere new.
+        // The mesh comes to us in a decent order, so the next triangle in
+        // it is as good a place as any.
+        if (best < 0) {
+            while (added_[cursor])
+                ++cursor;
+            best = int64_t(cursor);
+        }
+
+        uint32_t t = uint32_t(best);
+        added_[t] = 1;
+        uint32_t tri[3] = {local_[3 * t], local_[3 * t + 1], local_[3 * t + 2]};
+        for (uint32_t v : tri)
+            indices[written++] = v + firstVertex;
+
+        // Drop the triangle from its verts' lists.
+        for (uint32_t v : tri) {
+            Vertex& vertex = verts_[v];
+            uint32_t* first = &adjacency_[vertex.firstTriangle];
+            uint32_t* last = first + vertex.remaining;
+            *find(first, last, t) = last[-1];
+            --vertex.remaining;
+        }
+
+        // Move the triangle's verts to the front of the cache, with three
+        // extra slots for the verts that they push out, which need their
+        // scores updating too.
+        uint32_t next[CacheSize + 3];
+        size_t nextUsed = 0;
+        for (uint32_t v : tri)
+            next[nextUsed++] = v;
+        for (size_t i = 0; i < cacheUsed; ++i) {
+            uint32_t v = cache[i];
+            if (v != tri[0] && v != tri[1] && v != tri[2])
+                next[nextUsed++] = v;
+        }
+        for (size_t i = 0; i < nextUsed; ++i) {
+            Vertex& vertex = verts_[next[i]];
+            vertex.cachePosition = i < CacheSize ? int32_t(i) : -1;
+            vertex.score = score(vertex);
+        }
+
+        // Rescore everything the cache touches and take the best of it.
+        float bestScore = -1.f;
+        best = -1;
+        for (size_t i = 0; i < nextUsed; ++i) {
+            const Vertex& vertex = verts_[next[i]];
+            for (uint32_t j = 0; j < vertex.remaining; ++j) {
+                uint32_t u = adjacency_[vertex.firstTriangle + j];
+                float s = verts_[local_[3 * u]].score +
+                          verts_[local_[3 * u + 1]].score +
+                          verts_[local_[3 * u + 2]].score;
+                if (s > bestScore) {
+                    bestScore = s;
+                    best = u;
+                }
+            }
+        }
+
+        cacheUsed = std::min(nextUsed, size_t(CacheSize));
+        copy(next, next + cacheUsed, cache);
+    }
+}
+
+/* static */ float
+glit::VertexCacheOptimizer::acmr(const vector<uint32_t>& indices,
+                                 size_t vertexCount, size_t cacheSize)
+{
+    if (indices.size() < 3)
+        return 0.f;
+
+    // A vert is still in the FIFO if fewer than cacheSize misses have
+    // happened since it went in.
+    vector<size_t> insertedAt(vertexCount, 0);
+    size_t misses = 0;
+    for (uint32_t index : indices) {
+        if (insertedAt[index] == 0 || misses - insertedAt[index] >= cacheSize) {
+            ++misses;
+            insertedAt[index] = misses;
+        }
+    }
+    return float(misses) / float(indices.size() / 3);
+}
@@ -0,0 +1,436 @@
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+// Bakes a tile pyramid (see TilePyramid) of heights, normals and colours.
+// Heights come from SRTM .hgt elevation tiles where they have data, and
+// from the procedural terrain, or sea level without --procedural, everywhere
+// else. The pyramid goes --levels deep everywhere and --dem-levels deep
+// over the .hgt tiles; by default that is as deep as their resolution
+// needs. Afterwards we read the file back and compare it to the source.
+//
+// Usage: bake_tiles [--levels N] [--depth N] [--step m] [--procedural]
+//                   [--hgt file.hgt]... [--dem-levels N] output
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <glad/glad.h>
+#include <GLFW/glfw3.h>
+#include <glm/glm.hpp>
+
+#include "terrain.h"
+#include "thread_pool.h"
+#include "tile_pyramid.h"
+
+using namespace glit;
+using namespace glm;
+using namespace std;
+
+// Terrain compiles its programs on construction, so we need a context, but
+// we never draw.
+static GLFWwindow*
+makeHiddenContext()
+{
+    if (!glfwInit())
+        throw runtime_error("glfwInit failed");
+#if defined(__MACOSX__)
+    glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 4);
+    glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 1);
+    glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE);
+    glfwWindowHint(GLFW_OPENGL_FORWARD_COMPAT, GL_TRUE);
+#else
+    glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 2);
+    glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 0);
+    glfwWindowHint(GLFW_CLIENT_API, GLFW_OPENGL_ES_API);
+#endif
+    glfwWindowHint(GLFW_VISIBLE, GLFW_FALSE);
+    GLFWwindow* window = glfwCreateWindow(64, 64, "bake_tiles", nullptr, nullptr);
+    if (!window)
+        throw runtime_error("glfwCreateWindow failed");
+    glfwMakeContextCurrent(window);
+    gladLoadGLLoader((GLADloadproc)glfwGetProcAddress);
+    return window;
+}
+
+// Latitude and longitude in degrees, the way glm::polar has them: y is
+// north and longitude 0 is on +z, with east towards +x.
+static dvec2
+latLon(const vec3& unit)
+{
+    return dvec2(degrees(asin(clamp(double(unit.y), -1.0, 1.0))),
+                 degrees(atan2(double(unit.x), double(unit.z))));
+}
+
+static vec3
+fromLatLon(double lat, double lon)
+{
+    lat = radians(lat);
+    lon = radians(lon);
+    return vec3(cos(lat) * sin(lon), sin(lat), cos(lat) * cos(lon));
+}
+
+// One SRTM tile: a square degree of big endian 16 bit heights in meters,
+// named for its south west corner, e.g. N37W122.hgt. Rows run north to
+// south and both edges are included, so neighbouring tiles overlap by a
+// row. SRTM1 has 3601 samples a side and SRTM3 1201.
+class Hgt
+{
+    int lat_;
+    int lon_;
+    size_t size_;
+    vector<int16_t> samples_;
+
+    constexpr static int16_t Void = -32768;
+
+  public:
+    static unique_ptr<Hgt> load(const string& path);
+
+    double spacing() const { return 1.0 / double(size_ - 1); }
+
+    // Bilinear, if all four samples around the point have data.
+    bool height(const dvec2& latLon, float* out) const;
+
+    // A cap around the tile: its centre and the angle to its corners.
+    vec3 center() const { return fromLatLon(lat_ + 0.5, lon_ + 0.5); }
+    float capAngle() const;
+};
+
+/* static */ unique_ptr<Hgt>
+Hgt::load(const string& path)
+{
+    size_t slash = path.find_last_of("/\\");
+    string name = path.substr(slash == string::npos ? 0 : slash + 1);
+    char ns, ew;
+    int lat, lon;
+    if (sscanf(name.c_str(), "%c%2d%c%3d", &ns, &lat, &ew, &lon) != 4)
+        throw runtime_error("hgt file name is not like N37W122.hgt: " + path);
+    ns = char(toupper(ns));
+    ew = char(toupper(ew));
+    if ((ns != 'N' && ns != 'S') || (ew != 'E' && ew != 'W'))
+        throw runtime_error("hgt file name is not like N37W122.hgt: " + path);
+
+    FILE* fp = fopen(path.c_str(), "rb");
+    if (!fp)
+        throw runtime_error("cannot open " + path);
+    vector<uint8_t> bytes;
+    uint8_t buffer[1 << 16];
+    size_t got;
+    while ((got = fread(buffer, 1, sizeof(buffer), fp)) > 0)
+        bytes.insert(bytes.end(), buffer, buffer + got);
+    fclose(fp);
+
+    unique_ptr<Hgt> hgt(new Hgt);
+    hgt->lat_ = ns == 'N' ? lat : -lat;
+    hgt->lon_ = ew == 'E' ? lon : -lon;
+    hgt->size_ = size_t(lround(sqrt(double(bytes.size() / 2))));
+    if (hgt->size_ < 2 || hgt->size_ * hgt->size_ * 2 != bytes.size())
+        throw runtime_error("hgt file is not a square grid: " + path);
+    hgt->samples_.resize(bytes.size() / 2);
+    for (size_t i = 0; i < hgt->samples_.size(); ++i)
+        hgt->samples_[i] = int16_t(uint16_t(bytes[2 * i] << 8 | bytes[2 * i + 1]));
+    return hgt;
+}
+
+bool
+Hgt::height(const dvec2& latLon, float* out) const
+{
+    double row = (lat_ + 1.0 - latLon.x) * double(size_ - 1);
+    double col = (latLon.y - lon_) * double(size_ - 1);
+    if (row < 0.0 || col < 0.0 || row > double(size_ - 1) || col > double(size_ - 1))
+        return false;
+    size_t r = std::min(size_t(row), size_ - 2);
+    size_t c = std::min(size_t(col), size_ - 2);
+    double fr = row - double(r);
+    double fc = col - double(c);
+    int16_t s00 = samples_[r * size_ + c];
+    int16_t s01 = samples_[r * size_ + c + 1];
+    int16_t s10 = samples_[(r + 1) * size_ + c];
+    int16_t s11 = samples_[(r + 1) * size_ + c + 1];
+    if (s00 == Void || s01 == Void || s10 == Void || s11 == Void)
+        return false;
+    *out = float((s00 * (1.0 - fc) + s01 * fc) * (1.0 - fr) +
+                 (s10 * (1.0 - fc) + s11 * fc) * fr);
+    return true;
+}
+
+float
+Hgt::capAngle() const
+{
+    vec3 c = center();
+    float angle = 0.f;
+    for (int corner = 0; corner < 4; ++corner) {
+        vec3 p = fromLatLon(lat_ + (corner & 1), lon_ + (corner >> 1));
+        angle = std::max(angle, acos(clamp(dot(c, p), -1.f, 1.f)));
+    }
+    return angle;
+}
+
+// Heights above the radius from the DEMs, then the procedural terrain.
+struct Source
+{
+    float radius;
+    const Terrain* terrain = nullptr;
+    vector<unique_ptr<Hgt>> dems;
+
+    float height(const vec3& unit) const {
+        if (!dems.empty()) {
+            dvec2 at = latLon(unit);
+            float h;
+            for (auto& dem : dems) {
+                if (dem->height(at, &h))
+                    return h;
+            }
+        }
+        return terrain ? terrain->heightAt(unit) - radius : 0.f;
+    }
+
+    // From the slope over |step| radians, which should be about the
+    // sample spacing, so that the normals are as smooth as the heights.
+    vec3 normal(const vec3& unit, float step) const {
+        vec3 east = normalize(cross(std::abs(unit.y) < 0.9f ? vec3(0.f, 1.f, 0.f)
+                                                            : vec3(1.f, 0.f, 0.f), unit));
+        vec3 north = cross(unit, east);
+        auto at = [this](const vec3& u) {
+            vec3 n = normalize(u);
+            return dvec3(n) * double(radius + height(n));
+        };
+        dvec3 p = at(unit);
+        dvec3 n = cross(at(unit + east * step) - p, at(unit + north * step) - p);
+        vec3 result = normalize(vec3(n));
+        return dot(result, unit) < 0.f ? -result : result;
+    }
+};
+
+// A stand in until we have real colour maps: sea floor, beach, grass,
+// rock where it is steep or high, and snow above that.
+static u8vec3
+colourFor(float height, const vec3& normal, const vec3& unit)
+{
+    float flatness = dot(normal, unit);
+    if (height < 0.f)
+        return u8vec3(70, 90, 110);
+    if (height < 20.f)
+        return u8vec3(194, 178, 128);
+    if (flatness < 0.8f || (height > 2500.f && height < 4000.f))
+        return u8vec3(110, 100, 90);
+    if (height >= 4000.f)
+        return u8vec3(240, 240, 245);
+    return u8vec3(70, 110, 50);
+}
+
+struct Baker
+{
+    const Source& source;
+    size_t depth;
+    size_t levels;
+    size_t demLevels;
+    float edgeAngle;
+    TilePyramid::Builder& builder;
+    mutex builderLock;
+
+    bool overlapsDem(const vec3 corners[3]) const {
+        vec3 center = normalize(corners[0] + corners[1] + corners[2]);
+        float cap = 0.f;
+        for (size_t k = 0; k < 3; ++k)
+            cap = std::max(cap, acos(clamp(dot(center, corners[k]), -1.f, 1.f)));
+        for (auto& dem : source.dems) {
+            float apart = acos(clamp(dot(center, dem->center()), -1.f, 1.f));
+            if (apart < cap * 1.1f + dem->capAngle())
+                return true;
+        }
+        return false;
+    }
+
+    void bake(TilePyramid::Key key, size_t level, TilePyramid::Tile& tile) {
+        vec3 corners[3];
+        TilePyramid::corners(key, corners);
+        bool split = level + 1 < levels ||
+                     (level + 1 < demLevels && overlapsDem(corners));
+        if (split) {
+            TilePyramid::Tile children[4];
+            for (size_t i = 0; i < 4; ++i)
+                bake(TilePyramid::childKey(key, i), level + 1, children[i]);
+            TilePyramid::downsample(children, depth, tile);
+        } else {
+            vector<vec3> positions;
+            TilePyramid::samplePositions(corners, depth, positions);
+            float step = edgeAngle / float(size_t(1) << level) /
+                         float(TilePyramid::gridSize(depth));
+            tile.heights.resize(positions.size());
+            tile.normals.resize(positions.size());
+            tile.colours.resize(positions.size());
+            for (size_t k = 0; k < positions.size(); ++k) {
+                tile.heights[k] = source.height(positions[k]);
+                tile.normals[k] = source.normal(positions[k], step);
+                tile.colours[k] = colourFor(tile.heights[k], tile.normals[k], positions[k]);
+            }
+        }
+        lock_guard<mutex> guard(builderLock);
+        builder.add(key, tile);
+    }
+};
+
+static void
+usage()
+{
+    cerr << "usage: bake_tiles [--levels N] [--depth N] [--step m] [--procedural]\n"
+         << "                  [--hgt file.hgt]... [--dem-levels N] output" << endl;
+    exit(2);
+}
+
+int
+main(int argc, char** argv)
+{
+    size_t levels = 5;
+    size_t depth = 5;
+    size_t demLevels = 0;
+    float step = 0.125f;
+    bool procedural = false;
+    vector<string> hgts;
+    string output;
+    for (int i = 1; i < argc; ++i) {
+        string arg = argv[i];
+        bool hasValue = i + 1 < argc;
+        if (arg == "--levels" && hasValue)
+            levels = stoul(argv[++i]);
+        else if (arg == "--depth" && hasValue)
+            depth = stoul(argv[++i]);
+        else if (arg == "--dem-levels" && hasValue)
+            demLevels = stoul(argv[++i]);
+        else if (arg == "--step" && hasValue)
+            step = stof(argv[++i]);
+        else if (arg == "--procedural")
+            procedural = true;
+        else if (arg == "--hgt" && hasValue)
+            hgts.push_back(argv[++i]);
+        else if (arg[0] != '-' && output.empty())
+            output = arg;
+        else
+            usage();
+    }
+    if (output.empty() || levels == 0 || depth == 0 || depth > 8 || step <= 0.f)
+        usage();
+    if (hgts.empty())
+        procedural = true;
+
+    const float radius = 6371000.f;
+    Source source;
+    source.radius = radius;
+    GLFWwindow* window = nullptr;
+    unique_ptr<Terrain> terrain;
+    if (procedural) {
+        window = makeHiddenContext();
+        terrain.reset(new Terrain(radius));
+        source.terrain = terrain.get();
+    }
+    double finest = 1.0;
+    for (auto& path : hgts) {
+        source.dems.push_back(Hgt::load(path));
+        finest = std::min(finest, source.dems.back()->spacing());
+    }
+
+    // Deep enough that the sample spacing is no coarser than the DEM's.
+    const vec3* base = IcoSphere::baseVertices();
+    const int* face = IcoSphere::BaseFaces[0];
+    float edgeAngle = acos(dot(base[face[0]], base[face[1]]));
+    if (!hgts.empty() && demLevels == 0) {
+        double spacing = edgeAngle / double(TilePyramid::gridSize(depth));
+        while (spacing > radians(finest)) {
+            spacing /= 2.0;
+            ++demLevels;
+        }
+        ++demLevels;
+    }
+
+    cout << "baking " << levels << " levels";
+    if (!hgts.empty())
+        cout << ", " << demLevels << " over " << hgts.size() << " hgt tiles";
+    cout << ", " << TilePyramid::sampleCount(depth) << " samples a tile" << endl;
+
+    auto start = chrono::steady_clock::now();
+    TilePyramid::Builder builder(radius, depth, step);
+    Baker baker{source, depth, levels, demLevels, edgeAngle, builder, {}};
+    ThreadPool pool(ThreadPool::defaultThreadCount());
+    ThreadPool::TaskGroup group;
+    for (size_t i = 0; i < IcoSphere::BaseFaceCount; ++i) {
+        pool.spawn(group, [&baker, i](){
+            TilePyramid::Tile tile;
+            baker.bake(TilePyramid::rootKey(i), 0, tile);
+        });
+    }
+    pool.wait(group);
+    chrono::duration<double> took = chrono::steady_clock::now() - start;
+
+    if (!builder.write(output))
+        throw runtime_error("could not write " + output);
+    size_t samples = builder.tileCount() * TilePyramid::sampleCount(depth);
+    // A quantized height, two normal bytes and three colour bytes.
+    size_t raw = samples * (sizeof(int32_t) + 2 + 3);
+    cout << builder.tileCount() << " tiles, " << builder.bytes() << " bytes ("
+         << fixed << setprecision(2) << double(builder.bytes()) / double(samples)
+         << " bytes a sample, " << double(raw) / double(builder.bytes())
+         << "x smaller than raw) in " << took.count() << "s" << endl;
+
+    // Read it back and see how the finest tiles compare to the source at
+    // random points.
+    auto pyramid = TilePyramid::open(output);
+    mt19937 rng(42);
+    normal_distribution<float> gauss;
+    TilePyramid::Tile tile;
+    TilePyramid::Key decoded = 0;
+    double worst = 0.0;
+    double squares = 0.0;
+    const size_t Checks = 2000;
+    for (size_t i = 0; i < Checks; ++i) {
+        vec3 unit;
+        if (!source.dems.empty() && i % 2) {
+            // Half of them over the DEMs, if we have any.
+            auto& dem = source.dems[i / 2 % source.dems.size()];
+            float spread = dem->capAngle() * 0.5f;
+            unit = normalize(dem->center() +
+                             vec3(gauss(rng), gauss(rng), gauss(rng)) * spread);
+        } else {
+            unit = normalize(vec3(gauss(rng), gauss(rng), gauss(rng)));
+        }
+        vec3 corners[3];
+        TilePyramid::Key key = pyramid->deepest(unit, pyramid->levels(), corners);
+        if (key != decoded) {
+            pyramid->decode(key, tile);
+            decoded = key;
+        }
+        auto sample = TilePyramid::sample(tile, pyramid->depth(), corners, unit);
+        double error = std::abs(double(sample.height) - double(source.height(unit)));
+        worst = std::max(worst, error);
+        squares += error * error;
+    }
+    cout << "height error vs source at the finest tiles: max " << worst
+         << "m, rms " << sqrt(squares / Checks) << "m over " << Checks
+         << " points" << endl;
+
+    terrain.reset();
+    if (window) {
+        glfwDestroyWindow(window);
+        glfwTerminate();
+    }
+    return 0;
+}
@@ -0,0 +1,136 @@
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+// Times the height kernel on every path this CPU supports and checks each
+// against the scalar path.
+//
+// Usage: bench_noise [points [rounds [octaves]]]
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <iomanip>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+
+#include <glm/glm.hpp>
+
+#include "height_kernel.h"
+
+using namespace glit;
+using namespace glm;
+using namespace std;
+
+// Edges on the earth's surface, from a few hundred km down to a few m, like
+// the ones reshape splits.
+static void
+makeEdges(size_t count, float radius, MidpointBatch& batch)
+{
+    mt19937 rng(42);
+    normal_distribution<float> gauss;
+    uniform_real_distribution<float> level(0.f, 20.f);
+    for (size_t i = 0; i < count; ++i) {
+        vec3 a = normalize(vec3(gauss(rng), gauss(rng), gauss(rng)));
+        vec3 d = normalize(vec3(gauss(rng), gauss(rng), gauss(rng)));
+        vec3 b = normalize(a + d * (0.1f / exp2(level(rng))));
+        batch.push(a * radius, b * radius);
+    }
+}
+
+static float
+maxDifference(const MidpointBatch& lhs, const MidpointBatch& rhs)
+{
+    float worst = 0.f;
+    for (size_t i = 0; i < lhs.size(); ++i) {
+        vec3 d = abs(lhs.result(i) - rhs.result(i));
+        worst = std::max(worst, std::max(d.x, std::max(d.y, d.z)));
+    }
+    return worst;
+}
+
+int
+main(int argc, char** argv)
+{
+    const float radius = 6360000.f;
+    const float amplitude = 20000.f;
+    size_t count = argc > 1 ? stoul(argv[1]) : 1 << 20;
+    size_t rounds = argc > 2 ? stoul(argv[2]) : 10;
+    size_t octaves = argc > 3 ? stoul(argv[3]) : 1;
+
+    MidpointBatch batch;
+    makeEdges(count, radius, batch);
+
+    // With a zero radius and unit amplitudes, each output is the unit
+    // midpoint times the summed noise, so a component can be off by no more
+    // than the noise is.
+    MidpointBatch noiseRef = batch;
+    HeightKernel noiseKernel(0.f, HeightKernel::fractal(1.f, octaves, 1.f));
+    noiseKernel.setPath(HeightKernel::Path::Scalar);
+    noiseKernel.displace(noiseRef);
+    float tolerance = HeightKernel::NoiseTolerance * octaves;
+
+    HeightKernel kernel(radius, HeightKernel::fractal(amplitude, octaves, 0.5f));
+    kernel.setPath(HeightKernel::Path::Scalar);
+    MidpointBatch reference = batch;
+    kernel.displace(reference);
+
+    cout << count << " points, " << octaves << " octaves, "
+         << rounds << " rounds; best path is "
+         << HeightKernel::pathName(HeightKernel::bestPath()) << endl;
+    cout << setw(8) << "path" << setw(14) << "Mpoints/s"
+         << setw(14) << "speedup" << setw(14) << "max noise"
+         << setw(14) << "max pos (m)" << endl;
+
+    int status = 0;
+    double scalarRate = 0.0;
+    for (auto path : {HeightKernel::Path::Scalar,
+                      HeightKernel::Path::SSE41,
+                      HeightKernel::Path::AVX2})
+    {
+        if (!HeightKernel::supported(path))
+            continue;
+        kernel.setPath(path);
+        noiseKernel.setPath(path);
+
+        MidpointBatch work = batch;
+        double best = 1e30;
+        for (size_t r = 0; r < rounds; ++r) {
+            auto start = chrono::steady_clock::now();
+            kernel.displace(work);
+            chrono::duration<double> took = chrono::steady_clock::now() - start;
+            best = std::min(best, took.count());
+        }
+        double rate = count / best;
+        if (path == HeightKernel::Path::Scalar)
+            scalarRate = rate;
+
+        MidpointBatch noise = batch;
+        noiseKernel.displace(noise);
+        float noiseError = maxDifference(noise, noiseRef);
+        float positionError = maxDifference(work, reference);
+
+        cout << setw(8) << HeightKernel::pathName(path)
+             << setw(14) << fixed << setprecision(2) << rate / 1e6
+             << setw(14) << rate / scalarRate
+             << setw(14) << scientific << setprecision(2) << noiseError
+             << setw(14) << fixed << setprecision(4) << positionError << endl;
+        if (noiseError > tolerance) {
+            cout << "  noise differs from scalar by more than "
+                 << scientific << tolerance << endl;
+            status = 1;
+        }
+    }
+    return status;
+}
@@ -0,0 +1,611 @@
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+// Benches for the terrain tree, one function per feature, run in turn:
+//
+//   benchThreads:   reshape against the number of worker threads at low
+//                   altitude, then against the split depth at the most
+//                   threads, checking that each builds the serial mesh.
+//   benchCulling:   how many verts and edges culling saves.
+//   benchTeleport:  what the refine budget does to the frames after a
+//                   teleport from orbit, for each engine.
+//   benchStartup:   what the level cache saves at startup.
+//   benchTriangles: how steady a triangle budget keeps the mesh and the
+//                   frame time from the ground up to orbit.
+//   benchQueries:   how batched height and segment queries near the camera
+//                   scale with threads, and whether snapshots that share
+//                   unchanged subtrees answer them as full copies do.
+//   benchHeights:   how far the hierarchical heights the tree carries are
+//                   from a full evaluation of the same octaves.
+//
+// Any that check something return false, having said why, if it fails.
+//
+// Usage: bench_reshape [altitude_m [max_threads]]
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <iomanip>
+#include <iostream>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <glad/glad.h>
+#include <GLFW/glfw3.h>
+#include <glm/glm.hpp>
+
+#include "terrain.h"
+
+using namespace glm;
+using namespace std;
+
+// Terrain compiles its programs on construction, so we need a context, but
+// we never draw.
+static GLFWwindow*
+makeHiddenContext()
+{
+    if (!glfwInit())
+        throw runtime_error("glfwInit failed");
+#if defined(__MACOSX__)
+    glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 4);
+    glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 1);
+    glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE);
+    glfwWindowHint(GLFW_OPENGL_FORWARD_COMPAT, GL_TRUE);
+#else
+    glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 2);
+    glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 0);
+    glfwWindowHint(GLFW_CLIENT_API, GLFW_OPENGL_ES_API);
+#endif
+    glfwWindowHint(GLFW_VISIBLE, GLFW_FALSE);
+    GLFWwindow* window = glfwCreateWindow(64, 64, "bench_reshape", nullptr, nullptr);
+    if (!window)
+        throw runtime_error("glfwCreateWindow failed");
+    glfwMakeContextCurrent(window);
+    gladLoadGLLoader((GLADloadproc)glfwGetProcAddress);
+    return window;
+}
+
+static double
+millisSince(chrono::steady_clock::time_point start)
+{
+    auto dt = chrono::steady_clock::now() - start;
+    return chrono::duration<double, milli>(dt).count();
+}
+
+// Every bench stands over the same spot, looking along the ground, as the
+// player does when flying low.
+struct View {
+    constexpr static double Radius = 6371000.0;
+    constexpr static double Speed = 10000.0 / 60.0; // Player::MaxSpeed at 60Hz
+
+    vec3 up;
+    dvec3 east;
+    dvec3 north;
+    glit::Camera::Frustum frustum;
+
+    View()
+      : up(normalize(vec3(0.3f, 1.f, 0.2f)))
+      , east(normalize(cross(dvec3(up), dvec3(0.0, 0.0, 1.0))))
+      , north(cross(east, dvec3(up)))
+    {
+        glit::Camera camera;
+        camera.warp(vec3(0.f), vec3(east), up);
+        frustum = camera.frustum();
+    }
+
+    dvec3 above(const glit::Terrain& terrain, double altitude) const {
+        return dvec3(up) * double(terrain.heightAt(up) + altitude);
+    }
+};
+constexpr double View::Radius;
+constexpr double View::Speed;
+
+struct Mesh {
+    vector<glit::Terrain::MeshBatch> batches;
+    vector<glit::Terrain::MeshVertex> verts;
+    vector<uint32_t> indices;
+};
+
+static bool
+sameBatch(const glit::Terrain::MeshBatch& a, const glit::Terrain::MeshBatch& b)
+{
+    return a.origin == b.origin && a.scale == b.scale &&
+           a.firstVertex == b.firstVertex && a.vertexCount == b.vertexCount &&
+           a.firstIndex == b.firstIndex && a.indexCount == b.indexCount;
+}
+
+static bool
+sameMesh(const Mesh& a, const Mesh& b)
+{
+    return a.verts.size() == b.verts.size() &&
+           a.batches.size() == b.batches.size() &&
+           a.indices == b.indices &&
+           equal(a.batches.begin(), a.batches.end(), b.batches.begin(), sameBatch) &&
+           memcmp(a.verts.data(), b.verts.data(),
+                  a.verts.size() * sizeof(a.verts[0])) == 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Threads and culling
+
+struct Result {
+    double cold;   // First reshape into an empty tree.
+    double full;   // Re-testing every facet of a built tree.
+    double flight; // Incremental reshape per frame at max player speed.
+    Mesh mesh;
+    glit::Terrain::CullCounts culled;
+};
+
+// Leaves the split depth at the terrain's default.
+constexpr static size_t DefaultDepth = size_t(-1);
+
+static Result
+run(size_t threads, double altitude, bool cull, size_t depth = DefaultDepth)
+{
+    constexpr static size_t FullFrames = 20;
+    constexpr static size_t FlightFrames = 200;
+
+    Result result;
+    glit::Terrain terrain(View::Radius);
+    terrain.setReshapeThreads(threads);
+    if (depth != DefaultDepth)
+        terrain.setParallelSplitDepth(depth);
+    terrain.setRefineBudget(0, 0.0); // Splits would depend on the timing.
+    terrain.setFrustumCulling(cull);
+    terrain.setHorizonCulling(cull);
+
+    View view;
+    dvec3 position = view.above(terrain, altitude);
+    auto start = chrono::steady_clock::now();
+    terrain.reshape(position, view.frustum);
+    result.cold = millisSince(start);
+
+    terrain.setIncrementalReshape(false);
+    start = chrono::steady_clock::now();
+    for (size_t i = 0; i < FullFrames; ++i)
+        terrain.reshape(position, view.frustum);
+    result.full = millisSince(start) / FullFrames;
+
+    terrain.setIncrementalReshape(true);
+    start = chrono::steady_clock::now();
+    for (size_t i = 0; i < FlightFrames; ++i) {
+        position += view.east * View::Speed;
+        result.culled = terrain.reshape(position, view.frustum);
+    }
+    result.flight = millisSince(start) / FlightFrames;
+
+    terrain.buildWireframe(position, result.mesh.batches, result.mesh.verts,
+                           result.mesh.indices);
+    return result;
+}
+
+static bool
+benchThreads(double altitude, size_t maxThreads, const Result& serial)
+{
+    cout << "threads     cold ms   full ms  flight ms   speedup(full)" << endl;
+    for (size_t threads = 0; threads <= maxThreads; threads = threads ? threads * 2 : 1) {
+        Result r = threads ? run(threads, altitude, true) : serial;
+        cout << setw(7) << threads
+             << fixed << setprecision(2)
+             << setw(10) << r.cold
+             << setw(10) << r.full
+             << setw(11) << r.flight
+             << setw(14) << serial.full / r.full << "x"
+             << endl;
+        if (!sameMesh(serial.mesh, r.mesh)) {
+            cerr << "mesh differs from the serial path at " << threads
+                 << " threads" << endl;
+            return false;
+        }
+    }
+    if (maxThreads == 0)
+        return true;
+
+    cout << "split depth  full ms   speedup(full) at " << maxThreads << " threads"
+         << endl;
+    for (size_t depth = 0; depth <= 8; ++depth) {
+        Result r = run(maxThreads, altitude, true, depth);
+        cout << setw(11) << depth
+             << fixed << setprecision(2)
+             << setw(9) << r.full
+             << setw(15) << serial.full / r.full << "x"
+             << endl;
+        if (!sameMesh(serial.mesh, r.mesh)) {
+            cerr << "mesh differs from the serial path at split depth "
+                 << depth << endl;
+            return false;
+        }
+    }
+    return true;
+}
+
+static void
+benchCulling(double altitude, const Result& serial)
+{
+    Result unculled = run(0, altitude, false);
+    cout << "mesh: " << serial.mesh.verts.size() << " verts, "
+         << serial.mesh.indices.size() / 2 << " edges culled; "
+         << unculled.mesh.verts.size() << " verts, "
+         << unculled.mesh.indices.size() / 2 << " edges without; "
+         << serial.mesh.batches.size() << " batches" << endl;
+    cout << "culled leaves: " << serial.culled.frustum << " by frustum, "
+         << serial.culled.horizon << " by horizon" << endl;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Refine budget
+
+struct Teleport {
+    double worst;  // Slowest reshape after the jump.
+    size_t frames; // Until the tree stops growing.
+    size_t facets;
+};
+
+// Settle in orbit, then jump down to |altitude| and reshape until the tree
+// stops changing.
+static Teleport
+teleport(glit::Terrain::Engine engine, bool budget, double altitude)
+{
+    constexpr static size_t MaxFrames = 1000;
+
+    glit::Terrain terrain(View::Radius);
+    terrain.setEngine(engine);
+    if (!budget)
+        terrain.setRefineBudget(0, 0.0);
+
+    View view;
+    for (size_t i = 0; i < 10; ++i)
+        terrain.reshape(view.above(terrain, 1.0e6), view.frustum);
+
+    dvec3 position = view.above(terrain, altitude);
+    Teleport result{0.0, 0, terrain.liveFacets()};
+    for (size_t i = 0; i < MaxFrames; ++i) {
+        auto start = chrono::steady_clock::now();
+        terrain.reshape(position, view.frustum);
+        result.worst = std::max(result.worst, millisSince(start));
+        if (terrain.liveFacets() != result.facets)
+            result.frames = i + 1;
+        else if (i >= result.frames + 10)
+            break;
+        result.facets = terrain.liveFacets();
+    }
+    return result;
+}
+
+static void
+benchTeleport(double altitude)
+{
+    cout << "teleport from 1000km      worst ms  frames  facets" << endl;
+    for (auto engine : {glit::Terrain::Engine::Immediate, glit::Terrain::Engine::Chunked,
+                        glit::Terrain::Engine::Instanced}) {
+        for (bool budget : {false, true}) {
+            Teleport t = teleport(engine, budget, altitude);
+            cout << setw(10) << glit::Terrain::engineName(engine)
+                 << (budget ? "  budgeted  " : "  unlimited ")
+                 << fixed << setprecision(2)
+                 << setw(13) << t.worst
+                 << setw(8) << t.frames
+                 << setw(8) << t.facets
+                 << endl;
+        }
+    }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Level cache
+
+struct Startup {
+    double construct; // Terrain::Terrain, with whatever the cache costs.
+    double first;     // The first reshape after it.
+    size_t facets;
+};
+
+// Construct a terrain with |levels| levels from the level cache at |cache|,
+// if any, and reshape it once at |altitude|. The mean of |runs| runs.
+static Startup
+startAt(double altitude, const string& cache, size_t levels, size_t runs)
+{
+    Startup result{0.0, 0.0, 0};
+    for (size_t i = 0; i < runs; ++i) {
+        auto start = chrono::steady_clock::now();
+        glit::Terrain terrain(View::Radius, cache, levels);
+        result.construct += millisSince(start) / runs;
+        terrain.setRefineBudget(0, 0.0);
+
+        View view;
+        dvec3 position = view.above(terrain, altitude);
+        start = chrono::steady_clock::now();
+        terrain.reshape(position, view.frustum);
+        result.first += millisSince(start) / runs;
+        result.facets = terrain.liveFacets();
+    }
+    return result;
+}
+
+static void
+benchStartup(double altitude)
+{
+    constexpr static size_t Runs = 20;
+    const string cache = "bench_reshape.levels";
+
+    cout << "altitude m  cache levels   construct ms  first reshape ms  facets"
+            "  (written, then mapped)" << endl;
+    for (double height : {altitude, 1000000.0}) {
+        Startup none = startAt(height, string(), 0, Runs);
+        cout << setw(10) << fixed << setprecision(0) << height
+             << setw(14) << "none" << setprecision(2)
+             << setw(15) << none.construct
+             << setw(18) << none.first
+             << setw(8) << none.facets << endl;
+        for (size_t levels = 2; levels <= 5; ++levels) {
+            remove(cache.c_str());
+            Startup written = startAt(height, cache, levels, 1);
+            Startup mapped = startAt(height, cache, levels, Runs);
+            cout << setw(24) << levels
+                 << setw(8) << written.construct << setw(7) << mapped.construct
+                 << setw(11) << written.first << setw(7) << mapped.first
+                 << setw(8) << mapped.facets << endl;
+        }
+    }
+    remove(cache.c_str());
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Triangle budget
+
+struct Flight {
+    size_t verts;
+    double mean;
+    double worst;
+};
+
+// Settle at |altitude|, then fly along the ground at max player speed,
+// splitting by distance or to a triangle budget.
+static Flight
+flyAt(double altitude, size_t triangles)
+{
+    constexpr static size_t Frames = 200;
+
+    glit::Terrain terrain(View::Radius);
+    terrain.setTriangleBudget(triangles);
+    View view;
+    dvec3 position = view.above(terrain, altitude);
+    for (size_t i = 0; i < 100; ++i)
+        terrain.reshape(position, view.frustum);
+
+    Flight result{0, 0.0, 0.0};
+    for (size_t i = 0; i < Frames; ++i) {
+        position += view.east * View::Speed;
+        auto start = chrono::steady_clock::now();
+        terrain.reshape(position, view.frustum);
+        double ms = millisSince(start);
+        result.mean += ms / Frames;
+        result.worst = std::max(result.worst, ms);
+    }
+    Mesh mesh;
+    terrain.buildWireframe(position, mesh.batches, mesh.verts, mesh.indices);
+    result.verts = mesh.verts.size();
+    return result;
+}
+
+static void
+benchTriangles()
+{
+    constexpr static size_t TriangleBudget = 2000;
+
+    cout << "altitude m    by distance: verts  mean ms  worst ms"
+            "   " << TriangleBudget << " triangles: verts  mean ms  worst ms" << endl;
+    for (double height : {30.0, 1000.0, 30000.0, 1000000.0}) {
+        Flight distance = flyAt(height, 0);
+        Flight budget = flyAt(height, TriangleBudget);
+        cout << setw(10) << fixed << setprecision(0) << height
+             << setw(20) << distance.verts
+             << setprecision(2)
+             << setw(9) << distance.mean
+             << setw(10) << distance.worst
+             << setw(26) << budget.verts
+             << setw(9) << budget.mean
+             << setw(10) << budget.worst
+             << endl;
+    }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Queries
+
+constexpr static double QueryReach = 20000.0;
+
+// |count| points scattered over the |spread| meters either way of
+// |position|, projected to the ground, and a vertical segment through each.
+static void
+scatterQueries(const View& view, const dvec3& position, double spread, size_t count,
+               mt19937& random, vector<dvec3>& positions,
+               vector<glit::Terrain::Segment>& segments)
+{
+    uniform_real_distribution<double> offset(-spread, spread);
+    positions.clear();
+    segments.clear();
+    for (size_t i = 0; i < count; ++i) {
+        dvec3 unit = normalize(position + view.east * offset(random) +
+                               view.north * offset(random));
+        positions.push_back(unit * View::Radius);
+        segments.push_back(glit::Terrain::Segment{unit * (View::Radius + QueryReach),
+                                                  unit * (View::Radius - QueryReach)});
+    }
+}
+
+struct Queries {
+    double heights;  // Microseconds a query, batched.
+    double segments;
+};
+
+// Batches of height queries and vertical segments, scattered over the 10km
+// around the camera at |altitude|, answered on |threads| query threads.
+static Queries
+queryAt(double altitude, size_t threads)
+{
+    constexpr static size_t Count = 10000;
+    constexpr static size_t Repeats = 5;
+    constexpr static double Spread = 5000.0;
+
+    glit::Terrain terrain(View::Radius);
+    terrain.setQueryThreads(threads);
+    View view;
+    dvec3 position = view.above(terrain, altitude);
+    for (size_t i = 0; i < 100; ++i)
+        terrain.reshape(position, view.frustum);
+
+    mt19937 random(1);
+    vector<dvec3> positions;
+    vector<glit::Terrain::Segment> segments;
+    scatterQueries(view, position, Spread, Count, random, positions, segments);
+
+    Queries result{0.0, 0.0};
+    vector<double> heights;
+    vector<glit::Terrain::RayHit> hits;
+    auto start = chrono::steady_clock::now();
+    for (size_t i = 0; i < Repeats; ++i)
+        terrain.meshHeightsAt(positions, heights);
+    result.heights = millisSince(start) * 1000.0 / (Repeats * Count);
+    start = chrono::steady_clock::now();
+    for (size_t i = 0; i < Repeats; ++i)
+        terrain.intersectSegments(segments, hits);
+    result.segments = millisSince(start) * 1000.0 / (Repeats * Count);
+    return result;
+}
+
+// Walk two terrains through the same random jumps, climbing and diving
+// between 30m and 100km so that each reshape both splits and merges, with
+// one sharing what did not change between the snapshots that queries see
+// and the other copying all of it, and check that every snapshot answers
+// the same queries around the camera the same.
+static bool
+sharedQueriesMatch()
+{
+    constexpr static size_t Jumps = 50;
+    constexpr static size_t Count = 1000;
+    constexpr static double Spread = 5000.0;
+    constexpr static double Step = 2.0; // Altitudes a jump, at most.
+
+    glit::Terrain shared(View::Radius);
+    glit::Terrain copied(View::Radius);
+    copied.setIncrementalQueries(false);
+    for (auto* terrain : {&shared, &copied})
+        terrain->setRefineBudget(0, 0.0); // Splits would depend on the timing.
+
+    View view;
+    mt19937 random(1);
+    uniform_real_distribution<double> offset(-Spread, Spread);
+    uniform_real_distribution<double> climb(-1.0, 1.0);
+    dvec3 ground = dvec3(view.up) * View::Radius;
+    double altitude = 1000.0;
+    vector<dvec3> positions;
+    vector<glit::Terrain::Segment> segments;
+    for (size_t jump = 0; jump < Jumps; ++jump) {
+        dvec3 step = view.east * offset(random) + view.north * offset(random);
+        ground = normalize(ground + step * (Step * altitude / Spread)) * View::Radius;
+        altitude = clamp(altitude * exp(climb(random)), 30.0, 1.0e5);
+        dvec3 position = normalize(ground) * (View::Radius + altitude);
+        shared.reshape(position, view.frustum);
+        copied.reshape(position, view.frustum);
+
+        scatterQueries(view, position, Spread, Count, random, positions, segments);
+        vector<double> sharedHeights, copiedHeights;
+        shared.meshHeightsAt(positions, sharedHeights);
+        copied.meshHeightsAt(positions, copiedHeights);
+        vector<glit::Terrain::RayHit> sharedHits, copiedHits;
+        shared.intersectSegments(segments, sharedHits);
+        copied.intersectSegments(segments, copiedHits);
+        bool same = sharedHeights == copiedHeights;
+        for (size_t i = 0; i < Count && same; ++i) {
+            const glit::Terrain::RayHit& a = sharedHits[i];
+            const glit::Terrain::RayHit& b = copiedHits[i];
+            same = a.hit == b.hit &&
+                   (!a.hit || (a.distance == b.distance && a.position == b.position &&
+                               a.normal == b.normal));
+        }
+        if (!same) {
+            cerr << "shared query snapshot differs from a full copy after jump "
+                 << jump << endl;
+            return false;
+        }
+    }
+    return true;
+}
+
+static bool
+benchQueries(double altitude, size_t maxThreads)
+{
+    cout << "query threads  heights us  segments us   speedup(heights, segments)"
+         << endl;
+    Queries serial = queryAt(altitude, 0);
+    for (size_t threads = 0; threads <= maxThreads; threads = threads ? threads * 2 : 1) {
+        Queries q = threads ? queryAt(altitude, threads) : serial;
+        cout << setw(13) << threads
+             << fixed << setprecision(2)
+             << setw(12) << q.heights
+             << setw(13) << q.segments
+             << setw(12) << serial.heights / q.heights << "x"
+             << setw(9) << serial.segments / q.segments << "x"
+             << endl;
+    }
+    if (!sharedQueriesMatch())
+        return false;
+    cout << "shared query snapshots match full copies" << endl;
+    return true;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Hierarchical heights
+
+static void
+benchHeights(double altitude)
+{
+    glit::Terrain terrain(View::Radius);
+    terrain.setValidateHeights(true);
+    View view;
+    terrain.reshape(view.above(terrain, altitude), view.frustum);
+    glit::Terrain::HeightError error = terrain.heightError();
+    cout << "height error vs full fBm: max " << error.max << "m, rms "
+         << error.rms << "m over " << error.samples << " midpoints" << endl;
+}
+
+int
+main(int argc, char** argv)
+{
+    double altitude = argc > 1 ? stod(argv[1]) : 1000.0;
+    size_t maxThreads = argc > 2 ? stoul(argv[2]) : thread::hardware_concurrency();
+
+    GLFWwindow* window = makeHiddenContext();
+    cout << "altitude: " << altitude << "m" << endl;
+
+    Result serial = run(0, altitude, true);
+    if (!benchThreads(altitude, maxThreads, serial))
+        return 1;
+    benchCulling(altitude, serial);
+    benchTeleport(altitude);
+    benchStartup(altitude);
+    benchTriangles();
+    if (!benchQueries(altitude, maxThreads))
+        return 1;
+    benchHeights(altitude);
+
+    glfwDestroyWindow(window);
+    glfwTerminate();
+    return 0;
+}
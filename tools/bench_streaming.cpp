@@ -0,0 +1,223 @@
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+// Flies east over a tile pyramid from tools/bake_tiles at a steady speed,
+// once for each of a few prefetch distances, and reports how often reshape
+// had to make do without a tile it wanted, what got loaded, and how long
+// reshape took. Frames are paced at 60Hz, so that the loads get about the
+// time they would in the game. First, it checks that a tile that will not
+// decode costs us that tile and nothing more.
+//
+// Usage: bench_streaming pyramid [lat lon [altitude_m [speed_m_per_frame]]]
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <iomanip>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+
+#include <glad/glad.h>
+#include <GLFW/glfw3.h>
+#include <glm/glm.hpp>
+
+#include "icosphere.h"
+#include "player.h"
+#include "terrain.h"
+#include "tile_pyramid.h"
+
+using namespace glm;
+using namespace std;
+
+// Terrain compiles its programs on construction, so we need a context, but
+// we never draw.
+static GLFWwindow*
+makeHiddenContext()
+{
+    if (!glfwInit())
+        throw runtime_error("glfwInit failed");
+#if defined(__MACOSX__)
+    glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 4);
+    glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 1);
+    glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE);
+    glfwWindowHint(GLFW_OPENGL_FORWARD_COMPAT, GL_TRUE);
+#else
+    glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 2);
+    glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 0);
+    glfwWindowHint(GLFW_CLIENT_API, GLFW_OPENGL_ES_API);
+#endif
+    glfwWindowHint(GLFW_VISIBLE, GLFW_FALSE);
+    GLFWwindow* window = glfwCreateWindow(64, 64, "bench_streaming", nullptr, nullptr);
+    if (!window)
+        throw runtime_error("glfwCreateWindow failed");
+    glfwMakeContextCurrent(window);
+    gladLoadGLLoader((GLADloadproc)glfwGetProcAddress);
+    return window;
+}
+
+static double
+millisSince(chrono::steady_clock::time_point start)
+{
+    auto dt = chrono::steady_clock::now() - start;
+    return chrono::duration<double, milli>(dt).count();
+}
+
+// Writes a pyramid at |path| of flat roots and the four children of root
+// 0, and scribbles over the last child, which is the last tile in the file,
+// so that it stops short mid-value. With a single load task, the broken
+// tile has to give its task back for the other three to load at all.
+static void
+checkCorruptTile(const string& path)
+{
+    using glit::TilePyramid;
+    constexpr static size_t Depth = 2;
+    size_t count = TilePyramid::sampleCount(Depth);
+    TilePyramid::Tile flat;
+    flat.heights.assign(count, 0.f);
+    flat.normals.assign(count, vec3(0.f, 0.f, 1.f));
+    flat.colours.assign(count, u8vec3(0));
+    TilePyramid::Builder builder(6371000.f, Depth, 1.f);
+    for (size_t i = 0; i < glit::IcoSphere::BaseFaceCount; ++i)
+        builder.add(TilePyramid::rootKey(i), flat);
+    TilePyramid::Key children[4];
+    for (size_t c = 0; c < 4; ++c) {
+        children[c] = TilePyramid::childKey(TilePyramid::rootKey(0), c);
+        builder.add(children[c], flat);
+    }
+    if (!builder.write(path))
+        throw runtime_error("cannot write " + path);
+
+    size_t bytes = TilePyramid::open(path)->tileBytes(children[3]);
+    FILE* fp = fopen(path.c_str(), "r+b");
+    if (!fp || fseek(fp, -long(bytes), SEEK_END) != 0)
+        throw runtime_error("cannot scribble on " + path);
+    for (size_t i = 0; i < bytes; ++i)
+        fputc(0xFF, fp);
+    fclose(fp);
+
+    {
+        glit::TileStreamer tiles(TilePyramid::open(path), 1);
+        auto wait = [&](TilePyramid::Key key) {
+            vec3 corners[3];
+            TilePyramid::corners(key, corners);
+            vec3 unit = normalize(corners[0] + corners[1] + corners[2]);
+            for (size_t i = 0; i < 1000; ++i) {
+                bool complete;
+                tiles.find(unit, 1, &complete);
+                if (complete)
+                    return;
+                this_thread::sleep_for(chrono::milliseconds(1));
+            }
+            throw runtime_error("corrupt tile check: a tile never loaded");
+        };
+        wait(children[3]);
+        for (size_t c = 0; c < 3; ++c)
+            wait(children[c]);
+        if (tiles.stats().demandLoads != 3)
+            throw runtime_error("corrupt tile check: wrong tiles loaded");
+    }
+    remove(path.c_str());
+    cout << "corrupt tile: skipped, the rest loaded" << endl;
+}
+
+struct Result {
+    glit::TileStreamer::Stats stats;
+    double mean;
+    double worst;
+};
+
+static Result
+run(const string& pyramid, size_t prefetchFrames, vec3 up, double altitude,
+    double speed)
+{
+    constexpr static size_t Frames = 600;
+    constexpr static double FrameMillis = 1000.0 / 60.0;
+
+    glit::Terrain terrain(6371000.0);
+    terrain.setTileSource(pyramid);
+    glit::TileStreamer& tiles = *terrain.tileStreamer();
+    tiles.setPrefetchFrames(prefetchFrames);
+
+    dvec3 east = normalize(cross(dvec3(0.0, 1.0, 0.0), dvec3(up)));
+    dvec3 position = dvec3(up) * (double(terrain.radius()) + altitude);
+    dvec3 velocity = east * speed;
+    glit::Camera camera;
+    camera.warp(vec3(0.f), vec3(east), up);
+
+    // Start from a settled view, so that we only count what moving costs.
+    for (size_t i = 0; i < 30; ++i) {
+        tiles.prefetch(dvec3(0.0), glit::Player::MaxSpeed);
+        terrain.reshape(position, camera.frustum());
+        tiles.drain();
+    }
+    tiles.resetStats();
+
+    Result result{glit::TileStreamer::Stats(), 0.0, 0.0};
+    for (size_t i = 0; i < Frames; ++i) {
+        position += velocity;
+        auto start = chrono::steady_clock::now();
+        tiles.prefetch(velocity, glit::Player::MaxSpeed);
+        terrain.reshape(position, camera.frustum());
+        double ms = millisSince(start);
+        result.mean += ms / Frames;
+        result.worst = std::max(result.worst, ms);
+        if (ms < FrameMillis)
+            this_thread::sleep_for(chrono::duration<double, milli>(FrameMillis - ms));
+    }
+    result.stats = tiles.stats();
+    return result;
+}
+
+int
+main(int argc, char** argv)
+{
+    if (argc < 2) {
+        cerr << "usage: bench_streaming pyramid [lat lon [altitude_m [speed_m_per_frame]]]"
+             << endl;
+        return 1;
+    }
+    string pyramid = argv[1];
+    double lat = radians(argc > 3 ? stod(argv[2]) : 37.5);
+    double lon = radians(argc > 3 ? stod(argv[3]) : -121.95);
+    double altitude = argc > 4 ? stod(argv[4]) : 1500.0;
+    double speed = argc > 5 ? stod(argv[5]) : 250.0;
+    vec3 up(cos(lat) * sin(lon), sin(lat), cos(lat) * cos(lon));
+
+    checkCorruptTile(pyramid + ".corrupt");
+
+    GLFWwindow* window = makeHiddenContext();
+    cout << "altitude: " << altitude << "m, speed: " << speed << "m/frame" << endl;
+    cout << "prefetch   stalls  hit rate  demand  prefetch  evicted  resident KB"
+            "   mean ms  worst ms" << endl;
+    for (size_t frames : {0, 30, 120, 480}) {
+        Result r = run(pyramid, frames, up, altitude, speed);
+        cout << setw(8) << frames
+             << setw(9) << r.stats.stalls
+             << fixed << setprecision(4)
+             << setw(10) << r.stats.hitRate()
+             << setw(8) << r.stats.demandLoads
+             << setw(10) << r.stats.prefetchLoads
+             << setw(9) << r.stats.evictions
+             << setw(13) << r.stats.residentBytes / 1024
+             << setprecision(2)
+             << setw(10) << r.mean
+             << setw(10) << r.worst
+             << endl;
+    }
+
+    glfwDestroyWindow(window);
+    glfwTerminate();
+    return 0;
+}
@@ -0,0 +1,148 @@
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+// Reports the average cache miss ratio (verts transformed per triangle) of
+// the solid terrain mesh for each triangle order, at a few altitudes and
+// cache sizes, along with how long emitting the mesh takes.
+//
+// Usage: bench_vertex_cache [altitude_m ...]
+
+#include <algorithm>
+#include <chrono>
+#include <iomanip>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <glad/glad.h>
+#include <GLFW/glfw3.h>
+#include <glm/glm.hpp>
+
+#include "terrain.h"
+#include "vertex_cache.h"
+
+using namespace glm;
+using namespace std;
+
+// Terrain compiles its programs on construction, so we need a context, but
+// we never draw.
+static GLFWwindow*
+makeHiddenContext()
+{
+    if (!glfwInit())
+        throw runtime_error("glfwInit failed");
+#if defined(__MACOSX__)
+    glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 4);
+    glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 1);
+    glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE);
+    glfwWindowHint(GLFW_OPENGL_FORWARD_COMPAT, GL_TRUE);
+#else
+    glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 2);
+    glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 0);
+    glfwWindowHint(GLFW_CLIENT_API, GLFW_OPENGL_ES_API);
+#endif
+    glfwWindowHint(GLFW_VISIBLE, GLFW_FALSE);
+    GLFWwindow* window = glfwCreateWindow(64, 64, "bench_vertex_cache", nullptr, nullptr);
+    if (!window)
+        throw runtime_error("glfwCreateWindow failed");
+    glfwMakeContextCurrent(window);
+    gladLoadGLLoader((GLADloadproc)glfwGetProcAddress);
+    return window;
+}
+
+int
+main(int argc, char** argv)
+{
+    constexpr static size_t Rounds = 10;
+    const size_t cacheSizes[] = {8, 16, 32};
+    vector<double> altitudes;
+    for (int i = 1; i < argc; ++i)
+        altitudes.push_back(stod(argv[i]));
+    if (altitudes.empty())
+        altitudes = {100.0, 1000.0, 10000.0};
+
+    GLFWwindow* window = makeHiddenContext();
+    glit::Terrain terrain(6371000.0);
+    terrain.setAsyncPipeline(false);
+    vec3 up = normalize(vec3(0.3f, 1.f, 0.2f));
+    dvec3 east = normalize(cross(dvec3(up), dvec3(0.0, 0.0, 1.0)));
+    glit::Camera camera;
+    camera.warp(vec3(0.f), vec3(east), up);
+
+    int status = 0;
+    for (double altitude : altitudes) {
+        dvec3 position = dvec3(up) * double(terrain.heightAt(up) + altitude);
+        terrain.reshape(position, camera.frustum());
+
+        cout << "altitude " << size_t(altitude) << "m" << endl;
+        cout << setw(12) << "order" << setw(8) << "tris" << setw(8) << "verts"
+             << setw(8) << "batches";
+        for (size_t size : cacheSizes)
+            cout << setw(8) << "acmr" << setw(3) << size;
+        cout << setw(12) << "emit ms" << endl;
+
+        vector<uint32_t> reference;
+        for (auto order : {glit::Terrain::TriangleOrder::Tree,
+                           glit::Terrain::TriangleOrder::Sierpinski,
+                           glit::Terrain::TriangleOrder::Forsyth})
+        {
+            terrain.setTriangleOrder(order);
+            vector<glit::Terrain::MeshBatch> batches;
+            vector<glit::Terrain::MeshVertex> verts;
+            vector<uint32_t> indices;
+            double best = 1e30;
+            for (size_t r = 0; r < Rounds; ++r) {
+                batches.clear();
+                verts.clear();
+                indices.clear();
+                auto start = chrono::steady_clock::now();
+                terrain.buildTriangles(position, batches, verts, indices);
+                chrono::duration<double, milli> took = chrono::steady_clock::now() - start;
+                best = std::min(best, took.count());
+            }
+
+            cout << setw(12) << glit::Terrain::triangleOrderName(order)
+                 << setw(8) << indices.size() / 3 << setw(8) << verts.size()
+                 << setw(8) << batches.size();
+            for (size_t size : cacheSizes) {
+                cout << setw(11) << fixed << setprecision(3)
+                     << glit::VertexCacheOptimizer::acmr(indices, verts.size(), size);
+            }
+            cout << setw(12) << setprecision(2) << best << defaultfloat << endl;
+
+            // Every order has to draw the same triangles.
+            if (order == glit::Terrain::TriangleOrder::Sierpinski) {
+                reference = indices;
+            } else if (order == glit::Terrain::TriangleOrder::Forsyth) {
+                vector<uint64_t> lhs, rhs;
+                for (size_t i = 0; i < indices.size(); i += 3) {
+                    lhs.push_back(uint64_t(indices[i]) << 42 |
+                                  uint64_t(indices[i + 1]) << 21 | indices[i + 2]);
+                    rhs.push_back(uint64_t(reference[i]) << 42 |
+                                  uint64_t(reference[i + 1]) << 21 | reference[i + 2]);
+                }
+                sort(lhs.begin(), lhs.end());
+                sort(rhs.begin(), rhs.end());
+                if (lhs != rhs) {
+                    cerr << "forsyth order lost or changed triangles" << endl;
+                    status = 1;
+                }
+            }
+        }
+    }
+
+    glfwDestroyWindow(window);
+    glfwTerminate();
+    return status;
+}